@@ -0,0 +1,365 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Throughput benchmark: runs a fixed set of the test/in environments through
+// the library API and reports the rates for each as JSON.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define BHC_DLL_IMPORT 1
+#include <bhc/bhc.hpp>
+
+#ifndef BHC_BENCH_BUILD
+#define BHC_BENCH_BUILD "cxx"
+#endif
+#ifndef BHC_BENCH_DEFAULT_DIR
+#define BHC_BENCH_DEFAULT_DIR "test/in"
+#endif
+
+struct BenchCase {
+    const char *name;
+    const char *env; // FileRoot, relative to the test/in directory
+    int dim;         // 2, 3, or 4 (Nx2D), as for the -2 / -3 / -4 options
+};
+
+// One of each run type in 2D, and TL and ray in Nx2D and 3D, plus one 3D
+// eigenray run, all small enough to run in seconds.
+static const BenchCase cases[] = {
+    {"munk_2d_tl", "MunkB_Coh", 2},
+    {"munk_2d_ray", "MunkB_ray", 2},
+    {"munk_2d_eigen", "MunkB_eigenray", 2},
+    {"munk_2d_arr", "MunkB_Arr", 2},
+    {"dickins_2d_tl", "DickinsB", 2},
+    {"dickins_2d_ray", "DickinsBray", 2},
+    {"koreansea_nx2d_tl", "KoreanSea_Nx2D", 4},
+    {"koreansea_nx2d_ray", "KoreanSea_Nx2D_ray", 4},
+    {"munk_3d_tl", "munk3d", 3},
+    {"munk_3d_ray", "munk3d_ray", 3},
+    {"koreansea_3d_eigen", "KoreanSea_3D_eigen", 3},
+};
+
+struct Options {
+    std::string dir = BHC_BENCH_DEFAULT_DIR;
+    std::string filter;
+    std::string outFile;
+    int32_t numThreads = -1;
+    size_t maxMemory   = 0;
+    int warmup         = 1;
+    int reps           = 5;
+    bool verbose       = false;
+};
+
+struct CaseResult {
+    std::string runType;
+    uint64_t rays = 0, steps = 0, influenceEvals = 0;
+    std::vector<double> seconds;
+    size_t peakMemory = 0;
+    bool ok           = false;
+};
+
+// Messages from the library for the current case, printed if it fails.
+static std::string messages;
+static bool verbose = false;
+
+void OutputCallback(const char *message)
+{
+    messages += message;
+    messages += '\n';
+    if(verbose) std::cerr << message << "\n" << std::flush;
+}
+
+void PrtCallback(const char *) {}
+
+// Work counts from the streamed ray run, see CountWork.
+static uint64_t countRays, countSteps;
+
+void CountRay(bhc::real, int32_t Nsteps, int32_t, int32_t, const bhc::real *)
+{
+    ++countRays;
+    countSteps += (uint64_t)Nsteps;
+}
+
+bhc::bhcInit BaseInit(const Options &opt, const std::string &root)
+{
+    bhc::bhcInit init;
+    init.FileRoot       = root.c_str();
+    init.outputCallback = OutputCallback;
+    init.prtCallback    = PrtCallback;
+    init.numThreads     = opt.numThreads;
+    if(opt.maxMemory > 0) init.maxMemory = opt.maxMemory;
+    return init;
+}
+
+std::string RunTypeName(char r)
+{
+    switch(r) {
+    case 'R': return "ray";
+    case 'C':
+    case 'S':
+    case 'I': return "tl";
+    case 'E': return "eigen";
+    case 'A':
+    case 'a': return "arrivals";
+    default: return std::string(1, r);
+    }
+}
+
+/**
+ * The run counts neither the steps nor the influence evaluations, so they are
+ * counted by tracing the same fan as a streamed ray run, whose rays end where
+ * the rays of the field run do. TL, eigenray, and arrivals runs evaluate the
+ * influence once per step.
+ */
+template<bool O3D, bool R3D> bool CountWork(
+    const Options &opt, const std::string &root, CaseResult &res)
+{
+    bhc::bhcInit init = BaseInit(opt, root);
+    init.streamRays   = true;
+    init.rayCallback  = CountRay;
+    bhc::bhcParams<O3D> params;
+    bhc::bhcOutputs<O3D, R3D> outputs;
+    if(!bhc::setup<O3D, R3D>(init, params, outputs)) return false;
+    char runType            = params.Beam->RunType[0];
+    params.Beam->RunType[0] = 'R';
+    countRays               = 0;
+    countSteps              = 0;
+    bool ok                 = bhc::run<O3D, R3D>(params, outputs);
+    bhc::finalize<O3D, R3D>(params, outputs);
+    res.rays           = countRays;
+    res.steps          = countSteps;
+    res.influenceEvals = runType == 'R' ? 0 : countSteps;
+    return ok;
+}
+
+template<bool O3D, bool R3D> bool RunCase(
+    const Options &opt, const BenchCase &c, CaseResult &res)
+{
+    std::string root = opt.dir + "/" + c.env;
+    if(!CountWork<O3D, R3D>(opt, root, res)) return false;
+
+    bhc::bhcInit init = BaseInit(opt, root);
+    bhc::bhcParams<O3D> params;
+    bhc::bhcOutputs<O3D, R3D> outputs;
+    if(!bhc::setup<O3D, R3D>(init, params, outputs)) return false;
+    res.runType = RunTypeName(params.Beam->RunType[0]);
+    bool ok     = true;
+    for(int i = 0; ok && i < opt.warmup; ++i) ok = bhc::run<O3D, R3D>(params, outputs);
+    for(int i = 0; ok && i < opt.reps; ++i) {
+        auto t0 = std::chrono::steady_clock::now();
+        ok      = bhc::run<O3D, R3D>(params, outputs);
+        auto t1 = std::chrono::steady_clock::now();
+        res.seconds.push_back(std::chrono::duration<double>(t1 - t0).count());
+    }
+    res.peakMemory = bhc::get_peak_memory<O3D>(params);
+    bhc::finalize<O3D, R3D>(params, outputs);
+    return ok;
+}
+
+bool RunCaseDim(const Options &opt, const BenchCase &c, CaseResult &res)
+{
+    switch(c.dim) {
+#if BHC_BENCH_ENABLE_2D
+    case 2: return RunCase<false, false>(opt, c, res);
+#endif
+#if BHC_BENCH_ENABLE_3D
+    case 3: return RunCase<true, true>(opt, c, res);
+#endif
+#if BHC_BENCH_ENABLE_NX2D
+    case 4: return RunCase<true, false>(opt, c, res);
+#endif
+    default: return false;
+    }
+}
+
+bool DimEnabled(int dim)
+{
+    switch(dim) {
+    case 2: return BHC_BENCH_ENABLE_2D;
+    case 3: return BHC_BENCH_ENABLE_3D;
+    case 4: return BHC_BENCH_ENABLE_NX2D;
+    default: return false;
+    }
+}
+
+std::string JSONString(const std::string &s)
+{
+    std::string ret = "\"";
+    for(char ch : s) {
+        if(ch == '"' || ch == '\\') {
+            ret += '\\';
+            ret += ch;
+        } else if((unsigned char)ch < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", (unsigned)ch);
+            ret += buf;
+        } else {
+            ret += ch;
+        }
+    }
+    return ret + "\"";
+}
+
+double Rate(uint64_t count, double seconds)
+{
+    return seconds > 0.0 ? (double)count / seconds : 0.0;
+}
+
+void WriteCaseJSON(std::ostream &out, const BenchCase &c, const CaseResult &res)
+{
+    const char *dims[] = {"", "", "2D", "3D", "Nx2D"};
+    out << "    {\n";
+    out << "      \"name\": " << JSONString(c.name) << ",\n";
+    out << "      \"env\": " << JSONString(c.env) << ",\n";
+    out << "      \"dim\": \"" << dims[c.dim] << "\",\n";
+    out << "      \"ok\": " << (res.ok ? "true" : "false");
+    if(res.ok) {
+        std::vector<double> s = res.seconds;
+        std::sort(s.begin(), s.end());
+        double median = s.size() % 2 ? s[s.size() / 2]
+                                     : 0.5 * (s[s.size() / 2 - 1] + s[s.size() / 2]);
+        double mean   = 0.0;
+        for(double t : s) mean += t;
+        mean /= (double)s.size();
+        out << ",\n";
+        out << "      \"runType\": " << JSONString(res.runType) << ",\n";
+        out << "      \"rays\": " << res.rays << ",\n";
+        out << "      \"steps\": " << res.steps << ",\n";
+        out << "      \"influenceEvals\": " << res.influenceEvals << ",\n";
+        out << "      \"seconds\": {\"min\": " << s.front() << ", \"median\": " << median
+            << ", \"mean\": " << mean << ", \"max\": " << s.back() << "},\n";
+        out << "      \"raysPerSecond\": " << Rate(res.rays, median) << ",\n";
+        out << "      \"stepsPerSecond\": " << Rate(res.steps, median) << ",\n";
+        out << "      \"influenceEvalsPerSecond\": " << Rate(res.influenceEvals, median)
+            << ",\n";
+        out << "      \"peakMemoryBytes\": " << res.peakMemory << "\n";
+    } else {
+        out << ",\n      \"messages\": " << JSONString(messages) << "\n";
+    }
+    out << "    }";
+}
+
+void Usage(const char *argv0)
+{
+    std::cout
+        << "Usage: " << argv0
+        << " [options] [test/in directory]\n"
+           "Runs each benchmark case (setup once, then the warm-up runs and the\n"
+           "timed repetitions of run()), and writes the results as JSON. Rates are\n"
+           "per second of the median repetition. Steps and influence evaluations\n"
+           "are counted with a separate streamed ray run of each case.\n"
+           "-t=#, --threads=#: Number of worker threads (default all cores)\n"
+           "--mem=#: bhcInit::maxMemory in MiB (default library default)\n"
+           "--warmup=#: Untimed runs before the repetitions (default 1)\n"
+           "--reps=#: Timed repetitions (default 5)\n"
+           "--case=name: Only run cases whose name contains this\n"
+           "--out=file: Write the JSON to file instead of standard output\n"
+           "--list: List the cases and exit\n"
+           "-v, --verbose: Print the library's messages to standard error\n";
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    for(int32_t i = 1; i < argc; ++i) {
+        std::string s = argv[i];
+        std::string v = s.find('=') == std::string::npos ? "" : s.substr(s.find('=') + 1);
+        if(s == "-h" || s == "--help") {
+            Usage(argv[0]);
+            return 0;
+        } else if(s == "--list") {
+            for(const BenchCase &c : cases) std::cout << c.name << " (" << c.env << ")\n";
+            return 0;
+        } else if(s.rfind("-t=", 0) == 0 || s.rfind("--threads=", 0) == 0) {
+            opt.numThreads = std::stoi(v);
+        } else if(s.rfind("--mem=", 0) == 0) {
+            opt.maxMemory = std::stoull(v) * 1024ull * 1024ull;
+        } else if(s.rfind("--warmup=", 0) == 0) {
+            opt.warmup = std::max(std::stoi(v), 0);
+        } else if(s.rfind("--reps=", 0) == 0) {
+            opt.reps = std::max(std::stoi(v), 1);
+        } else if(s.rfind("--case=", 0) == 0) {
+            opt.filter = v;
+        } else if(s.rfind("--out=", 0) == 0) {
+            opt.outFile = v;
+        } else if(s == "-v" || s == "--verbose") {
+            opt.verbose = true;
+        } else if(!s.empty() && s[0] == '-') {
+            std::cerr << "Unknown option " << s << ", try --help\n";
+            return 1;
+        } else {
+            opt.dir = s;
+        }
+    }
+    verbose = opt.verbose;
+
+    std::stringstream json;
+    json.precision(10);
+    json << "{\n";
+    json << "  \"build\": \"" << BHC_BENCH_BUILD << "\",\n";
+#if defined(BHC_USE_MIXED_PRECISION)
+    json << "  \"precision\": \"mixed\",\n";
+#elif defined(BHC_USE_FLOATS)
+    json << "  \"precision\": \"float\",\n";
+#else
+    json << "  \"precision\": \"double\",\n";
+#endif
+    json << "  \"threads\": " << opt.numThreads << ",\n";
+    json << "  \"warmup\": " << opt.warmup << ",\n";
+    json << "  \"repetitions\": " << opt.reps << ",\n";
+    json << "  \"cases\": [";
+    bool allOk = true, first = true;
+    for(const BenchCase &c : cases) {
+        bool match = std::string(c.name).find(opt.filter) != std::string::npos;
+        if(!match || !DimEnabled(c.dim)) continue;
+        std::cerr << c.name << "... " << std::flush;
+        messages.clear();
+        CaseResult res;
+        res.ok = RunCaseDim(opt, c, res);
+        std::cerr << (res.ok ? "done" : "FAILED") << "\n" << std::flush;
+        if(!res.ok) {
+            allOk = false;
+            if(!verbose) std::cerr << messages;
+        }
+        json << (first ? "\n" : ",\n");
+        first = false;
+        WriteCaseJSON(json, c, res);
+    }
+    json << "\n  ]\n}\n";
+
+    if(opt.outFile.empty()) {
+        std::cout << json.str() << std::flush;
+    } else {
+        std::ofstream out(opt.outFile);
+        out << json.str();
+        if(!out.good()) {
+            std::cerr << "Could not write " << opt.outFile << "\n";
+            return 1;
+        }
+    }
+    return allOk ? 0 : 1;
+}
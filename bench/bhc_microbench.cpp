@@ -0,0 +1,875 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Micro-benchmark: times the per-step HOST_DEVICE functions (EvaluateSSP,
+// GetBdrySeg, StepToBdry, InterpolateReflectionCoefficient, and Step_Influence
+// via ReplayFieldModes) directly, on ray states recorded from test/in
+// environments and on synthetic states, for the template config (CfgSel) of
+// each environment. Built against the static library and its internal headers,
+// and compiled as CUDA for the bellhopcuda build, where each function is also
+// launched as a kernel over the same states. Reports ns/op as JSON.
+
+#include "common_setup.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef BHC_BENCH_BUILD
+#define BHC_BENCH_BUILD "cxx"
+#endif
+#ifndef BHC_BENCH_DEFAULT_DIR
+#define BHC_BENCH_DEFAULT_DIR "test/in"
+#endif
+
+using namespace bhc;
+
+struct MicroCase {
+    const char *name;
+    const char *env; // FileRoot, relative to the test/in directory
+    int dim;         // 2, 3, or 4 (Nx2D), as for the -2 / -3 / -4 options
+};
+
+// Chosen to cover each SSP type and the common influence types, not for
+// their run time; only a sample of each environment's rays is traced.
+static const MicroCase cases[] = {
+    {"munk_2d_spline", "MunkB_Coh", 2},
+    {"dickins_2d_clinear", "DickinsB", 2},
+    {"dickins_2d_cerveny", "DickinsCervenyB", 2},
+    {"aet_2d_pchip", "aetB_TL", 2},
+    {"free_2d_n2linear", "free_gbtB", 2},
+    {"gulf_2d_quad", "GulfB_rd_gb", 2},
+    {"munk_2d_eigen", "MunkB_eigenray", 2},
+    {"munk_2d_arr", "MunkB_Arr", 2},
+    {"koreansea_nx2d_hexahedral", "KoreanSea_Nx2D", 4},
+    {"munk_3d_clinear", "munk3d", 3},
+    {"koreansea_3d_hexahedral", "KoreanSea_3D", 3},
+};
+
+struct Options {
+    std::string dir = BHC_BENCH_DEFAULT_DIR;
+    std::string filter;
+    std::string outFile;
+    int32_t rays      = 256;
+    int32_t synthetic = 16384;
+    int reps          = 10;
+    bool gpu          = true;
+    bool verbose      = false;
+};
+
+struct MicroResult {
+    std::string function, states, device;
+    uint64_t ops;
+    double nsPerOp;
+};
+
+struct CaseResult {
+    std::string config;
+    int32_t rays = 0;
+    size_t recorded = 0, synthetic = 0;
+    std::vector<MicroResult> results;
+    bool ok = false;
+};
+
+// Messages from the library for the current case, printed if it fails.
+static std::string messages;
+static bool verbose = false;
+// Reflection coefficient tables are only used in a few environments, so there
+// is always also a synthetic, uniformly spaced one.
+static ReflectionInfoTopBot synthRefl;
+
+void OutputCallback(const char *message)
+{
+    messages += message;
+    messages += '\n';
+    if(verbose) std::cerr << message << "\n" << std::flush;
+}
+
+void PrtCallback(const char *) {}
+
+/**
+ * One ray state: the point as stored in a rayPt and the tracing state which
+ * goes with it, i.e. the arguments the functions are called with when the ray
+ * is stepped from this point. The SSP segment and boundary segments are those
+ * found at this point.
+ */
+template<bool O3D, bool R3D> struct MicroState {
+    VEC23<R3D> x, t;
+    Origin<O3D, R3D> org;
+    VEC23<O3D> x_o, urayt_o; // ocean coordinates, unit tangent
+    VEC23<O3D> xs;
+    SSPSegState iSeg;
+    BdryState<O3D> bds;
+};
+
+template<bool O3D, bool R3D> struct MicroData {
+    std::vector<MicroState<O3D, R3D>> recorded, synthetic;
+    /// The recorded rays, for ReplayFieldModes.
+    std::vector<rayPt<R3D>> points;
+    std::vector<RayInitInfo> rinits;
+    std::vector<int32_t> rayStart, rayN;
+    uint64_t influenceSteps = 0;
+    /// Incident angles in degrees, uniform over the reflection table.
+    std::vector<real> angles;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Operations, each of which is run over an array of states; the result of each
+// is kept so that it is not optimized out
+////////////////////////////////////////////////////////////////////////////////
+
+template<typename CFG, bool O3D, bool R3D> struct SSPOp {
+    const MicroState<O3D, R3D> *states;
+    const SSPStructure *ssp;
+    ErrState *errState;
+
+    HOST_DEVICE real operator()(int32_t i) const
+    {
+        const MicroState<O3D, R3D> &s = states[i];
+        SSPOutputs<R3D> o;
+        SSPSegState iSeg = s.iSeg;
+        EvaluateSSP<CFG, O3D, R3D>(s.x, s.t, o, s.org, ssp, iSeg, errState);
+        return o.ccpx.real();
+    }
+};
+
+/// Top and bottom, starting from the segments of the previous state, as the
+/// ray update does after each step.
+template<bool O3D, bool R3D> struct BdrySegOp {
+    const MicroState<O3D, R3D> *states;
+    const BdryInfo<O3D> *bdinfo;
+    ErrState *errState;
+
+    HOST_DEVICE real operator()(int32_t i) const
+    {
+        const MicroState<O3D, R3D> &s = states[i];
+        BdryState<O3D> bds            = states[i > 0 ? i - 1 : 0].bds;
+        BdryType Bdry;
+        GetBdrySeg<O3D>(
+            s.x_o, s.urayt_o, bds.top, &bdinfo->top, Bdry.Top, true, false, errState);
+        GetBdrySeg<O3D>(
+            s.x_o, s.urayt_o, bds.bot, &bdinfo->bot, Bdry.Bot, false, false, errState);
+        return DEP(bds.top.x) + DEP(bds.bot.x);
+    }
+};
+
+/// With the nominal step size, i.e. without the ReduceStep which precedes it
+/// in Step.
+template<typename CFG, bool O3D, bool R3D> struct StepToBdryOp {
+    const MicroState<O3D, R3D> *states;
+    const BeamStructure<O3D> *Beam;
+    const SSPStructure *ssp;
+    ErrState *errState;
+
+    HOST_DEVICE real operator()(int32_t i) const
+    {
+        const MicroState<O3D, R3D> &s = states[i];
+        BdryState<O3D> bds            = s.bds;
+        VEC23<O3D> x2;
+        real h = Beam->deltas;
+        bool topRefl, botRefl;
+        int32_t snapDim;
+        StepToBdry<CFG, O3D>(
+            s.x_o, x2, s.urayt_o, h, topRefl, botRefl, snapDim, s.iSeg, bds, Beam, s.xs,
+            ssp, errState, Beam->deltas);
+        return h + DEP(x2);
+    }
+};
+
+struct ReflCoefOp {
+    const real *angles;
+    ReflectionInfoTopBot rtb;
+    ErrState *errState;
+
+    HOST_DEVICE real operator()(int32_t i) const
+    {
+        ReflectionCoef RInt;
+        RInt.theta = angles[i];
+        InterpolateReflectionCoefficient(RInt, rtb, errState);
+        return RInt.r + RInt.phi;
+    }
+};
+
+/// One recorded ray per index; each step of it is one Step_Influence.
+template<typename CFG, bool O3D, bool R3D> struct InfluenceOp {
+    const rayPt<R3D> *points;
+    const RayInitInfo *rinits;
+    const int32_t *rayStart, *rayN;
+    const bhcParams<O3D> *params;
+    cpxf *uAllSources;
+    EigenInfo *eigen;
+    const ArrInfo *arrinfo;
+    ErrState *errState;
+
+    HOST_DEVICE real operator()(int32_t i) const
+    {
+        RayInitInfo rinit = rinits[i];
+        ReplayFieldModes<CFG, O3D, R3D>(
+            rinit, &points[rayStart[i]], rayN[i], uAllSources, params->Bdry,
+            params->bdinfo, params->ssp, params->Pos, params->Angles, params->freqinfo,
+            params->Beam, params->sbp, eigen, arrinfo, errState);
+        return (real)rayN[i];
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Timing
+////////////////////////////////////////////////////////////////////////////////
+
+static volatile real sinkCPU;
+
+/// Runs op over [0, n) once untimed and then reps times, returns ns per op.
+template<typename OP> double TimeCPU(const OP &op, int32_t n, int reps, uint64_t ops)
+{
+    real acc = RL(0.0);
+    for(int32_t i = 0; i < n; ++i) acc += op(i);
+    auto t0 = std::chrono::steady_clock::now();
+    for(int r = 0; r < reps; ++r) {
+        for(int32_t i = 0; i < n; ++i) acc += op(i);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    sinkCPU = acc;
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+    return ns / ((double)reps * (double)ops);
+}
+
+#ifdef BHC_BUILD_CUDA
+
+template<typename OP> __global__ void MicroKernel(OP op, int32_t n, real *sink)
+{
+    int32_t i = blockIdx.x * blockDim.x + threadIdx.x;
+    if(i >= n) return;
+    sink[i] = op(i);
+}
+
+/**
+ * Same as TimeCPU, one thread per index. As all of them run concurrently, this
+ * is the throughput of the GPU for the op, not its latency.
+ */
+template<typename OP> double TimeGPU(const OP &op, int32_t n, int reps, uint64_t ops)
+{
+    constexpr int32_t blockSize = 256;
+    int32_t numBlocks           = (n + blockSize - 1) / blockSize;
+    real *sink;
+    checkCudaErrors(cudaMalloc(&sink, (size_t)n * sizeof(real)));
+    cudaEvent_t start, stop;
+    checkCudaErrors(cudaEventCreate(&start));
+    checkCudaErrors(cudaEventCreate(&stop));
+    MicroKernel<<<numBlocks, blockSize>>>(op, n, sink);
+    checkCudaErrors(cudaGetLastError());
+    checkCudaErrors(cudaEventRecord(start));
+    for(int r = 0; r < reps; ++r) MicroKernel<<<numBlocks, blockSize>>>(op, n, sink);
+    checkCudaErrors(cudaEventRecord(stop));
+    checkCudaErrors(cudaEventSynchronize(stop));
+    checkCudaErrors(cudaGetLastError());
+    float ms;
+    checkCudaErrors(cudaEventElapsedTime(&ms, start, stop));
+    checkCudaErrors(cudaEventDestroy(start));
+    checkCudaErrors(cudaEventDestroy(stop));
+    checkCudaErrors(cudaFree(sink));
+    return (double)ms * 1.0e6 / ((double)reps * (double)ops);
+}
+
+/// Copy of v in managed memory, so the same pointer works on the CPU and GPU.
+template<typename T> T *ManagedCopy(const std::vector<T> &v)
+{
+    T *ptr;
+    checkCudaErrors(cudaMallocManaged(&ptr, bhc::max(v.size(), (size_t)1) * sizeof(T)));
+    if(!v.empty()) memcpy((void *)ptr, v.data(), v.size() * sizeof(T));
+    return ptr;
+}
+template<typename T> void ManagedFree(T *ptr) { checkCudaErrors(cudaFree(ptr)); }
+
+#else
+
+template<typename T> T *ManagedCopy(const std::vector<T> &v)
+{
+    return const_cast<T *>(v.data());
+}
+template<typename T> void ManagedFree(T *) {}
+
+#endif
+
+/// Times op on the CPU, and on the GPU if it is a CUDA build and enabled.
+template<typename OP> void TimeOp(
+    const Options &opt, const char *function, const char *states, const OP &op,
+    int32_t n, uint64_t ops, CaseResult &res)
+{
+    if(n <= 0 || ops == 0) return;
+    res.results.push_back(
+        {function, states, "cpu", ops, TimeCPU(op, n, opt.reps, ops)});
+#ifdef BHC_BUILD_CUDA
+    if(opt.gpu) {
+        res.results.push_back(
+            {function, states, "gpu", ops, TimeGPU(op, n, opt.reps, ops)});
+    }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// States
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Traces an evenly spaced sample of the environment's rays with RecordFieldRay
+ * and keeps the state at each of their points. Returns false if no ray could
+ * be traced.
+ */
+template<typename CFG, bool O3D, bool R3D> bool RecordStates(
+    const bhcParams<O3D> &params, const Options &opt, MicroData<O3D, R3D> &d)
+{
+    int32_t numJobs = GetNumJobs<O3D>(params.Pos, params.Angles);
+    int32_t nRays   = bhc::min(opt.rays, numJobs);
+    std::vector<rayPt<R3D>> work(MaxN);
+    ErrState errState;
+    for(int32_t r = 0; r < nRays; ++r) {
+        int32_t job = (int32_t)((int64_t)r * numJobs / nRays);
+        RayInitInfo rinit;
+        if(!GetJobIndices<O3D>(rinit, job, params.Pos, params.Angles)) continue;
+        ResetErrState(&errState);
+        RayInitInfo rinitRec = rinit;
+        int32_t Nsteps;
+        RecordFieldRay<CFG, O3D, R3D>(
+            rinitRec, work.data(), Nsteps, params.Bdry, params.bdinfo, params.refl,
+            params.ssp, params.Pos, params.Angles, params.freqinfo, params.Beam,
+            params.sbp, &errState);
+        if(Nsteps < 2 || HasErrored(&errState)) continue;
+
+        // Repeated for the tracing state at the source, as in
+        // ReplayFieldModes.
+        real DistBegTop, DistBegBot;
+        SSPSegState iSeg;
+        VEC23<O3D> xs, gradc;
+        BdryState<O3D> bds;
+        BdryType Bdry;
+        Origin<O3D, R3D> org;
+        rayPt<R3D> point0;
+        RayInitInfo rinitState = rinit;
+        if(!RayInit<CFG, O3D, R3D>(
+               rinitState, xs, point0, gradc, DistBegTop, DistBegBot, org, iSeg, bds,
+               Bdry, params.Bdry, params.bdinfo, params.ssp, params.Pos, params.Angles,
+               params.freqinfo, params.Beam, params.sbp, &errState)) {
+            continue;
+        }
+        for(int32_t is = 0; is < Nsteps; ++is) {
+            const rayPt<R3D> &point = work[is];
+            MicroState<O3D, R3D> s;
+            SSPOutputs<R3D> o;
+            EvaluateSSP<CFG, O3D, R3D>(
+                point.x, point.t, o, org, params.ssp, iSeg, &errState);
+            s.x       = point.x;
+            s.t       = point.t;
+            s.org     = org;
+            s.x_o     = RayToOceanX(point.x, org);
+            s.urayt_o = RayToOceanT(o.ccpx.real() * point.t, org);
+            s.xs      = xs;
+            GetBdrySeg<O3D>(
+                s.x_o, s.urayt_o, bds.top, &params.bdinfo->top, Bdry.Top, true, false,
+                &errState);
+            GetBdrySeg<O3D>(
+                s.x_o, s.urayt_o, bds.bot, &params.bdinfo->bot, Bdry.Bot, false, false,
+                &errState);
+            s.iSeg = iSeg;
+            s.bds  = bds;
+            d.recorded.push_back(s);
+        }
+        if(HasErrored(&errState)) {
+            d.recorded.resize(d.recorded.size() - (size_t)Nsteps);
+            continue;
+        }
+        d.rinits.push_back(rinit);
+        d.rayStart.push_back((int32_t)d.points.size());
+        d.rayN.push_back(Nsteps);
+        d.points.insert(d.points.end(), work.begin(), work.begin() + Nsteps);
+        d.influenceSteps += (uint64_t)(Nsteps - 1);
+    }
+    return !d.recorded.empty();
+}
+
+/**
+ * States at random points within the bounding box of the recorded ones (in ray
+ * coordinates, each with the origin of a random recorded state), heading in
+ * random directions. Unlike along a ray, successive states are unrelated, so
+ * the segment searches start far from the result. Points outside the SSP or
+ * the boundaries are rejected.
+ */
+template<typename CFG, bool O3D, bool R3D> void SyntheticStates(
+    const bhcParams<O3D> &params, const Options &opt, MicroData<O3D, R3D> &d)
+{
+    VEC23<R3D> xmin = d.recorded[0].x, xmax = d.recorded[0].x;
+    for(const MicroState<O3D, R3D> &s : d.recorded) {
+        xmin = glm::min(xmin, s.x);
+        xmax = glm::max(xmax, s.x);
+    }
+    std::mt19937 rng(12345);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::uniform_int_distribution<size_t> pick(0, d.recorded.size() - 1);
+    ErrState errState;
+    int64_t attempts = 0, maxAttempts = (int64_t)opt.synthetic * 20;
+    while((int32_t)d.synthetic.size() < opt.synthetic && attempts++ < maxAttempts) {
+        MicroState<O3D, R3D> s = d.recorded[pick(rng)];
+        VEC23<R3D> dir;
+        for(int32_t c = 0; c < (R3D ? 3 : 2); ++c) {
+            s.x[c] = xmin[c] + (real)unit(rng) * (xmax[c] - xmin[c]);
+            dir[c] = (real)(unit(rng) * 2.0 - 1.0);
+        }
+        if(glm::length(dir) < RL(1e-3)) continue;
+        dir = glm::normalize(dir);
+        ResetErrState(&errState);
+        SSPOutputs<R3D> o;
+        EvaluateSSP<CFG, O3D, R3D>(s.x, dir, o, s.org, params.ssp, s.iSeg, &errState);
+        real c    = o.ccpx.real();
+        s.t       = dir / c;
+        s.x_o     = RayToOceanX(s.x, s.org);
+        s.urayt_o = RayToOceanT(dir, s.org);
+        BdryType Bdry;
+        GetBdrySeg<O3D>(
+            s.x_o, s.urayt_o, s.bds.top, &params.bdinfo->top, Bdry.Top, true, false,
+            &errState);
+        GetBdrySeg<O3D>(
+            s.x_o, s.urayt_o, s.bds.bot, &params.bdinfo->bot, Bdry.Bot, false, false,
+            &errState);
+        real DistTop, DistBot;
+        Distances<O3D>(
+            s.x_o, s.bds.top.x, s.bds.bot.x, s.bds.top.n, s.bds.bot.n, DistTop, DistBot);
+        if(HasErrored(&errState) || !(c > RL(0.0)) || DistTop <= RL(0.0)
+           || DistBot <= RL(0.0)) {
+            continue;
+        }
+        d.synthetic.push_back(s);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmark of one config
+////////////////////////////////////////////////////////////////////////////////
+
+/// Run, influence, and SSP type characters, e.g. "CGS".
+template<char RT, char IT, char ST> std::string ConfigName(CfgSel<RT, IT, ST>)
+{
+    return std::string{RT, IT, ST};
+}
+
+template<typename CFG, bool O3D, bool R3D> bool BenchConfig(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const Options &opt,
+    CaseResult &res)
+{
+    res.config = ConfigName(CFG());
+    MicroData<O3D, R3D> d;
+    if(!RecordStates<CFG, O3D, R3D>(params, opt, d)) {
+        messages += "No rays could be recorded\n";
+        return false;
+    }
+    SyntheticStates<CFG, O3D, R3D>(params, opt, d);
+    res.rays      = (int32_t)d.rayN.size();
+    res.recorded  = d.recorded.size();
+    res.synthetic = d.synthetic.size();
+
+    ErrState *errState;
+#ifdef BHC_BUILD_CUDA
+    checkCudaErrors(cudaMallocManaged(&errState, sizeof(ErrState)));
+#else
+    ErrState errStateCPU;
+    errState = &errStateCPU;
+#endif
+    ResetErrState(errState);
+
+    const char *setNames[2] = {"recorded", "synthetic"};
+    const std::vector<MicroState<O3D, R3D>> *sets[2] = {&d.recorded, &d.synthetic};
+    for(int32_t set = 0; set < 2; ++set) {
+        MicroState<O3D, R3D> *states = ManagedCopy(*sets[set]);
+        int32_t n                    = (int32_t)sets[set]->size();
+        TimeOp(
+            opt, "EvaluateSSP", setNames[set],
+            SSPOp<CFG, O3D, R3D>{states, params.ssp, errState}, n, (uint64_t)n, res);
+        TimeOp(
+            opt, "GetBdrySeg", setNames[set],
+            BdrySegOp<O3D, R3D>{states, params.bdinfo, errState}, n, (uint64_t)n * 2,
+            res);
+        TimeOp(
+            opt, "StepToBdry", setNames[set],
+            StepToBdryOp<CFG, O3D, R3D>{states, params.Beam, params.ssp, errState}, n,
+            (uint64_t)n, res);
+        ManagedFree(states);
+    }
+
+    const ReflectionInfoTopBot *tables[2] = {&params.refl->bot, &synthRefl};
+    const char *tableNames[2]             = {"environment", "synthetic"};
+    std::mt19937 rng(54321);
+    for(int32_t t = 0; t < 2; ++t) {
+        const ReflectionInfoTopBot &rtb = *tables[t];
+        if(rtb.NPts < 2) continue;
+        real lo = rtb.r[0].theta, hi = rtb.r[rtb.NPts - 1].theta;
+        std::uniform_real_distribution<double> dist(lo, hi);
+        d.angles.resize((size_t)opt.synthetic);
+        for(real &a : d.angles) a = (real)dist(rng);
+        real *angles = ManagedCopy(d.angles);
+        TimeOp(
+            opt, "InterpolateReflectionCoefficient", tableNames[t],
+            ReflCoefOp{angles, rtb, errState}, (int32_t)d.angles.size(),
+            (uint64_t)d.angles.size(), res);
+        ManagedFree(angles);
+    }
+
+    // The replayed rays add to the outputs of the last run, which are not
+    // used after this.
+    std::vector<bhcParams<O3D>> paramsVec(1, params);
+    rayPt<R3D> *points     = ManagedCopy(d.points);
+    RayInitInfo *rinits    = ManagedCopy(d.rinits);
+    int32_t *rayStart      = ManagedCopy(d.rayStart);
+    int32_t *rayN          = ManagedCopy(d.rayN);
+    bhcParams<O3D> *parPtr = ManagedCopy(paramsVec);
+    TimeOp(
+        opt, "Step_Influence", "recorded",
+        InfluenceOp<CFG, O3D, R3D>{
+            points, rinits, rayStart, rayN, parPtr, outputs.uAllSources, outputs.eigen,
+            outputs.arrinfo, errState},
+        (int32_t)d.rayN.size(), d.influenceSteps, res);
+    ManagedFree(parPtr);
+    ManagedFree(rayN);
+    ManagedFree(rayStart);
+    ManagedFree(rinits);
+    ManagedFree(points);
+
+#ifdef BHC_BUILD_CUDA
+    checkCudaErrors(cudaFree(errState));
+#endif
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Config selection, as in RunFieldModesSelInfl
+////////////////////////////////////////////////////////////////////////////////
+
+template<char RT, char IT, bool O3D, bool R3D> bool BenchSelSSP(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const Options &opt,
+    CaseResult &res)
+{
+    switch(params.ssp->Type) {
+#ifdef BHC_SSP_ENABLE_N2LINEAR
+    case 'N':
+        return BenchConfig<CfgSel<RT, IT, 'N'>, O3D, R3D>(params, outputs, opt, res);
+#endif
+#ifdef BHC_SSP_ENABLE_CLINEAR
+    case 'C':
+        return BenchConfig<CfgSel<RT, IT, 'C'>, O3D, R3D>(params, outputs, opt, res);
+#endif
+#ifdef BHC_SSP_ENABLE_CUBIC
+    case 'S':
+        return BenchConfig<CfgSel<RT, IT, 'S'>, O3D, R3D>(params, outputs, opt, res);
+#endif
+#ifdef BHC_SSP_ENABLE_PCHIP
+    case 'P':
+        return BenchConfig<CfgSel<RT, IT, 'P'>, O3D, R3D>(params, outputs, opt, res);
+#endif
+#ifdef BHC_SSP_ENABLE_QUAD
+    case 'Q':
+        if constexpr(!O3D) {
+            return BenchConfig<CfgSel<RT, IT, 'Q'>, O3D, R3D>(params, outputs, opt, res);
+        }
+        break;
+#endif
+#ifdef BHC_SSP_ENABLE_HEXAHEDRAL
+    case 'H':
+        if constexpr(O3D) {
+            return BenchConfig<CfgSel<RT, IT, 'H'>, O3D, R3D>(params, outputs, opt, res);
+        }
+        break;
+#endif
+#ifdef BHC_SSP_ENABLE_ANALYTIC
+    case 'A':
+        return BenchConfig<CfgSel<RT, IT, 'A'>, O3D, R3D>(params, outputs, opt, res);
+#endif
+    default: break;
+    }
+    messages += "SSP type not enabled at compile time or not valid in this dimension\n";
+    return false;
+}
+
+template<char IT, bool O3D, bool R3D> bool BenchSelRun(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const Options &opt,
+    CaseResult &res)
+{
+    char rt = params.Beam->RunType[0];
+    if(rt == 'C' || rt == 'S' || rt == 'I') {
+#ifdef BHC_RUN_ENABLE_TL
+        return BenchSelSSP<'C', IT, O3D, R3D>(params, outputs, opt, res);
+#endif
+    } else if(rt == 'E') {
+#ifdef BHC_RUN_ENABLE_EIGENRAYS
+        if constexpr(!InflType<IT>::IsCerveny()) {
+            return BenchSelSSP<'E', IT, O3D, R3D>(params, outputs, opt, res);
+        }
+#endif
+    } else if(rt == 'A' || rt == 'a' || rt == 'V' || rt == 'v') {
+#ifdef BHC_RUN_ENABLE_ARRIVALS
+        if constexpr(!InflType<IT>::IsCerveny()) {
+            return BenchSelSSP<'A', IT, O3D, R3D>(params, outputs, opt, res);
+        }
+#endif
+    }
+    messages += "Run type not a field run, not enabled at compile time, or not valid "
+                "with this influence type\n";
+    return false;
+}
+
+template<bool O3D, bool R3D> bool BenchSelInfl(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const Options &opt,
+    CaseResult &res)
+{
+    char it = params.Beam->Type[0];
+    if(it == 'R') {
+#ifdef BHC_INFL_ENABLE_CERVENY_RAYCEN
+        if constexpr(!R3D) return BenchSelRun<'R', O3D, R3D>(params, outputs, opt, res);
+#endif
+    } else if(it == 'C') {
+#ifdef BHC_INFL_ENABLE_CERVENY_CART
+        if constexpr(!R3D) return BenchSelRun<'C', O3D, R3D>(params, outputs, opt, res);
+#endif
+    } else if(it == 'G' || it == '^' || it == ' ' || it == 'B') {
+#ifdef BHC_INFL_ENABLE_GEOM_CART
+        return BenchSelRun<'G', O3D, R3D>(params, outputs, opt, res);
+#endif
+    } else if(it == 'g' || it == 'b') {
+#ifdef BHC_INFL_ENABLE_GEOM_RAYCEN
+        return BenchSelRun<'g', O3D, R3D>(params, outputs, opt, res);
+#endif
+    } else if(it == 'S') {
+#ifdef BHC_INFL_ENABLE_SGB
+        if constexpr(!R3D) return BenchSelRun<'S', O3D, R3D>(params, outputs, opt, res);
+#endif
+    }
+    messages += "Influence type not enabled at compile time or not valid in this "
+                "dimension\n";
+    return false;
+}
+
+template<bool O3D> void SetupSynthRefl(bhcParams<O3D> &params)
+{
+    synthRefl.NPts      = 91;
+    synthRefl.inDegrees = false;
+    trackallocate(params, "micro-benchmark reflection table", synthRefl.r, synthRefl.NPts);
+    for(int32_t i = 0; i < synthRefl.NPts; ++i) {
+        synthRefl.r[i].theta = (real)i;
+        synthRefl.r[i].r     = RL(1.0) - (real)i / RL(180.0);
+        synthRefl.r[i].phi   = (real)i * DegRad;
+    }
+    BuildIntervalLookup(
+        params, synthRefl.lookup, &synthRefl.r[0].theta, synthRefl.NPts,
+        sizeof(ReflectionCoef) / sizeof(real));
+}
+
+/**
+ * Sets up and runs the environment once through the API, so that all its
+ * inputs are preprocessed and its outputs are allocated, then benchmarks the
+ * functions with its config.
+ */
+template<bool O3D, bool R3D> bool RunCase(
+    const Options &opt, const MicroCase &c, CaseResult &res)
+{
+    std::string root = opt.dir + "/" + c.env;
+    bhcInit init;
+    init.FileRoot       = root.c_str();
+    init.outputCallback = OutputCallback;
+    init.prtCallback    = PrtCallback;
+    bhcParams<O3D> params;
+    bhcOutputs<O3D, R3D> outputs;
+    if(!bhc::setup<O3D, R3D>(init, params, outputs)) return false;
+    // The table is allocated before the run, as arrivals runs size their
+    // outputs to use all the memory which is left.
+    bool ok = true;
+    try {
+        SetupSynthRefl(params);
+    } catch(const std::exception &e) {
+        messages += std::string(e.what()) + "\n";
+        ok = false;
+    }
+    if(ok) ok = bhc::run<O3D, R3D>(params, outputs);
+    if(ok) ok = BenchSelInfl<O3D, R3D>(params, outputs, opt, res);
+    trackdeallocate(params, synthRefl.lookup.iCell);
+    trackdeallocate(params, synthRefl.r);
+    bhc::finalize<O3D, R3D>(params, outputs);
+    return ok;
+}
+
+bool RunCaseDim(const Options &opt, const MicroCase &c, CaseResult &res)
+{
+    switch(c.dim) {
+#if BHC_ENABLE_2D
+    case 2: return RunCase<false, false>(opt, c, res);
+#endif
+#if BHC_ENABLE_3D
+    case 3: return RunCase<true, true>(opt, c, res);
+#endif
+#if BHC_ENABLE_NX2D
+    case 4: return RunCase<true, false>(opt, c, res);
+#endif
+    default: return false;
+    }
+}
+
+bool DimEnabled(int dim)
+{
+    switch(dim) {
+    case 2: return BHC_ENABLE_2D;
+    case 3: return BHC_ENABLE_3D;
+    case 4: return BHC_ENABLE_NX2D;
+    default: return false;
+    }
+}
+
+void WriteCaseJSON(std::ostream &out, const MicroCase &c, const CaseResult &res)
+{
+    const char *dims[] = {"", "", "2D", "3D", "Nx2D"};
+    out << "    {\n";
+    out << "      \"name\": \"" << c.name << "\",\n";
+    out << "      \"env\": \"" << c.env << "\",\n";
+    out << "      \"dim\": \"" << dims[c.dim] << "\",\n";
+    out << "      \"ok\": " << (res.ok ? "true" : "false");
+    if(res.ok) {
+        out << ",\n";
+        out << "      \"config\": \"" << res.config << "\",\n";
+        out << "      \"rays\": " << res.rays << ",\n";
+        out << "      \"recordedStates\": " << res.recorded << ",\n";
+        out << "      \"syntheticStates\": " << res.synthetic << ",\n";
+        out << "      \"results\": [";
+        for(size_t i = 0; i < res.results.size(); ++i) {
+            const MicroResult &r = res.results[i];
+            out << (i == 0 ? "\n" : ",\n");
+            out << "        {\"function\": \"" << r.function << "\", \"states\": \""
+                << r.states << "\", \"device\": \"" << r.device
+                << "\", \"ops\": " << r.ops << ", \"nsPerOp\": " << r.nsPerOp << "}";
+        }
+        out << "\n      ]\n";
+    } else {
+        std::string m;
+        for(char ch : messages) {
+            if(ch == '"' || ch == '\\') m += '\\';
+            m += ch == '\n' ? ' ' : ch;
+        }
+        out << ",\n      \"messages\": \"" << m << "\"\n";
+    }
+    out << "    }";
+}
+
+void Usage(const char *argv0)
+{
+    std::cout
+        << "Usage: " << argv0
+        << " [options] [test/in directory]\n"
+           "For each case, runs the environment once, records a sample of its rays,\n"
+           "and times the ray tracing functions for its template config on the\n"
+           "recorded ray states and on synthetic ones. Writes ns/op as JSON; GPU\n"
+           "times are the throughput of one thread per state.\n"
+           "--rays=#: Rays recorded per case (default 256)\n"
+           "--synthetic=#: Synthetic states per case (default 16384)\n"
+           "--reps=#: Timed repetitions over all states (default 10)\n"
+           "--cpu-only: Do not launch the functions on the GPU (CUDA build)\n"
+           "--case=name: Only run cases whose name contains this\n"
+           "--out=file: Write the JSON to file instead of standard output\n"
+           "--list: List the cases and exit\n"
+           "-v, --verbose: Print the library's messages to standard error\n";
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    for(int32_t i = 1; i < argc; ++i) {
+        std::string s = argv[i];
+        std::string v = s.find('=') == std::string::npos ? "" : s.substr(s.find('=') + 1);
+        if(s == "-h" || s == "--help") {
+            Usage(argv[0]);
+            return 0;
+        } else if(s == "--list") {
+            for(const MicroCase &c : cases) std::cout << c.name << " (" << c.env << ")\n";
+            return 0;
+        } else if(s.rfind("--rays=", 0) == 0) {
+            opt.rays = std::max(std::stoi(v), 1);
+        } else if(s.rfind("--synthetic=", 0) == 0) {
+            opt.synthetic = std::max(std::stoi(v), 1);
+        } else if(s.rfind("--reps=", 0) == 0) {
+            opt.reps = std::max(std::stoi(v), 1);
+        } else if(s == "--cpu-only") {
+            opt.gpu = false;
+        } else if(s.rfind("--case=", 0) == 0) {
+            opt.filter = v;
+        } else if(s.rfind("--out=", 0) == 0) {
+            opt.outFile = v;
+        } else if(s == "-v" || s == "--verbose") {
+            opt.verbose = true;
+        } else if(!s.empty() && s[0] == '-') {
+            std::cerr << "Unknown option " << s << ", try --help\n";
+            return 1;
+        } else {
+            opt.dir = s;
+        }
+    }
+    verbose = opt.verbose;
+
+    std::stringstream json;
+    json.precision(6);
+    json << "{\n";
+    json << "  \"build\": \"" << BHC_BENCH_BUILD << "\",\n";
+#if defined(BHC_USE_MIXED_PRECISION)
+    json << "  \"precision\": \"mixed\",\n";
+#elif defined(BHC_USE_FLOATS)
+    json << "  \"precision\": \"float\",\n";
+#else
+    json << "  \"precision\": \"double\",\n";
+#endif
+    json << "  \"repetitions\": " << opt.reps << ",\n";
+    json << "  \"cases\": [";
+    bool allOk = true, first = true;
+    for(const MicroCase &c : cases) {
+        bool match = std::string(c.name).find(opt.filter) != std::string::npos;
+        if(!match || !DimEnabled(c.dim)) continue;
+        std::cerr << c.name << "... " << std::flush;
+        messages.clear();
+        CaseResult res;
+        res.ok = RunCaseDim(opt, c, res);
+        std::cerr << (res.ok ? "done" : "FAILED") << "\n" << std::flush;
+        if(!res.ok) {
+            allOk = false;
+            if(!verbose) std::cerr << messages;
+        }
+        json << (first ? "\n" : ",\n");
+        first = false;
+        WriteCaseJSON(json, c, res);
+    }
+    json << "\n  ]\n}\n";
+
+    if(opt.outFile.empty()) {
+        std::cout << json.str() << std::flush;
+    } else {
+        std::ofstream out(opt.outFile);
+        out << json.str();
+        if(!out.good()) {
+            std::cerr << "Could not write " << opt.outFile << "\n";
+            return 1;
+        }
+    }
+    return allOk ? 0 : 1;
+}
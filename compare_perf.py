@@ -0,0 +1,193 @@
+'''
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+'''
+import sys
+
+if sys.version_info.major < 3:
+    print('This is a python3 script')
+    sys.exit(-1)
+
+import argparse
+import math
+import os
+import shutil
+import subprocess
+import time
+
+# Runs the same test lists as run_tests.sh with BELLHOP (if present),
+# bellhopcxx single- and multi-threaded, and bellhopcuda (if built), and
+# writes one report with the wall time of each program, its ratio to BELLHOP,
+# and whether its results matched BELLHOP's according to the compare_*.py
+# scripts. Must be run from the repository root, like run_tests.sh.
+
+memopt = '--mem=18G'
+
+def parse_set(s):
+    '''tl2D:tl_match -> ('tl', '2D', 'tl_match')'''
+    if ':' not in s:
+        raise argparse.ArgumentTypeError(
+            '{} is not of the form (ray/tl/eigen/arr)(2D/3D/Nx2D):tests_list'.format(s))
+    kind, listname = s.split(':', 1)
+    if listname.endswith('.txt'):
+        listname = listname[:-4]
+    for dim in ['Nx2D', '3D', '2D']:
+        if kind.endswith(dim):
+            runtype = kind[:-len(dim)]
+            if runtype in {'ray', 'tl', 'eigen', 'arr'}:
+                return (runtype, dim, listname)
+    raise argparse.ArgumentTypeError('{} is not a valid run type'.format(kind))
+
+def read_list(listname):
+    with open(listname + '.txt', 'r') as f:
+        return [l.strip() for l in f if l.strip() and not l.startswith('//')]
+
+def find_exe(path):
+    for p in [path, path + '.exe']:
+        if os.path.isfile(p) and os.access(p, os.X_OK):
+            return p
+    return None
+
+def run_timed(cmd, timeout):
+    t0 = time.perf_counter()
+    try:
+        res = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+            timeout=timeout)
+    except subprocess.TimeoutExpired:
+        return None, 'timeout'
+    t = (time.perf_counter() - t0) * 1000.0
+    out = res.stdout.decode('utf-8', errors='replace')
+    # BELLHOP exits with 0 even after a fatal error
+    if res.returncode != 0 or 'STOP Fatal Error' in out:
+        return None, 'failed'
+    return t, 'ok'
+
+def compare(runtype, envfil, dir):
+    comparepy = {'ray': 'compare_ray_2.py', 'eigen': 'compare_ray_2.py',
+        'tl': 'compare_shdfil.py', 'arr': 'compare_arrivals.py'}[runtype]
+    res = subprocess.run([sys.executable, comparepy, envfil, dir],
+        stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return 'match' if res.returncode == 0 else 'MISMATCH'
+
+def fmt_ms(t):
+    return '-' if t is None else '{:.1f}'.format(t)
+
+def fmt_ratio(t, tref):
+    return '-' if t is None or tref is None or t <= 0.0 else '{:.2f}'.format(tref / t)
+
+def main():
+    parser = argparse.ArgumentParser(description='Compares the speed and results of '
+        'bellhopcxx / bellhopcuda with BELLHOP over test lists.')
+    parser.add_argument('sets', nargs='+', type=parse_set,
+        help='(ray/tl/eigen/arr)(2D/3D/Nx2D):tests_list, e.g. tl2D:tl_match')
+    parser.add_argument('--fortran', default='../bellhop/Bellhop',
+        help='Directory with bellhop.exe / bellhop3d.exe (skipped if absent)')
+    parser.add_argument('--bin', default='./bin', help='Directory with bellhopcxx etc.')
+    parser.add_argument('--repeat', type=int, default=1,
+        help='Runs of each program per test; the fastest is reported')
+    parser.add_argument('--timeout', type=float, default=3600.0,
+        help='Seconds before a run is abandoned')
+    parser.add_argument('--report', default='compare_perf_report.tsv',
+        help='Report file (tab-separated)')
+    args = parser.parse_args()
+
+    cxx = find_exe(os.path.join(args.bin, 'bellhopcxx'))
+    cuda = find_exe(os.path.join(args.bin, 'bellhopcuda'))
+    if cxx is None:
+        print('bellhopcxx not found in {}, build it first'.format(args.bin))
+        sys.exit(1)
+    progs = [('cxx1', cxx, ['-1']), ('cxxmulti', cxx, [])]
+    if cuda is not None:
+        progs.append(('cuda', cuda, []))
+    else:
+        print('bellhopcuda not found ... ignoring')
+
+    rows = []
+    ratios = {p[0]: [] for p in progs}
+    nmismatch = 0
+    for runtype, dim, listname in args.sets:
+        dimopt = {'2D': '-2', '3D': '-3', 'Nx2D': '-4'}[dim]
+        fortran = find_exe(os.path.join(args.fortran,
+            'bellhop.exe' if dim == '2D' else 'bellhop3d.exe'))
+        if fortran is None:
+            print('BELLHOP not found in {}, only timing {}'.format(args.fortran, listname))
+        for envfil in read_list(listname):
+            print('{}{} {}'.format(runtype, dim, envfil))
+            if not os.path.isfile('test/in/{}.env'.format(envfil)):
+                print('test/in/{}.env does not exist'.format(envfil))
+                sys.exit(1)
+            dirs = ['FORTRAN'] + [p[0] for p in progs]
+            for d in dirs:
+                os.makedirs('test/' + d, exist_ok=True)
+                for f in os.listdir('test/' + d):
+                    if f.startswith(envfil + '.'):
+                        os.remove('test/{}/{}'.format(d, f))
+                for f in os.listdir('test/in'):
+                    if f.startswith(envfil + '.'):
+                        shutil.copy('test/in/' + f, 'test/' + d)
+            def best(cmd):
+                t, status = None, 'ok'
+                for _ in range(args.repeat):
+                    ti, status = run_timed(cmd, args.timeout)
+                    if ti is None:
+                        return None, status
+                    t = ti if t is None else min(t, ti)
+                return t, status
+            tfor, sfor = None, 'absent'
+            if fortran is not None:
+                tfor, sfor = best([fortran, 'test/FORTRAN/' + envfil])
+            row = [runtype + dim, envfil, fmt_ms(tfor)]
+            for name, exe, opts in progs:
+                t, status = best([exe] + opts + [dimopt, memopt,
+                    'test/{}/{}'.format(name, envfil)])
+                if status != 'ok':
+                    result = status
+                elif tfor is None:
+                    result = '-'
+                elif runtype == 'arr' and name != 'cxx1':
+                    # See run_tests.sh: arrival order is not deterministic
+                    result = 'skipped'
+                else:
+                    result = compare(runtype, envfil, name)
+                    if result != 'match':
+                        nmismatch += 1
+                if t is not None and tfor is not None and t > 0.0:
+                    ratios[name].append(tfor / t)
+                row += [fmt_ms(t), fmt_ratio(t, tfor), result]
+            rows.append(row)
+
+    header = ['set', 'test', 'BELLHOP ms']
+    for name, _, _ in progs:
+        header += [name + ' ms', name + ' speedup', name + ' result']
+    with open(args.report, 'w') as f:
+        f.write('\t'.join(header) + '\n')
+        for row in rows:
+            f.write('\t'.join(row) + '\n')
+    print('')
+    print('Report written to {}'.format(args.report))
+    for name, _, _ in progs:
+        r = ratios[name]
+        if r:
+            gm = math.exp(sum(math.log(x) for x in r) / len(r))
+            print('{}: geometric mean speedup over BELLHOP {:.2f}x ({} tests)'.format(
+                name, gm, len(r)))
+    if nmismatch > 0:
+        print('{} results did not match BELLHOP'.format(nmismatch))
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
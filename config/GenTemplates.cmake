@@ -18,6 +18,8 @@
 set(BHC_RUN_DATABASE "TL:C;EIGENRAYS:E;ARRIVALS:A")
 set(BHC_INFL_DATABASE "CERVENY_RAYCEN:R;CERVENY_CART:C;GEOM_RAYCEN:g;GEOM_CART:G;SGB:S")
 set(BHC_SSP_DATABASE "N2LINEAR:N;CLINEAR:C;CUBIC:S;PCHIP:P;QUAD:Q;HEXAHEDRAL:H;ANALYTIC:A")
+set(BHC_BDRY_DATABASE "GENERAL:G;FLAT:F")
+set(BHC_BDRY_ENABLE_GENERAL ON)
 
 function(add_gen_template_defs_inner target_name type)
     foreach(pair IN LISTS BHC_${type}_DATABASE)
@@ -36,6 +38,7 @@ function(add_gen_template_defs target_name)
     add_gen_template_defs_inner(${target_name} RUN)
     add_gen_template_defs_inner(${target_name} INFL)
     add_gen_template_defs_inner(${target_name} SSP)
+    add_gen_template_defs_inner(${target_name} BDRY)
 endfunction()
 
 function(is_config_valid out_var_name)
@@ -48,6 +51,8 @@ function(is_config_valid out_var_name)
         set(res 0)
     elseif(BHCGENINFL MATCHES "[RC]" AND BHCGENRUN MATCHES "[EAa]")
         set(res 0)
+    elseif(BHCGENBDRY MATCHES "F" AND (BHCGENO3D STREQUAL "true" OR BHCGENSSP MATCHES "Q"))
+        set(res 0)
     endif()
     if(BHC_LIMIT_FEATURES)
         if(BHCGENSSP MATCHES "P" AND BHCGENO3D STREQUAL "true")
@@ -93,18 +98,36 @@ function(gen_templates_inner EXTENSION SOURCE_LIST_INNER_VAR)
                 if(NOT ${BHC_SSP_ENABLE_${SSP_NAME}})
                     continue()
                 endif()
-                is_config_valid(isvalid)
-                if(NOT isvalid)
-                    message(DEBUG "Not building ${DIM_NAME}_${RUN_NAME}_${INFL_NAME}_${SSP_NAME}")
-                    continue()
-                endif()
-                set(OUT_FILENAME "field_${DIM_NAME}_${RUN_NAME}_${INFL_NAME}_${SSP_NAME}.${EXTENSION}")
-                set(OUT_FILE "${CMAKE_CURRENT_BINARY_DIR}/gen_templates/${OUT_FILENAME}")
-                configure_file(
-                    "${CMAKE_SOURCE_DIR}/src/mode/fieldimpl.${EXTENSION}.in"
-                    "${OUT_FILE}"
-                )
-                list(APPEND SOURCE_LIST_INNER "${OUT_FILE}")
+                foreach(bdry_pair IN LISTS BHC_BDRY_DATABASE)
+                    if(bdry_pair MATCHES "(.+):(.+)")
+                        set(BDRY_NAME "${CMAKE_MATCH_1}")
+                        set(BHCGENBDRY "'${CMAKE_MATCH_2}'")
+                    else()
+                        message(FATAL_ERROR "Internal error with template generation: bdry")
+                    endif()
+                    if(NOT ${BHC_BDRY_ENABLE_${BDRY_NAME}})
+                        continue()
+                    endif()
+                    # General boundaries keep the names the files had before the
+                    # boundary dimension was added
+                    set(BDRY_SUFFIX "")
+                    if(NOT BDRY_NAME STREQUAL "GENERAL")
+                        set(BDRY_SUFFIX "_${BDRY_NAME}")
+                    endif()
+                    set(CFG_NAME "${DIM_NAME}_${RUN_NAME}_${INFL_NAME}_${SSP_NAME}${BDRY_SUFFIX}")
+                    is_config_valid(isvalid)
+                    if(NOT isvalid)
+                        message(DEBUG "Not building ${CFG_NAME}")
+                        continue()
+                    endif()
+                    set(OUT_FILENAME "field_${CFG_NAME}.${EXTENSION}")
+                    set(OUT_FILE "${CMAKE_CURRENT_BINARY_DIR}/gen_templates/${OUT_FILENAME}")
+                    configure_file(
+                        "${CMAKE_SOURCE_DIR}/src/mode/fieldimpl.${EXTENSION}.in"
+                        "${OUT_FILE}"
+                    )
+                    list(APPEND SOURCE_LIST_INNER "${OUT_FILE}")
+                endforeach()
             endforeach()
         endforeach()
     endforeach()
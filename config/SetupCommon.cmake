@@ -68,18 +68,29 @@ set(common_source
     mode/eigen.hpp
     mode/field.cpp
     mode/field.hpp
+    mode/fielddist.cpp
     mode/fieldimpl.hpp
+    mode/fieldpacket.hpp
+    mode/fieldplayback.hpp
+    mode/fieldretain.hpp
+    mode/fieldslice.cpp
+    mode/launchcfg.hpp
+    mode/memplan.hpp
     mode/modemodule.hpp
+    mode/pipeline.hpp
     mode/ray.cpp
     mode/ray.hpp
     mode/tl.cpp
     mode/tl.hpp
+    mode/tlchunked.hpp
+    mode/waveform.cpp
     module/atten.cpp
     module/atten.hpp
     module/beaminfo.hpp
     module/botopt.hpp
     module/boundarycond.hpp
     module/boundary.hpp
+    module/envcache.hpp
     module/freq0.hpp
     module/freqvec.hpp
     module/nmedia.hpp
@@ -99,8 +110,13 @@ set(common_source
     util/directio.hpp
     util/errors.cpp
     util/errors.hpp
+    util/fft.hpp
+    util/jobsched.hpp
     util/ldio.hpp
+    util/mappedfile.hpp
     util/prtfileemu.hpp
+    util/threadpool.cpp
+    util/threadpool.hpp
     util/timing.cpp
     util/timing.hpp
     util/unformattedio.hpp
@@ -127,15 +143,31 @@ if(NOT BHC_DIM_ENABLE_2D AND NOT BHC_DIM_ENABLE_3D AND NOT BHC_DIM_ENABLE_NX2D)
     message(FATAL_ERROR "2D, 3D, and Nx2D dim modes all disabled, nothing to build!")
 endif()
 
+if(BHC_SSP_ANALYTIC_HEADER AND NOT BHC_SSP_ENABLE_ANALYTIC)
+    message(FATAL_ERROR "BHC_SSP_ANALYTIC_HEADER is set but the analytic SSP is disabled (BHC_SSP_ENABLE_ANALYTIC)")
+endif()
+
 find_package(Threads)
+if(BHC_USE_MPI)
+    find_package(MPI REQUIRED COMPONENTS CXX)
+endif()
 
 function(bhc_setup_target target_name defs use_addl)
-    if(BHC_USE_FLOATS)
+    if(BHC_USE_FLOATS OR BHC_USE_MIXED_PRECISION)
         target_compile_definitions(${target_name} PUBLIC BHC_USE_FLOATS=1)
     endif()
+    if(BHC_USE_MIXED_PRECISION)
+        target_compile_definitions(${target_name} PUBLIC BHC_USE_MIXED_PRECISION=1)
+    endif()
     if(BHC_DEBUG)
         target_compile_definitions(${target_name} PUBLIC BHC_DEBUG=1)
     endif()
+    if(BHC_PERF_COUNTERS)
+        target_compile_definitions(${target_name} PUBLIC BHC_PERF_COUNTERS=1)
+    endif()
+    if(BHC_SSP_ANALYTIC_HEADER)
+        target_compile_definitions(${target_name} PRIVATE BHC_SSP_ANALYTIC_HEADER="${BHC_SSP_ANALYTIC_HEADER}")
+    endif()
     # if(BHC_PROF AND CMAKE_COMPILER_IS_GNUCXX)
     #     target_compile_options(${target_name} PUBLIC -pg)
     #     target_link_options(${target_name} PUBLIC -pg)
@@ -149,6 +181,10 @@ function(bhc_setup_target target_name defs use_addl)
     target_include_directories(${target_name} PUBLIC "${CMAKE_SOURCE_DIR}/include")
     target_include_directories(${target_name} PUBLIC "${CMAKE_SOURCE_DIR}/glm")
     target_link_libraries(${target_name} PUBLIC Threads::Threads)
+    if(BHC_USE_MPI)
+        target_compile_definitions(${target_name} PUBLIC BHC_USE_MPI=1)
+        target_link_libraries(${target_name} PUBLIC MPI::MPI_CXX)
+    endif()
     if(WIN32)
         set_property(TARGET ${target_name} PROPERTY MSVC_RUNTIME_LIBRARY "MultiThreaded")
     endif()
@@ -0,0 +1,70 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+/*
+Example user-defined analytic SSP (ssp->Type == 'A'). Build with
+    cmake -DBHC_SSP_ANALYTIC_HEADER=/path/to/examples/analytic_ssp.hpp ...
+and every run with the analytic SSP option evaluates this model instead of the
+built-in one, on the CPU and the GPU.
+
+This is the canonical Munk profile, with a sound channel axis which deepens
+linearly in x (range in 2D):
+    c   = c0 * (1 + eps * (eta - 1 + exp(-eta)))
+    eta = 2 * (z - zAxis(x)) / B,  zAxis(x) = z0 + slope * x
+so all the derivatives follow from dc/deta and d2c/deta2 by the chain rule.
+*/
+
+namespace bhc {
+
+struct AnalyticSSPModel {
+    template<bool O3D> HOST_DEVICE static inline void Evaluate(
+        const VEC23<O3D> &x, SSPOutputs<O3D> &o)
+    {
+        const real c0    = FL(1500.0);
+        const real eps   = FL(0.00737);
+        const real B     = FL(1300.0); // scale depth
+        const real z0    = FL(1300.0); // axis depth at x = 0
+        const real slope = FL(0.004);  // axis deepens 4 m per km
+
+        real z        = DEP(x);
+        real eta      = FL(2.0) * (z - (z0 + slope * x.x)) / B;
+        real eta_x    = FL(-2.0) * slope / B;
+        real eta_z    = FL(2.0) / B;
+        real emeta    = STD::exp(-eta);
+        real c_eta    = c0 * eps * (FL(1.0) - emeta);
+        real c_etaeta = c0 * eps * emeta;
+
+        o.ccpx = cpx(c0 * (FL(1.0) + eps * (eta - FL(1.0) + emeta)), FL(0.0));
+        o.rho  = FL(1.0);
+        o.czz  = c_etaeta * SQ(eta_z);
+        if constexpr(O3D) {
+            o.gradc = vec3(c_eta * eta_x, FL(0.0), c_eta * eta_z);
+            o.cxx   = c_etaeta * SQ(eta_x);
+            o.cxz   = c_etaeta * eta_x * eta_z;
+            o.cyy = o.cxy = o.cyz = FL(0.0);
+        } else {
+            o.gradc = vec2(c_eta * eta_x, c_eta * eta_z);
+            o.crr   = c_etaeta * SQ(eta_x);
+            o.crz   = c_etaeta * eta_x * eta_z;
+        }
+    }
+};
+
+} // namespace bhc
@@ -49,10 +49,9 @@ int main()
     init.outputCallback    = OutputCallback;
     init.prtCallback       = PrtCallback;
     init.completedCallback = CompletedCallback;
+    init.blocking          = false;
 
     bhc::setup(init, params, outputs);
-    // Awkward, but only rays are non-blocking.
-    outputs.rayinfo->blocking = false;
 
     strcpy(params.Beam->RunType, "RG   3");
 
@@ -102,10 +101,10 @@ int main()
 
     bhc::echo(params);
 
-    bhc::run(params, outputs);
-
     std::cout << "Starting the ray calculation\n" << std::flush;
     going = true;
+    bhc::run(params, outputs);
+
     while(going) {
         std::cout << "   " << bhc::get_percent_progress(params) << "% done\n "
                   << std::flush;
@@ -294,7 +294,12 @@ extern template BHC_API bool echo<true>(bhcParams<true> &params);
  * Runs the selected run type and places the results in the appropriate struct
  * within outputs.
  *
- * returns: false if an error occurred, true if no errors.
+ * If bhcInit::blocking was false, returns immediately and the run continues in
+ * the background; see bhcInit::blocking.
+ *
+ * returns: false if an error occurred, true if no errors. In non-blocking mode,
+ * errors during the run are reported through the outputCallback, and cause
+ * the subsequent writeout() to fail.
  */
 template<bool O3D, bool R3D> bool run(
     bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs);
@@ -309,14 +314,244 @@ extern template BHC_API bool run<true, false>(
 extern template BHC_API bool run<true, true>(
     bhcParams<true> &params, bhcOutputs<true, true> &outputs);
 
+/**
+ * Runs a batch of n environments, e.g. an ensemble of perturbed SSPs or
+ * bathymetries, and places the results of environment i in outputs[i]. params[i]
+ * and outputs[i] must each have been set up with their own setup() call.
+ *
+ * For TL, eigenray, and arrivals runs, the rays of all the environments are
+ * traced together, so that the worker threads or GPU(s) stay busy across the
+ * whole batch rather than ramping down at the end of each environment. This
+ * requires all the environments to have the same run type, beam (influence)
+ * type, and SSP type, and uses the threads and GPU(s) of params[0]. Ray runs
+ * and batches of one environment are simply run one after another.
+ *
+ * Always blocks until the whole batch is done, regardless of bhcInit::blocking.
+ *
+ * returns: false if an error occurred, true if no errors.
+ */
+template<bool O3D, bool R3D> bool run_batch(
+    bhcParams<O3D> *params, bhcOutputs<O3D, R3D> *outputs, int32_t n);
+
+/// 2D version, see template.
+extern template BHC_API bool run_batch<false, false>(
+    bhcParams<false> *params, bhcOutputs<false, false> *outputs, int32_t n);
+/// Nx2D version, see template.
+extern template BHC_API bool run_batch<true, false>(
+    bhcParams<true> *params, bhcOutputs<true, false> *outputs, int32_t n);
+/// 3D version, see template.
+extern template BHC_API bool run_batch<true, true>(
+    bhcParams<true> *params, bhcOutputs<true, true> *outputs, int32_t n);
+
 /**
  * Get the percent progress as an int. Thread safe.
- * Returns an int from 0 to 100.
+ * Returns an int from 0 to 100. This is the fraction of rays which have been
+ * traced; post-processing (e.g. for eigenrays) is not included.
  */
 template<bool O3D> int get_percent_progress(bhcParams<O3D> &params);
 extern template BHC_API int get_percent_progress<true>(bhcParams<true> &params);
 extern template BHC_API int get_percent_progress<false>(bhcParams<false> &params);
 
+/**
+ * Get the largest amount of memory (in bytes, counted the same way as for
+ * bhcInit::maxMemory) which the instance has had allocated at any one time
+ * since setup(), or since the last call with reset = true. Useful for sizing
+ * maxMemory, and for benchmarking. Not thread safe with a run in progress.
+ */
+template<bool O3D> size_t get_peak_memory(bhcParams<O3D> &params, bool reset = false);
+extern template BHC_API size_t get_peak_memory<true>(
+    bhcParams<true> &params, bool reset);
+extern template BHC_API size_t get_peak_memory<false>(
+    bhcParams<false> &params, bool reset);
+
+/**
+ * Get the breakdown of the instance's memory by the structure it is allocated
+ * for (see bhcMemoryUse), sorted by peak, largest first. Fills up to maxUses
+ * entries of uses, which may be nullptr if maxUses is 0. Useful for sizing
+ * maxMemory. Not thread safe with a run in progress.
+ *
+ * returns: the number of structures there are entries for, which may be more
+ * than maxUses.
+ */
+template<bool O3D> int32_t get_memory_usage(
+    bhcParams<O3D> &params, bhcMemoryUse *uses, int32_t maxUses);
+extern template BHC_API int32_t get_memory_usage<true>(
+    bhcParams<true> &params, bhcMemoryUse *uses, int32_t maxUses);
+extern template BHC_API int32_t get_memory_usage<false>(
+    bhcParams<false> &params, bhcMemoryUse *uses, int32_t maxUses);
+
+/**
+ * Get the ray tracing event counters (steps, reflections, why rays were
+ * terminated, etc.) from the last run(), totals and per-ray histograms; see
+ * bhcPerfCounters. These are only counted if the library was built with the
+ * CMake option BHC_PERF_COUNTERS, which costs some performance; otherwise
+ * counters.enabled is false. Not thread safe with a run in progress.
+ */
+template<bool O3D> void get_perf_counters(
+    bhcParams<O3D> &params, bhcPerfCounters &counters);
+extern template BHC_API void get_perf_counters<true>(
+    bhcParams<true> &params, bhcPerfCounters &counters);
+extern template BHC_API void get_perf_counters<false>(
+    bhcParams<false> &params, bhcPerfCounters &counters);
+
+/**
+ * Get the durations of the phases of the last setup(), run() (or run_batch(),
+ * whose timings are in its first params), and writeout(); see bhcTimings.
+ * These are recorded instead of being printed. Not thread safe with a run in
+ * progress.
+ */
+template<bool O3D> void get_timings(bhcParams<O3D> &params, bhcTimings &timings);
+extern template BHC_API void get_timings<true>(
+    bhcParams<true> &params, bhcTimings &timings);
+extern template BHC_API void get_timings<false>(
+    bhcParams<false> &params, bhcTimings &timings);
+
+/**
+ * Get the per-ray statistics of the last field run (see bhcInit::rayStats and
+ * bhcRayStats). These stay valid until the next run() or finalize().
+ *
+ * returns: the number of rays, with raystats pointing to their stats; or 0,
+ * with raystats nullptr, if there are none.
+ */
+template<bool O3D, bool R3D> int32_t get_ray_stats(
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+    const bhcRayStats *&raystats);
+
+/// 2D version, see template.
+extern template BHC_API int32_t get_ray_stats<false, false>(
+    const bhcParams<false> &params, const bhcOutputs<false, false> &outputs,
+    const bhcRayStats *&raystats);
+/// Nx2D version, see template.
+extern template BHC_API int32_t get_ray_stats<true, false>(
+    const bhcParams<true> &params, const bhcOutputs<true, false> &outputs,
+    const bhcRayStats *&raystats);
+/// 3D version, see template.
+extern template BHC_API int32_t get_ray_stats<true, true>(
+    const bhcParams<true> &params, const bhcOutputs<true, true> &outputs,
+    const bhcRayStats *&raystats);
+
+/**
+ * Reads the rays captured by a run with bhcInit::captureSteps / captureTime
+ * from FileRoot.rayinit (e.g. "foo_capture" for a run written out to "foo").
+ * Pass nullptr for FileRoot to use the FileRoot params were set up from, i.e.
+ * the captured environment foo_capture.env. Up to maxRays rays are stored in
+ * rays, with their init indices and captured stats; call with maxRays 0 to
+ * get the count first.
+ *
+ * returns: the number of rays in the file, or -1 if an error occurred.
+ */
+template<bool O3D> int32_t read_capture(
+    const bhcParams<O3D> &params, const char *FileRoot, bhcPlaybackRay *rays,
+    int32_t maxRays);
+
+/// 2D version, see template.
+extern template BHC_API int32_t read_capture<false>(
+    const bhcParams<false> &params, const char *FileRoot, bhcPlaybackRay *rays,
+    int32_t maxRays);
+/// Nx2D or 3D version, see template.
+extern template BHC_API int32_t read_capture<true>(
+    const bhcParams<true> &params, const char *FileRoot, bhcPlaybackRay *rays,
+    int32_t maxRays);
+
+/**
+ * Re-traces only the given rays of a field run (TL, eigenrays, arrivals), one
+ * at a time on the calling thread (on the CPU, also in CUDA builds), and
+ * stores each one's stats, time, and performance counters in its
+ * bhcPlaybackRay. This is for reproducing the cost of a few slow rays without
+ * the rest of the run; see bhcInit::captureSteps. The rays' contributions are
+ * added to outputs, but these are not postprocessed, so they are not the
+ * results of a run. get_perf_counters() gives the totals over these rays.
+ *
+ * returns: false if an error occurred, true if no errors.
+ */
+template<bool O3D, bool R3D> bool playback(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, bhcPlaybackRay *rays,
+    int32_t nRays);
+
+/// 2D version, see template.
+extern template BHC_API bool playback<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs, bhcPlaybackRay *rays,
+    int32_t nRays);
+/// Nx2D version, see template.
+extern template BHC_API bool playback<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs, bhcPlaybackRay *rays,
+    int32_t nRays);
+/// 3D version, see template.
+extern template BHC_API bool playback<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs, bhcPlaybackRay *rays,
+    int32_t nRays);
+
+/**
+ * Projects the memory run() would use for the current state of params, per
+ * structure and in total, without allocating anything. Call after setup() and
+ * any changes to params. budget is the number of bytes to plan for; if 0,
+ * bhcInit::maxMemory is used. If the run does not fit, the plan also gives the
+ * number of TL source groups or the arrivals cap which would; see
+ * bhcMemoryPlan.
+ *
+ * returns: false if an error occurred, otherwise whether the run fits in the
+ * budget (plan.fits).
+ */
+template<bool O3D, bool R3D> bool plan_memory(
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+    bhcMemoryPlan &plan, size_t budget = 0);
+
+/// 2D version, see template.
+extern template BHC_API bool plan_memory<false, false>(
+    const bhcParams<false> &params, const bhcOutputs<false, false> &outputs,
+    bhcMemoryPlan &plan, size_t budget);
+/// Nx2D version, see template.
+extern template BHC_API bool plan_memory<true, false>(
+    const bhcParams<true> &params, const bhcOutputs<true, false> &outputs,
+    bhcMemoryPlan &plan, size_t budget);
+/// 3D version, see template.
+extern template BHC_API bool plan_memory<true, true>(
+    const bhcParams<true> &params, const bhcOutputs<true, true> &outputs,
+    bhcMemoryPlan &plan, size_t budget);
+
+/**
+ * Registers caller-owned memory for the outputs of later runs, so that they
+ * are computed directly into it rather than into memory allocated by the
+ * library, which would then have to be copied out. Takes effect from the next
+ * run(), and stays in effect until it is called again; pass nullptr to go back
+ * to the library allocating the output. The memory must stay valid until
+ * then, and until finalize(). The library never frees it.
+ *
+ * field: TL runs, used for bhcOutputs::uAllSources. fieldCount is its size in
+ * elements, and the run fails if it is smaller than the field, which is laid
+ * out as in GetFieldAddr (common.hpp): source z, x, y, then frequency
+ * (broadband runs only), bearing, receiver depth, and receiver range, which is
+ * contiguous. Streamed TL runs (bhcInit::streamTLSources) only need one
+ * source's worth.
+ *
+ * arrivals: arrivals runs, used for ArrInfo::Arr, or ArrInfo::ArrC for compact
+ * arrivals. arrivalsBytes is its size in bytes. The number of arrivals per
+ * receiver (ArrInfo::MaxNArr), or in arena mode the number of chunks, is set
+ * from this size instead of from bhcInit::maxMemory. Receiver r's arrivals
+ * start at Arr[r * MaxNArr], with r from GetFieldAddr; in arena mode, use
+ * ArrivalIndex (arrivals.hpp). The counts (ArrInfo::NArr) are still allocated
+ * by the library.
+ *
+ * Both must be aligned for their type. CUDA builds: both must be managed
+ * memory (cudaMallocManaged), as the post-processing and writeout are done
+ * on the host. Multi-GPU runs still allocate a copy of the output per
+ * additional GPU, which is merged into this one.
+ *
+ * returns: false if an error occurred, true if no errors.
+ */
+template<bool O3D> bool set_output_buffers(
+    bhcParams<O3D> &params, cpxf *field, size_t fieldCount, void *arrivals,
+    size_t arrivalsBytes);
+
+/// 2D version, see template.
+extern template BHC_API bool set_output_buffers<false>(
+    bhcParams<false> &params, cpxf *field, size_t fieldCount, void *arrivals,
+    size_t arrivalsBytes);
+/// 3D or Nx2D version, see template.
+extern template BHC_API bool set_output_buffers<true>(
+    bhcParams<true> &params, cpxf *field, size_t fieldCount, void *arrivals,
+    size_t arrivalsBytes);
+
 /**
  * Write results for the past run to BELLHOP-formatted files, i.e. a ray file,
  * a shade file, or an arrivals file. If you only want to use the results in
@@ -344,6 +579,99 @@ extern template BHC_API bool writeout<true, true>(
     const bhcParams<true> &params, const bhcOutputs<true, true> &outputs,
     const char *FileRoot);
 
+/**
+ * Synthesizes the time series at every receiver from the arrivals of the past
+ * arrivals run, in memory, e.g. channel impulse responses or received
+ * waveforms, without writing out and reading back the arrivals. See
+ * bhcWaveformParams. The receivers are done in parallel on the worker threads,
+ * each with one FFT of nSamples plus the length of the pulse, rounded up to a
+ * power of 2. The amplitudes include the spreading done by the postprocessing
+ * of the run, so they are as in the arrivals file.
+ *
+ * out: wp.nSamples floats per receiver, with the receivers in the order of the
+ * arrivals (source z, x, y, receiver bearing, depth, and range, see
+ * GetFieldAddr in common.hpp). outCount is its size in floats.
+ *
+ * returns: false if an error occurred, true if no errors.
+ */
+template<bool O3D, bool R3D> bool synthesize_waveforms(
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+    const bhcWaveformParams &wp, float *out, size_t outCount);
+
+/// 2D version, see template.
+extern template BHC_API bool synthesize_waveforms<false, false>(
+    const bhcParams<false> &params, const bhcOutputs<false, false> &outputs,
+    const bhcWaveformParams &wp, float *out, size_t outCount);
+/// Nx2D version, see template.
+extern template BHC_API bool synthesize_waveforms<true, false>(
+    const bhcParams<true> &params, const bhcOutputs<true, false> &outputs,
+    const bhcWaveformParams &wp, float *out, size_t outCount);
+/// 3D version, see template.
+extern template BHC_API bool synthesize_waveforms<true, true>(
+    const bhcParams<true> &params, const bhcOutputs<true, true> &outputs,
+    const bhcWaveformParams &wp, float *out, size_t outCount);
+
+/**
+ * Runs and writes out a series of jobs, overlapping the writeout of each job
+ * with the run of the next. Each call runs a job (like run(), always blocking)
+ * and then starts writing out its results (like writeout()) on a background
+ * thread, and returns while that is still in progress. The library keeps a
+ * second set of outputs for this: when the call returns, outputs holds the
+ * results of the job just run, but these must not be modified, as they are
+ * being written out; the next call runs into the other set. If the writeout
+ * of the previous job has not finished when the run of the next one has, the
+ * next call waits for it before starting its own writeout, so at most one job
+ * is ever being written out.
+ *
+ * Between calls, the params may be changed for the next job (e.g. with the
+ * extsetup functions, or by running setup() with the same internal data).
+ * Only the parts of them which are written to the output files are copied
+ * for the writeout. While the pipeline is in use, outputs which are sized to
+ * use the remaining memory (arrivals, rays, eigenray hits) are limited to half
+ * of it, so there is room for both sets. Caller-owned output buffers (see
+ * set_output_buffers()) cannot be used with this.
+ *
+ * Call finish_pipeline() after the last job, to wait for its writeout and to
+ * free the second set of outputs.
+ *
+ * FileRoot: as for writeout(), for the files of this job.
+ *
+ * returns: false if an error occurred in this run or in the writeout of the
+ * previous job, true if no errors.
+ */
+template<bool O3D, bool R3D> bool run_pipelined(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const char *FileRoot);
+
+/// 2D version, see template.
+extern template BHC_API bool run_pipelined<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs, const char *FileRoot);
+/// Nx2D version, see template.
+extern template BHC_API bool run_pipelined<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs, const char *FileRoot);
+/// 3D version, see template.
+extern template BHC_API bool run_pipelined<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs, const char *FileRoot);
+
+/**
+ * Waits for the writeout of the last job of run_pipelined() to finish, and
+ * frees the second set of outputs. The results in outputs remain valid. Does
+ * nothing if run_pipelined() is not in use. Also done by finalize().
+ *
+ * returns: false if an error occurred in the writeout, true if no errors.
+ */
+template<bool O3D, bool R3D> bool finish_pipeline(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs);
+
+/// 2D version, see template.
+extern template BHC_API bool finish_pipeline<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs);
+/// Nx2D version, see template.
+extern template BHC_API bool finish_pipeline<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+/// 3D version, see template.
+extern template BHC_API bool finish_pipeline<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs);
+
 /**
  * Read saved results from a past run (a ray file, TL / shade file, or arrivals
  * file) to memory (the outputs struct). params should have already been
@@ -371,6 +699,56 @@ extern template BHC_API bool readout<true, false>(
 extern template BHC_API bool readout<true, true>(
     bhcParams<true> &params, bhcOutputs<true, true> &outputs, const char *FileRoot);
 
+/**
+ * Like readout() for ray and eigenray runs, but loads only some of the rays:
+ * the nRays rays with indices rays[0..nRays-1], counting the rays in the order
+ * they are in the ray file, which is the order of outputs.rayinfo->results
+ * after a full readout(). They are loaded in the order given. If the ray file
+ * has an index (bhcInit::rayIndexFile), only these rays are read from the
+ * file; otherwise, the whole file has to be scanned to find them.
+ *
+ * returns: false if an error occurred, true if no errors.
+ */
+template<bool O3D, bool R3D> bool readout_rays(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const char *FileRoot,
+    const int32_t *rays, int32_t nRays);
+
+/// 2D version, see template.
+extern template BHC_API bool readout_rays<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs, const char *FileRoot,
+    const int32_t *rays, int32_t nRays);
+/// Nx2D version, see template.
+extern template BHC_API bool readout_rays<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs, const char *FileRoot,
+    const int32_t *rays, int32_t nRays);
+/// 3D version, see template.
+extern template BHC_API bool readout_rays<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs, const char *FileRoot,
+    const int32_t *rays, int32_t nRays);
+
+/**
+ * Read a single tile of a chunked TL file (see bhcInit::chunkedTLFile): the
+ * field at all the receiver depths and ranges for one source, frequency (0
+ * unless broadband), and bearing, without reading the rest of the file. field
+ * must hold NRz_per_range * NRr values, which are stored depth major, as in
+ * bhcOutputs::uAllSources. The dimensions are taken from the file, not from
+ * params, which is only used for error reporting and the default FileRoot.
+ *
+ * returns: false if an error occurred, true if no errors.
+ */
+template<bool O3D> bool readout_tl_tile(
+    const bhcParams<O3D> &params, const char *FileRoot, int32_t isx, int32_t isy,
+    int32_t isz, int32_t ifreq, int32_t itheta, cpxf *field);
+
+/// 2D version, see template.
+extern template BHC_API bool readout_tl_tile<false>(
+    const bhcParams<false> &params, const char *FileRoot, int32_t isx, int32_t isy,
+    int32_t isz, int32_t ifreq, int32_t itheta, cpxf *field);
+/// 3D or Nx2D version, see template.
+extern template BHC_API bool readout_tl_tile<true>(
+    const bhcParams<true> &params, const char *FileRoot, int32_t isx, int32_t isy,
+    int32_t isz, int32_t ifreq, int32_t itheta, cpxf *field);
+
 /**
  * Write the current params state to an environment file and any other "input"
  * file types (e.g. SSP, bathymetry, etc.), so that the state can be loaded
@@ -38,12 +38,22 @@ using real = float;
 using real = double;
 #endif
 
+/// Type for the quantities accumulated along a ray or over many rays: phase,
+/// travel time (delay), and sums of field copies. Same as real, except with
+/// BHC_USE_MIXED_PRECISION, where it is double while real is float.
+#ifdef BHC_USE_MIXED_PRECISION
+using realacc = double;
+#else
+using realacc = real;
+#endif
+
 using vec2   = glm::vec<2, real, glm::defaultp>;
 using vec3   = glm::vec<3, real, glm::defaultp>;
 using int2   = glm::vec<2, int32_t, glm::defaultp>;
 using mat2x2 = glm::mat<2, 2, real, glm::defaultp>;
 
-using cpx  = STD::complex<real>;
-using cpxf = STD::complex<float>;
+using cpx    = STD::complex<real>;
+using cpxf   = STD::complex<float>;
+using cpxacc = STD::complex<realacc>;
 
 } // namespace bhc
@@ -76,11 +76,20 @@ struct SSPStructure {
     cpx cCoef[4][MaxSSP], CSWork[4][MaxSSP]; // for PCHIP coefs.
     real *cMat, *czMat; // LP: No need for separate cMat3 / czMat3 as we don't have to
                         // specify the dimension here.
+    /// Hexahedral only, see bhcInit::packHexSSP: for each cell, c and cz at the
+    /// four x-y corners at the cell's top depth. Computed in preprocessing,
+    /// nullptr if not used.
+    real *cellMat;
     rxyz_vector Seg;
     real z[MaxSSP], rho[MaxSSP];
     real alphaR[MaxSSP], alphaI[MaxSSP];
     // LP: Not actually used, but echoed, so with new system need to store them
     real betaR[MaxSSP], betaI[MaxSSP];
+    // Real parts of the cubic spline / PCHIP polynomials of each segment for
+    // c, c_z, and c_zz, in Horner order, computed in preprocessing. If cIsReal,
+    // the whole profile has no imaginary part (attenuation) and these are used
+    // instead of the complex coefficients.
+    real cPoly[4][MaxSSP], czPoly[3][MaxSSP], czzPoly[2][MaxSSP];
 
     int32_t NPts, Nr, Nx, Ny, Nz;
     char Type;
@@ -88,6 +97,7 @@ struct SSPStructure {
     bool rangeInKm; // Ranges (R, X, Y) specified in km, will be automatically converted
                     // to meters
     bool dirty;     // reset and update derived params
+    bool cIsReal;   // set in preprocessing, see cPoly
 };
 
 // SSPOutputs is templated as O3D during computation, but R3D when returned,
@@ -169,12 +179,29 @@ template<bool O3D> struct BdryPtFull : public BdryPtFullExtras<O3D>,
 };
 template<bool O3D> constexpr int32_t BdryStride = sizeof(BdryPtFull<O3D>) / sizeof(real);
 
+/**
+ * Inverse map from a coordinate (boundary x or y, reflection coefficient
+ * angle) to the index of the interval between tabulated points containing it.
+ * The coordinate range is divided into nBuckets uniform buckets, and iCell is
+ * the interval containing the start of each bucket. For uniformly spaced
+ * points, this is the correct interval or its neighbor. See IntervalGuess.
+ */
+struct IntervalLookup {
+    real min, rcpDelta; // coordinate of the first point, buckets per unit length
+    int32_t nBuckets;
+    int32_t *iCell;
+};
+
 template<bool O3D> struct BdryInfoTopBot {
     IORI2<O3D> NPts;
     char type[2];        // In 3D, only first char is used
     bool dirty;          // Set to indicate that derived values need updating
     bool rangeInKm;      // R, X, Y values in km; automatically converted to meters
+    /// 2D only, computed in preprocessing: a single segment at constant depth,
+    /// see BdryShape.
+    bool flat;
     BdryPtFull<O3D> *bd; // 2D: 1D array / 3D: 2D array
+    IntervalLookup xLookup, yLookup; // 3D only, computed in preprocessing
 };
 /**
  * LP: There are three boundary structures. This one represents static/global
@@ -245,6 +272,7 @@ struct ReflectionInfoTopBot {
     int32_t NPts;
     bool inDegrees; // Angles in degrees, converted to radians at preprocess
     ReflectionCoef *r;
+    IntervalLookup lookup; // of r[].theta, computed in preprocessing
 };
 struct ReflectionInfo {
     ReflectionInfoTopBot bot, top;
@@ -334,6 +362,18 @@ template<bool O3D> struct BeamStructure {
     bool autoDeltas; // stores whether deltas was automatically computed, for echo
     real deltas, epsMultiplier, rLoop;
     VEC23<O3D> Box;
+    // Adaptive step size, copied from bhcInit::stepTolerance etc. in
+    // preprocess. stepTol == 0 means every step starts from deltas. stepMin and
+    // stepMax are in meters.
+    real stepTol, stepMin, stepMax;
+    // Ray pruning, from bhcInit::rayAmpCutoffdB and maxBottomBounces.
+    // ampCutoff is a linear amplitude ratio, 0 means disabled; maxBotBnc < 0
+    // means disabled.
+    real ampCutoff;
+    int32_t maxBotBnc;
+    // TL runs, from bhcInit::allTLTypes: the field has a plane for each of
+    // the three TL types, see TLPlaneType.
+    bool allTLTypes;
 };
 
 /**
@@ -375,15 +415,44 @@ struct Arrival {
     cpxf delay;
 };
 
+/**
+ * Arrival stored in 28 instead of 40 bytes, see bhcInit::compactArrivals.
+ * The angles are IEEE half precision (binary16) bit patterns, and the bounce
+ * counts are saturated at 32767. Use LoadArrival / StoreArrival (arrivals.hpp)
+ * to convert.
+ */
+struct ArrivalCompact {
+    float a, Phase;
+    float delayR, delayI;
+    uint16_t SrcDeclAngle, SrcAzimAngle, RcvrDeclAngle, RcvrAzimAngle;
+    int16_t NTopBnc, NBotBnc;
+};
+
 /**
  * LP: Arrival setup and results.
  */
 struct ArrInfo {
+    /// Arrivals, or nullptr if isCompact.
     Arrival *Arr;
+    /// Compact arrivals if isCompact (bhcInit::compactArrivals), otherwise
+    /// nullptr. Indexed the same way as Arr.
+    ArrivalCompact *ArrC;
+    bool isCompact;
     int32_t *NArr;
     int32_t *MaxNPerSource;
     int32_t MaxNArr;
     bool AllowMerging;
+    /// Arena mode only (bhcInit::arrivalsChunkSize > 0), otherwise
+    /// ArrChunks is nullptr and Arr holds MaxNArr arrivals for each receiver.
+    /// In arena mode, Arr is NArrChunks chunks of ArrChunkSize arrivals, handed
+    /// out in order by incrementing *ArrChunksUsed. ArrChunks holds the chunk
+    /// indices (-1 if not allocated yet) of MaxNArr / ArrChunkSize chunks per
+    /// receiver. Use ArrivalIndex and LoadArrival (arrivals.hpp) to access one
+    /// arrival in any mode.
+    int32_t *ArrChunks;
+    int32_t *ArrChunksUsed;
+    int32_t ArrChunkSize;
+    int32_t NArrChunks;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -415,8 +484,9 @@ template<bool R3D> struct rayPt : public rayPtExtras<R3D> {
     VEC23<R3D> t;
     /// c * t would be the unit tangent
     real c;
-    real Amp, Phase;
-    cpx tau;
+    real Amp;
+    realacc Phase;
+    cpxacc tau;
 };
 
 template<bool R3D> struct StepPartials {};
@@ -427,8 +497,37 @@ template<> struct StepPartials<true> {
     real cnn, cmn, cmm;
 };
 
+/**
+ * Ray point with only what is needed to write the ray file, see
+ * bhcInit::compactRays. The position is ray.x - RayResult::x0, in single
+ * precision, and the bounce counts are saturated at 32767.
+ */
+template<bool R3D> struct rayPtCompact {
+    glm::vec<R3D ? 3 : 2, float, glm::defaultp> dx;
+    int16_t NumTopBnc, NumBotBnc;
+};
+
+/**
+ * Ray points as a separate array for each field (struct of arrays), see
+ * bhcInit::soaRays. In RayInfo, these are the whole arrays; in RayResult,
+ * they point to the first point of that ray in each array.
+ */
+template<bool R3D> struct rayPtSoA {
+    VEC23<R3D> *x, *t;
+    cpxacc *tau;
+    real *Amp;
+    int32_t *NumTopBnc, *NumBotBnc;
+};
+
 template<bool O3D, bool R3D> struct RayResult {
+    /// Full ray points, or nullptr if compact / SoA (or not traced).
     rayPt<R3D> *ray;
+    /// Compact ray points if bhcInit::compactRays, otherwise nullptr.
+    rayPtCompact<R3D> *compact;
+    /// SoA ray points if bhcInit::soaRays, otherwise all nullptr.
+    rayPtSoA<R3D> soa;
+    /// Compact only: position of the first point of the ray.
+    VEC23<R3D> x0;
     Origin<O3D, R3D> org;
     real SrcDeclAngle;
     int32_t Nsteps;
@@ -438,11 +537,19 @@ template<bool O3D, bool R3D> struct RayInfo {
     RayResult<O3D, R3D> *results;
     rayPt<R3D> *RayMem;
     rayPt<R3D> *WorkRayMem;
+    rayPtCompact<R3D> *CompactRayMem;
+    rayPtSoA<R3D> SoARayMem;
     size_t RayMemCapacity;
     size_t RayMemPoints;
     int32_t MaxPointsPerRay;
     int32_t NRays;
     bool isCopyMode;
+    /// If true, RayMemCapacity and RayMemPoints refer to CompactRayMem.
+    bool isCompact;
+    /// If true, RayMemCapacity and RayMemPoints refer to SoARayMem.
+    bool isSoA;
+    /// Deprecated, use bhcInit::blocking. If false, run() is non-blocking,
+    /// same as if bhcInit::blocking is false.
     bool blocking = true;
 };
 
@@ -456,6 +563,31 @@ struct RayInitInfo {
 // Influence / transmission loss
 ////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * CUDA only: a block's tile of a TL field in shared memory, see
+ * bhcInit::cudaFieldTile. It covers receiver depths iz0 to iz0 + nz - 1 and
+ * ranges 0 to nr - 1, for all Nfreq frequencies, of one source and bearing of
+ * the field.
+ */
+struct FieldTile {
+    cpxf *smem;
+    cpxf *field; // uAllSources this is a tile of
+    int32_t isx, isy, isz, itheta;
+    int32_t iz0, nz, nr, Nfreq;
+};
+
+/**
+ * CUDA only: a block's eigenray hits staged in shared memory, see
+ * bhcInit::cudaHitStage. count is in shared memory too, and keeps counting
+ * past size; the hits beyond size go to eigen directly.
+ */
+struct HitStage {
+    EigenHit *smem;
+    int32_t *count;
+    int32_t size;
+    EigenInfo *eigen; // EigenInfo the hits are flushed to
+};
+
 template<bool R3D> struct InfluenceRayInfo {
     // LP: Constants.
     RayInitInfo init;
@@ -464,6 +596,9 @@ template<bool R3D> struct InfluenceRayInfo {
     cpx epsilon1, epsilon2; // beam constant
     VEC23<R3D> xs;          // source
     real freq0, omega;
+    // Broadband TL: all the frequencies to compute, otherwise 1 and null.
+    int32_t Nfreq;
+    const real *freqVec;
     real RadMax;
     real BeamWindow;
     int32_t iBeamWindow2;
@@ -478,6 +613,19 @@ template<bool R3D> struct InfluenceRayInfo {
     bool lastValid;
     int32_t kmah;
     int32_t ir;
+    // False if this ray is being traced by a CPU worker which has its own
+    // private copy of the field, so atomics are not needed.
+    bool atomicField;
+    // Beam->allTLTypes: elements between the planes of the field,
+    // otherwise 0; and the square of the ray's Lloyd mirror factor, which
+    // turns its incoherent contributions into semi-coherent ones.
+    size_t tlPlaneStride;
+    real semiFactor;
+    // Tile of the field the ray's TL contributions go to when they fall
+    // inside it, or null.
+    const FieldTile *tile;
+    // Stage the ray's eigenray hits go to, or null.
+    const HitStage *stage;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -489,16 +637,418 @@ struct bhcInit {
     int32_t numThreads = -1;
     /// Maximum amount of memory (in bytes) this instance should use.
     size_t maxMemory = 4ull * 1024ull * 1024ull * 1024ull; // 4 GiB
+    /**
+     * Keep freed memory for reuse instead of returning it to the system (or
+     * cudaFree, which synchronizes the device). Reallocating an array, e.g.
+     * in extsetup_*() or run(), keeps the existing block if the new size is
+     * between half of and the size of the block, and other freed blocks are
+     * kept in a pool by size class for later allocations. Useful when
+     * repeatedly changing the environment and running in a loop. Blocks in
+     * the pool do not count against maxMemory, but are released when needed
+     * to stay within it, and at finalize().
+     */
+    bool poolAllocations = false;
     /// If there is not enough memory to hold the requested number of rays
     /// where each is maximum length, whether to solve this by reducing the
     /// maximum length (false), or by using copy mode (true). Copy mode can fit
     /// more ray data in memory but is slower. This only affects ray and
     /// eigenray runs (no effect on TL or arrivals).
     bool useRayCopyMode = false;
+    /// Ray and eigenray runs only: store each ray as only the positions (in
+    /// single precision, relative to the first point) and bounce counts,
+    /// which is all that is written to the ray file, instead of the full ray
+    /// state. This takes 12 (2D) or 16 (3D) bytes per point instead of over
+    /// 100, so many more ray points fit in maxMemory. Takes precedence over
+    /// useRayCopyMode. The ray file is then lossy: its positions are rounded
+    /// to single precision (under 1 cm at 100 km from the source). See
+    /// RayResult::compact.
+    bool compactRays = false;
+    /// Ray and eigenray runs only: store the ray points as separate arrays of
+    /// positions, tangents, delays, amplitudes, and bounce counts (struct of
+    /// arrays), instead of an array of the full ray state. Each ray is traced
+    /// into a per-worker buffer and then stored as whole contiguous streams of
+    /// each field, which takes about half the memory and bandwidth of the full
+    /// state. compactRays takes precedence. See RayResult::soa.
+    bool soaRays = false;
+    /**
+     * Ray runs only: instead of keeping all the rays in memory until
+     * writeout(), the worker threads hand each finished ray to a writer thread
+     * through a queue of streamRaysQueueDepth ray buffers. The writer appends
+     * the ray to FileRoot.ray (or passes it to rayCallback) during run() and
+     * then reuses its buffer. Memory for rays is then bounded by the queue
+     * depth rather than the number of rays, so fans of any size can be written
+     * with full-length rays. The rays are written in the order they finish,
+     * not in launch order, each with its take-off angle as usual. writeout()
+     * does nothing for these runs, and outputs.rayinfo holds no rays after
+     * run(). Takes precedence over compactRays, soaRays, and useRayCopyMode.
+     */
+    bool streamRays = false;
+    /// streamRays only: number of ray buffers of MaxN points each. Workers
+    /// wait for a free buffer if the writer falls behind. Reduced if they do
+    /// not fit in maxMemory. -1 means four per worker thread.
+    int32_t streamRaysQueueDepth = -1;
+    /**
+     * streamRays only: if not null, each ray is passed to this callback
+     * instead of being written to the ray file. alpha0, the bounce counts, and
+     * the points are the same as written to the ray file: x holds Nsteps
+     * points of (r, z) in 2D or (x, y, z) in Nx2D / 3D. The callback is only
+     * called from the writer thread, one ray at a time. The memory pointed to
+     * by x is reused after the callback returns, so the callback must copy the
+     * points rather than storing the pointer.
+     */
+    void (*rayCallback)(
+        real alpha0, int32_t Nsteps, int32_t NumTopBnc, int32_t NumBotBnc,
+        const real *x) = nullptr;
+    /**
+     * Ray and eigenray runs: also write FileRoot.rayidx alongside the ray file,
+     * with the byte offset and number of points of each ray in it. The ray
+     * file itself is unchanged. When this index is present and matches the
+     * ray file, readout() finds the rays from it instead of scanning the whole
+     * file, and readout_rays() reads only the rays asked for.
+     */
+    bool rayIndexFile = false;
+    /// TL runs with more than one source only: instead of holding the field
+    /// for all the sources at once, trace one source at a time into a field
+    /// buffer for a single source, and postprocess and write that source's
+    /// records of the shade file before moving on to the next source. Peak
+    /// field memory is then that of one source. The shade file is written
+    /// during run(), so writeout() does nothing, and afterwards uAllSources
+    /// only holds the field of the last source (isz, isx, isy all at their
+    /// maximum), with the layout of a single-source run.
+    bool streamTLSources = false;
+    /**
+     * TL runs: write (and read back) the field as a chunked TL file
+     * (FileRoot.shdc) instead of a shade file (FileRoot.shd). The field is
+     * stored in tiles of one source, frequency, and bearing (all the receiver
+     * depths and ranges), which the CPU worker threads write concurrently,
+     * with an index so that single tiles can be loaded without reading the
+     * rest of the file (see readout_tl_tile). This format is not readable by
+     * the BELLHOP tools.
+     */
+    bool chunkedTLFile = false;
+    /// chunkedTLFile only: losslessly compress each tile, which mostly helps
+    /// with regions of the field which are zero or smooth.
+    bool compressTLFile = false;
+    /// Hexahedral (3D) SSPs only: also store the SSP in a cell-packed layout,
+    /// with the eight values needed to evaluate the SSP within each cell (c and
+    /// cz at the four x-y corners) in the same cache line. This makes each SSP
+    /// evaluation one contiguous read instead of four reads which are far
+    /// apart in memory, which helps with large ocean model grids, but it takes
+    /// about four times the memory of the SSP grid itself.
+    bool packHexSSP = false;
+    /// If > 0, altimetry and bathymetry files are simplified during
+    /// preprocessing, so that the boundary is within bdryTolerance meters
+    /// (vertically) of the original points. In 2D, the points are decimated
+    /// with Douglas-Peucker; points where the geoacoustics of a long format file
+    /// change are always kept. In Nx2D/3D, whole grid lines in x and then in y
+    /// are dropped where the depths along them are reproduced within the
+    /// tolerance by interpolating between the lines which are kept. Rays step
+    /// to every boundary segment edge, so dense survey data this removes steps,
+    /// but results will differ slightly. The reduction is reported in the print
+    /// file. 0 (default) disables this.
+    real bdryTolerance = 0.0;
+    /// If > 0, the ray tracer chooses the length of each step instead of always
+    /// starting from deltas. The step is sized from the curvature of the ray
+    /// (due to the sound speed gradient) so that the estimated local truncation
+    /// error of the integrator is about stepTolerance meters, and is limited to
+    /// [stepMinFactor, stepMaxFactor] * deltas. Steps are still shortened to land
+    /// exactly on interfaces and boundaries as usual. This takes fewer steps in
+    /// smooth regions and more in strong gradients, so results will differ
+    /// slightly from BELLHOP. 0 (default) disables this. Useful values are
+    /// about 1e-5 to 1e-3 m, which on the Munk and Dickins seamount tests were
+    /// more accurate than the fixed step at about the same run time. From about
+    /// 0.01 m, the error grows quickly: at 0.1 m, 10% or more of the TL points
+    /// were off by over 10 dB. Values over 0.01 m give a warning.
+    real stepTolerance = 0.0;
+    real stepMinFactor = 0.25;
+    real stepMaxFactor = 10.0;
+    /// If > 0, rays are stopped once their amplitude, including reflection
+    /// losses and volume attenuation at the source frequency, has fallen more
+    /// than this many dB below their initial amplitude. This skips rays which
+    /// would only make negligible contributions to the field, e.g. after many
+    /// bounces off a lossy bottom. 0 (default) disables this, leaving only
+    /// BELLHOP's fixed absolute amplitude cutoff.
+    real rayAmpCutoffdB = 0.0;
+    /// If >= 0, rays are stopped when they reach the bottom for the
+    /// (maxBottomBounces + 1)th time, so they contribute to the field with at
+    /// most maxBottomBounces bottom bounces. -1 (default) disables this.
+    int32_t maxBottomBounces = -1;
+    /// Eigenray and arrivals runs only: if > 0, the elevation (alpha) fan from
+    /// the environment file is only a coarse fan. After it is traced, every
+    /// interval between neighboring launch angles where either ray reached a
+    /// receiver (produced an eigenray hit or an arrival) is bisected, and only
+    /// those intervals are traced again, this many times. The results are
+    /// those of the final level, which are the same as for a uniform fan
+    /// 2^adaptiveFanLevels times denser, except for receivers not reached at
+    /// all by the coarser fans. 0 (default) disables this.
+    int32_t adaptiveFanLevels = 0;
+    /**
+     * 2D TL and arrivals runs: if there are fewer receiver depths than source
+     * depths, trace the rays from the receiver depths instead and swap the
+     * roles back in the results (acoustic reciprocity), so NRz instead of NSz
+     * fans of rays are traced. The outputs and output files are the same as
+     * for a normal run. Runs with at least as many receiver as source depths,
+     * and eigenray and ray runs, are done normally. Otherwise, the run must be
+     * one where reciprocity holds, or run() fails with an error: 2D only (not
+     * Nx2D or 3D), a range-independent environment (flat top and bottom
+     * without per-point properties, SSP not range-dependent), no source beam
+     * pattern, not semi-coherent, a rectilinear receiver grid, no adaptive
+     * fan, streamed TL, or eigenrays also, and a launch angle fan which is
+     * full (from -90 to 90 degrees, to within one step) and symmetric about
+     * the horizontal. The results agree with a normal run to within the
+     * accuracy of the beam approximation. The ray stats (rayStats) are those of
+     * the rays actually traced. Not used by bhc::run_batch().
+     */
+    bool reciprocal = false;
+    /**
+     * Nx2D and 3D TL and arrivals runs: in a range-independent environment
+     * (flat top and bottom, SSP depending on depth only), every source at the
+     * same depth sees the same problem relative to itself, and in Nx2D so does
+     * every bearing. If so, only the first source position (x, y) of each
+     * depth, and in Nx2D only the first bearing, are traced, and the results
+     * are copied to the others. This is only done if every receiver is closer
+     * to its source than the beam box and the edges of the boundaries in every
+     * direction, so that no ray is stopped differently in another direction;
+     * not with streamTLSources, adaptive fans, eigenrays also, the arrivals
+     * arena, caller-owned output buffers, or rayStats; and in Nx2D, the
+     * bearings are only copied if they are not limited to a single one.
+     * Otherwise the run is done normally. Results agree with a normal run
+     * except for rounding, and for rays which take steps across boundary grid
+     * lines in different places. Not used by bhc::run_batch().
+     */
+    bool exploitSymmetry = false;
+    /**
+     * Nx2D TL runs: before tracing, cut the 2D range-depth slice of the
+     * altimetry and bathymetry along each bearing from each source, and trace
+     * each bearing's rays with the 2D ray tracer against its slice. The slices
+     * are exact (the boundaries are triangulated, so they are piecewise linear
+     * along any line), but every step no longer has to look up and walk the
+     * 3D boundaries, so the run costs about as much as the same number of 2D
+     * runs. Only done if the SSP depends on depth only (types N, C, S, P) and
+     * the run is not broadband; otherwise the run is done normally. Results
+     * differ slightly from a normal Nx2D run, as the 2D tracer handles steps
+     * across SSP layers slightly differently, and rays which travel back past
+     * the edge of the boundaries behind the source are continued over a flat
+     * extension instead of being stopped. Not used by bhc::run_batch(), or
+     * with rayStats or retainRays.
+     */
+    bool radialSlices = false;
+    /**
+     * TL runs: compute the coherent, semi-coherent, and incoherent fields
+     * together from one trace of the rays, instead of only the one of the
+     * run type (Beam->RunType[0] 'C', 'S', or 'I'). The field
+     * (bhcOutputs::uAllSources) then holds three fields of the usual size one
+     * after the other: first the run type's own, which is what is written to
+     * FileRoot.shd, then the other two in the order C, S, I, which are written
+     * to FileRoot_C.shd etc. The semi-coherent field is the incoherent one with
+     * each ray weighted by its Lloyd mirror factor, as in an 'S' run, but
+     * rays are not stopped earlier (by rayAmpCutoffdB) for having a low
+     * Lloyd mirror factor. Geometric beams only (not Cerveny or simple
+     * Gaussian beams), and not with streamTLSources; reciprocal and
+     * radialSlices are not used.
+     */
+    bool allTLTypes = false;
+    /// Arrivals runs only: if > 0, arrivals are stored in chunks of this many
+    /// arrivals, which are handed out from one shared arena to receivers as
+    /// they need them. Memory is then used for the arrivals actually found,
+    /// instead of reserving the same maximum number of arrivals for every
+    /// receiver. 0 (default) uses the fixed per-receiver layout.
+    int32_t arrivalsChunkSize = 0;
+    /// Arrivals runs with arrivalsChunkSize > 0 only: maximum number of
+    /// arrivals kept for any one receiver (rounded up to a whole number of
+    /// chunks). Each receiver costs 4 bytes per possible chunk.
+    int32_t arrivalsMaxPerRcvr = 1024;
+    /**
+     * Arrivals runs only: store the arrivals in memory as ArrivalCompact,
+     * with the angles in half precision and 16-bit bounce counts, so about 40%
+     * more arrivals fit in maxMemory. Binary arrivals files are then written
+     * in a compact format too (readout() reads either format): the same
+     * fields as in memory, with the delays real only unless some arrival has
+     * an imaginary delay. This format is not readable by the BELLHOP tools.
+     * Both binary and ASCII arrivals files are then lossy: the angles are
+     * rounded to half precision, which is up to 0.03 degrees off (0.004
+     * degrees for angles under 16 degrees).
+     */
+    bool compactArrivals = false;
+    /// compactArrivals only: in the binary arrivals file, store the amplitudes
+    /// in dB (20 log10) in half precision, which is accurate to about 1% of
+    /// the amplitude.
+    bool compactArrivalsdB = false;
+    /**
+     * TL, eigenray, and arrivals runs: keep the rays traced by run() in
+     * memory, and if the next run() has the same sources, launch angles,
+     * frequency, boundaries, SSP, and ray tracing settings, only compute the
+     * influence of the kept rays on the receivers instead of tracing them
+     * again. This makes it much faster to change only the receivers (e.g. with
+     * extsetup_rcvrranges / extsetup_rcvrdepths) or to switch between coherent
+     * and incoherent TL. The rays take about 100 bytes per step, up to half
+     * the memory left when they are traced; if they do not fit, none are kept.
+     * These runs always use the CPU worker threads, also in CUDA builds, and
+     * this does not apply to streamed TL (streamTLSources), run_batch(), or
+     * adaptive fan (adaptiveFanLevels) runs. Rays are traced to the end of the
+     * box even if they have passed all the receivers.
+     */
+    bool retainRays = false;
     /// Index of the GPU to use (ignored if not in CUDA mode). This is the order
     /// the GPUs are enumerated in CUDA, usually with the most powerful GPU
     /// as index 0.
     int gpuIndex = 0;
+    /// If numGPUs > 1, TL, eigenray, and arrivals runs are split across the
+    /// numGPUs GPUs listed in gpuIndices, and gpuIndex is ignored. The list is
+    /// copied during setup. Ignored if not in CUDA mode. Ray runs are always
+    /// computed on the CPU.
+    const int *gpuIndices = nullptr;
+    int32_t numGPUs       = 1;
+    /**
+     * Builds with BHC_USE_MPI only: TL and arrivals runs are split across the
+     * ranks of MPI_COMM_WORLD, which must all call run() with the same params.
+     * Each rank traces its share of the rays with its own worker threads or
+     * GPUs: whole sources if there are at least as many sources as ranks,
+     * otherwise an equal range of the rays. The outputs are then gathered on
+     * rank 0 (the TL field is summed if the ranks shared sources), where they
+     * are complete; the outputs of the other ranks are not, and only rank 0
+     * should call writeout(). Other run types, and runs with retainRays or
+     * adaptiveFanLevels, are run in full on every rank. The caller must
+     * initialize MPI. Not supported with checkpointFile, arrivals runs which
+     * also find eigenrays, or the arrivals arena (arrivalsChunkSize).
+     */
+    bool mpiDistribute = false;
+    /// CUDA only: before each TL, eigenray, or arrivals run, explicitly
+    /// migrate the inputs and outputs to the GPU(s), and migrate the outputs
+    /// back to the host as soon as each GPU finishes. If false, all of this
+    /// data is moved one page fault at a time instead. Has no effect on GPUs
+    /// which do not support concurrent managed memory access (e.g. Windows).
+    bool prefetchMemory = true;
+    /// CUDA only: threads per block for the field modes kernel. Must be a
+    /// multiple of 32, and is limited to the compile-time maximum for each
+    /// config (see FieldLaunchBounds in src/mode/launchcfg.hpp, normally 256).
+    /// -1 means use the maximum.
+    int32_t cudaBlockSize = -1;
+    /// CUDA only: blocks to launch per SM for the field modes kernel. -1 means
+    /// as many as can be resident at once with the chosen block size.
+    int32_t cudaBlocksPerSM = -1;
+    /// CUDA only: if true, and cudaBlockSize and cudaBlocksPerSM are both
+    /// automatic, the first field run for each GPU model and template config
+    /// traces small samples of its rays with a few block sizes and block
+    /// counts, and uses the fastest for the rest of the rays. The choice is
+    /// remembered for later runs in the same process. Has no effect if the
+    /// run is too small to time meaningfully.
+    bool autoTuneLaunch = false;
+    /// CUDA only: after each field modes kernel finishes, report (through
+    /// outputCallback) its time, registers per thread, launch config, and
+    /// occupancy on each GPU. These are always available from
+    /// bhc::get_timings, for the first GPU.
+    bool cudaKernelReport = false;
+    /// CUDA only: for Nx2D and 3D runs with a fan in both alpha and beta,
+    /// reorder the rays so that each warp traces a compact 8 x 4 tile of
+    /// neighboring launch angles, rather than a strip of 32 alphas. Nearby
+    /// rays interact with similar bathymetry and boundaries, so this reduces
+    /// warp divergence. Only affects the order rays are computed in.
+    bool cudaTileRays = false;
+    /// CUDA only: instead of each GPU thread tracing a fixed set of rays, each
+    /// warp claims the next 32 rays from a queue whenever it finishes its
+    /// previous ones. This balances the load across warps when ray costs vary
+    /// a lot, at the cost of an atomic operation per warp per 32 rays.
+    bool cudaJobQueue = false;
+    /// CUDA only, TL runs: size, in complex cells (up to 6144, i.e. 48 KiB),
+    /// of a tile of the field which each block keeps in shared memory. The
+    /// tile covers the receivers nearest the source of the block's rays,
+    /// where neighboring rays still overlap. Their contributions there are
+    /// summed with shared memory atomics and added to the field once the
+    /// block's rays are done, instead of each being a global atomic. Other
+    /// contributions go to the field directly. Uses more shared memory per
+    /// block, which may lower occupancy; a full 48 KiB tile needs a device
+    /// which allows more than that per block (compute capability 7.0 or
+    /// later). Not used with cudaJobQueue. 0 (the default) disables it. Only
+    /// changes the floating-point summation order.
+    int32_t cudaFieldTile = 0;
+    /// CUDA only, eigenray runs and arrivals runs which also record eigenrays:
+    /// number of eigenray hits (up to 1024, i.e. 36 KiB) which each block
+    /// stages in shared memory. Threads reserve slots in the stage, and the
+    /// block's hits are copied out with one global atomic once its rays are
+    /// done, instead of every hit being an atomic on the same global counter.
+    /// Hits which do not fit in the stage go to global memory directly. Not
+    /// used with cudaJobQueue. 0 (the default) disables it. Only changes the
+    /// order of the hits.
+    int32_t cudaHitStage = 0;
+    /// Number of rays each CPU worker thread claims at a time. Larger values
+    /// reduce contention between threads, smaller values improve load
+    /// balancing. -1 means automatic.
+    int32_t jobChunkSize = -1;
+    /// If true, CPU worker threads trace the rays which are estimated to be the
+    /// most expensive (steepest launch angles) first, so that the end of the
+    /// run is not dominated by a few long rays. Only affects the order rays are
+    /// computed in, not the results (except for floating-point summation order
+    /// in multithreaded TL runs, which is already nondeterministic).
+    bool orderJobsByCost = false;
+    /// Experimental. Number of rays each CPU worker thread traces together,
+    /// stepping each of them in turn, from the run of jobs it has claimed. When
+    /// a ray ends, the next job takes its place. Interleaving independent rays
+    /// is meant to give the CPU more work to overlap within one thread, but no
+    /// speedup has been measured yet (MunkB, one core: the same run time for
+    /// every size from 1 to 16). 1 (default) traces one ray at a time; values
+    /// are limited to 16. Arrivals runs then merge arrival pairs afterwards, as
+    /// multithreaded runs do, and TL runs may differ in the floating-point
+    /// summation order.
+    int32_t rayPacketSize = 1;
+    /**
+     * Pinning of the CPU worker threads to logical CPUs (Linux only, ignored
+     * elsewhere). Only the CPUs the process is allowed to run on are used.
+     * 'N': not pinned, the OS schedules the threads (default).
+     * 'C': compact, fill all the cores of one socket / package before moving
+     *      on to the next, keeping the workers close to each other.
+     * 'S': spread, deal the workers round-robin across the sockets, and use
+     *      one logical CPU per physical core before using hyperthreads. This
+     *      spreads the memory bandwidth load across all the NUMA nodes.
+     */
+    char threadAffinity = 'N';
+    /// CPU only: the large outputs (TL field, arrivals) are zeroed by all the
+    /// worker threads, each page by a different worker in turn. With the
+    /// default first-touch page placement, this interleaves the pages across
+    /// the NUMA nodes the workers are running on (see threadAffinity 'S'),
+    /// instead of putting them all on the node of the thread calling run().
+    bool interleaveOutputs = false;
+    /**
+     * If not null, record when each CPU worker thread traces each ray (with
+     * its job number and source and launch angle indices) in field, ray, and
+     * eigenray post-processing runs, as well as the phases of setup(), run(),
+     * and writeout(). After each run() and writeout(), all of this is written
+     * to this path as a Chrome trace (JSON, viewable in Perfetto or
+     * chrome://tracing). Each thread keeps only its last traceBufferEvents
+     * events. Rays traced on the GPU are not recorded.
+     */
+    const char *traceFile     = nullptr;
+    int32_t traceBufferEvents = 65536;
+    /**
+     * Field runs (TL, eigenrays, arrivals): record the number of steps,
+     * reflections, and influence evaluations of each ray, and how long it
+     * took, in bhcOutputs::raystats (see bhcRayStats and bhc::get_ray_stats).
+     * This costs 16 bytes of memory and two clock reads per ray. If
+     * rayStatsFile, writeout() also writes them to FileRoot.raystats.
+     */
+    bool rayStats     = false;
+    bool rayStatsFile = false;
+    /**
+     * Field runs: capture the rays which took at least captureSteps steps or
+     * captureTime microseconds (either threshold is off if 0), to reproduce a
+     * slowdown without the rest of the run. writeout() writes the launch
+     * indices and stats of these rays to FileRoot_capture.rayinit, and a copy
+     * of the environment (as for bhc::writeenv()) to FileRoot_capture.env etc.
+     * Load that environment and pass the rays from bhc::read_capture() to
+     * bhc::playback() to re-trace just those rays. Turns on rayStats.
+     */
+    int32_t captureSteps = 0;
+    float captureTime    = 0.0f;
+    /**
+     * If false, bhc::run() returns immediately after starting the computation,
+     * which continues in the background; this works for all run types. Use
+     * bhc::get_percent_progress() and/or completedCallback to find out when it
+     * is finished. The params and outputs must not be used (other than
+     * bhc::get_percent_progress()) until then; bhc::run(), bhc::writeout(),
+     * and bhc::finalize() will wait for the computation to finish if it has
+     * not already.
+     */
+    bool blocking = true;
     /**
      * If not null: Relative path to environment file, without the .env
      * extension. E.g. path/to/MunkB_ray_rot (where path/to/MunkB_ray_rot.env
@@ -511,6 +1061,38 @@ struct bhcInit {
      * real *.prt file cannot be created. bhc::writeout() also cannot be used.
      */
     const char *FileRoot = nullptr;
+    /**
+     * If not null: directory for the preprocessed environment cache. After
+     * setup() reads the environment file and the other input files, the
+     * params are preprocessed (as run() would) and saved to a binary file in
+     * this directory, named by a hash of the contents of the input files
+     * (FileRoot.env, .ssp, .bty, .ati, .brc, .trc, .sbp) and the build
+     * configuration. A later setup() with identical input files loads that
+     * file instead of parsing and preprocessing the inputs, which is much
+     * faster for large 3D environments run many times. The print file then
+     * only contains what is echoed after reading (the same as bhc::echo()).
+     * The directory must exist; failures to write the cache are ignored. The
+     * string is copied during setup.
+     */
+    const char *envCacheDir = nullptr;
+    /**
+     * If not null: TL and arrivals runs save their progress to this file every
+     * checkpointInterval seconds, so a run which is killed (e.g. on a
+     * preemptible node) can be resumed. The rays are traced in windows of
+     * consecutive jobs (sources are the outermost index, so a window is part
+     * of one source or several whole sources), and after a window, if the
+     * interval has passed, the number of jobs done and the partial TL field or
+     * arrivals (and ray stats) are written to the file. If the file exists
+     * when run() starts and it was saved by a run with the same input files
+     * and options, the run continues from there; otherwise it is ignored and
+     * overwritten. The file is removed when the run finishes. Not used with
+     * retainRays, adaptiveFanLevels, or streamTLSources; not supported for
+     * arrivals runs which also find eigenrays or use the arrivals arena
+     * (arrivalsChunkSize); and Nx2D runs do not use radialSlices. The string
+     * is copied during setup.
+     */
+    const char *checkpointFile = nullptr;
+    double checkpointInterval  = 600.0;
     /**
      * prtCallback, outputCallback: There are two different types of output
      * messages which can be produced by BELLHOP(3D) and therefore bellhopcxx /
@@ -537,11 +1119,225 @@ struct bhcInit {
     /// See documentation for prtCallback above.
     void (*outputCallback)(const char *message) = nullptr;
 
-    /// Called after all the threads have completed.
+    /// Called after each run() has completed, including post-processing.
     /// Probably only useful in non-blocking mode.
     void (*completedCallback)() = nullptr;
 };
 
+/**
+ * Projected memory use of a run, from bhc::plan_memory(). All sizes are in
+ * bytes and include the 16 bytes of bookkeeping per allocation. Inputs are
+ * what setup() has already allocated; outputs are what run() would allocate
+ * for the run type currently in params.
+ */
+struct bhcMemoryPlan {
+    size_t ssp;         ///< SSP structure and its 2D / 3D grids
+    size_t boundaries;  ///< Altimetry / bathymetry and their lookup tables
+    size_t otherInputs; ///< All other data structures from setup()
+    size_t field;       ///< TL sound field, including per-GPU copies
+    size_t arrivals;    ///< Arrivals, counts, and arena tables
+    size_t rays;        ///< Ray points (ray runs, and eigenray runs per hit)
+    size_t eigenHits;   ///< Eigenray hit records
+    /// Inputs plus outputs; run() fails if this is larger than the budget.
+    size_t peak;
+    /// Budget the plan was made against, bhcInit::maxMemory if not specified.
+    size_t budget;
+    /// Whether the outputs fit in the budget without being truncated, i.e.
+    /// without fewer arrivals or ray points than BELLHOP would store.
+    bool fits;
+    /**
+     * TL runs: number of groups the sources must be split into for each
+     * group's field to fit, 0 if even one source does not fit. If this is
+     * more than 1, use bhcInit::streamTLSources, which runs one source at a
+     * time.
+     */
+    int32_t tlSourceGroups;
+    /// Arrivals runs: maximum number of arrivals per receiver which fit, for
+    /// bhcInit::arrivalsMaxPerRcvr in arena mode.
+    int32_t maxArrivalsPerRcvr;
+    /// Ray runs: maximum number of points per ray which fit (MaxN if not
+    /// limited by memory).
+    int32_t maxPointsPerRay;
+};
+
+/**
+ * Memory allocated for one kind of structure, from bhc::get_memory_usage. All
+ * sizes are in bytes, counted the same way as for bhcInit::maxMemory.
+ */
+struct bhcMemoryUse {
+    /// Description of the structure, e.g. "Receiver r-coordinates, Rr". Valid
+    /// until finalize().
+    const char *description;
+    size_t current; ///< Currently allocated
+    /// Most allocated at any one time since setup(), or since the last
+    /// get_peak_memory() with reset = true.
+    size_t peak;
+    uint64_t allocations; ///< Number of allocations made
+};
+
+#define BHC_TIMING_MAX_MODULES 32
+
+/**
+ * Durations in ms of the phases of the last setup(), run() (or run_batch()),
+ * and writeout(), from bhc::get_timings(). Phases which have not happened, or
+ * do not apply to the build, are 0.
+ */
+struct bhcTimings {
+    double setup;     ///< All of setup()
+    double setupRead; ///< Reading and parsing the environment, or loading it from cache
+    /// run(): validating and preprocessing the params and setting up the
+    /// outputs, i.e. modePreprocess plus all of modulePreprocess.
+    double preprocess;
+    /// Number of params modules, in the order they are preprocessed.
+    int32_t numModules;
+    /// Name of each params module, e.g. "SSP" or "Bathymetry".
+    const char *moduleNames[BHC_TIMING_MAX_MODULES];
+    /// Validate and Preprocess of each params module.
+    double modulePreprocess[BHC_TIMING_MAX_MODULES];
+    /// Preprocess of the run type, e.g. allocating the field or arrivals.
+    double modePreprocess;
+    double run; ///< Tracing the rays and computing the outputs
+    /// Postprocessing the outputs, including eigenrays.
+    double postprocess;
+    double writeout; ///< All of writeout()
+    /// bellhopcuda field runs: total time of the kernels on all GPUs, and of
+    /// moving the params and outputs to and from the GPUs. These overlap with
+    /// run.
+    double cudaKernel;
+    double cudaTransfer;
+    /// bellhopcuda field runs, for the last kernel on the first GPU: its name
+    /// (including the template config), registers per thread, launch config,
+    /// and the theoretical occupancy of that config, i.e. the fraction of the
+    /// thread slots of each SM which the resident blocks fill.
+    const char *cudaKernelName;
+    int32_t cudaRegsPerThread;
+    int32_t cudaBlockSize;
+    int32_t cudaBlocksPerSM;
+    double cudaOccupancy;
+};
+
+#define BHC_PERF_STEPS 0
+#define BHC_PERF_REDUCED_STEPS 1
+#define BHC_PERF_SMALL_STEPS 2
+#define BHC_PERF_SSP_CROSSINGS 3
+#define BHC_PERF_BDRY_SNAPS 4
+#define BHC_PERF_TRIDIAG_CROSSINGS 5
+#define BHC_PERF_TOP_REFL 6
+#define BHC_PERF_BOT_REFL 7
+#define BHC_PERF_TERM_BOX 8
+#define BHC_PERF_TERM_ENERGY 9
+#define BHC_PERF_TERM_BOUNCES 10
+#define BHC_PERF_TERM_ESCAPED 11
+#define BHC_PERF_TERM_SMALL_STEPS 12
+#define BHC_PERF_TERM_MAX_POINTS 13
+#define BHC_PERF_INFLUENCE 14
+#define BHC_PERF_TERM_INFLUENCE 15
+#define BHC_PERF_MAX 16
+#define BHC_PERF_HIST_BINS 24
+
+/**
+ * Ray tracing event counters from the last run, from bhc::get_perf_counters().
+ * Indexed by BHC_PERF_*:
+ * - STEPS: steps along the ray (calls to Step)
+ * - REDUCED_STEPS: steps which ReduceStep shortened to land on an SSP
+ *   interface, boundary, beam box edge, or segment edge
+ * - SMALL_STEPS: steps forced to the infinitesimal step size, see
+ *   iSmallStepCtr
+ * - SSP_CROSSINGS: steps which crossed into another SSP segment, so the jump
+ *   condition was applied
+ * - BDRY_SNAPS: steps which StepToBdry snapped onto an interface, boundary, or
+ *   edge (other than a tri diagonal)
+ * - TRIDIAG_CROSSINGS: steps which StepToBdry snapped onto the diagonal of a
+ *   3D boundary segment
+ * - TOP_REFL, BOT_REFL: reflections off the top / bottom
+ * - TERM_*: 0 or 1 per ray, why the ray was terminated (left the beam box,
+ *   lost its energy, exceeded the bottom bounce limit, escaped the boundaries,
+ *   took too many small steps, ran out of points, or passed all receivers in
+ *   Step_Influence)
+ * - INFLUENCE: influence evaluations (calls to Step_Influence)
+ */
+struct bhcPerfCounters {
+    /// Whether the library was built with the CMake option BHC_PERF_COUNTERS.
+    /// If not, nothing is counted and the rest of this struct is all zeros.
+    bool enabled;
+    /// Number of rays traced. With bhcInit::retainRays, rays whose points
+    /// were reused only contribute to the INFLUENCE counters.
+    uint64_t rays;
+    /// Sum of each counter over all rays.
+    uint64_t total[BHC_PERF_MAX];
+    /// Per-ray histogram of each counter: hist[c][0] is the number of rays
+    /// for which counter c was 0, and hist[c][b] for b > 0 the number for
+    /// which it was in [2^(b-1), 2^b). The last bin also holds all larger
+    /// counts.
+    uint64_t hist[BHC_PERF_MAX][BHC_PERF_HIST_BINS];
+};
+
+/**
+ * Cost of one ray of the last field (TL, eigenray, or arrivals) run, see
+ * bhcInit::rayStats. bhcOutputs::raystats holds one of these per ray, in job
+ * order: the launch elevation angle (alpha) varies fastest, then (Nx2D / 3D)
+ * the azimuthal angle (beta), the source y and x coordinates, and last the
+ * source depth. Rays which could not be started are all zeros.
+ */
+struct bhcRayStats {
+    int32_t steps;     ///< Steps along the ray
+    int32_t influence; ///< Influence evaluations (calls to Step_Influence)
+    /// Reflections off the top / bottom, saturated at 65535.
+    uint16_t topRefl, botRefl;
+    /// Time to trace the ray in microseconds. On the GPU, this is converted
+    /// from the SM clock cycles at the GPU's nominal clock rate.
+    float time;
+};
+
+/**
+ * A ray to re-trace with bhc::playback(), e.g. one from bhc::read_capture().
+ * Only the indices in init (isx, isy, isz, ialpha, ibeta; all 0-based, and
+ * isx, isy, and ibeta 0 in 2D) are used; the rest are outputs.
+ */
+struct bhcPlaybackRay {
+    RayInitInfo init;
+    /// Cost of the ray when it was captured (from bhc::read_capture()), then
+    /// when it was re-traced.
+    bhcRayStats stats;
+    /// Event counts for this ray, see bhcPerfCounters. All zeros unless the
+    /// library was built with BHC_PERF_COUNTERS.
+    uint64_t perf[BHC_PERF_MAX];
+};
+
+/**
+ * Time series to synthesize from the arrivals of a run with
+ * bhc::synthesize_waveforms(). Each receiver's time series is the sum over its
+ * arrivals of the source signal, delayed by the arrival's (complex) delay,
+ * phase shifted by its phase, and scaled by its amplitude. This is the same
+ * sum as the TL field of a coherent run at any one frequency, so attenuation
+ * is included through the imaginary part of the delays, as computed at the
+ * run's frequency.
+ */
+struct bhcWaveformParams {
+    /// Samples per second of the time series (and of waveform).
+    double sampleRate;
+    /// Length of each receiver's time series.
+    int32_t nSamples;
+    /// Time of the first sample in seconds, the same for all receivers. NAN
+    /// for each receiver's own earliest arrival, less the lead-in of the
+    /// band's pulse, so that the time series holds its arrivals wherever the
+    /// receiver is.
+    double t0;
+    /// If not nullptr, set to the time of the first sample of each receiver's
+    /// time series (one per receiver, in the order of the time series).
+    double *startTimes;
+    /// Source signal, waveformLength samples at sampleRate, or nullptr for a
+    /// band-limited impulse response: the source spectrum is a Hann window
+    /// from fMin to fMax, scaled so that a single arrival of amplitude a and
+    /// phase 0 gives a pulse of peak a.
+    const float *waveform;
+    int32_t waveformLength;
+    /// Band in Hz. Only frequencies in this band are synthesized. fMax <= 0
+    /// means sampleRate / 2. With a waveform, the band just limits the
+    /// spectrum, so leave it at 0 / 0 to use the whole waveform.
+    double fMin, fMax;
+};
+
 template<bool O3D> struct bhcParams {
     char Title[80]; // Size determined by WriteHeader for TL
     real fT;
@@ -564,6 +1360,11 @@ template<bool O3D, bool R3D> struct bhcOutputs {
     cpxf *uAllSources;
     EigenInfo *eigen;
     ArrInfo *arrinfo;
+    /// Per-ray statistics of the last field run if bhcInit::rayStats,
+    /// otherwise nullptr.
+    bhcRayStats *raystats;
+    /// Number of rays in raystats.
+    int32_t NRayStats;
 };
 
 } // namespace bhc
@@ -37,6 +37,7 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #include "module/beaminfo.hpp"
 #include "module/boundary.hpp"
 #include "module/reflcoef.hpp"
+#include "module/envcache.hpp"
 #include "module/sbp.hpp"
 
 #include "mode/modemodule.hpp"
@@ -45,6 +46,8 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #include "mode/tl.hpp"
 #include "mode/eigen.hpp"
 #include "mode/arr.hpp"
+#include "mode/memplan.hpp"
+#include "mode/pipeline.hpp"
 
 namespace bhc {
 
@@ -54,29 +57,29 @@ template<bool O3D> class ModulesList {
 public:
     ModulesList()
     {
-        modules.push_back(new Atten<O3D>());
-        modules.push_back(new Title<O3D>());
-        modules.push_back(new Freq0<O3D>());
-        modules.push_back(new NMedia<O3D>());
-        modules.push_back(new TopOpt<O3D>());
-        modules.push_back(new BoundaryCondTop<O3D>());
-        modules.push_back(new SSP<O3D>());
-        modules.push_back(new BotOpt<O3D>());
-        modules.push_back(new BoundaryCondBot<O3D>());
-        modules.push_back(new SxSy<O3D>());
-        modules.push_back(new SzRz<O3D>());
-        modules.push_back(new RcvrRanges<O3D>());
-        modules.push_back(new RcvrBearings<O3D>());
-        modules.push_back(new FreqVec<O3D>());
-        modules.push_back(new RunType<O3D>());
-        modules.push_back(new RayAnglesElevation<O3D>());
-        modules.push_back(new RayAnglesBearing<O3D>());
-        modules.push_back(new BeamInfo<O3D>());
-        modules.push_back(new Altimetry<O3D>());
-        modules.push_back(new Bathymetry<O3D>());
-        modules.push_back(new BRC<O3D>());
-        modules.push_back(new TRC<O3D>());
-        modules.push_back(new SBP<O3D>());
+        Add(new Atten<O3D>(), "Atten");
+        Add(new Title<O3D>(), "Title");
+        Add(new Freq0<O3D>(), "Freq0");
+        Add(new NMedia<O3D>(), "NMedia");
+        Add(new TopOpt<O3D>(), "TopOpt");
+        Add(new BoundaryCondTop<O3D>(), "BoundaryCondTop");
+        Add(new SSP<O3D>(), "SSP");
+        Add(new BotOpt<O3D>(), "BotOpt");
+        Add(new BoundaryCondBot<O3D>(), "BoundaryCondBot");
+        Add(new SxSy<O3D>(), "SxSy");
+        Add(new SzRz<O3D>(), "SzRz");
+        Add(new RcvrRanges<O3D>(), "RcvrRanges");
+        Add(new RcvrBearings<O3D>(), "RcvrBearings");
+        Add(new FreqVec<O3D>(), "FreqVec");
+        Add(new RunType<O3D>(), "RunType");
+        Add(new RayAnglesElevation<O3D>(), "RayAnglesElevation");
+        Add(new RayAnglesBearing<O3D>(), "RayAnglesBearing");
+        Add(new BeamInfo<O3D>(), "BeamInfo");
+        Add(new Altimetry<O3D>(), "Altimetry");
+        Add(new Bathymetry<O3D>(), "Bathymetry");
+        Add(new BRC<O3D>(), "BRC");
+        Add(new TRC<O3D>(), "TRC");
+        Add(new SBP<O3D>(), "SBP");
     }
     ~ModulesList()
     {
@@ -84,9 +87,18 @@ public:
     }
 
     const std::vector<ParamsModule<O3D> *> &list() const { return modules; }
+    /// Name of each module in list(), for bhcTimings.
+    const std::vector<const char *> &names() const { return modnames; }
 
 private:
+    void Add(ParamsModule<O3D> *module, const char *name)
+    {
+        modules.push_back(module);
+        modnames.push_back(name);
+    }
+
     std::vector<ParamsModule<O3D> *> modules;
+    std::vector<const char *> modnames;
 };
 
 #if BHC_ENABLE_2D
@@ -98,6 +110,30 @@ template class ParamsModule<true>;
 template class ModulesList<true>;
 #endif
 
+/**
+ * Validates and preprocesses the params for a run, adding the time each module
+ * takes to timings.modulePreprocess.
+ */
+template<bool O3D> void PreprocessModules(bhcParams<O3D> &params, bhcTimings &timings)
+{
+    ModulesList<O3D> modules;
+    const auto &list = modules.list();
+    int32_t n        = bhc::min((int32_t)list.size(), (int32_t)BHC_TIMING_MAX_MODULES);
+    Stopwatch sw;
+    for(int32_t i = 0; i < (int32_t)list.size(); ++i) {
+        sw.tick();
+        list[i]->Validate(params);
+        if(i < n) timings.modulePreprocess[i] += sw.tock();
+    }
+    for(int32_t i = 0; i < (int32_t)list.size(); ++i) {
+        sw.tick();
+        list[i]->Preprocess(params);
+        if(i < n) timings.modulePreprocess[i] += sw.tock();
+    }
+    timings.numModules = n;
+    for(int32_t i = 0; i < n; ++i) timings.moduleNames[i] = modules.names()[i];
+}
+
 } // namespace module
 
 namespace mode {
@@ -149,19 +185,32 @@ template<bool O3D> void setupGPU(const bhcParams<O3D> &params)
     if(num_gpus <= 0) {
         EXTERR("No CUDA GPUs found; is the driver installed and loaded?");
     }
-    int gpuIndex = GetInternal(params)->gpuIndex;
-    if(gpuIndex >= num_gpus) {
-        EXTERR(
-            "You specified CUDA device %d, but there are only %d GPUs", gpuIndex,
-            num_gpus);
+    std::vector<int> &gpuIndices = GetInternal(params)->gpuIndices;
+    for(size_t i = 0; i < gpuIndices.size(); ++i) {
+        if(gpuIndices[i] < 0 || gpuIndices[i] >= num_gpus) {
+            EXTERR(
+                "You specified CUDA device %d, but there are only %d GPUs",
+                gpuIndices[i], num_gpus);
+        }
+        for(size_t j = 0; j < i; ++j) {
+            if(gpuIndices[j] == gpuIndices[i]) {
+                EXTERR("CUDA device %d specified more than once", gpuIndices[i]);
+            }
+        }
     }
     cudaDeviceProp cudaProperties;
     for(int g = 0; g < num_gpus; ++g) {
         checkCudaErrors(cudaGetDeviceProperties(&cudaProperties, g));
-        if(g == gpuIndex) {
+        if(std::find(gpuIndices.begin(), gpuIndices.end(), g) != gpuIndices.end()) {
             EXTWARN(
-                "CUDA device: %s / compute %d.%d", cudaProperties.name,
+                "CUDA device %d: %s / compute %d.%d", g, cudaProperties.name,
                 cudaProperties.major, cudaProperties.minor);
+            if(gpuIndices.size() > 1 && !cudaProperties.concurrentManagedAccess) {
+                EXTWARN(
+                    "CUDA device %d does not support concurrent managed memory "
+                    "access, running on multiple GPUs may be slow",
+                    g);
+            }
         }
         /*
         EXTWARN("%s GPU %d: %s, compute SM %d.%d",
@@ -178,14 +227,23 @@ template<bool O3D> void setupGPU(const bhcParams<O3D> &params)
         */
     }
 
-    // Store properties about used GPU
-    checkCudaErrors(cudaGetDeviceProperties(&cudaProperties, gpuIndex));
-    /*
-    GetInternal(params)->d_warp       = cudaProperties.warpSize;
-    GetInternal(params)->d_maxthreads = cudaProperties.maxThreadsPerBlock;
-    */
-    GetInternal(params)->d_multiprocs = cudaProperties.multiProcessorCount;
-    checkCudaErrors(cudaSetDevice(gpuIndex));
+    // Store properties about used GPUs
+    GetInternal(params)->d_multiprocs.clear();
+    GetInternal(params)->d_names.clear();
+    for(int gpuIndex : gpuIndices) {
+        checkCudaErrors(cudaGetDeviceProperties(&cudaProperties, gpuIndex));
+        /*
+        GetInternal(params)->d_warp       = cudaProperties.warpSize;
+        GetInternal(params)->d_maxthreads = cudaProperties.maxThreadsPerBlock;
+        */
+        GetInternal(params)->d_multiprocs.push_back(cudaProperties.multiProcessorCount);
+        GetInternal(params)->d_names.push_back(cudaProperties.name);
+        // cudaMemPrefetchAsync is not supported without this
+        if(!cudaProperties.concurrentManagedAccess) {
+            GetInternal(params)->prefetchMemory = false;
+        }
+    }
+    checkCudaErrors(cudaSetDevice(gpuIndices[0]));
 }
 #endif
 
@@ -197,8 +255,10 @@ template<bool O3D, bool R3D> bool setup(
     try {
         params.internal = new bhcInternal(init, O3D, R3D);
 
-        Stopwatch sw(GetInternal(params));
+        NvtxRange nvtx("bhc::setup");
+        Stopwatch sw;
         sw.tick();
+        double tBegin = GetInternal(params)->execTrace.Now();
 
         if(GetInternal(params)->maxMemory < 8000000u) {
             EXTERR(
@@ -206,24 +266,30 @@ template<bool O3D, bool R3D> bool setup(
                 "ask " BHC_PROGRAMNAME " to limit itself to",
                 GetInternal(params)->maxMemory);
         }
+        if(init.threadAffinity != 'N' && init.threadAffinity != 'C'
+           && init.threadAffinity != 'S') {
+            EXTERR("Invalid bhcInit::threadAffinity '%c'", init.threadAffinity);
+        }
 #ifdef BHC_BUILD_CUDA
         setupGPU(params);
 #endif
 
         // Allocate main structs
-        params.Bdry     = nullptr;
-        params.bdinfo   = nullptr;
-        params.refl     = nullptr;
-        params.ssp      = nullptr;
-        params.atten    = nullptr;
-        params.Pos      = nullptr;
-        params.Angles   = nullptr;
-        params.freqinfo = nullptr;
-        params.Beam     = nullptr;
-        params.sbp      = nullptr;
-        outputs.rayinfo = nullptr;
-        outputs.eigen   = nullptr;
-        outputs.arrinfo = nullptr;
+        params.Bdry       = nullptr;
+        params.bdinfo     = nullptr;
+        params.refl       = nullptr;
+        params.ssp        = nullptr;
+        params.atten      = nullptr;
+        params.Pos        = nullptr;
+        params.Angles     = nullptr;
+        params.freqinfo   = nullptr;
+        params.Beam       = nullptr;
+        params.sbp        = nullptr;
+        outputs.rayinfo   = nullptr;
+        outputs.eigen     = nullptr;
+        outputs.arrinfo   = nullptr;
+        outputs.raystats  = nullptr;
+        outputs.NRayStats = 0;
         trackallocate(params, "data structures", params.Bdry);
         trackallocate(params, "data structures", params.bdinfo);
         trackallocate(params, "data structures", params.refl);
@@ -262,26 +328,40 @@ template<bool O3D, bool R3D> bool setup(
             PrintFileEmu &PRTFile = GetInternal(params)->PRTFile;
             PRTFile << BHC_PROGRAMNAME << (R3D ? "3D" : O3D ? "Nx2D" : "") << "\n\n";
 
-            // Open the environmental file
-            LDIFile ENVFile(GetInternal(params), GetInternal(params)->FileRoot + ".env");
-            if(!ENVFile.Good()) {
-                PRTFile << "ENVFile = " << GetInternal(params)->FileRoot << ".env\n";
-                EXTERR(BHC_PROGRAMNAME
-                       " - ReadEnvironment: Unable to open the environmental file");
-            }
-
-            for(auto *m : modules.list()) {
-                m->SetupPre(params);
-                m->Read(params, ENVFile, RecycledHS);
-                m->SetupPost(params);
+            // See bhcInit::envCacheDir
+            Stopwatch swRead;
+            swRead.tick();
+            std::string cachePath = module::EnvCachePath(params);
+            bool cached = !cachePath.empty() && module::LoadEnvCache(params, cachePath);
+            if(!cached) {
+                // Open the environmental file
+                LDIFile ENVFile(
+                    GetInternal(params), GetInternal(params)->FileRoot + ".env");
+                if(!ENVFile.Good()) {
+                    PRTFile << "ENVFile = " << GetInternal(params)->FileRoot << ".env\n";
+                    EXTERR(BHC_PROGRAMNAME
+                           " - ReadEnvironment: Unable to open the environmental file");
+                }
+
+                for(auto *m : modules.list()) {
+                    m->SetupPre(params);
+                    m->Read(params, ENVFile, RecycledHS);
+                    m->SetupPost(params);
+                }
             }
+            GetInternal(params)->timings.setupRead = swRead.tock();
             for(auto *m : modules.list()) {
                 m->Validate(params);
                 m->Echo(params);
             }
+            if(!cachePath.empty() && !cached) {
+                for(auto *m : modules.list()) m->Preprocess(params);
+                module::SaveEnvCache(params, cachePath);
+            }
         }
 
-        sw.tock("setup");
+        GetInternal(params)->timings.setup = sw.tock();
+        GetInternal(params)->execTrace.Phase("setup", tBegin);
     } catch(const std::exception &e) {
         EXTWARN("Exception caught in bhc::setup(): %s\n", e.what());
         return false;
@@ -326,6 +406,26 @@ template BHC_API bool echo<false>(bhcParams<false> &params);
 template BHC_API bool echo<true>(bhcParams<true> &params);
 #endif
 
+/**
+ * Writes the environment file and any other files it refers to (SSP, boundary,
+ * reflection coefficients, etc.) to FileRoot.*, which becomes the FileRoot of
+ * params. The params must already be preprocessed.
+ */
+template<bool O3D> void WriteEnvFiles(bhcParams<O3D> &params, const std::string &FileRoot)
+{
+    module::ModulesList<O3D> modules;
+    GetInternal(params)->FileRoot = FileRoot;
+    LDOFile ENVFile;
+    ENVFile.setStyle(LDOFile::Style::WRITTEN_BY_HAND);
+    ENVFile.open(FileRoot + ".env");
+    if(!ENVFile.good()) {
+        PrintFileEmu &PRTFile = GetInternal(params)->PRTFile;
+        PRTFile << "ENVFile = " << FileRoot << ".env\n";
+        EXTERR(BHC_PROGRAMNAME " - writeenv: Unable to open the new environmental file");
+    }
+    for(auto *m : modules.list()) m->Write(params, ENVFile);
+}
+
 template<bool O3D> bool writeenv(bhcParams<O3D> &params, const char *FileRoot)
 {
     try {
@@ -334,18 +434,7 @@ template<bool O3D> bool writeenv(bhcParams<O3D> &params, const char *FileRoot)
             m->Validate(params);
             m->Preprocess(params);
         }
-
-        GetInternal(params)->FileRoot = FileRoot;
-        LDOFile ENVFile;
-        ENVFile.setStyle(LDOFile::Style::WRITTEN_BY_HAND);
-        ENVFile.open(std::string(FileRoot) + ".env");
-        if(!ENVFile.good()) {
-            PrintFileEmu &PRTFile = GetInternal(params)->PRTFile;
-            PRTFile << "ENVFile = " << FileRoot << ".env\n";
-            EXTERR(BHC_PROGRAMNAME
-                   " - writeenv: Unable to open the new environmental file");
-        }
-        for(auto *m : modules.list()) m->Write(params, ENVFile);
+        WriteEnvFiles(params, FileRoot);
 
     } catch(const std::exception &e) {
         EXTWARN("Exception caught in bhc::writeenv(): %s\n", e.what());
@@ -381,33 +470,60 @@ template<bool O3D, bool R3D> inline mode::ModeModule<O3D, R3D> *GetMode(
     }
 }
 
-template<bool O3D, bool R3D> bool run(
+template<bool O3D, bool R3D> bool RunInternal(
     bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
 {
     try {
-        Stopwatch sw(GetInternal(params));
+        bhcTimings &timings = GetInternal(params)->timings;
+        ExecTrace &trace    = GetInternal(params)->execTrace;
+        ResetRunTimings(timings);
+        Stopwatch sw, swMode;
+        NvtxRange nvtx("bhc::run");
+        NvtxRange phase("preprocess");
 
         sw.tick();
-        module::ModulesList<O3D> modules;
-        for(auto *m : modules.list()) m->Validate(params);
-        for(auto *m : modules.list()) m->Preprocess(params);
+        double tBegin = trace.Now();
+        module::PreprocessModules(params, timings);
+        swMode.tick();
+        mode::BeginReciprocal<O3D, R3D>(params);
+        mode::BeginSymmetry<O3D, R3D>(params);
         auto *mo = GetMode<O3D, R3D>(params);
         mo->Preprocess(params, outputs);
-        sw.tock("Preprocess");
+        timings.modePreprocess = swMode.tock();
+        timings.preprocess     = sw.tock();
+        trace.Phase("preprocess", tBegin);
 
+        phase.Next("run");
         sw.tick();
+        tBegin = trace.Now();
+        ResetPerfCounters(GetInternal(params));
+        GetInternal(params)->completedRayCount = 0;
+        GetInternal(params)->totalJobs = GetNumJobs<O3D>(params.Pos, params.Angles);
         mo->Run(params, outputs);
-        sw.tock("Run");
+        timings.run = sw.tock();
+        trace.Phase("run", tBegin);
 
+        phase.Next("postprocess");
         sw.tick();
+        tBegin = trace.Now();
         mo->Postprocess(params, outputs);
+        mode::EndReciprocal(params, outputs);
+        mode::EndSymmetry(params, outputs);
         if(IsAlsoEigenraysRun(params.Beam)) {
             mode::PostProcessEigenrays(params, outputs);
         }
-        sw.tock("Postprocess");
+        mode::EndAdaptiveFan(params);
+        timings.postprocess = sw.tock();
+        trace.Phase("postprocess", tBegin);
 
         delete mo;
+        if(trace.Enabled()) {
+            trace.Write(GetInternal(params), GetInternal(params)->traceFile);
+        }
     } catch(const std::exception &e) {
+        mode::AbortReciprocal(params);
+        mode::AbortSymmetry(params);
+        mode::EndAdaptiveFan(params);
         EXTWARN("Exception caught in bhc::run(): %s\n", e.what());
         return false;
     }
@@ -415,6 +531,30 @@ template<bool O3D, bool R3D> bool run(
     return true;
 }
 
+template<bool O3D, bool R3D> bool run(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
+{
+    bhcInternal *internal = GetInternal(params);
+    WaitForRun(internal);
+    internal->asyncRunFailed = false;
+    if(internal->blocking && outputs.rayinfo->blocking) {
+        bool ret = RunInternal<O3D, R3D>(params, outputs);
+        if(internal->completedCallback != nullptr) internal->completedCallback();
+        return ret;
+    }
+    try {
+        internal->completedRayCount = 0;
+        internal->runThread         = std::thread([&params, &outputs, internal]() {
+            if(!RunInternal<O3D, R3D>(params, outputs)) internal->asyncRunFailed = true;
+            if(internal->completedCallback != nullptr) internal->completedCallback();
+        });
+    } catch(const std::exception &e) {
+        EXTWARN("Exception caught in bhc::run(): %s\n", e.what());
+        return false;
+    }
+    return true;
+}
+
 #if BHC_ENABLE_2D
 template bool BHC_API
 run<false, false>(bhcParams<false> &params, bhcOutputs<false, false> &outputs);
@@ -428,21 +568,197 @@ template bool BHC_API
 run<true, true>(bhcParams<true> &params, bhcOutputs<true, true> &outputs);
 #endif
 
+template<bool O3D, bool R3D> bool run_batch(
+    bhcParams<O3D> *params, bhcOutputs<O3D, R3D> *outputs, int32_t n)
+{
+    try {
+        if(n <= 0) return true;
+        for(int32_t e = 0; e < n; ++e) {
+            bhcInternal *internal = GetInternal(params[e]);
+            WaitForRun(internal);
+            internal->asyncRunFailed = false;
+        }
+        bool streamed = false;
+        for(int32_t e = 0; e < n; ++e) {
+            streamed = streamed || mode::IsStreamedTLRun(params[e]);
+        }
+        if(n == 1 || IsRayRun(params[0].Beam) || streamed) {
+            // Ray runs are cheap and write a separate ray file per
+            // environment, so there is nothing to gain by merging them.
+            // Streamed TL runs have to run one source at a time.
+            bool ret = true;
+            for(int32_t e = 0; e < n; ++e) {
+                if(!RunInternal<O3D, R3D>(params[e], outputs[e])) ret = false;
+                bhcInternal *internal = GetInternal(params[e]);
+                if(internal->completedCallback != nullptr) internal->completedCallback();
+            }
+            return ret;
+        }
+
+        // Timings for the whole batch go in the first environment.
+        bhcTimings &timings = GetInternal(params[0])->timings;
+        ExecTrace &trace    = GetInternal(params[0])->execTrace;
+        ResetRunTimings(timings);
+        Stopwatch sw, swMode;
+        NvtxRange nvtx("bhc::run_batch");
+        NvtxRange phase("preprocess");
+
+        sw.tick();
+        double tBegin = trace.Now();
+        std::vector<std::unique_ptr<mode::ModeModule<O3D, R3D>>> mos;
+        for(int32_t e = 0; e < n; ++e) {
+            module::PreprocessModules(params[e], timings);
+            swMode.tick();
+            mos.emplace_back(GetMode<O3D, R3D>(params[e]));
+            mos[e]->Preprocess(params[e], outputs[e]);
+            timings.modePreprocess += swMode.tock();
+        }
+        timings.preprocess = sw.tock();
+        trace.Phase("preprocess", tBegin);
+
+        phase.Next("run");
+        sw.tick();
+        tBegin = trace.Now();
+        for(int32_t e = 0; e < n; ++e) {
+            bhcInternal *internal       = GetInternal(params[e]);
+            internal->completedRayCount = 0;
+            internal->totalJobs = GetNumJobs<O3D>(params[e].Pos, params[e].Angles);
+        }
+        mode::FieldBatch<O3D, R3D> batch(params, outputs, n);
+        mode::RunFieldModesBatch<O3D, R3D>(batch);
+        timings.run = sw.tock();
+        trace.Phase("run", tBegin);
+
+        phase.Next("postprocess");
+        sw.tick();
+        tBegin = trace.Now();
+        for(int32_t e = 0; e < n; ++e) {
+            mos[e]->Postprocess(params[e], outputs[e]);
+            if(IsAlsoEigenraysRun(params[e].Beam)) {
+                mode::PostProcessEigenrays(params[e], outputs[e]);
+            }
+        }
+        timings.postprocess = sw.tock();
+        trace.Phase("postprocess", tBegin);
+        if(trace.Enabled()) {
+            trace.Write(GetInternal(params[0]), GetInternal(params[0])->traceFile);
+        }
+
+        for(int32_t e = 0; e < n; ++e) {
+            bhcInternal *internal = GetInternal(params[e]);
+            if(internal->completedCallback != nullptr) internal->completedCallback();
+        }
+    } catch(const std::exception &e) {
+        ExternalWarning(
+            GetInternal(params[0]), "Exception caught in bhc::run_batch(): %s\n",
+            e.what());
+        return false;
+    }
+    return true;
+}
+
+#if BHC_ENABLE_2D
+template bool BHC_API run_batch<false, false>(
+    bhcParams<false> *params, bhcOutputs<false, false> *outputs, int32_t n);
+#endif
+#if BHC_ENABLE_NX2D
+template bool BHC_API run_batch<true, false>(
+    bhcParams<true> *params, bhcOutputs<true, false> *outputs, int32_t n);
+#endif
+#if BHC_ENABLE_3D
+template bool BHC_API run_batch<true, true>(
+    bhcParams<true> *params, bhcOutputs<true, true> *outputs, int32_t n);
+#endif
+
+/**
+ * Writes the rays of the last run over the thresholds of bhcInit::captureSteps /
+ * captureTime to FileRoot_capture.rayinit, and the environment to
+ * FileRoot_capture.env etc. Writes nothing if there are no such rays.
+ */
+template<bool O3D> void WriteCapture(
+    const bhcParams<O3D> &params, const bhcRayStats *raystats, int32_t NRays,
+    const std::string &FileRoot)
+{
+    bhcInternal *internal = GetInternal(params);
+    if(raystats == nullptr) return;
+    int32_t nJobs = GetNumJobs<O3D>(params.Pos, params.Angles);
+    // After an adaptive fan run, the stats are of the final fan, but the
+    // params have been put back to the fan from the environment file.
+    if(NRays != nJobs) return;
+    std::vector<int32_t> jobs;
+    for(int32_t job = 0; job < nJobs; ++job) {
+        const bhcRayStats &st = raystats[job];
+        if((internal->captureSteps > 0 && st.steps >= internal->captureSteps)
+           || (internal->captureTime > 0.0f && st.time >= internal->captureTime)) {
+            jobs.push_back(job);
+        }
+    }
+    if(jobs.empty()) return;
+
+    std::string root = FileRoot + "_capture";
+    std::ofstream out(root + ".rayinit");
+    out << "# " BHC_PROGRAMNAME " ray capture, " << jobs.size() << " rays of "
+        << nJobs << " (steps >= " << internal->captureSteps
+        << ", time >= " << internal->captureTime << " us)\n";
+    out << "# isx isy isz ialpha ibeta steps influence topRefl botRefl time_us\n";
+    for(int32_t job : jobs) {
+        RayInitInfo rinit;
+        GetJobIndices<O3D>(rinit, job, params.Pos, params.Angles);
+        const bhcRayStats &st = raystats[job];
+        out << (O3D ? rinit.isx : 0) << " " << (O3D ? rinit.isy : 0) << " "
+            << rinit.isz << " " << rinit.ialpha << " " << (O3D ? rinit.ibeta : 0)
+            << " " << st.steps << " " << st.influence << " " << st.topRefl << " "
+            << st.botRefl << " " << st.time << "\n";
+    }
+    if(!out.good()) EXTERR("Failed to write ray capture file %s.rayinit", root.c_str());
+
+    // The params were preprocessed by the run, so only the modules' Write
+    // is needed. Write is not const because of the side files it names, but
+    // it does not change the environment; FileRoot is put back afterwards.
+    std::string origRoot = internal->FileRoot;
+    try {
+        WriteEnvFiles(const_cast<bhcParams<O3D> &>(params), root);
+    } catch(...) {
+        internal->FileRoot = origRoot;
+        throw;
+    }
+    internal->FileRoot = origRoot;
+}
+
 template<bool O3D, bool R3D> bool writeout(
     const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
     const char *FileRoot)
 {
     try {
-        Stopwatch sw(GetInternal(params));
+        WaitForRun(GetInternal(params));
+        if(GetInternal(params)->asyncRunFailed) {
+            EXTERR("Not writing out results of a run which failed");
+        }
+        NvtxRange nvtx("bhc::writeout");
+        Stopwatch sw;
         sw.tick();
+        double tBegin = GetInternal(params)->execTrace.Now();
         if(FileRoot != nullptr) { GetInternal(params)->FileRoot = FileRoot; }
         auto *mo = GetMode<O3D, R3D>(params);
-        mo->Writeout(params, outputs);
+        const char *root = GetInternal(params)->FileRoot.c_str();
+        mo->Writeout(params, outputs, root);
         if(IsAlsoEigenraysRun(params.Beam)) {
             mode::Eigen<O3D, R3D> E1;
-            E1.Writeout(params, outputs);
+            E1.Writeout(params, outputs, root);
+        }
+        if(GetInternal(params)->rayStatsFile) {
+            mode::WriteRayStats(params, outputs.raystats, outputs.NRayStats, root);
+        }
+        if(GetInternal(params)->captureSteps > 0
+           || GetInternal(params)->captureTime > 0.0f) {
+            WriteCapture(params, outputs.raystats, outputs.NRayStats, root);
+        }
+        GetInternal(params)->timings.writeout = sw.tock();
+        ExecTrace &trace                      = GetInternal(params)->execTrace;
+        trace.Phase("writeout", tBegin);
+        if(trace.Enabled()) {
+            trace.Write(GetInternal(params), GetInternal(params)->traceFile);
         }
-        sw.tock("writeout");
         delete mo;
     } catch(const std::exception &e) {
         EXTWARN("Exception caught in bhc::writeout(): %s\n", e.what());
@@ -467,6 +783,280 @@ template bool BHC_API writeout<true, true>(
     const char *FileRoot);
 #endif
 
+template<bool O3D, bool R3D> bool synthesize_waveforms(
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+    const bhcWaveformParams &wp, float *out, size_t outCount)
+{
+    try {
+        WaitForRun(GetInternal(params));
+        NvtxRange nvtx("bhc::synthesize_waveforms");
+        mode::SynthesizeWaveforms<O3D>(params, outputs.arrinfo, wp, out, outCount);
+    } catch(const std::exception &e) {
+        EXTWARN("Exception caught in bhc::synthesize_waveforms(): %s\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+#if BHC_ENABLE_2D
+template bool BHC_API synthesize_waveforms<false, false>(
+    const bhcParams<false> &params, const bhcOutputs<false, false> &outputs,
+    const bhcWaveformParams &wp, float *out, size_t outCount);
+#endif
+#if BHC_ENABLE_NX2D
+template bool BHC_API synthesize_waveforms<true, false>(
+    const bhcParams<true> &params, const bhcOutputs<true, false> &outputs,
+    const bhcWaveformParams &wp, float *out, size_t outCount);
+#endif
+#if BHC_ENABLE_3D
+template bool BHC_API synthesize_waveforms<true, true>(
+    const bhcParams<true> &params, const bhcOutputs<true, true> &outputs,
+    const bhcWaveformParams &wp, float *out, size_t outCount);
+#endif
+
+template<bool O3D> int32_t read_capture(
+    const bhcParams<O3D> &params, const char *FileRoot, bhcPlaybackRay *rays,
+    int32_t maxRays)
+{
+    try {
+        std::string root = FileRoot != nullptr ? FileRoot
+                                               : GetInternal(params)->FileRoot;
+        std::ifstream in(root + ".rayinit");
+        if(!in.good()) EXTERR("Could not open ray capture file %s.rayinit", root.c_str());
+        int32_t n = 0;
+        std::string line;
+        while(std::getline(in, line)) {
+            size_t first = line.find_first_not_of(" \t\r");
+            if(first == std::string::npos || line[first] == '#') continue;
+            std::istringstream ls(line);
+            bhcPlaybackRay ray;
+            memset(&ray, 0, sizeof(ray));
+            ls >> ray.init.isx >> ray.init.isy >> ray.init.isz >> ray.init.ialpha
+                >> ray.init.ibeta >> ray.stats.steps >> ray.stats.influence
+                >> ray.stats.topRefl >> ray.stats.botRefl >> ray.stats.time;
+            if(ls.fail()) {
+                EXTERR("Invalid line in ray capture file %s.rayinit: %s", root.c_str(),
+                       line.c_str());
+            }
+            if(n < maxRays) rays[n] = ray;
+            ++n;
+        }
+        return n;
+    } catch(const std::exception &e) {
+        EXTWARN("Exception caught in bhc::read_capture(): %s\n", e.what());
+        return -1;
+    }
+}
+
+#if BHC_ENABLE_2D
+template BHC_API int32_t read_capture<false>(
+    const bhcParams<false> &params, const char *FileRoot, bhcPlaybackRay *rays,
+    int32_t maxRays);
+#endif
+#if BHC_ENABLE_NX2D || BHC_ENABLE_3D
+template BHC_API int32_t read_capture<true>(
+    const bhcParams<true> &params, const char *FileRoot, bhcPlaybackRay *rays,
+    int32_t maxRays);
+#endif
+
+template<bool O3D, bool R3D> bool playback(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, bhcPlaybackRay *rays,
+    int32_t nRays)
+{
+    bhcInternal *internal = GetInternal(params);
+    try {
+        WaitForRun(internal);
+        if(IsRayRun(params.Beam)) {
+            EXTERR("bhc::playback() is only for field runs (TL, eigenrays, arrivals)");
+        }
+        const Position *Pos           = params.Pos;
+        const AnglesStructure *Angles = params.Angles;
+        for(int32_t r = 0; r < nRays; ++r) {
+            const RayInitInfo &init = rays[r].init;
+            bool ok = init.isz >= 0 && init.isz < Pos->NSz && init.ialpha >= 0
+                && init.ialpha < Angles->alpha.n;
+            if constexpr(O3D) {
+                ok = ok && init.isx >= 0 && init.isx < Pos->NSx && init.isy >= 0
+                    && init.isy < Pos->NSy && init.ibeta >= 0
+                    && init.ibeta < Angles->beta.n;
+            }
+            if(!ok) {
+                EXTERR("bhc::playback(): ray %d is not in the sources / angles of "
+                       "this environment",
+                       r);
+            }
+        }
+        NvtxRange nvtx("bhc::playback");
+        ExecTrace &trace = internal->execTrace;
+        double tBegin    = trace.Now();
+        module::PreprocessModules(params, internal->timings);
+        std::unique_ptr<mode::ModeModule<O3D, R3D>> mo(GetMode<O3D, R3D>(params));
+        mo->Preprocess(params, outputs);
+        ResetPerfCounters(internal);
+        mode::RunFieldModesPlayback<O3D, R3D>(params, outputs, rays, nRays);
+        trace.Phase("playback", tBegin);
+        if(trace.Enabled()) trace.Write(internal, internal->traceFile);
+    } catch(const std::exception &e) {
+        EXTWARN("Exception caught in bhc::playback(): %s\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+#if BHC_ENABLE_2D
+template bool BHC_API playback<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs, bhcPlaybackRay *rays,
+    int32_t nRays);
+#endif
+#if BHC_ENABLE_NX2D
+template bool BHC_API playback<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs, bhcPlaybackRay *rays,
+    int32_t nRays);
+#endif
+#if BHC_ENABLE_3D
+template bool BHC_API playback<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs, bhcPlaybackRay *rays,
+    int32_t nRays);
+#endif
+
+/**
+ * Waits for the writeout of the previous job of run_pipelined, if any, and
+ * frees the copy of the params it used. Returns false if it failed.
+ */
+template<bool O3D> bool JoinPipelineWriter(const bhcParams<O3D> &params)
+{
+    bhcInternal *internal = GetInternal(params);
+    if(internal->pipeThread.joinable()) internal->pipeThread.join();
+    auto *copy = (mode::PipelineParams<O3D> *)internal->pipeParams;
+    mode::FreePipelineParams(params, copy);
+    internal->pipeParams     = nullptr;
+    internal->pipeHeldMemory = 0;
+    if(!internal->pipeError) return true;
+    std::exception_ptr error = internal->pipeError;
+    internal->pipeError      = nullptr;
+    try {
+        std::rethrow_exception(error);
+    } catch(const std::exception &e) {
+        EXTWARN("Exception caught in writeout of pipelined job: %s\n", e.what());
+    }
+    return false;
+}
+
+template<bool O3D, bool R3D> bool run_pipelined(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const char *FileRoot)
+{
+    bhcInternal *internal = GetInternal(params);
+    try {
+        WaitForRun(internal);
+        internal->asyncRunFailed = false;
+        if(internal->userField != nullptr || internal->userArrivals != nullptr) {
+            EXTERR("bhc::run_pipelined cannot be used with caller-owned output "
+                   "buffers (bhc::set_output_buffers)");
+        }
+        auto *spare = (bhcOutputs<O3D, R3D> *)internal->pipeOutputs;
+        if(spare == nullptr) {
+            trackallocate(params, "pipelined outputs", spare);
+            trackallocate(params, "pipelined outputs", spare->rayinfo);
+            trackallocate(params, "pipelined outputs", spare->eigen);
+            trackallocate(params, "pipelined outputs", spare->arrinfo);
+            spare->raystats  = nullptr;
+            spare->NRayStats = 0;
+            mode::ModesList<O3D, R3D> modes;
+            for(auto *m : modes.list()) m->Init(*spare);
+            internal->pipeOutputs = spare;
+        }
+        // outputs holds the previous job, which may still be being written
+        // out, so run into the other set.
+        bool previous = internal->pipeParams != nullptr;
+        if(previous) std::swap(outputs, *spare);
+        bool ret = RunInternal<O3D, R3D>(params, outputs);
+        if(internal->completedCallback != nullptr) internal->completedCallback();
+        if(!ret) {
+            if(previous) std::swap(outputs, *spare);
+            return false;
+        }
+        if(!JoinPipelineWriter(params)) ret = false;
+        std::string root = FileRoot != nullptr ? FileRoot : internal->FileRoot;
+
+        // The writer has its own copies of the params and of the outputs
+        // struct, as the caller may change both for the next job.
+        auto *copy                   = mode::CopyPipelineParams(params);
+        bhcOutputs<O3D, R3D> written = outputs;
+        internal->pipeParams         = copy;
+        internal->pipeHeldMemory     = mode::OutputsTrackedSize(params, outputs);
+        internal->pipeThread         = std::thread([internal, copy, written, root]() {
+            try {
+                std::unique_ptr<mode::ModeModule<O3D, R3D>> mo(
+                    GetMode<O3D, R3D>(copy->params));
+                mo->Writeout(copy->params, written, root.c_str());
+                if(IsAlsoEigenraysRun(copy->params.Beam)) {
+                    mode::Eigen<O3D, R3D> E1;
+                    E1.Writeout(copy->params, written, root.c_str());
+                }
+                if(internal->rayStatsFile) {
+                    mode::WriteRayStats(
+                        copy->params, written.raystats, written.NRayStats, root);
+                }
+            } catch(...) {
+                internal->pipeError = std::current_exception();
+            }
+        });
+        return ret;
+    } catch(const std::exception &e) {
+        EXTWARN("Exception caught in bhc::run_pipelined(): %s\n", e.what());
+        return false;
+    }
+}
+
+#if BHC_ENABLE_2D
+template bool BHC_API run_pipelined<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs, const char *FileRoot);
+#endif
+#if BHC_ENABLE_NX2D
+template bool BHC_API run_pipelined<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs, const char *FileRoot);
+#endif
+#if BHC_ENABLE_3D
+template bool BHC_API run_pipelined<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs, const char *FileRoot);
+#endif
+
+template<bool O3D, bool R3D> bool finish_pipeline(
+    bhcParams<O3D> &params, [[maybe_unused]] bhcOutputs<O3D, R3D> &outputs)
+{
+    bhcInternal *internal = GetInternal(params);
+    auto *spare           = (bhcOutputs<O3D, R3D> *)internal->pipeOutputs;
+    if(spare == nullptr) return true;
+    bool ret = JoinPipelineWriter(params);
+    try {
+        mode::ModesList<O3D, R3D> modes;
+        for(auto *m : modes.list()) m->Finalize(params, *spare);
+        trackdeallocate(params, spare->rayinfo);
+        trackdeallocate(params, spare->eigen);
+        trackdeallocate(params, spare->arrinfo);
+        trackdeallocate(params, spare->raystats);
+        trackdeallocate(params, spare);
+        internal->pipeOutputs = nullptr;
+    } catch(const std::exception &e) {
+        EXTWARN("Exception caught in bhc::finish_pipeline(): %s\n", e.what());
+        return false;
+    }
+    return ret;
+}
+
+#if BHC_ENABLE_2D
+template bool BHC_API finish_pipeline<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs);
+#endif
+#if BHC_ENABLE_NX2D
+template bool BHC_API finish_pipeline<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+#endif
+#if BHC_ENABLE_3D
+template bool BHC_API finish_pipeline<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs);
+#endif
+
 template<bool O3D, bool R3D> bool readout(
     bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const char *FileRoot)
 {
@@ -497,15 +1087,76 @@ template BHC_API bool readout<true, true>(
     bhcParams<true> &params, bhcOutputs<true, true> &outputs, const char *FileRoot);
 #endif
 
+template<bool O3D, bool R3D> bool readout_rays(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const char *FileRoot,
+    const int32_t *rays, int32_t nRays)
+{
+    try {
+        if(FileRoot == nullptr) { FileRoot = GetInternal(params)->FileRoot.c_str(); }
+        if(rays == nullptr || nRays < 0) EXTERR("readout_rays(): invalid list of rays");
+        mode::ReadOutRay<O3D, R3D>(params, outputs, FileRoot, rays, nRays);
+        module::ModulesList<O3D> modules;
+        for(auto *m : modules.list()) m->Validate(params);
+    } catch(const std::exception &e) {
+        EXTWARN("Exception caught in bhc::readout_rays(): %s\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+#if BHC_ENABLE_2D
+template BHC_API bool readout_rays<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs, const char *FileRoot,
+    const int32_t *rays, int32_t nRays);
+#endif
+#if BHC_ENABLE_NX2D
+template BHC_API bool readout_rays<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs, const char *FileRoot,
+    const int32_t *rays, int32_t nRays);
+#endif
+#if BHC_ENABLE_3D
+template BHC_API bool readout_rays<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs, const char *FileRoot,
+    const int32_t *rays, int32_t nRays);
+#endif
+
+template<bool O3D> bool readout_tl_tile(
+    const bhcParams<O3D> &params, const char *FileRoot, int32_t isx, int32_t isy,
+    int32_t isz, int32_t ifreq, int32_t itheta, cpxf *field)
+{
+    try {
+        if(FileRoot == nullptr) { FileRoot = GetInternal(params)->FileRoot.c_str(); }
+        mode::ReadOutTLTile<O3D>(params, FileRoot, isx, isy, isz, ifreq, itheta, field);
+    } catch(const std::exception &e) {
+        EXTWARN("Exception caught in bhc::readout_tl_tile(): %s\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+#if BHC_ENABLE_2D
+template BHC_API bool readout_tl_tile<false>(
+    const bhcParams<false> &params, const char *FileRoot, int32_t isx, int32_t isy,
+    int32_t isz, int32_t ifreq, int32_t itheta, cpxf *field);
+#endif
+#if BHC_ENABLE_NX2D || BHC_ENABLE_3D
+template BHC_API bool readout_tl_tile<true>(
+    const bhcParams<true> &params, const char *FileRoot, int32_t isx, int32_t isy,
+    int32_t isz, int32_t ifreq, int32_t itheta, cpxf *field);
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 
 template<bool O3D, bool R3D> void finalize(
     bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
 {
+    WaitForRun(GetInternal(params));
+    finish_pipeline(params, outputs);
     module::ModulesList<O3D> modules;
     mode::ModesList<O3D, R3D> modes;
     for(auto *m : modules.list()) m->Finalize(params);
     for(auto *m : modes.list()) m->Finalize(params, outputs);
+    mode::FreeRetainedRays(params);
 
     trackdeallocate(params, params.Bdry);
     trackdeallocate(params, params.bdinfo);
@@ -520,6 +1171,7 @@ template<bool O3D, bool R3D> void finalize(
     trackdeallocate(params, outputs.rayinfo);
     trackdeallocate(params, outputs.eigen);
     trackdeallocate(params, outputs.arrinfo);
+    trackdeallocate(params, outputs.raystats);
 
     if(GetInternal(params)->usedMemory != 0) {
         EXTWARN(
@@ -527,6 +1179,7 @@ template<bool O3D, bool R3D> void finalize(
             GetInternal(params)->usedMemory);
     }
 
+    ReleaseAllocPool(GetInternal(params));
     delete GetInternal(params);
     params.internal = nullptr;
 }
@@ -744,6 +1397,188 @@ template BHC_API int get_percent_progress<false>(bhcParams<false> &params);
 template BHC_API int get_percent_progress<true>(bhcParams<true> &params);
 #endif
 
+template<bool O3D> size_t get_peak_memory(bhcParams<O3D> &params, bool reset)
+{
+    bhcInternal *internal = GetInternal(params);
+    size_t peak           = internal->peakMemory;
+    if(reset) {
+        internal->peakMemory = internal->usedMemory;
+        for(auto &kv : internal->memoryUse) kv.second.peak = kv.second.current;
+    }
+    return peak;
+}
+
+#if BHC_ENABLE_2D
+template BHC_API size_t get_peak_memory<false>(bhcParams<false> &params, bool reset);
+#endif
+#if BHC_ENABLE_NX2D || BHC_ENABLE_3D
+template BHC_API size_t get_peak_memory<true>(bhcParams<true> &params, bool reset);
+#endif
+
+template<bool O3D> int32_t get_memory_usage(
+    bhcParams<O3D> &params, bhcMemoryUse *uses, int32_t maxUses)
+{
+    std::vector<bhcMemoryUse> all;
+    for(const auto &kv : GetInternal(params)->memoryUse) {
+        const MemoryUse &use = kv.second;
+        all.push_back({kv.first.c_str(), use.current, use.peak, use.allocations});
+    }
+    std::sort(all.begin(), all.end(), [](const bhcMemoryUse &a, const bhcMemoryUse &b) {
+        return a.peak > b.peak;
+    });
+    for(int32_t i = 0; i < maxUses && i < (int32_t)all.size(); ++i) uses[i] = all[i];
+    return (int32_t)all.size();
+}
+
+#if BHC_ENABLE_2D
+template BHC_API int32_t get_memory_usage<false>(
+    bhcParams<false> &params, bhcMemoryUse *uses, int32_t maxUses);
+#endif
+#if BHC_ENABLE_NX2D || BHC_ENABLE_3D
+template BHC_API int32_t get_memory_usage<true>(
+    bhcParams<true> &params, bhcMemoryUse *uses, int32_t maxUses);
+#endif
+
+template<bool O3D> void get_perf_counters(
+    bhcParams<O3D> &params, bhcPerfCounters &counters)
+{
+    counters = GetInternal(params)->perfCounters;
+}
+
+#if BHC_ENABLE_2D
+template BHC_API void get_perf_counters<false>(
+    bhcParams<false> &params, bhcPerfCounters &counters);
+#endif
+#if BHC_ENABLE_NX2D || BHC_ENABLE_3D
+template BHC_API void get_perf_counters<true>(
+    bhcParams<true> &params, bhcPerfCounters &counters);
+#endif
+
+template<bool O3D> void get_timings(bhcParams<O3D> &params, bhcTimings &timings)
+{
+    timings = GetInternal(params)->timings;
+}
+
+#if BHC_ENABLE_2D
+template BHC_API void get_timings<false>(bhcParams<false> &params, bhcTimings &timings);
+#endif
+#if BHC_ENABLE_NX2D || BHC_ENABLE_3D
+template BHC_API void get_timings<true>(bhcParams<true> &params, bhcTimings &timings);
+#endif
+
+template<bool O3D, bool R3D> int32_t get_ray_stats(
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+    const bhcRayStats *&raystats)
+{
+    WaitForRun(GetInternal(params));
+    raystats = outputs.raystats;
+    if(raystats == nullptr) return 0;
+    return outputs.NRayStats;
+}
+
+#if BHC_ENABLE_2D
+template BHC_API int32_t get_ray_stats<false, false>(
+    const bhcParams<false> &params, const bhcOutputs<false, false> &outputs,
+    const bhcRayStats *&raystats);
+#endif
+#if BHC_ENABLE_NX2D
+template BHC_API int32_t get_ray_stats<true, false>(
+    const bhcParams<true> &params, const bhcOutputs<true, false> &outputs,
+    const bhcRayStats *&raystats);
+#endif
+#if BHC_ENABLE_3D
+template BHC_API int32_t get_ray_stats<true, true>(
+    const bhcParams<true> &params, const bhcOutputs<true, true> &outputs,
+    const bhcRayStats *&raystats);
+#endif
+
+template<bool O3D, bool R3D> bool plan_memory(
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+    bhcMemoryPlan &plan, size_t budget)
+{
+    try {
+        mode::PlanMemory<O3D, R3D>(params, outputs, plan, budget);
+        return plan.fits;
+    } catch(const std::exception &e) {
+        EXTWARN("Exception caught in bhc::plan_memory(): %s\n", e.what());
+        return false;
+    }
+}
+
+#if BHC_ENABLE_2D
+template BHC_API bool plan_memory<false, false>(
+    const bhcParams<false> &params, const bhcOutputs<false, false> &outputs,
+    bhcMemoryPlan &plan, size_t budget);
+#endif
+#if BHC_ENABLE_NX2D
+template BHC_API bool plan_memory<true, false>(
+    const bhcParams<true> &params, const bhcOutputs<true, false> &outputs,
+    bhcMemoryPlan &plan, size_t budget);
+#endif
+#if BHC_ENABLE_3D
+template BHC_API bool plan_memory<true, true>(
+    const bhcParams<true> &params, const bhcOutputs<true, true> &outputs,
+    bhcMemoryPlan &plan, size_t budget);
+#endif
+
+#ifdef BHC_BUILD_CUDA
+template<bool O3D> void CheckOutputBufferMemory(
+    const bhcParams<O3D> &params, const void *ptr, const char *name)
+{
+    cudaPointerAttributes attr;
+    checkCudaErrors(cudaPointerGetAttributes(&attr, ptr));
+    if(attr.type != cudaMemoryTypeManaged) {
+        EXTERR("Output buffer for %s must be CUDA managed memory", name);
+    }
+}
+#endif
+
+template<bool O3D> bool set_output_buffers(
+    bhcParams<O3D> &params, cpxf *field, size_t fieldCount, void *arrivals,
+    size_t arrivalsBytes)
+{
+    try {
+        bhcInternal *internal = GetInternal(params);
+        WaitForRun(internal);
+        if(field != nullptr) {
+            if((uintptr_t)field % alignof(cpxf) != 0) {
+                EXTERR("Output buffer for the field is not aligned");
+            }
+#ifdef BHC_BUILD_CUDA
+            CheckOutputBufferMemory(params, field, "the field");
+#endif
+        }
+        if(arrivals != nullptr) {
+            if((uintptr_t)arrivals % alignof(Arrival) != 0
+               || (uintptr_t)arrivals % alignof(ArrivalCompact) != 0) {
+                EXTERR("Output buffer for arrivals is not aligned");
+            }
+#ifdef BHC_BUILD_CUDA
+            CheckOutputBufferMemory(params, arrivals, "arrivals");
+#endif
+        }
+        internal->userField         = field;
+        internal->userFieldCount    = field == nullptr ? 0 : fieldCount;
+        internal->userArrivals      = arrivals;
+        internal->userArrivalsBytes = arrivals == nullptr ? 0 : arrivalsBytes;
+    } catch(const std::exception &e) {
+        EXTWARN("Exception caught in bhc::set_output_buffers(): %s\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+#if BHC_ENABLE_2D
+template BHC_API bool set_output_buffers<false>(
+    bhcParams<false> &params, cpxf *field, size_t fieldCount, void *arrivals,
+    size_t arrivalsBytes);
+#endif
+#if BHC_ENABLE_NX2D || BHC_ENABLE_3D
+template BHC_API bool set_output_buffers<true>(
+    bhcParams<true> &params, cpxf *field, size_t fieldCount, void *arrivals,
+    size_t arrivalsBytes);
+#endif
+
 template<bool O3D, bool R3D> bool get_ssp(
     bhcParams<O3D> &params, const VEC23<R3D> &x, float &sound_speed)
 {
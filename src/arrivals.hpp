@@ -21,21 +21,254 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 
 namespace bhc {
 
+/**
+ * Index in Arr (or ArrC) of arrival iArr of the receiver at base (see
+ * GetFieldAddr), which must already have been stored.
+ */
+HOST_DEVICE inline size_t ArrivalIndex(const ArrInfo *arrinfo, size_t base, int32_t iArr)
+{
+    if(arrinfo->ArrChunks == nullptr) return base * (size_t)arrinfo->MaxNArr + iArr;
+    int32_t chunksPerRcvr = arrinfo->MaxNArr / arrinfo->ArrChunkSize;
+    int32_t chunk
+        = arrinfo->ArrChunks[base * (size_t)chunksPerRcvr + iArr / arrinfo->ArrChunkSize];
+    return (size_t)chunk * (size_t)arrinfo->ArrChunkSize + iArr % arrinfo->ArrChunkSize;
+}
+
+/**
+ * Space for a new arrival iArr (< MaxNArr) of the receiver at base; sets idx
+ * to its index. In arena mode, allocates the chunk for it if needed; returns
+ * false if the arena is full. Never waits for other threads, so concurrent
+ * callers may each allocate the same chunk, in which case all but one of those
+ * chunks are wasted.
+ *
+ * A caller which has already counted iArr in NArr and gets false must not be
+ * followed by another caller installing the chunk, or iArr would be counted
+ * but never written. So a failed claim closes the chunk's slot (-2), and
+ * NumStoredArrivals stops at the first chunk which is not installed.
+ */
+HOST_DEVICE inline bool ClaimArrival(
+    const ArrInfo *arrinfo, size_t base, int32_t iArr, size_t &idx)
+{
+    if(arrinfo->ArrChunks == nullptr) {
+        idx = ArrivalIndex(arrinfo, base, iArr);
+        return true;
+    }
+    int32_t chunksPerRcvr = arrinfo->MaxNArr / arrinfo->ArrChunkSize;
+    int32_t *slot = &arrinfo->ArrChunks
+                         [base * (size_t)chunksPerRcvr + iArr / arrinfo->ArrChunkSize];
+    int32_t chunk = AtomicLoad(slot);
+    if(chunk == -1) {
+        // Check first so that the counter does not keep growing (and
+        // eventually overflow) once the arena is full.
+        int32_t fresh = -2;
+        if(AtomicLoad(arrinfo->ArrChunksUsed) < arrinfo->NArrChunks) {
+            fresh = AtomicFetchAdd(arrinfo->ArrChunksUsed, 1);
+            if(fresh >= arrinfo->NArrChunks) fresh = -2;
+        }
+        // Either installs the fresh chunk, or closes the slot if there is none;
+        // unless another caller got there first, in which case its outcome
+        // stands (and a fresh chunk is wasted).
+        chunk = AtomicCompareExchange(slot, -1, fresh);
+        if(chunk == -1) chunk = fresh;
+    }
+    if(chunk < 0) return false;
+    idx = (size_t)chunk * (size_t)arrinfo->ArrChunkSize + iArr % arrinfo->ArrChunkSize;
+    return true;
+}
+
+/// Bytes per stored arrival, see bhcInit::compactArrivals.
+HOST_DEVICE inline size_t ArrivalBytes(const ArrInfo *arrinfo)
+{
+    return arrinfo->isCompact ? sizeof(ArrivalCompact) : sizeof(Arrival);
+}
+
+/// Arrival idx as raw bytes, for copying whole ranges of arrivals.
+HOST_DEVICE inline char *ArrivalData(const ArrInfo *arrinfo, size_t idx)
+{
+    return arrinfo->isCompact ? (char *)&arrinfo->ArrC[idx] : (char *)&arrinfo->Arr[idx];
+}
+
+HOST_DEVICE inline Arrival LoadArrival(const ArrInfo *arrinfo, size_t idx)
+{
+    if(!arrinfo->isCompact) return arrinfo->Arr[idx];
+    const ArrivalCompact &c = arrinfo->ArrC[idx];
+    Arrival arr;
+    arr.NTopBnc       = c.NTopBnc;
+    arr.NBotBnc       = c.NBotBnc;
+    arr.SrcDeclAngle  = HalfToFloat(c.SrcDeclAngle);
+    arr.SrcAzimAngle  = HalfToFloat(c.SrcAzimAngle);
+    arr.RcvrDeclAngle = HalfToFloat(c.RcvrDeclAngle);
+    arr.RcvrAzimAngle = HalfToFloat(c.RcvrAzimAngle);
+    arr.a             = c.a;
+    arr.Phase         = c.Phase;
+    arr.delay         = cpxf(c.delayR, c.delayI);
+    return arr;
+}
+
+HOST_DEVICE inline void StoreArrival(
+    const ArrInfo *arrinfo, size_t idx, const Arrival &arr)
+{
+    if(!arrinfo->isCompact) {
+        arrinfo->Arr[idx] = arr;
+        return;
+    }
+    ArrivalCompact &c = arrinfo->ArrC[idx];
+    c.NTopBnc         = (int16_t)bhc::min(arr.NTopBnc, 0x7FFF);
+    c.NBotBnc         = (int16_t)bhc::min(arr.NBotBnc, 0x7FFF);
+    c.SrcDeclAngle    = FloatToHalf(arr.SrcDeclAngle);
+    c.SrcAzimAngle    = FloatToHalf(arr.SrcAzimAngle);
+    c.RcvrDeclAngle   = FloatToHalf(arr.RcvrDeclAngle);
+    c.RcvrAzimAngle   = FloatToHalf(arr.RcvrAzimAngle);
+    c.a               = arr.a;
+    c.Phase           = arr.Phase;
+    c.delayR          = arr.delay.real();
+    c.delayI          = arr.delay.imag();
+}
+
+/// Amplitude only, without converting the rest of the arrival.
+HOST_DEVICE inline float &ArrivalAmp(const ArrInfo *arrinfo, size_t idx)
+{
+    return arrinfo->isCompact ? arrinfo->ArrC[idx].a : arrinfo->Arr[idx].a;
+}
+
+/**
+ * In parallel runs, the amplitude of an arrival is its lock: it holds
+ * ArrivalBusy while the rest of the arrival is being written, and is written
+ * last. This lets a thread replace the weakest arrival of a full receiver
+ * without tearing an arrival which another thread is still storing.
+ */
+constexpr float ArrivalBusy = -1.0f;
+
+HOST_DEVICE inline int32_t *ArrivalAmpBits(const ArrInfo *arrinfo, size_t idx)
+{
+    return (int32_t *)&ArrivalAmp(arrinfo, idx);
+}
+
+HOST_DEVICE inline int32_t FloatBits(float f)
+{
+    int32_t i;
+    memcpy(&i, &f, sizeof(i));
+    return i;
+}
+
+/**
+ * Stores arr to idx, which the caller has locked (amplitude ArrivalBusy), and
+ * then unlocks it.
+ */
+HOST_DEVICE inline void PublishArrival(
+    const ArrInfo *arrinfo, size_t idx, const Arrival &arr)
+{
+    Arrival busy = arr;
+    busy.a       = ArrivalBusy;
+    StoreArrival(arrinfo, idx, busy);
+    ThreadFence();
+    AtomicExchange(ArrivalAmpBits(arrinfo, idx), FloatBits(arr.a));
+}
+
+/**
+ * For parallel runs: replaces the weakest of the first narr arrivals of the
+ * receiver at base with arr, if arr is stronger, as the single-threaded AddArr
+ * does once a receiver is full. Skips arrivals which other threads are still
+ * writing, and gives up after a few lost races. So which arrivals are kept may
+ * differ slightly from a single-threaded run.
+ */
+HOST_DEVICE inline void ReplaceWeakestArrival(
+    const ArrInfo *arrinfo, size_t base, int32_t narr, const Arrival &arr)
+{
+    const int32_t busyBits = FloatBits(ArrivalBusy);
+    for(int32_t attempt = 0; attempt < 4; ++attempt) {
+        float weakest     = arr.a;
+        int32_t *wkBits   = nullptr;
+        int32_t wkOldBits = 0;
+        size_t wkIdx      = 0;
+        for(int32_t iArr = 0; iArr < narr; ++iArr) {
+            if(arrinfo->ArrChunks != nullptr && iArr % arrinfo->ArrChunkSize == 0) {
+                int32_t chunksPerRcvr = arrinfo->MaxNArr / arrinfo->ArrChunkSize;
+                if(AtomicLoad(&arrinfo->ArrChunks
+                                   [base * (size_t)chunksPerRcvr
+                                    + iArr / arrinfo->ArrChunkSize])
+                   < 0)
+                    break;
+            }
+            size_t i      = ArrivalIndex(arrinfo, base, iArr);
+            int32_t *bits = ArrivalAmpBits(arrinfo, i);
+            int32_t cur   = AtomicLoad(bits);
+            float a;
+            memcpy(&a, &cur, sizeof(a));
+            // Also false for ArrivalBusy and NaN
+            if(a >= 0.0f && a < weakest) {
+                weakest   = a;
+                wkBits    = bits;
+                wkOldBits = cur;
+                wkIdx     = i;
+            }
+        }
+        // arr is weaker than all stored
+        if(wkBits == nullptr) return;
+        if(AtomicCompareExchange(wkBits, wkOldBits, busyBits) == wkOldBits) {
+            PublishArrival(arrinfo, wkIdx, arr);
+            return;
+        }
+    }
+}
+
+/**
+ * Number of arrivals actually stored for the receiver at base. NArr may also
+ * count arrivals which did not fit, and in arena mode, some chunks may be
+ * missing once the arena is full; only the arrivals before the first missing
+ * chunk are kept.
+ */
+HOST_DEVICE inline int32_t NumStoredArrivals(const ArrInfo *arrinfo, size_t base)
+{
+    int32_t narr = bhc::min(arrinfo->NArr[base], arrinfo->MaxNArr);
+    if(arrinfo->ArrChunks != nullptr) {
+        int32_t chunksPerRcvr = arrinfo->MaxNArr / arrinfo->ArrChunkSize;
+        const int32_t *chunks = &arrinfo->ArrChunks[base * (size_t)chunksPerRcvr];
+        for(int32_t c = 0; c * arrinfo->ArrChunkSize < narr; ++c) {
+            if(chunks[c] < 0) return c * arrinfo->ArrChunkSize;
+        }
+    }
+    return narr;
+}
+
 /**
  * Is this the second step of a pair (on the same ray)?
  * If so, we want to combine the arrivals to conserve space.
  * (test this by seeing if the arrival time is close to the previous one)
  * (also need that the phase is about the same to make sure surface and direct paths are
  * not joined)
+ * prevArr is the previous arrival for this receiver, or nullptr if none.
  */
 template<bool R3D> HOST_DEVICE inline bool IsSecondStepOfPair(
-    real omega, real Phase, cpx delay, Arrival *baseArr, int32_t Nt)
+    real omega, real Phase, cpx delay, const Arrival *prevArr)
 {
     // arrivals with essentially the same phase are grouped into one
     const float PhaseTol = /*R3D ? FL(0.5) :*/ FL(0.05); // LP: 0.5 for 2D removed by mbp
                                                          // in 2022 revisions.
-    return Nt >= 1 && omega * STD::abs(delay - Cpxf2Cpx(baseArr[Nt - 1].delay)) < PhaseTol
-        && STD::abs(baseArr[Nt - 1].Phase - Phase) < PhaseTol;
+    return prevArr != nullptr
+        && omega * STD::abs(delay - Cpxf2Cpx(prevArr->delay)) < PhaseTol
+        && STD::abs(prevArr->Phase - Phase) < PhaseTol;
+}
+
+/**
+ * Combines a new arrival which IsSecondStepOfPair into the previous one.
+ */
+HOST_DEVICE inline void MergeArrival(
+    Arrival *prevArr, float Amp, cpxf delay, float SrcDeclAngle, float SrcAzimAngle,
+    float RcvrDeclAngle, float RcvrAzimAngle)
+{
+    // calculate weightings of old ray information vs. new, based on amplitude of
+    // the arrival
+    float AmpTot = prevArr->a + Amp;
+    float w1     = prevArr->a / AmpTot;
+    float w2     = Amp / AmpTot;
+
+    prevArr->delay         = w1 * prevArr->delay + w2 * delay; // weighted sum
+    prevArr->a             = AmpTot;
+    prevArr->SrcDeclAngle  = w1 * prevArr->SrcDeclAngle + w2 * SrcDeclAngle;
+    prevArr->SrcAzimAngle  = w1 * prevArr->SrcAzimAngle + w2 * SrcAzimAngle;
+    prevArr->RcvrDeclAngle = w1 * prevArr->RcvrDeclAngle + w2 * RcvrDeclAngle;
+    prevArr->RcvrAzimAngle = w1 * prevArr->RcvrAzimAngle + w2 * RcvrAzimAngle;
 }
 
 /**
@@ -47,85 +280,84 @@ template<bool R3D> HOST_DEVICE inline void AddArr(
     const RayInitInfo &rinit, real RcvrDeclAngle, real RcvrAzimAngle, int32_t NumTopBnc,
     int32_t NumBotBnc, const ArrInfo *arrinfo, const Position *Pos)
 {
-    size_t base      = GetFieldAddr(rinit.isx, rinit.isy, rinit.isz, itheta, id, ir, Pos);
-    Arrival *baseArr = &arrinfo->Arr[base * arrinfo->MaxNArr];
+    size_t base = GetFieldAddr(rinit.isx, rinit.isy, rinit.isz, itheta, id, ir, Pos);
     int32_t *baseNArr = &arrinfo->NArr[base];
     int32_t Nt;
 
+    Arrival newArr;
+    newArr.a             = (float)Amp;                // amplitude
+    newArr.Phase         = (float)Phase;              // phase
+    newArr.delay         = Cpx2Cpxf(delay);           // delay time
+    newArr.SrcDeclAngle  = (float)rinit.SrcDeclAngle; // launch angle from source
+    newArr.SrcAzimAngle  = (float)rinit.SrcAzimAngle; // launch angle from source
+    newArr.RcvrDeclAngle = (float)RcvrDeclAngle;      // angle ray reaches receiver
+    newArr.RcvrAzimAngle = (float)RcvrAzimAngle;      // angle ray reaches receiver
+    newArr.NTopBnc       = NumTopBnc;                 // Number of top    bounces
+    newArr.NBotBnc       = NumBotBnc;                 //   "       bottom
+
     if(arrinfo->AllowMerging) {
         // LP: BUG: This only checks the last arrival, whereas the first step of the
         // pair could have been placed in previous slots. See the Fortran version readme.
 
         Nt = *baseNArr; // # of arrivals
+        size_t prevIdx = Nt >= 1 ? ArrivalIndex(arrinfo, base, Nt - 1) : 0;
+        Arrival prevArr;
+        if(Nt >= 1) prevArr = LoadArrival(arrinfo, prevIdx);
 
-        if(!IsSecondStepOfPair<R3D>(omega, Phase, delay, baseArr, Nt)) {
-            int32_t iArr;
-            if(Nt >= arrinfo->MaxNArr) { // space not available to add an arrival?
+        // Compared as stored, so that the post-merge of parallel runs, which
+        // only has the stored values, makes the same decisions.
+        if(!IsSecondStepOfPair<R3D>(
+               omega, newArr.Phase, Cpxf2Cpx(newArr.delay),
+               Nt >= 1 ? &prevArr : nullptr)) {
+            // In arena mode, space may also run out before MaxNArr.
+            size_t idx = 0;
+            if(Nt < arrinfo->MaxNArr && ClaimArrival(arrinfo, base, Nt, idx)) {
+                *baseNArr = Nt + 1; // # of arrivals
+            } else {                // space not available to add an arrival?
                 // replace weakest arrival
-                iArr         = -1;
                 real weakest = Amp;
-                for(Nt = 0; Nt < arrinfo->MaxNArr; ++Nt) {
-                    if(baseArr[Nt].a < weakest) {
-                        weakest = baseArr[Nt].a;
-                        iArr    = Nt;
+                bool found   = false;
+                for(int32_t iArr = 0; iArr < Nt; ++iArr) {
+                    size_t i = ArrivalIndex(arrinfo, base, iArr);
+                    if(ArrivalAmp(arrinfo, i) < weakest) {
+                        weakest = ArrivalAmp(arrinfo, i);
+                        idx     = i;
+                        found   = true;
                     }
                 }
-                if(iArr < 0) return; // LP: current arrival is weaker than all stored
-            } else {
-                iArr      = Nt;
-                *baseNArr = Nt + 1; // # of arrivals
+                // current arrival is weaker than all stored
+                if(!found) return;
             }
-            baseArr[iArr].a            = (float)Amp;                // amplitude
-            baseArr[iArr].Phase        = (float)Phase;              // phase
-            baseArr[iArr].delay        = Cpx2Cpxf(delay);           // delay time
-            baseArr[iArr].SrcDeclAngle = (float)rinit.SrcDeclAngle; // launch angle from
-                                                                    // source
-            baseArr[iArr].SrcAzimAngle = (float)rinit.SrcAzimAngle; // launch angle from
-                                                                    // source
-            baseArr[iArr].RcvrDeclAngle = (float)RcvrDeclAngle;     // angle ray reaches
-                                                                    // receiver
-            baseArr[iArr].RcvrAzimAngle = (float)RcvrAzimAngle;     // angle ray reaches
-                                                                    // receiver
-            baseArr[iArr].NTopBnc = NumTopBnc; // Number of top    bounces
-            baseArr[iArr].NBotBnc = NumBotBnc; //   "       bottom
-        } else {                               // not a new ray
+            StoreArrival(arrinfo, idx, newArr);
+        } else { // not a new ray
             // PhaseArr[<base> + Nt-1] = PhaseArr[<base> + Nt-1] // LP: ???
 
-            // calculate weightings of old ray information vs. new, based on amplitude of
-            // the arrival
-            float AmpTot = baseArr[Nt - 1].a + (float)Amp;
-            float w1     = baseArr[Nt - 1].a / AmpTot;
-            float w2     = (float)Amp / AmpTot;
-
-            baseArr[Nt - 1].delay = w1 * baseArr[Nt - 1].delay
-                + w2 * Cpx2Cpxf(delay); // weighted sum
-            baseArr[Nt - 1].a            = AmpTot;
-            baseArr[Nt - 1].SrcDeclAngle = w1 * baseArr[Nt - 1].SrcDeclAngle
-                + w2 * (float)rinit.SrcDeclAngle;
-            baseArr[Nt - 1].SrcAzimAngle = w1 * baseArr[Nt - 1].SrcAzimAngle
-                + w2 * (float)rinit.SrcAzimAngle;
-            baseArr[Nt - 1].RcvrDeclAngle = w1 * baseArr[Nt - 1].RcvrDeclAngle
-                + w2 * (float)RcvrDeclAngle;
-            baseArr[Nt - 1].RcvrAzimAngle = w1 * baseArr[Nt - 1].RcvrAzimAngle
-                + w2 * (float)RcvrAzimAngle;
+            MergeArrival(
+                &prevArr, newArr.a, newArr.delay, newArr.SrcDeclAngle,
+                newArr.SrcAzimAngle, newArr.RcvrDeclAngle, newArr.RcvrAzimAngle);
+            StoreArrival(arrinfo, prevIdx, prevArr);
         }
 
     } else {
         // LP: For multithreading mode, some mutex scheme would be needed to
         // guarantee correct access to previously written data, which would
-        // destroy the performance on GPU. So just write the first
-        // arrinfo->MaxNArr arrivals and give up.
-        Nt = AtomicFetchAdd(baseNArr, 1);
-        if(Nt >= arrinfo->MaxNArr) return;
-        baseArr[Nt].a             = (float)Amp;                // amplitude
-        baseArr[Nt].Phase         = (float)Phase;              // phase
-        baseArr[Nt].delay         = Cpx2Cpxf(delay);           // delay time
-        baseArr[Nt].SrcDeclAngle  = (float)rinit.SrcDeclAngle; // launch angle from source
-        baseArr[Nt].SrcAzimAngle  = (float)rinit.SrcAzimAngle; // launch angle from source
-        baseArr[Nt].RcvrDeclAngle = (float)RcvrDeclAngle; // angle ray reaches receiver
-        baseArr[Nt].RcvrAzimAngle = (float)RcvrAzimAngle; // angle ray reaches receiver
-        baseArr[Nt].NTopBnc       = NumTopBnc;            // Number of top    bounces
-        baseArr[Nt].NBotBnc       = NumBotBnc;            //   "       bottom
+        // destroy the performance on GPU. So just write each arrival to its
+        // own slot, and once the receiver is full, replace the weakest one.
+        // The pairs are merged afterwards by MergeArrivalPairs (mode/arr.cpp).
+        // Lanes of a warp adding to the same receiver share one atomic.
+        Nt = AtomicIncrementWarp(baseNArr);
+        size_t idx;
+        if(Nt >= arrinfo->MaxNArr || !ClaimArrival(arrinfo, base, Nt, idx)) {
+            ReplaceWeakestArrival(
+                arrinfo, base, bhc::min(Nt, arrinfo->MaxNArr), newArr);
+            return;
+        }
+        // The slot's previous contents are stale, unless a thread replacing
+        // the weakest arrival got to it first.
+        if(AtomicExchange(ArrivalAmpBits(arrinfo, idx), FloatBits(ArrivalBusy))
+           == FloatBits(ArrivalBusy))
+            return;
+        PublishArrival(arrinfo, idx, newArr);
     }
 }
 
@@ -73,6 +73,14 @@ template<bool O3D> HOST_DEVICE inline void GetBdrySeg(
 
         int32_t nx = bdinfotb->NPts.x;
         int32_t ny = bdinfotb->NPts.y;
+        // The coordinates are strictly increasing, so the result of the
+        // searches below only depends on x and t, not on where they start.
+        // Starting from the inverse map makes them O(1) instead of O(cells)
+        // when the ray has moved far since the last call.
+        if(bdinfotb->xLookup.iCell != nullptr) {
+            bds.Iseg.x = IntervalGuess(bdinfotb->xLookup, x.x, bds.Iseg.x);
+            bds.Iseg.y = IntervalGuess(bdinfotb->yLookup, x.y, bds.Iseg.y);
+        }
         bds.Iseg.x = bhc::min(bhc::max(bds.Iseg.x, 0), nx - 2);
         bds.Iseg.y = bhc::min(bhc::max(bds.Iseg.y, 0), ny - 2);
         if(t.x >= FL(0.0)) {
@@ -18,16 +18,236 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 */
 #include "common_setup.hpp"
 
+#ifdef BHC_USE_MPI
+#include <mpi.h>
+#endif
+
 static bhc::bhcInit init;
+static bool playbackMode = false;
+static bool serveMode    = false;
+static int mpiRank       = 0;
+
+#ifdef BHC_USE_MPI
+static void discardprt(const char *) {}
+
+/**
+ * MPI builds: every rank runs the program, with field runs split across them
+ * (see bhcInit::mpiDistribute). Only rank 0 writes the print file and the
+ * outputs; -playback and -serve only run on rank 0.
+ */
+struct MPISession {
+    MPISession(int *argc, char ***argv)
+    {
+        MPI_Init(argc, argv);
+        MPI_Comm_rank(MPI_COMM_WORLD, &mpiRank);
+        init.mpiDistribute = true;
+        if(mpiRank != 0) init.prtCallback = discardprt;
+    }
+    ~MPISession() { MPI_Finalize(); }
+};
+#endif
+
+/// Exit code for a failed setup or run. MPI builds abort all the ranks, as the
+/// others may be waiting for this one's share of the outputs.
+static int runfailed()
+{
+#ifdef BHC_USE_MPI
+    MPI_Abort(MPI_COMM_WORLD, 1);
+#endif
+    return 1;
+}
+
+/**
+ * -playback: re-traces the rays in FileRoot.rayinit (written by a run with
+ * -capture) and prints the cost of each one then and now.
+ */
+template<bool O3D, bool R3D> int playbackmain(
+    bhc::bhcParams<O3D> &params, bhc::bhcOutputs<O3D, R3D> &outputs)
+{
+    int32_t n = bhc::read_capture(params, nullptr, nullptr, 0);
+    if(n < 0) return 1;
+    std::vector<bhc::bhcPlaybackRay> rays(n);
+    if(bhc::read_capture(params, nullptr, rays.data(), n) != n) return 1;
+    std::vector<bhc::bhcRayStats> captured(n);
+    for(int32_t r = 0; r < n; ++r) captured[r] = rays[r].stats;
+    if(!bhc::playback<O3D, R3D>(params, outputs, rays.data(), n)) return 1;
+    bhc::bhcPerfCounters counters;
+    bhc::get_perf_counters(params, counters);
+    bhc::finalize<O3D, R3D>(params, outputs);
+    printf("%d rays, cost when captured -> now\n", n);
+    printf("isx isy isz ialpha ibeta: steps influence topRefl botRefl time_us");
+    if(counters.enabled) printf(" | reduced small sspcross bdrysnap");
+    printf("\n");
+    for(int32_t r = 0; r < n; ++r) {
+        const bhc::bhcPlaybackRay &ray = rays[r];
+        const bhc::bhcRayStats &was    = captured[r];
+        printf(
+            "%d %d %d %d %d: %d->%d %d->%d %d->%d %d->%d %.1f->%.1f", ray.init.isx,
+            ray.init.isy, ray.init.isz, ray.init.ialpha, ray.init.ibeta, was.steps,
+            ray.stats.steps, was.influence, ray.stats.influence, was.topRefl,
+            ray.stats.topRefl, was.botRefl, ray.stats.botRefl, was.time, ray.stats.time);
+        if(counters.enabled) {
+            printf(
+                " | %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64,
+                ray.perf[BHC_PERF_REDUCED_STEPS], ray.perf[BHC_PERF_SMALL_STEPS],
+                ray.perf[BHC_PERF_SSP_CROSSINGS], ray.perf[BHC_PERF_BDRY_SNAPS]);
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+/**
+ * -serve: keeps the environment (and its GPU allocations) set up and answers
+ * queries read from stdin, one per line, each of which changes some of the
+ * parameters or runs with them. Every query is answered on stdout by its
+ * results, if any, and then a line "ok" or "error"; the library's messages go
+ * to stderr. Only the preprocessing of what changed is repeated by each run,
+ * e.g. the SSP and boundaries are not, so small queries take milliseconds.
+ *
+ * sx|sy|rr X...: replaces the source x / y coordinates / receiver ranges (km)
+ * sz|rz Z...: replaces the source / receiver depths (m)
+ * theta|alpha|beta A...: replaces the receiver bearings / ray elevation /
+ *     ray bearing angles (degrees)
+ * freq F: nominal frequency (Hz). Attenuation given per wavelength etc. stays
+ *     as converted for the frequency of the environment file.
+ * freqs F...: replaces the frequencies of a broadband run (Hz)
+ * run: runs with the current parameters
+ * field: TL runs: prints "field" and the dimensions of the field of the last
+ *     run (planes, NSz, NSx, NSy, Nfreq, Ntheta, NRz, NRr, outermost first, see
+ *     GetFieldAddr), then the real and imaginary part of each element
+ * write [FileRoot]: writes the output files of the last run
+ * quit
+ */
+static void serveoutput(const char *message) { std::cerr << message << "\n"; }
+
+static void servesetvector(float *dst, const std::vector<double> &v, double scale)
+{
+    for(size_t i = 0; i < v.size(); ++i) dst[i] = (float)(v[i] * scale);
+}
+
+template<bool O3D, bool R3D> int servemain(
+    bhc::bhcParams<O3D> &params, bhc::bhcOutputs<O3D, R3D> &outputs)
+{
+    bhc::Position *Pos = params.Pos;
+    bool fresh         = false; // Outputs are from the current parameters
+    std::string line;
+    while(std::getline(std::cin, line)) {
+        std::istringstream ss(line);
+        std::string cmd, arg;
+        ss >> cmd;
+        if(cmd.empty()) continue;
+        std::vector<double> v;
+        double x;
+        while(ss >> x) v.push_back(x);
+        int32_t n = (int32_t)v.size();
+        bool ok   = true;
+        if(cmd == "quit") {
+            break;
+        } else if(cmd == "sx" && n > 0) {
+            // extsetup_sxsy reallocates both, so keep the other one.
+            std::vector<float> Sy(Pos->Sy, Pos->Sy + Pos->NSy);
+            bhc::extsetup_sxsy(params, n, Pos->NSy);
+            servesetvector(Pos->Sx, v, 1000.0);
+            std::copy(Sy.begin(), Sy.end(), Pos->Sy);
+        } else if(cmd == "sy" && n > 0) {
+            std::vector<float> Sx(Pos->Sx, Pos->Sx + Pos->NSx);
+            bhc::extsetup_sxsy(params, Pos->NSx, n);
+            std::copy(Sx.begin(), Sx.end(), Pos->Sx);
+            servesetvector(Pos->Sy, v, 1000.0);
+        } else if(cmd == "sz" && n > 0) {
+            bhc::extsetup_sz(params, n);
+            servesetvector(Pos->Sz, v, 1.0);
+        } else if(cmd == "rz" && n > 0) {
+            bhc::extsetup_rcvrdepths(params, n);
+            servesetvector(Pos->Rz, v, 1.0);
+        } else if(cmd == "rr" && n > 0) {
+            bhc::extsetup_rcvrranges(params, n);
+            servesetvector(Pos->Rr, v, 1000.0);
+        } else if(cmd == "theta" && n > 0) {
+            bhc::extsetup_rcvrbearings(params, n);
+            servesetvector(Pos->theta, v, 1.0);
+            Pos->thetaDuplRemoved = false;
+        } else if((cmd == "alpha" || cmd == "beta") && n > 0) {
+            bhc::AngleInfo &a = cmd == "alpha" ? params.Angles->alpha
+                                               : params.Angles->beta;
+            if(cmd == "alpha") {
+                bhc::extsetup_rayelevations(params, n);
+            } else {
+                bhc::extsetup_raybearings(params, n);
+            }
+            for(int32_t i = 0; i < n; ++i) a.angles[i] = (bhc::real)v[i];
+            a.inDegrees = true;
+            a.iSingle   = 0;
+        } else if(cmd == "freq" && n == 1) {
+            if(params.freqinfo->Nfreq == 1
+               && params.freqinfo->freqVec[0] == params.freqinfo->freq0) {
+                params.freqinfo->freqVec[0] = (bhc::real)v[0];
+            }
+            params.freqinfo->freq0 = (bhc::real)v[0];
+        } else if(cmd == "freqs" && n > 0) {
+            bhc::extsetup_freqvec(params, n);
+            for(int32_t i = 0; i < n; ++i) params.freqinfo->freqVec[i] = (bhc::real)v[i];
+        } else if(cmd == "run") {
+            ok    = bhc::run<O3D, R3D>(params, outputs);
+            fresh = ok;
+            if(ok) {
+                bhc::bhcTimings timings;
+                bhc::get_timings(params, timings);
+                printf("preprocess %f ms, run %f ms, postprocess %f ms\n",
+                    timings.preprocess, timings.run, timings.postprocess);
+            }
+        } else if(cmd == "field") {
+            ok = fresh && bhc::IsTLRun(params.Beam) && outputs.uAllSources != nullptr;
+            if(ok) {
+                int32_t planes = bhc::GetNumTLPlanes(params);
+                size_t size    = bhc::GetFieldSize(params);
+                printf("field %d %d %d %d %d %d %d %d\n", planes, Pos->NSz, Pos->NSx,
+                    Pos->NSy, bhc::GetNumFieldFreqs(params), Pos->Ntheta,
+                    Pos->NRz_per_range, Pos->NRr);
+                for(size_t i = 0; i < size; ++i) {
+                    printf("%.8g %.8g\n", outputs.uAllSources[i].real(),
+                        outputs.uAllSources[i].imag());
+                }
+            }
+        } else if(cmd == "write") {
+            std::istringstream(line) >> cmd >> arg;
+            ok = fresh
+                && bhc::writeout<O3D, R3D>(
+                     params, outputs, arg.empty() ? nullptr : arg.c_str());
+        } else {
+            ok = false;
+        }
+        if(ok && cmd != "run" && cmd != "field" && cmd != "write") fresh = false;
+        printf(ok ? "ok\n" : "error\n");
+        fflush(stdout);
+    }
+    bhc::finalize<O3D, R3D>(params, outputs);
+    return 0;
+}
 
 template<bool O3D, bool R3D> int mainmain()
 {
     bhc::bhcParams<O3D> params;
     bhc::bhcOutputs<O3D, R3D> outputs;
-    if(!bhc::setup<O3D, R3D>(init, params, outputs)) return 1;
-    if(!bhc::run<O3D, R3D>(params, outputs)) return 1;
+    bhc::bhcTimings timings;
+    if((playbackMode || serveMode) && mpiRank != 0) return 0;
+    if(!bhc::setup<O3D, R3D>(init, params, outputs)) return runfailed();
+    if(playbackMode) return playbackmain<O3D, R3D>(params, outputs);
+    if(serveMode) return servemain<O3D, R3D>(params, outputs);
+    if(!bhc::run<O3D, R3D>(params, outputs)) return runfailed();
+    if(mpiRank != 0) {
+        bhc::finalize<O3D, R3D>(params, outputs);
+        return 0;
+    }
     if(!bhc::writeout<O3D, R3D>(params, outputs, nullptr)) return 1;
+    bhc::get_timings(params, timings);
     bhc::finalize<O3D, R3D>(params, outputs);
+    printf("setup: %f ms\n", timings.setup);
+    printf("Preprocess: %f ms\n", timings.preprocess);
+    printf("Run: %f ms\n", timings.run);
+    printf("Postprocess: %f ms\n", timings.postprocess);
+    printf("writeout: %f ms\n", timings.writeout);
     return 0;
 }
 
@@ -69,13 +289,103 @@ void showhelp(const char *argv0)
            "-copy, -raycopy: Sets the behavior when there is insufficient memory to\n"
            "    allocate the requested number of full-size rays. See "
            "bhcInit::useRayCopyMode\n    in <bhc/structs.hpp> for more details\n"
+           "-pool: Keeps freed memory for reuse by later allocations. See\n"
+           "    bhcInit::poolAllocations in <bhc/structs.hpp>\n"
+           "-compactrays: Ray / eigenray runs: stores only the ray positions and\n"
+           "    bounce counts. The .ray file is lossy: positions are in single\n"
+           "    precision (under 1 cm off at 100 km). See bhcInit::compactRays\n"
+           "-soarays: Ray / eigenray runs: stores each field of the ray points as a\n"
+           "    separate array. See bhcInit::soaRays in <bhc/structs.hpp>\n"
+           "-streamrays: Ray runs: writes each ray to the .ray file as soon as it is\n"
+           "    traced, through a bounded queue. See bhcInit::streamRays\n"
+           "-rayindex: Ray / eigenray runs: also writes a .rayidx index of the rays\n"
+           "    in the .ray file. See bhcInit::rayIndexFile in <bhc/structs.hpp>\n"
+           "-raystats: Field runs: writes the steps, reflections, influence\n"
+           "    evaluations, and time of each ray to a .raystats file. See\n"
+           "    bhcInit::rayStats in <bhc/structs.hpp>\n"
+           "-capture=S[,T]: Field runs: writes the rays which took at least S steps\n"
+           "    (or T microseconds) and the environment to FileRoot_capture.*. See\n"
+           "    bhcInit::captureSteps in <bhc/structs.hpp>\n"
+           "-playback: Re-traces only the rays in FileRoot.rayinit, e.g. with\n"
+           "    FileRoot_capture as FileRoot, and prints the cost of each ray\n"
+           "-serve: Sets up the environment once, then reads queries (new sources,\n"
+           "    receivers, angles, or frequency; run; field; write) from stdin and\n"
+           "    answers them on stdout. See servemain in src/cmdline.cpp\n"
+           "-chunk=N: Number of rays each CPU worker thread claims at a time\n"
+           "-costorder: CPU worker threads trace the steepest (most expensive) rays\n"
+           "    first\n"
+           "-packet=N: Experimental, no speedup measured yet. Each CPU worker thread\n"
+           "    traces N rays (up to 16) together, stepping them in turn. See\n"
+           "    bhcInit::rayPacketSize\n"
+           "-affinity=none|compact|spread: Pins the CPU worker threads to cores. See\n"
+           "    bhcInit::threadAffinity in <bhc/structs.hpp>\n"
+           "-interleave: Spreads the pages of the TL field / arrivals across the\n"
+           "    NUMA nodes of the worker threads. See bhcInit::interleaveOutputs\n"
+           "-streamtl: TL runs: traces, postprocesses, and writes one source at a\n"
+           "    time. See bhcInit::streamTLSources in <bhc/structs.hpp>\n"
+           "-shdc, -shdcz: TL runs: writes the field as a chunked (and compressed)\n"
+           "    .shdc file. See bhcInit::chunkedTLFile in <bhc/structs.hpp>\n"
+           "-packssp: Stores hexahedral (3D) SSPs in a cell-packed layout for faster\n"
+           "    evaluation. See bhcInit::packHexSSP in <bhc/structs.hpp>\n"
+           "-bdrytol=X: Simplifies altimetry / bathymetry files to within X meters\n"
+           "    in depth. See bhcInit::bdryTolerance in <bhc/structs.hpp>\n"
+           "-steptol=X: Enables adaptive ray step size with a local error of about X\n"
+           "    meters per step. Use about 1e-5 to 1e-3; from 0.01, TL gets much less\n"
+           "    accurate. -stepmin=X, -stepmax=X: bounds on the step as multiples of\n"
+           "    deltas. See bhcInit::stepTolerance in <bhc/structs.hpp>\n"
+           "-ampcutoff=X: Stops rays once they are X dB below their initial amplitude\n"
+           "-maxbotbnc=N: Stops rays when they reach the bottom for the (N+1)th time\n"
+           "-adaptfan=N: Eigenray / arrivals runs: refines the launch angle fan N\n"
+           "    times around receivers. See bhcInit::adaptiveFanLevels\n"
+           "-reciprocal: 2D TL / arrivals runs with fewer receiver than source\n"
+           "    depths: traces from the receivers instead. Range-independent 2D\n"
+           "    environments with a full, symmetric launch fan only; other runs with\n"
+           "    fewer receiver depths fail. See bhcInit::reciprocal\n"
+           "-symmetry: Nx2D / 3D TL / arrivals runs in a range-independent\n"
+           "    environment: traces one source position per depth (and in Nx2D one\n"
+           "    bearing) and copies the results. See bhcInit::exploitSymmetry\n"
+           "-slices: Nx2D TL runs: traces each bearing in 2D against the slices of\n"
+           "    the boundaries along it. See bhcInit::radialSlices\n"
+           "-alltl: TL runs: computes and writes the coherent, semi-coherent, and\n"
+           "    incoherent fields from one trace. See bhcInit::allTLTypes\n"
+           "-arrchunk=N: Arrivals runs: stores arrivals in a shared arena in chunks of\n"
+           "    N per receiver. See bhcInit::arrivalsChunkSize in <bhc/structs.hpp>\n"
+           "-arrmax=N: Arena mode: at most N arrivals per receiver (default 1024)\n"
+           "-compactarr, -compactarrdb: Arrivals runs: stores the arrivals (and\n"
+           "    binary arrivals file) in a compact format. The .arr file is lossy:\n"
+           "    angles are in half precision (up to 0.03 degrees off), and with\n"
+           "    -compactarrdb, amplitudes to about 1%. See bhcInit::compactArrivals\n"
 #if BHC_BUILD_CUDA
            "-gpu=N, -device=N: Selects CUDA device N\n"
+           "-gpus=N,M,...: Splits field runs across CUDA devices N, M, ...\n"
+           "-noprefetch: Lets the GPU page fault data in and out instead of migrating\n"
+           "    it explicitly. See bhcInit::prefetchMemory in <bhc/structs.hpp>\n"
+           "-blocksize=N, -blockspersm=N: CUDA launch configuration for field runs\n"
+           "-autotune: Times a few CUDA launch configurations on the first rays and\n"
+           "    uses the fastest. See bhcInit::autoTuneLaunch in <bhc/structs.hpp>\n"
+           "-tilerays: Traces tiles of neighboring launch angles together in each\n"
+           "    warp. See bhcInit::cudaTileRays in <bhc/structs.hpp>\n"
+           "-jobqueue: Warps claim rays dynamically instead of in a fixed order.\n"
+           "    See bhcInit::cudaJobQueue in <bhc/structs.hpp>\n"
+           "-fieldtile=N: TL runs: each block sums the field near its rays' source\n"
+           "    in a tile of N cells in shared memory. See bhcInit::cudaFieldTile\n"
+           "-hitstage=N: Eigenray runs: each block stages up to N eigenray hits in\n"
+           "    shared memory. See bhcInit::cudaHitStage in <bhc/structs.hpp>\n"
+#endif
+#ifdef BHC_USE_MPI
+           "Run with mpirun to split TL and arrivals runs across the MPI ranks; rank 0\n"
+           "    writes the outputs. See bhcInit::mpiDistribute in <bhc/structs.hpp>\n"
 #endif
            "-mem=X, -memory=X: Sets the amount of memory " BHC_PROGRAMNAME
            " should use.\n"
            "    X may have a wide range of suffixes, examples: 16GiB, 8M, 100000kB\n"
            "    non-examples: 4gI, 2m, 5.3G. Default: 4GiB\n"
+           "-envcache=path/to/dir: Caches the preprocessed environment in this\n"
+           "    directory, and loads it instead of reading the input files if they\n"
+           "    are unchanged. See bhcInit::envCacheDir in <bhc/structs.hpp>\n"
+           "-checkpoint=path/to/file: TL and arrivals runs: saves progress to this\n"
+           "    file and resumes from it if it exists. See bhcInit::checkpointFile\n"
+           "-checkpointevery=S: Saves the checkpoint every S seconds (default 600)\n"
            "-writeenv=\"path/to/newFileRoot\": For testing purposes, writes out\n"
            "    a copy of all the input data read from the environment file etc.\n"
            "    to a new environment file and other data files. Does not run the\n"
@@ -84,8 +394,14 @@ void showhelp(const char *argv0)
 
 int main(int argc, char **argv)
 {
+#ifdef BHC_USE_MPI
+    MPISession mpi(&argc, &argv);
+#endif
     int dimmode = BHC_DIM_ONLY;
     std::string FileRoot;
+    std::string envCacheDir;
+    std::string checkpointFile;
+    std::vector<int> gpuList;
     for(int32_t i = 1; i < argc; ++i) {
         std::string s = argv[i];
         if(argv[i][0] == '-') {
@@ -102,6 +418,57 @@ int main(int argc, char **argv)
                 dimmode = 3;
             } else if(s == "-copy" || s == "-raycopy") {
                 init.useRayCopyMode = true;
+            } else if(s == "-pool") {
+                init.poolAllocations = true;
+            } else if(s == "-compactarr") {
+                init.compactArrivals = true;
+            } else if(s == "-compactarrdb") {
+                init.compactArrivals   = true;
+                init.compactArrivalsdB = true;
+            } else if(s == "-compactrays") {
+                init.compactRays = true;
+            } else if(s == "-soarays") {
+                init.soaRays = true;
+            } else if(s == "-streamrays") {
+                init.streamRays = true;
+            } else if(s == "-rayindex") {
+                init.rayIndexFile = true;
+            } else if(s == "-raystats") {
+                init.rayStatsFile = true;
+            } else if(s == "-playback") {
+                playbackMode = true;
+            } else if(s == "-serve") {
+                serveMode           = true;
+                init.outputCallback = serveoutput;
+            } else if(s == "-reciprocal") {
+                init.reciprocal = true;
+            } else if(s == "-symmetry") {
+                init.exploitSymmetry = true;
+            } else if(s == "-slices") {
+                init.radialSlices = true;
+            } else if(s == "-alltl") {
+                init.allTLTypes = true;
+            } else if(s == "-costorder") {
+                init.orderJobsByCost = true;
+            } else if(s == "-interleave") {
+                init.interleaveOutputs = true;
+            } else if(s == "-streamtl") {
+                init.streamTLSources = true;
+            } else if(s == "-shdc") {
+                init.chunkedTLFile = true;
+            } else if(s == "-shdcz") {
+                init.chunkedTLFile  = true;
+                init.compressTLFile = true;
+            } else if(s == "-packssp") {
+                init.packHexSSP = true;
+            } else if(s == "-noprefetch") {
+                init.prefetchMemory = false;
+            } else if(s == "-autotune") {
+                init.autoTuneLaunch = true;
+            } else if(s == "-tilerays") {
+                init.cudaTileRays = true;
+            } else if(s == "-jobqueue") {
+                init.cudaJobQueue = true;
             } else if(s == "-?" || s == "-h" || s == "-help") {
                 showhelp(argv[0]);
                 return 0;
@@ -122,6 +489,172 @@ int main(int argc, char **argv)
                         return 1;
                     }
                     init.gpuIndex = std::stoi(value);
+                } else if(key == "-gpus" || key == "-devices") {
+                    gpuList.clear();
+                    size_t start = 0;
+                    while(true) {
+                        size_t comma    = value.find(",", start);
+                        std::string gpu = value.substr(
+                            start, comma == std::string::npos ? comma : comma - start);
+                        if(!bhc::isInt(gpu, false)) {
+                            std::cout << "Value \"" << value
+                                      << "\" for --gpus argument is invalid, try "
+                                      << argv[0] << " --help\n";
+                            return 1;
+                        }
+                        gpuList.push_back(std::stoi(gpu));
+                        if(comma == std::string::npos) break;
+                        start = comma + 1;
+                    }
+                    init.gpuIndices = gpuList.data();
+                    init.numGPUs    = (int32_t)gpuList.size();
+                } else if(key == "-blocksize" || key == "-blockspersm") {
+                    if(!bhc::isInt(value, false) || std::stoi(value) <= 0) {
+                        std::cout << "Value \"" << value << "\" for -" << key
+                                  << " argument is invalid, try " << argv[0]
+                                  << " --help\n";
+                        return 1;
+                    }
+                    if(key == "-blocksize") {
+                        init.cudaBlockSize = std::stoi(value);
+                    } else {
+                        init.cudaBlocksPerSM = std::stoi(value);
+                    }
+                } else if(key == "-fieldtile") {
+                    if(!bhc::isInt(value, false) || std::stoi(value) > 6144) {
+                        std::cout << "Value \"" << value << "\" for -" << key
+                                  << " argument is invalid, try " << argv[0]
+                                  << " --help\n";
+                        return 1;
+                    }
+                    init.cudaFieldTile = std::stoi(value);
+                } else if(key == "-hitstage") {
+                    if(!bhc::isInt(value, false) || std::stoi(value) > 1024) {
+                        std::cout << "Value \"" << value << "\" for -" << key
+                                  << " argument is invalid, try " << argv[0]
+                                  << " --help\n";
+                        return 1;
+                    }
+                    init.cudaHitStage = std::stoi(value);
+                } else if(key == "-affinity") {
+                    if(value == "none") {
+                        init.threadAffinity = 'N';
+                    } else if(value == "compact") {
+                        init.threadAffinity = 'C';
+                    } else if(value == "spread") {
+                        init.threadAffinity = 'S';
+                    } else {
+                        std::cout << "Value \"" << value
+                                  << "\" for --affinity argument is invalid, try "
+                                  << argv[0] << " --help\n";
+                        return 1;
+                    }
+                } else if(key == "-chunk") {
+                    if(!bhc::isInt(value, false) || std::stoi(value) <= 0) {
+                        std::cout << "Value \"" << value
+                                  << "\" for --chunk argument is invalid, try "
+                                  << argv[0] << " --help\n";
+                        return 1;
+                    }
+                    init.jobChunkSize = std::stoi(value);
+                } else if(key == "-packet") {
+                    if(!bhc::isInt(value, false) || std::stoi(value) <= 0) {
+                        std::cout << "Value \"" << value
+                                  << "\" for --packet argument is invalid, try "
+                                  << argv[0] << " --help\n";
+                        return 1;
+                    }
+                    init.rayPacketSize = std::stoi(value);
+                } else if(key == "-steptol" || key == "-stepmin" || key == "-stepmax") {
+                    if(!bhc::isReal(value) || std::stod(value) < 0.0) {
+                        std::cout << "Value \"" << value << "\" for -" << key
+                                  << " argument is invalid, try " << argv[0]
+                                  << " --help\n";
+                        return 1;
+                    }
+                    if(key == "-steptol") {
+                        init.stepTolerance = (bhc::real)std::stod(value);
+                    } else if(key == "-stepmin") {
+                        init.stepMinFactor = (bhc::real)std::stod(value);
+                    } else {
+                        init.stepMaxFactor = (bhc::real)std::stod(value);
+                    }
+                } else if(key == "-capture") {
+                    size_t comma      = value.find(",");
+                    std::string steps = value.substr(0, comma);
+                    std::string time  = "0";
+                    if(comma != std::string::npos) time = value.substr(comma + 1);
+                    if(!bhc::isInt(steps, false) || !bhc::isReal(time)
+                       || std::stod(time) < 0.0) {
+                        std::cout << "Value \"" << value
+                                  << "\" for --capture argument is invalid, try "
+                                  << argv[0] << " --help\n";
+                        return 1;
+                    }
+                    init.captureSteps = std::stoi(steps);
+                    init.captureTime  = (float)std::stod(time);
+                } else if(key == "-bdrytol") {
+                    if(!bhc::isReal(value) || std::stod(value) < 0.0) {
+                        std::cout << "Value \"" << value
+                                  << "\" for --bdrytol argument is invalid, try "
+                                  << argv[0] << " --help\n";
+                        return 1;
+                    }
+                    init.bdryTolerance = (bhc::real)std::stod(value);
+                } else if(key == "-ampcutoff") {
+                    if(!bhc::isReal(value) || std::stod(value) < 0.0) {
+                        std::cout << "Value \"" << value
+                                  << "\" for --ampcutoff argument is invalid, try "
+                                  << argv[0] << " --help\n";
+                        return 1;
+                    }
+                    init.rayAmpCutoffdB = (bhc::real)std::stod(value);
+                } else if(key == "-maxbotbnc") {
+                    if(!bhc::isInt(value, false)) {
+                        std::cout << "Value \"" << value
+                                  << "\" for --maxbotbnc argument is invalid, try "
+                                  << argv[0] << " --help\n";
+                        return 1;
+                    }
+                    init.maxBottomBounces = std::stoi(value);
+                } else if(key == "-adaptfan") {
+                    if(!bhc::isInt(value, false)) {
+                        std::cout << "Value \"" << value
+                                  << "\" for --adaptfan argument is invalid, try "
+                                  << argv[0] << " --help\n";
+                        return 1;
+                    }
+                    init.adaptiveFanLevels = std::stoi(value);
+                } else if(key == "-arrchunk") {
+                    if(!bhc::isInt(value, false)) {
+                        std::cout << "Value \"" << value
+                                  << "\" for --arrchunk argument is invalid, try "
+                                  << argv[0] << " --help\n";
+                        return 1;
+                    }
+                    init.arrivalsChunkSize = std::stoi(value);
+                } else if(key == "-arrmax") {
+                    if(!bhc::isInt(value, false)) {
+                        std::cout << "Value \"" << value
+                                  << "\" for --arrmax argument is invalid, try "
+                                  << argv[0] << " --help\n";
+                        return 1;
+                    }
+                    init.arrivalsMaxPerRcvr = std::stoi(value);
+                } else if(key == "-envcache") {
+                    envCacheDir      = value;
+                    init.envCacheDir = envCacheDir.c_str();
+                } else if(key == "-checkpoint") {
+                    checkpointFile      = value;
+                    init.checkpointFile = checkpointFile.c_str();
+                } else if(key == "-checkpointevery") {
+                    if(!bhc::isReal(value) || std::stod(value) < 0.0) {
+                        std::cout << "Value \"" << value
+                                  << "\" for --checkpointevery argument is invalid, try "
+                                  << argv[0] << " --help\n";
+                        return 1;
+                    }
+                    init.checkpointInterval = std::stod(value);
                 } else if(key == "-mem" || key == "-memory") {
                     size_t multiplier = 1u;
                     size_t base       = 1000u;
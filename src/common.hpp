@@ -39,7 +39,9 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #include <cinttypes>
 #include <cstdarg>
 #include <chrono>
+#include <map>
 #include <thread>
+#include <exception>
 
 #define GLM_FORCE_EXPLICIT_CTOR 1
 #include <glm/common.hpp>
@@ -131,6 +133,19 @@ namespace bhc {
 #define bail() throw std::runtime_error("bhc::bail()")
 #endif
 
+/**
+ * Load through the read-only (texture) data cache on the GPU. Only for data
+ * which is not modified during the run.
+ */
+template<typename T> HOST_DEVICE inline T LoadReadOnly(const T *ptr)
+{
+#ifdef __CUDA_ARCH__
+    return __ldg(ptr);
+#else
+    return *ptr;
+#endif
+}
+
 #ifdef _MSC_VER
 #define CPU_NOINLINE __declspec(noinline)
 #else
@@ -202,6 +217,76 @@ HOST_DEVICE constexpr inline cpx Cpxf2Cpx(const cpxf &c)
 {
     return cpx((real)c.real(), (real)c.imag());
 }
+HOST_DEVICE constexpr inline cpx Cpxacc2Cpx(const cpxacc &c)
+{
+    return cpx((real)c.real(), (real)c.imag());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Half precision
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * IEEE binary16 bit pattern of f, rounded to nearest even. Done in integer
+ * arithmetic so it is the same on host and device and needs no half type.
+ */
+HOST_DEVICE inline uint16_t FloatToHalf(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(float));
+    uint32_t sign = (x >> 16) & 0x8000u;
+    uint32_t absx = x & 0x7FFFFFFFu;
+    if(absx >= 0x7F800000u) {
+        // Inf or NaN
+        return (uint16_t)(sign | 0x7C00u | (absx > 0x7F800000u ? 0x200u : 0u));
+    }
+    if(absx < 0x38800000u) {
+        // Subnormal in half precision, or zero
+        if(absx < 0x33000000u) return (uint16_t)sign;
+        uint32_t e     = absx >> 23;
+        uint32_t m     = (absx & 0x7FFFFFu) | 0x800000u;
+        uint32_t shift = 126u - e;
+        uint32_t h     = m >> shift;
+        uint32_t rem   = m & ((1u << shift) - 1u);
+        uint32_t mid   = 1u << (shift - 1u);
+        if(rem > mid || (rem == mid && (h & 1u))) ++h;
+        return (uint16_t)(sign | h);
+    }
+    // Rounding up may carry into the exponent, and out of range to Inf,
+    // which is the correct result in both cases.
+    uint32_t h   = (absx - 0x38000000u) >> 13;
+    uint32_t rem = absx & 0x1FFFu;
+    if(rem > 0x1000u || (rem == 0x1000u && (h & 1u))) ++h;
+    if(h > 0x7C00u) h = 0x7C00u;
+    return (uint16_t)(sign | h);
+}
+
+/// Inverse of FloatToHalf (exact).
+HOST_DEVICE inline float HalfToFloat(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000u) << 16;
+    uint32_t e    = (h >> 10) & 0x1Fu;
+    uint32_t m    = h & 0x3FFu;
+    uint32_t x;
+    if(e == 0x1Fu) {
+        x = sign | 0x7F800000u | (m << 13);
+    } else if(e != 0u) {
+        x = sign | ((e + 112u) << 23) | (m << 13);
+    } else if(m == 0u) {
+        x = sign;
+    } else {
+        // Subnormal, normalize
+        e = 113u;
+        while((m & 0x400u) == 0u) {
+            m <<= 1;
+            --e;
+        }
+        x = sign | (e << 23) | ((m & 0x3FFu) << 13);
+    }
+    float f;
+    memcpy(&f, &x, sizeof(float));
+    return f;
+}
 
 // CUDA::std::cpx<double> and glm::mat2x2 do not like operators being applied
 // with float literals, due to template type deduction issues.
@@ -226,6 +311,47 @@ HOST_DEVICE inline cpx operator/(float a, const cpx &b) { return (double)a / b;
 HOST_DEVICE inline mat2x2 operator*(float a, const mat2x2 &b) { return (double)a * b; }
 #endif
 
+#ifdef BHC_USE_MIXED_PRECISION
+// Accumulated quantities (double) combined with ray quantities (float).
+// Done in double, so the accumulated value does not lose precision.
+HOST_DEVICE constexpr inline cpxacc operator+(const cpxacc &a, const cpx &b)
+{
+    return cpxacc(a.real() + (double)b.real(), a.imag() + (double)b.imag());
+}
+HOST_DEVICE constexpr inline cpxacc operator-(const cpxacc &a, const cpx &b)
+{
+    return cpxacc(a.real() - (double)b.real(), a.imag() - (double)b.imag());
+}
+HOST_DEVICE constexpr inline cpxacc operator+(const cpxacc &a, float b)
+{
+    return cpxacc(a.real() + (double)b, a.imag());
+}
+HOST_DEVICE constexpr inline cpxacc operator*(float a, const cpxacc &b)
+{
+    return cpxacc((double)a * b.real(), (double)a * b.imag());
+}
+HOST_DEVICE constexpr inline cpxacc operator*(const cpxacc &a, float b)
+{
+    return cpxacc(a.real() * (double)b, a.imag() * (double)b);
+}
+#endif
+
+/**
+ * STD::exp(-J * arg), where the real part of arg is a phase in radians. With
+ * BHC_USE_MIXED_PRECISION, that phase is reduced to [-pi, pi] in double before
+ * the float exponential, so only the reduced phase is rounded to float.
+ */
+HOST_DEVICE inline cpx ExpMinusJ(const cpxacc &arg)
+{
+#ifdef BHC_USE_MIXED_PRECISION
+    constexpr double TwoPi = 2.0 * M_PI;
+    double re = arg.real() - TwoPi * STD::floor(arg.real() / TwoPi + 0.5);
+    return STD::exp(-J * cpx((real)re, (real)arg.imag()));
+#else
+    return STD::exp(-J * arg);
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Misc math
 ////////////////////////////////////////////////////////////////////////////////
@@ -378,20 +504,74 @@ template<bool O3D> HOST_DEVICE inline bool GetJobIndices(
     return (rinit.isz < Pos->NSz);
 }
 
+/// Size in launch angles of the tiles of rays for bhcInit::cudaTileRays.
+constexpr int32_t RayTileAlpha = 8, RayTileBeta = 4;
+
+/**
+ * Remaps a job so that consecutive jobs cover RayTileAlpha x RayTileBeta tiles
+ * of (alpha, beta) rather than rows of alpha, see bhcInit::cudaTileRays. Jobs
+ * are only permuted within each source. The tiles at the high-alpha and
+ * high-beta edges of the fan are narrower, so this is a permutation for any
+ * fan size.
+ */
+template<bool O3D> HOST_DEVICE inline int32_t TileRayJob(
+    int32_t job, const AnglesStructure *Angles)
+{
+    if constexpr(!O3D) {
+        return job;
+    } else {
+        if(Angles->alpha.iSingle >= 1 || Angles->beta.iSingle >= 1) return job;
+        int32_t na = Angles->alpha.n, nb = Angles->beta.n;
+        int32_t nRays = na * nb;
+        int32_t src = job / nRays, k = job % nRays;
+        // Rows b0 to b0 + h - 1 of beta
+        int32_t b0 = (k / (na * RayTileBeta)) * RayTileBeta;
+        int32_t h  = bhc::min(RayTileBeta, nb - b0);
+        k -= b0 * na;
+        // Columns a0 to a0 + w - 1 of alpha within those rows
+        int32_t a0 = (k / (RayTileAlpha * h)) * RayTileAlpha;
+        int32_t w  = bhc::min(RayTileAlpha, na - a0);
+        k -= a0 * h;
+        return src * nRays + (b0 + k / w) * na + (a0 + k % w);
+    }
+}
+
+/**
+ * Index into the field (uAllSources) or arrivals. For broadband TL runs, the
+ * field has Nfreq frequencies (see GetNumFieldFreqs), which are inside the
+ * source indices so that each source's part of the field is contiguous.
+ */
 HOST_DEVICE inline size_t GetFieldAddr(
     int32_t isx, int32_t isy, int32_t isz, int32_t itheta, int32_t id, int32_t ir,
-    const Position *Pos)
+    const Position *Pos, int32_t ifreq = 0, int32_t Nfreq = 1)
 {
     // clang-format off
-    return (((((size_t)isz
+    return ((((((size_t)isz
         * (size_t)Pos->NSx + (size_t)isx)
         * (size_t)Pos->NSy + (size_t)isy)
+        * (size_t)Nfreq + (size_t)ifreq)
         * (size_t)Pos->Ntheta + (size_t)itheta)
         * (size_t)Pos->NRz_per_range + (size_t)id)
         * (size_t)Pos->NRr + (size_t)ir;
     // clang-format on
 }
 
+/// Number of elements in the field (uAllSources), see GetFieldAddr.
+HOST_DEVICE inline size_t GetFieldSize(const Position *Pos, int32_t Nfreq = 1)
+{
+    return (size_t)Pos->NSz * (size_t)Pos->NSx * (size_t)Pos->NSy * (size_t)Nfreq
+        * (size_t)Pos->Ntheta * (size_t)Pos->NRz_per_range * (size_t)Pos->NRr;
+}
+
+/**
+ * Broadband run (TopOpt[5] == 'B'): TL runs compute the field for every
+ * frequency in freqVec from a single trace of the rays.
+ */
+HOST_DEVICE inline bool IsBroadbandRun(const BdryType *Bdry)
+{
+    return Bdry->Top.hs.Opt[5] == 'B';
+}
+
 std::ostream &operator<<(std::ostream &s, const vec2 &v);
 
 } // namespace bhc
@@ -400,6 +580,8 @@ std::ostream &operator<<(std::ostream &s, const vec2 &v);
 #include "util/errors.hpp"
 #include "util/prtfileemu.hpp"
 #include "util/timing.hpp"
+#include "util/jobsched.hpp"
+#include "util/threadpool.hpp"
 #include "runtype.hpp"
 #undef _BHC_INCLUDING_COMPONENTS_
 
@@ -409,36 +591,199 @@ namespace bhc {
 // Internal
 ////////////////////////////////////////////////////////////////////////////////
 
+inline std::vector<int> GetGPUList(const bhcInit &init)
+{
+    if(init.numGPUs <= 1 || init.gpuIndices == nullptr) return {init.gpuIndex};
+    return std::vector<int>(init.gpuIndices, init.gpuIndices + init.numGPUs);
+}
+
+/// Memory from trackallocate with one description, see bhc::get_memory_usage.
+struct MemoryUse {
+    size_t current;
+    size_t peak;
+    uint64_t allocations;
+};
+
 struct bhcInternal {
     void (*outputCallback)(const char *message);
     void (*completedCallback)();
     std::string FileRoot;
+    std::string envCacheDir;
+    std::string checkpointFile;
+    double checkpointInterval;
     PrintFileEmu PRTFile;
-    std::atomic<int32_t> sharedJobID;
-    int gpuIndex, d_multiprocs; // d_warp, d_maxthreads
+    JobScheduler jobSched;
+    std::vector<int> gpuIndices;   // First is the primary GPU
+    std::vector<int> d_multiprocs; // Per GPU; d_warp, d_maxthreads
+    std::vector<std::string> d_names;
+    bool prefetchMemory;
+    int32_t cudaBlockSize;
+    int32_t cudaBlocksPerSM;
+    bool autoTuneLaunch;
+    bool cudaKernelReport;
+    bool cudaTileRays;
+    bool cudaJobQueue;
+    int32_t cudaFieldTile;
+    int32_t cudaHitStage;
+    bool mpiDistribute;
+#ifdef BHC_BUILD_CUDA
+    /// All trackallocate allocations and their sizes, for prefetching.
+    std::map<const void *, size_t> allocations;
+#endif
     int32_t numThreads;
+    int32_t jobChunkSize;
+    bool orderJobsByCost;
+    int32_t rayPacketSize;
+    char threadAffinity;
+    bool interleaveOutputs;
     size_t maxMemory;
     size_t usedMemory;
+    size_t peakMemory; // See bhc::get_peak_memory
+    /// By trackallocate description. Entries are never removed, as each
+    /// tracked block points to the entry it is counted in.
+    std::map<std::string, MemoryUse> memoryUse;
+    /// See bhcInit::poolAllocations. Freed blocks, including their size info,
+    /// by size class.
+    bool poolAllocations;
+    std::map<uint64_t, std::vector<uint64_t *>> allocPool;
+    size_t pooledMemory;
     bool useRayCopyMode;
+    bool compactRays;
+    bool soaRays;
+    bool streamRays;
+    int32_t streamRaysQueueDepth;
+    void (*rayCallback)(
+        real alpha0, int32_t Nsteps, int32_t NumTopBnc, int32_t NumBotBnc,
+        const real *x);
+    bool rayIndexFile;
+    bool rayStats, rayStatsFile; // See bhcInit::rayStats
+    int32_t captureSteps;        // See bhcInit::captureSteps
+    float captureTime;
+    bool streamTLSources;
+    bool chunkedTLFile, compressTLFile;
+    bool packHexSSP;
+    real bdryTolerance;
+    real stepTolerance, stepMinFactor, stepMaxFactor;
+    real rayAmpCutoffdB;
+    int32_t maxBottomBounces;
+    int32_t adaptiveFanLevels;
+    bool reciprocal;
+    bool exploitSymmetry;
+    bool radialSlices;
+    bool allTLTypes;
+    int32_t arrivalsChunkSize, arrivalsMaxPerRcvr;
+    bool compactArrivals, compactArrivalsdB;
+    // Caller-owned output memory, see bhc::set_output_buffers; nullptr if
+    // none. fieldIsUser / arrivalsIsUser say whether the outputs currently
+    // point to it, so that it is never passed to trackdeallocate.
+    cpxf *userField;
+    size_t userFieldCount;
+    void *userArrivals;
+    size_t userArrivalsBytes;
+    bool fieldIsUser, arrivalsIsUser;
+    // Elevation fan from the environment file while an adaptive fan is in
+    // use, see bhcInit::adaptiveFanLevels.
+    real *origAlphaAngles;
+    int32_t origAlphaN;
+    real origAlphaD;
+    // Whether the current run has swapped the source and receiver depths,
+    // see bhcInit::reciprocal.
+    bool reciprocalActive;
+    // Whether the current run traces only one source position per depth
+    // (and bearing), and the counts it replaced, see bhcInit::exploitSymmetry.
+    bool symmetryActive;
+    int32_t origNSx, origNSy, origNtheta, origBetaSingle;
+    // Rays kept from the last field run, see bhcInit::retainRays. The
+    // points (rayPt) of all the rays back to back, and where each job's ray
+    // starts and how many points it has. retainedRayKey is a hash of all the
+    // inputs the rays depend on, 0 if no rays are kept.
+    bool retainRays;
+    char *retainedRayMem;
+    size_t *retainedRayStart;
+    int32_t *retainedRayN;
+    uint64_t retainedRayKey;
     bool noEnvFil;
+    bool blocking;
     uint8_t dim;
     std::atomic<int32_t> totalJobs;
-    std::atomic<int32_t> activeThreadCount;
     std::atomic<int32_t> completedRayCount;
+    std::atomic<bool> asyncRunFailed;
     ErrState errState;
+    bhcPerfCounters perfCounters; // See bhc::get_perf_counters
+    bhcTimings timings;           // See bhc::get_timings
+    ThreadPool threadPool;
+    std::string traceFile; // See bhcInit::traceFile, empty if not tracing
+    ExecTrace execTrace;
+    std::thread runThread; // Non-blocking run(), see WaitForRun
+    // bhc::run_pipelined. pipeOutputs is the second set of outputs (a
+    // bhcOutputs<O3D, R3D>), nullptr if the pipeline is not in use;
+    // pipeParams the copy of the params (a mode::PipelineParams<O3D>) the
+    // results in it are being written out with by pipeThread, and
+    // pipeHeldMemory the tracked memory they hold meanwhile.
+    void *pipeOutputs;
+    void *pipeParams;
+    size_t pipeHeldMemory;
+    std::thread pipeThread;
+    std::exception_ptr pipeError;
 
     bhcInternal(const bhcInit &init, bool o3d, bool r3d)
         : outputCallback(init.outputCallback), completedCallback(init.completedCallback),
           FileRoot(
               init.FileRoot == nullptr ? "error_incorrect_use_of_" BHC_PROGRAMNAME
                                        : init.FileRoot),
-          PRTFile(this, this->FileRoot, init.prtCallback), gpuIndex(init.gpuIndex),
-          numThreads(ModifyNumThreads(init.numThreads)), maxMemory(init.maxMemory),
-          usedMemory(0), useRayCopyMode(init.useRayCopyMode),
-          noEnvFil(init.FileRoot == nullptr), dim(r3d       ? 3
-                                                      : o3d ? 4
-                                                            : 2),
-          totalJobs(1), activeThreadCount(0), completedRayCount(0)
+          envCacheDir(init.envCacheDir == nullptr ? "" : init.envCacheDir),
+          checkpointFile(init.checkpointFile == nullptr ? "" : init.checkpointFile),
+          checkpointInterval(init.checkpointInterval),
+          PRTFile(this, this->FileRoot, init.prtCallback), gpuIndices(GetGPUList(init)),
+          prefetchMemory(init.prefetchMemory), cudaBlockSize(init.cudaBlockSize),
+          cudaBlocksPerSM(init.cudaBlocksPerSM), autoTuneLaunch(init.autoTuneLaunch),
+          cudaKernelReport(init.cudaKernelReport), cudaTileRays(init.cudaTileRays),
+          cudaJobQueue(init.cudaJobQueue), cudaFieldTile(init.cudaFieldTile),
+          cudaHitStage(init.cudaHitStage), mpiDistribute(init.mpiDistribute),
+          numThreads(ModifyNumThreads(init.numThreads)), jobChunkSize(init.jobChunkSize),
+          orderJobsByCost(init.orderJobsByCost),
+          rayPacketSize(bhc::max(1, bhc::min(init.rayPacketSize, 16))),
+          threadAffinity(init.threadAffinity),
+          interleaveOutputs(init.interleaveOutputs), maxMemory(init.maxMemory),
+          usedMemory(0), peakMemory(0), poolAllocations(init.poolAllocations),
+          pooledMemory(0), useRayCopyMode(init.useRayCopyMode),
+          compactRays(init.compactRays), soaRays(init.soaRays),
+          streamRays(init.streamRays), streamRaysQueueDepth(init.streamRaysQueueDepth),
+          rayCallback(init.rayCallback), rayIndexFile(init.rayIndexFile),
+          rayStats(
+              init.rayStats || init.rayStatsFile || init.captureSteps > 0
+              || init.captureTime > 0.0f),
+          rayStatsFile(init.rayStatsFile), captureSteps(init.captureSteps),
+          captureTime(init.captureTime),
+          streamTLSources(init.streamTLSources),
+          chunkedTLFile(init.chunkedTLFile || init.compressTLFile),
+          compressTLFile(init.compressTLFile), packHexSSP(init.packHexSSP),
+          bdryTolerance(init.bdryTolerance),
+          stepTolerance(init.stepTolerance), stepMinFactor(init.stepMinFactor),
+          stepMaxFactor(init.stepMaxFactor),
+          rayAmpCutoffdB(init.rayAmpCutoffdB), maxBottomBounces(init.maxBottomBounces),
+          adaptiveFanLevels(init.adaptiveFanLevels), reciprocal(init.reciprocal),
+          exploitSymmetry(init.exploitSymmetry),
+          radialSlices(init.radialSlices), allTLTypes(init.allTLTypes),
+          arrivalsChunkSize(init.arrivalsChunkSize),
+          arrivalsMaxPerRcvr(init.arrivalsMaxPerRcvr),
+          compactArrivals(init.compactArrivals || init.compactArrivalsdB),
+          compactArrivalsdB(init.compactArrivalsdB), userField(nullptr),
+          userFieldCount(0), userArrivals(nullptr), userArrivalsBytes(0),
+          fieldIsUser(false), arrivalsIsUser(false), origAlphaAngles(nullptr),
+          origAlphaN(0), origAlphaD(RL(0.0)), reciprocalActive(false),
+          symmetryActive(false), origNSx(1), origNSy(1), origNtheta(1),
+          origBetaSingle(0),
+          retainRays(init.retainRays),
+          retainedRayMem(nullptr), retainedRayStart(nullptr), retainedRayN(nullptr),
+          retainedRayKey(0),
+          noEnvFil(init.FileRoot == nullptr), blocking(init.blocking),
+          dim(r3d ? 3 : o3d ? 4 : 2), totalJobs(1), completedRayCount(0),
+          asyncRunFailed(false), perfCounters(), timings(),
+          threadPool(numThreads, init.threadAffinity),
+          traceFile(init.traceFile == nullptr ? "" : init.traceFile),
+          execTrace(numThreads, init.traceFile == nullptr ? 0 : init.traceBufferEvents),
+          pipeOutputs(nullptr), pipeParams(nullptr), pipeHeldMemory(0)
     {}
 };
 
@@ -447,4 +792,89 @@ template<bool O3D> inline bhcInternal *GetInternal(const bhcParams<O3D> &params)
     return reinterpret_cast<bhcInternal *>(params.internal);
 }
 
+/**
+ * Waits for a non-blocking run() to complete, if one is in progress. Must be
+ * called before anything which uses the outputs or modifies the params.
+ */
+inline void WaitForRun(bhcInternal *internal)
+{
+    if(internal->runThread.joinable()) internal->runThread.join();
+}
+
+/// Number of frequencies in the TL field, see IsBroadbandRun.
+template<bool O3D> inline int32_t GetNumFieldFreqs(const bhcParams<O3D> &params)
+{
+    if(IsTLRun(params.Beam) && IsBroadbandRun(params.Bdry)) {
+        return params.freqinfo->Nfreq;
+    }
+    return 1;
+}
+
+/// Number of TL types in the field, see bhcInit::allTLTypes.
+template<bool O3D> inline int32_t GetNumTLPlanes(const bhcParams<O3D> &params)
+{
+    return IsTLRun(params.Beam) && params.Beam->allTLTypes ? 3 : 1;
+}
+
+/// Number of elements in the field of one TL type (or the arrivals) of params.
+template<bool O3D> inline size_t GetTLPlaneSize(const bhcParams<O3D> &params)
+{
+    return GetFieldSize(params.Pos, GetNumFieldFreqs(params));
+}
+
+/// Number of elements in the TL field (or arrivals) of params.
+template<bool O3D> inline size_t GetFieldSize(const bhcParams<O3D> &params)
+{
+    return GetTLPlaneSize(params) * (size_t)GetNumTLPlanes(params);
+}
+
+/// Estimated relative cost of tracing a ray, see bhcInit::orderJobsByCost.
+template<bool O3D> inline float GetRayJobCost(const bhcParams<O3D> &params, int32_t job)
+{
+    RayInitInfo rinit;
+    GetJobIndices<O3D>(rinit, job, params.Pos, params.Angles);
+    return (float)STD::abs(STD::sin(params.Angles->alpha.angles[rinit.ialpha]));
+}
+
+/**
+ * Sets up the job scheduler for a run over all the rays (GetNumJobs). If cost
+ * ordering is enabled, the cost of each ray is estimated from its launch
+ * angle, as steep rays bounce many more times than nearly horizontal ones.
+ */
+template<bool O3D> inline void InitRayJobs(const bhcParams<O3D> &params)
+{
+    bhcInternal *internal = GetInternal(params);
+    int32_t numJobs       = GetNumJobs<O3D>(params.Pos, params.Angles);
+    if(!internal->orderJobsByCost) {
+        internal->jobSched.Init(numJobs, internal->numThreads, internal->jobChunkSize);
+        return;
+    }
+    std::vector<float> cost(numJobs);
+    for(int32_t job = 0; job < numJobs; ++job) cost[job] = GetRayJobCost(params, job);
+    internal->jobSched.Init(
+        numJobs, internal->numThreads, internal->jobChunkSize, &cost);
+}
+
+/**
+ * Number of copies of the TL / arrivals outputs a field run needs. When a run
+ * is split across multiple GPUs, the GPUs normally each get a disjoint set of
+ * sources, so they write disjoint parts of the outputs. But if there are fewer
+ * sources than GPUs, the rays are interleaved across the GPUs instead, and each
+ * GPU accumulates into its own copy of the outputs, which are merged at the
+ * end of the run.
+ */
+template<bool O3D> inline int32_t NumDeviceOutputCopies(const bhcParams<O3D> &params)
+{
+#ifdef BHC_BUILD_CUDA
+    int32_t numGPUs = (int32_t)GetInternal(params)->gpuIndices.size();
+#else
+    int32_t numGPUs = 1; // GPU list is ignored
+#endif
+    int32_t nSrcs = params.Pos->NSx * params.Pos->NSy * params.Pos->NSz;
+    // The arrivals arena is not copied; fewer GPUs are used instead (see
+    // SetupDeviceOutputs).
+    if(IsArrivalsRun(params.Beam) && GetInternal(params)->arrivalsChunkSize > 0) return 1;
+    return nSrcs >= numGPUs ? 1 : numGPUs;
+}
+
 } // namespace bhc
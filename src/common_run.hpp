@@ -137,6 +137,19 @@ template<typename REAL> HOST_DEVICE inline int32_t BinarySearchGT(
     return hi;
 }
 
+/**
+ * Index of the interval containing x from the preprocessed inverse map, or
+ * fallback if x is outside the tabulated range or NaN. This is only a starting
+ * point for a linear search, except for uniformly spaced points.
+ */
+HOST_DEVICE inline int32_t IntervalGuess(
+    const IntervalLookup &lk, real x, int32_t fallback)
+{
+    real b = (x - lk.min) * lk.rcpDelta;
+    if(!(b >= RL(0.0) && b < (real)lk.nBuckets)) return fallback;
+    return LoadReadOnly(&lk.iCell[(int32_t)b]);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Ray normals
 ////////////////////////////////////////////////////////////////////////////////
@@ -25,6 +25,7 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #include <string>
 #include <locale>
 #include <algorithm>
+#include <charconv>
 //#include <cfenv>
 #include <exception>
 
@@ -136,8 +137,10 @@ inline bool endswith(const std::string &source, const std::string &target)
 
 #define _BHC_INCLUDING_COMPONENTS_ 1
 #include "util/ldio.hpp"
+#include "util/mappedfile.hpp"
 #include "util/directio.hpp"
 #include "util/unformattedio.hpp"
+#include "util/fft.hpp"
 #undef _BHC_INCLUDING_COMPONENTS_
 
 namespace bhc {
@@ -146,48 +149,219 @@ namespace bhc {
 // CUDA memory
 ////////////////////////////////////////////////////////////////////////////////
 
+inline void FreeTrackedBlock(uint64_t *ptr2)
+{
+#ifdef BHC_BUILD_CUDA
+    checkCudaErrors(cudaFree(ptr2));
+#else
+    free(ptr2);
+#endif
+}
+
+/// Frees all the blocks kept for reuse, see bhcInit::poolAllocations.
+inline void ReleaseAllocPool(bhcInternal *internal)
+{
+    for(auto &sizeClass : internal->allocPool) {
+        for(uint64_t *ptr2 : sizeClass.second) FreeTrackedBlock(ptr2);
+    }
+    internal->allocPool.clear();
+    internal->pooledMemory = 0;
+}
+
+/**
+ * Size of the block for a request of s2 bytes (including size info) when
+ * pooling: 16 byte granularity up to 4 KiB, then four size classes per power
+ * of two, so a block is at most 25% larger than requested.
+ */
+inline uint64_t AllocSizeClass(uint64_t s2)
+{
+    if(s2 <= 4096ull) return s2;
+    uint64_t step = 1024ull;
+    while((step << 3) <= s2) step <<= 1;
+    return (s2 + step - 1ull) & ~(step - 1ull);
+}
+
 template<bool O3D, typename T> inline void trackdeallocate(
     const bhcParams<O3D> &params, T *&ptr)
 {
     if(ptr == nullptr) return;
-    // Size stored two 64-bit words before returned pointer. 16 byte aligned.
+    bhcInternal *internal = GetInternal(params);
+    // Size and MemoryUse stored in the two 64-bit words before returned
+    // pointer. 16 byte aligned.
     uint64_t *ptr2 = (uint64_t *)ptr;
     ptr2 -= 2;
-    GetInternal(params)->usedMemory -= *ptr2;
+    internal->usedMemory -= *ptr2;
+    ((MemoryUse *)(uintptr_t)ptr2[1])->current -= *ptr2;
 #ifdef BHC_BUILD_CUDA
-    checkCudaErrors(cudaFree(ptr2));
-#else
-    free(ptr2);
+    internal->allocations.erase(ptr);
 #endif
+    if(internal->poolAllocations) {
+        internal->allocPool[*ptr2].push_back(ptr2);
+        internal->pooledMemory += *ptr2;
+    } else {
+        FreeTrackedBlock(ptr2);
+    }
     ptr = nullptr;
 }
 
+/**
+ * Size of a block from trackallocate, including its size info, or 0 if not
+ * allocated.
+ */
+template<typename T> inline size_t trackedsize(const T *ptr)
+{
+    if(ptr == nullptr) return 0;
+    return (size_t)*((const uint64_t *)ptr - 2);
+}
+
+/// Size trackallocate will take for n elements of T.
+template<typename T> inline size_t trackallocsize(size_t n)
+{
+    return (((n * sizeof(T)) + 15ull) & ~15ull) + 16ull;
+}
+
 template<bool O3D, typename T> inline void trackallocate(
     const bhcParams<O3D> &params, const char *description, T *&ptr, size_t n = 1)
 {
-    if(ptr != nullptr) trackdeallocate(params, ptr);
-    uint64_t *ptr2;
+    bhcInternal *internal = GetInternal(params);
+    uint64_t *ptr2        = nullptr;
     uint64_t s  = ((n * sizeof(T)) + 15ull) & ~15ull; // Round up to 16 byte aligned
     uint64_t s2 = s + 16ull; // Total size to allocate, including size info
-    if(GetInternal(params)->usedMemory + s2 > GetInternal(params)->maxMemory) {
+    if(internal->poolAllocations) {
+        // Keep the existing block if it is not much too big
+        if(ptr != nullptr) {
+            uint64_t cap = *((uint64_t *)ptr - 2);
+            if(cap >= s2 && cap / 2ull <= s2) {
+#ifdef BHC_DEBUG
+                memset(ptr, 0xFE, cap - 16ull);
+#endif
+                return;
+            }
+        }
+        // Allocations sized to take all the remaining memory (e.g. for
+        // arrivals) must not be rounded up past it.
+        uint64_t sc    = AllocSizeClass(s2);
+        uint64_t freed = ptr == nullptr ? 0ull : *((uint64_t *)ptr - 2);
+        if(internal->usedMemory - freed + sc <= internal->maxMemory) {
+            s2 = sc;
+            s  = s2 - 16ull;
+        }
+    }
+    if(ptr != nullptr) trackdeallocate(params, ptr);
+    if(internal->usedMemory + s2 > internal->maxMemory) {
         EXTERR(
             "Insufficient memory to allocate %s, need more than %" PRIu64 " MiB",
-            description, (GetInternal(params)->usedMemory + s2) / (1024ull * 1024ull));
+            description, (internal->usedMemory + s2) / (1024ull * 1024ull));
+    }
+    if(internal->poolAllocations) {
+        auto it = internal->allocPool.find(s2);
+        if(it != internal->allocPool.end() && !it->second.empty()) {
+            ptr2 = it->second.back();
+            it->second.pop_back();
+            internal->pooledMemory -= s2;
+        } else if(
+            internal->usedMemory + internal->pooledMemory + s2 > internal->maxMemory) {
+            ReleaseAllocPool(internal);
+        }
     }
+    if(ptr2 == nullptr) {
 #ifdef BHC_BUILD_CUDA
-    checkCudaErrors(cudaMallocManaged(&ptr2, s2));
+        NvtxRange nvtx(description);
+        checkCudaErrors(cudaMallocManaged(&ptr2, s2));
 #else
-    ptr2 = (uint64_t *)malloc(s2);
+        ptr2 = (uint64_t *)malloc(s2);
+#endif
+        *ptr2 = s2;
+    }
+    internal->usedMemory += s2;
+    internal->peakMemory = bhc::max(internal->peakMemory, internal->usedMemory);
+    // The second word of the size info is otherwise unused.
+    MemoryUse &use = internal->memoryUse[description];
+    use.current += s2;
+    ++use.allocations;
+    use.peak = bhc::max(use.peak, use.current);
+    ptr2[1]  = (uint64_t)(uintptr_t)&use;
+    ptr      = (T *)(ptr2 + 2);
+#ifdef BHC_BUILD_CUDA
+    internal->allocations[ptr] = s;
 #endif
-    *ptr2 = s2;
-    GetInternal(params)->usedMemory += s2;
-    ptr = (T *)(ptr2 + 2);
 #ifdef BHC_DEBUG
     // Debugging: Fill memory with garbage data to help detect uninitialized vars
     memset(ptr, 0xFE, s);
 #endif
 }
 
+/**
+ * Memory available for outputs which are sized to use what is left
+ * (arrivals, rays, eigenray hits). While bhc::run_pipelined is in use, the
+ * other set of outputs may be holding memory for the job being written out,
+ * and each set gets at most half of what the two can share, so the first job
+ * does not leave none for the second.
+ */
+template<bool O3D> inline size_t RemainingOutputMemory(const bhcParams<O3D> &params)
+{
+    bhcInternal *internal = GetInternal(params);
+    size_t remaining      = internal->usedMemory < internal->maxMemory
+        ? internal->maxMemory - internal->usedMemory
+        : 0;
+    if(internal->pipeOutputs == nullptr) return remaining;
+    return bhc::min(remaining, (remaining + internal->pipeHeldMemory) / 2);
+}
+
+/**
+ * Zeroes a large output buffer. If bhcInit::interleaveOutputs, the pages are
+ * zeroed round-robin by the worker threads, so that each page is first
+ * touched by, and therefore placed on the NUMA node of, a different worker.
+ */
+template<bool O3D, typename T> inline void zerooutput(
+    const bhcParams<O3D> &params, T *ptr, size_t n)
+{
+    size_t bytes          = n * sizeof(T);
+    bhcInternal *internal = GetInternal(params);
+    ThreadPool &pool      = internal->threadPool;
+#ifdef BHC_BUILD_CUDA
+    // Managed memory pages end up wherever the GPU or host touches them.
+    bool interleave = false;
+#else
+    bool interleave = internal->interleaveOutputs && pool.NumThreads() > 1;
+#endif
+    if(!interleave) {
+        memset(ptr, 0, bytes);
+        return;
+    }
+    constexpr uintptr_t pageSize = 4096;
+    uintptr_t begin = (uintptr_t)ptr, end = begin + bytes;
+    uintptr_t firstPage = begin / pageSize, lastPage = (end + pageSize - 1) / pageSize;
+    uintptr_t numThreads = (uintptr_t)pool.NumThreads();
+    pool.Run([&](int32_t worker) {
+        for(uintptr_t p = firstPage + (uintptr_t)worker; p < lastPage; p += numThreads) {
+            uintptr_t b = bhc::max(begin, p * pageSize);
+            uintptr_t e = bhc::min(end, (p + 1) * pageSize);
+            memset((void *)b, 0, e - b);
+        }
+    });
+}
+
+/**
+ * Builds the inverse map lk (see IntervalLookup) for n >= 2 strictly
+ * increasing coordinates, the first at coord and each stride reals apart.
+ */
+template<bool O3D> inline void BuildIntervalLookup(
+    const bhcParams<O3D> &params, IntervalLookup &lk, const real *coord, int32_t n,
+    int32_t stride)
+{
+    lk.nBuckets = n - 1;
+    lk.min      = coord[0];
+    lk.rcpDelta = (real)lk.nBuckets / (coord[(n - 1) * stride] - lk.min);
+    trackallocate(params, "interval lookup table", lk.iCell, lk.nBuckets);
+    int32_t i = 0;
+    for(int32_t b = 0; b < lk.nBuckets; ++b) {
+        real xb = lk.min + (real)b / lk.rcpDelta;
+        while(i < n - 2 && coord[(i + 1) * stride] <= xb) ++i;
+        lk.iCell[b] = i;
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Vector input related
 ////////////////////////////////////////////////////////////////////////////////
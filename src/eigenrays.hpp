@@ -21,23 +21,38 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 
 namespace bhc {
 
+/**
+ * If stage is not null (GPU only), the hit goes there while it has space,
+ * see HitStage. Hits beyond eigen->memsize are counted but not stored.
+ */
 HOST_DEVICE inline void RecordEigenHit(
     int32_t itheta, int32_t ir, int32_t iz, int32_t is, const RayInitInfo &rinit,
-    EigenInfo *eigen)
+    EigenInfo *eigen, [[maybe_unused]] const HitStage *stage = nullptr)
 {
-    int32_t mi = AtomicFetchAdd(&eigen->neigen, 1);
+    EigenHit hit;
+    hit.is     = is;
+    hit.iz     = iz;
+    hit.ir     = ir;
+    hit.itheta = itheta;
+    hit.isx    = rinit.isx;
+    hit.isy    = rinit.isy;
+    hit.isz    = rinit.isz;
+    hit.ialpha = rinit.ialpha;
+    hit.ibeta  = rinit.ibeta;
+#ifdef __CUDA_ARCH__
+    if(stage != nullptr && stage->eigen == eigen) {
+        int32_t si = AtomicIncrementWarp(stage->count);
+        if(si < stage->size) {
+            stage->smem[si] = hit;
+            return;
+        }
+    }
+#endif
+    int32_t mi = AtomicIncrementWarp(&eigen->neigen);
     if(mi >= eigen->memsize) return;
     // printf("Eigenray hit %d ir %d iz %d isrc %d ialpha %d is %d\n",
     //     mi, ir, iz, isrc, ialpha, is);
-    eigen->hits[mi].is     = is;
-    eigen->hits[mi].iz     = iz;
-    eigen->hits[mi].ir     = ir;
-    eigen->hits[mi].itheta = itheta;
-    eigen->hits[mi].isx    = rinit.isx;
-    eigen->hits[mi].isy    = rinit.isy;
-    eigen->hits[mi].isz    = rinit.isz;
-    eigen->hits[mi].ialpha = rinit.ialpha;
-    eigen->hits[mi].ibeta  = rinit.ibeta;
+    eigen->hits[mi] = hit;
 }
 
 } // namespace bhc
@@ -88,6 +88,20 @@ HOST_DEVICE inline int32_t RToIR(real r, const Position *Pos)
     return bhc::max(bhc::min((int)temp, Pos->NRr - 1), 0);
 }
 
+/**
+ * Range of receiver depth indices [izMin, izMax] which may be within the
+ * depth limits [zmin, zmax] of the beam. Rz is validated to be monotonically
+ * increasing, so this is two binary searches instead of a scan over all
+ * receiver depths. When no depth is within the limits, the endpoints are
+ * clamped to a valid index, so the caller must still check each depth.
+ */
+HOST_DEVICE inline void RcvrDepthBand(
+    int32_t &izMin, int32_t &izMax, real zmin, real zmax, const Position *Pos)
+{
+    izMin = BinarySearchGEQ(Pos->Rz, Pos->NRz_per_range, 1, 0, zmin);
+    izMax = BinarySearchLEQ(Pos->Rz, Pos->NRz_per_range, 1, 0, zmax);
+}
+
 template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void AdjustSigma(
     real &sigma, const rayPt<R3D> &point0, const rayPt<R3D> &point1,
     const InfluenceRayInfo<R3D> &inflray, const BeamStructure<O3D> *Beam)
@@ -96,7 +110,8 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void AdjustSigma(
     real lambda = point0.c / inflray.freq0; // local wavelength
     // min pi * lambda, unless near
     sigma = bhc::max(
-        sigma, bhc::min(FL(0.2) * inflray.freq0 * point1.tau.real(), REAL_PI * lambda));
+        sigma,
+        bhc::min(FL(0.2) * inflray.freq0 * (real)point1.tau.real(), REAL_PI * lambda));
 }
 
 /**
@@ -404,10 +419,10 @@ template<bool R3D> HOST_DEVICE inline void IncPhaseIfCaustic(
 /**
  * phase shifts at caustics
  */
-template<bool R3D> HOST_DEVICE inline real FinalPhase(
+template<bool R3D> HOST_DEVICE inline realacc FinalPhase(
     const rayPt<R3D> &point, const InfluenceRayInfo<R3D> &inflray, real q)
 {
-    real phaseInt = point.Phase + inflray.phase;
+    realacc phaseInt = point.Phase + inflray.phase;
     if(IsAtCaustic<R3D>(inflray, q, true)) {
         // LP: All 2D influence functions discard point.Phase when this
         // condition is met. Probably a BUG as none of the 3D functions do this.
@@ -416,21 +431,60 @@ template<bool R3D> HOST_DEVICE inline real FinalPhase(
     return phaseInt;
 }
 
+/**
+ * Lloyd mirror pattern of the semi-coherent option: factor on the initial
+ * amplitude of a ray launched at angle alpha from a source at depth zs.
+ */
+HOST_DEVICE inline real LloydMirrorFactor(real freq0, real c, real zs, real alpha)
+{
+    float omega = FL(2.0) * REAL_PI * freq0;
+    return STD::sqrt(FL(2.0)) * STD::abs(STD::sin(omega / c * zs * STD::sin(alpha)));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Storing results
 ////////////////////////////////////////////////////////////////////////////////
 
 template<bool R3D> HOST_DEVICE inline void AddToField(
     cpxf *uAllSources, const cpxf &dfield, int32_t itheta, int32_t ir, int32_t iz,
-    const InfluenceRayInfo<R3D> &inflray, const Position *Pos)
+    const InfluenceRayInfo<R3D> &inflray, const Position *Pos, int32_t ifreq = 0)
 {
     size_t base = GetFieldAddr(
-        inflray.init.isx, inflray.init.isy, inflray.init.isz, itheta, iz, ir, Pos);
+        inflray.init.isx, inflray.init.isy, inflray.init.isz, itheta, iz, ir, Pos, ifreq,
+        inflray.Nfreq);
+#ifdef __CUDA_ARCH__
+    const FieldTile *tile = inflray.tile;
+    if(tile != nullptr && uAllSources == tile->field && itheta == tile->itheta
+        && ir < tile->nr && (uint32_t)(iz - tile->iz0) < (uint32_t)tile->nz) {
+        AtomicAddCpx(
+            &tile->smem[((size_t)ifreq * tile->nz + (iz - tile->iz0)) * tile->nr + ir],
+            dfield);
+        return;
+    }
+#else
+    if(!inflray.atomicField) {
+        uAllSources[base] += dfield;
+        return;
+    }
+#endif
     AtomicAddCpx(&uAllSources[base], dfield);
 }
 
+/// Contribution of a beam to an incoherent or semi-coherent field.
+template<bool O3D, bool R3D> HOST_DEVICE inline real IncoherentIntensity(
+    real cnst, real w, real omegaf, cpxacc delay, const BeamStructure<O3D> *Beam)
+{
+    real v = cnst * STD::exp(omegaf * (real)delay.imag());
+    v      = SQ(v) * w;
+    if(IsGaussianGeomInfl(Beam)) {
+        // Gaussian beam
+        v *= GaussScaleFactor<R3D>();
+    }
+    return v;
+}
+
 template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void ApplyContribution(
-    cpxf *uAllSources, real cnst, real w, real omega, cpx delay, real phaseInt,
+    cpxf *uAllSources, real cnst, real w, real omega, cpxacc delay, realacc phaseInt,
     real RcvrDeclAngle, real RcvrAzimAngle, int32_t itheta, int32_t ir, int32_t iz,
     int32_t is, const InfluenceRayInfo<R3D> &inflray, const rayPt<R3D> &point1,
     const Position *Pos, const BeamStructure<O3D> *Beam, EigenInfo *eigen,
@@ -439,36 +493,57 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void ApplyContribu
     if constexpr(O3D && !R3D) { itheta = inflray.init.ibeta; }
     if constexpr(CFG::run::IsEigenrays()) {
         // eigenrays
-        RecordEigenHit(itheta, ir, iz, is, inflray.init, eigen);
+        RecordEigenHit(itheta, ir, iz, is, inflray.init, eigen, inflray.stage);
     } else if constexpr(CFG::run::IsArrivals()) {
         // arrivals
         AddArr<R3D>(
-            itheta, iz, ir, cnst * w, omega, phaseInt, delay, inflray.init, RcvrDeclAngle,
-            RcvrAzimAngle, point1.NumTopBnc, point1.NumBotBnc, arrinfo, Pos);
+            itheta, iz, ir, cnst * w, omega, (real)phaseInt, Cpxacc2Cpx(delay),
+            inflray.init, RcvrDeclAngle, RcvrAzimAngle, point1.NumTopBnc,
+            point1.NumBotBnc, arrinfo, Pos);
         if(IsAlsoEigenraysRun(Beam)) {
             // TODO: check how much this if statement costs
-            RecordEigenHit(itheta, ir, iz, is, inflray.init, eigen);
+            RecordEigenHit(itheta, ir, iz, is, inflray.init, eigen, inflray.stage);
         }
     } else {
-        cpxf dfield;
-        if(IsCoherentRun(Beam)) {
-            // coherent TL
-            dfield = Cpx2Cpxf(cnst * w * STD::exp(-J * (omega * delay - phaseInt)));
-            // printf("%20.17f %20.17f\n", dfield.real(), dfield.imag());
-            // omega * SQ(n) / (FL(2.0) * SQ(point1.c) * delay)))) // curvature correction
-            // [LP: 2D only]
-        } else {
-            // incoherent/semicoherent TL
-            real v = cnst * STD::exp((omega * delay).imag());
-            v      = SQ(v) * w;
-            if(IsGaussianGeomInfl(Beam)) {
-                // Gaussian beam
-                v *= GaussScaleFactor<R3D>();
+        // For broadband runs, the ray path, amplitude, and beam width are
+        // those at freq0; only the phase delay and the attenuation (the
+        // imaginary part of the delay, which scales with frequency) differ
+        // between the frequencies.
+        for(int32_t ifreq = 0; ifreq < inflray.Nfreq; ++ifreq) {
+            real omegaf = inflray.freqVec == nullptr
+                ? omega
+                : FL(2.0) * REAL_PI * inflray.freqVec[ifreq];
+            cpxf dfield;
+            if(inflray.tlPlaneStride != 0) {
+                // All three TL types, see bhcInit::allTLTypes.
+                cpxf coh = Cpx2Cpxf(cnst * w * ExpMinusJ(omegaf * delay - phaseInt));
+                real v   = IncoherentIntensity<O3D, R3D>(cnst, w, omegaf, delay, Beam);
+                for(int32_t p = 0; p < 3; ++p) {
+                    char t  = TLPlaneType(Beam, p);
+                    real vt = t == 'S' ? v * inflray.semiFactor : v;
+                    dfield  = t == 'C' ? coh : cpxf((float)vt, 0.0f);
+                    AddToField<R3D>(
+                        &uAllSources[(size_t)p * inflray.tlPlaneStride], dfield, itheta,
+                        ir, iz, inflray, Pos, ifreq);
+                }
+                continue;
+            }
+            if(IsCoherentRun(Beam)) {
+                // coherent TL
+                dfield = Cpx2Cpxf(cnst * w * ExpMinusJ(omegaf * delay - phaseInt));
+                // printf("%20.17f %20.17f\n", dfield.real(), dfield.imag());
+                // omega * SQ(n) / (FL(2.0) * SQ(point1.c) * delay)))) // curvature
+                // correction [2D only]
+            } else {
+                // incoherent/semicoherent TL
+                dfield = cpxf(
+                    (float)IncoherentIntensity<O3D, R3D>(cnst, w, omegaf, delay, Beam),
+                    0.0f);
             }
-            dfield = cpxf((float)v, 0.0f);
+            // printf("ApplyContribution dfield (%g,%g)\n", dfield.real(),
+            // dfield.imag());
+            AddToField<R3D>(uAllSources, dfield, itheta, ir, iz, inflray, Pos, ifreq);
         }
-        // printf("ApplyContribution dfield (%g,%g)\n", dfield.real(), dfield.imag());
-        AddToField<R3D>(uAllSources, dfield, itheta, ir, iz, inflray, Pos);
     }
 }
 
@@ -520,6 +595,15 @@ template<bool O3D, bool R3D> inline void PreRun_Influence(bhcParams<O3D> &params
     } else {
         EXTERR("Invalid Run Type");
     }
+    if(IsBroadbandRun(params.Bdry)) {
+        if(!IsTLRun(params.Beam)) {
+            EXTWARN("Broadband option (TopOpt[5] == 'B') only affects TL runs, "
+                    "computing at freq0");
+        } else if(!IsGeometricInfl(params.Beam)) {
+            EXTERR("Broadband TL runs (TopOpt[5] == 'B') are only supported with "
+                   "geometric beams, as the width of other beams depends on frequency");
+        }
+    }
 }
 
 template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void Init_Influence(
@@ -532,6 +616,8 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void Init_Influenc
     bool isGaussian = IsGaussianGeomInfl(Beam);
 
     inflray.init  = rinit;
+    inflray.tile  = nullptr;
+    inflray.stage = nullptr;
     inflray.freq0 = freqinfo->freq0;
     inflray.omega = FL(2.0) * REAL_PI * inflray.freq0;
     inflray.c0    = point0.c;
@@ -555,6 +641,10 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void Init_Influenc
         if(IsLineSource(Beam)) inflray.Ratio1 = RL(1.0);
     }
     if(isGaussian) { inflray.Ratio1 /= GaussScaleFactor<R3D>(); }
+    inflray.semiFactor = Beam->allTLTypes
+        ? SQ(LloydMirrorFactor(
+              freqinfo->freq0, point0.c, Pos->Sz[rinit.isz], rinit.alpha))
+        : RL(1.0);
 
     if constexpr(CFG::infl::IsCerveny()) {
         inflray.epsilon1 = PickEpsilon<O3D, R3D>(
@@ -703,7 +793,8 @@ template<typename CFG, bool O3D> HOST_DEVICE inline bool Step_InfluenceCervenyRa
             if(inflray.lastValid && ir1 < ir2) {
                 for(int32_t ir = ir1 + 1; ir <= ir2; ++ir) {
                     real w, n, nSq, c;
-                    cpx q, gamma, tau, contri;
+                    cpx q, gamma, contri;
+                    cpxacc tau;
                     w     = (Pos->Rr[ir] - rA) / (rB - rA);
                     q     = qB0 + w * (qB1 - qB0);
                     gamma = gamma0 + w * (gamma1 - gamma0);
@@ -722,10 +813,9 @@ template<typename CFG, bool O3D> HOST_DEVICE inline bool Step_InfluenceCervenyRa
                         tau    = point0.tau + w * (point1.tau - point0.tau);
                         contri = inflray.Ratio1 * point1.Amp
                             * STD::sqrt(c * STD::abs(eps1) / q)
-                            * STD::exp(
-                                     -J
-                                     * (inflray.omega * (tau + FL(0.5) * gamma * nSq)
-                                        - point1.Phase));
+                            * ExpMinusJ(
+                                     inflray.omega * (tau + FL(0.5) * gamma * nSq)
+                                     - point1.Phase);
 
                         cpx P_n = -J * inflray.omega * gamma * n * contri;
                         cpx P_s = -J * inflray.omega / c * contri;
@@ -818,7 +908,8 @@ template<typename CFG, bool O3D> HOST_DEVICE inline bool Step_InfluenceCervenyCa
     for(int32_t ir = irA + 1; ir <= irB; ++ir) {
         real w, c;
         vec2 x, rayt;
-        cpx q, tau, gamma, cnst;
+        cpx q, gamma, cnst;
+        cpxacc tau;
         w     = (Pos->Rr[ir] - rA) / (rB - rA);
         x     = point0.x + w * (point1.x - point0.x);
         rayt  = point0.t + w * (point1.t - point0.t);
@@ -863,11 +954,10 @@ template<typename CFG, bool O3D> HOST_DEVICE inline bool Step_InfluenceCervenyCa
                 if(inflray.omega * gamma.imag() * SQ(deltaz) < inflray.iBeamWindow2) {
                     contri += Polarity * point1.Amp
                         * Hermite(deltaz, inflray.RadMax, FL(2.0) * inflray.RadMax)
-                        * STD::exp(
-                                  -J
-                                  * (inflray.omega
-                                         * (tau + rayt.y * deltaz + gamma * SQ(deltaz))
-                                     - point1.Phase));
+                        * ExpMinusJ(
+                                  inflray.omega
+                                      * (tau + rayt.y * deltaz + gamma * SQ(deltaz))
+                                  - point1.Phase);
                 }
             }
 
@@ -986,7 +1076,7 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void InfluenceGeoC
         return;
     }
 
-    cpx delay    = point0.tau + s * dtau; // interpolated delay
+    cpxacc delay = point0.tau + s * dtau; // interpolated delay
     real cfactor = point1.c;
     if constexpr(!R3D) cfactor = STD::sqrt(cfactor);
     real cnst = inflray.Ratio1 * cfactor * point1.Amp / STD::sqrt(STD::abs(qFinal));
@@ -1005,7 +1095,7 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void InfluenceGeoC
             w = (sigma - n1prime) / sigma; // hat function: 1 on center, 0 on edge
         }
     }
-    real phaseInt
+    realacc phaseInt
         = FinalPhase<R3D>((!R3D && isGaussian ? point1 : point0), inflray, qFinal);
 
 #ifdef INFL_DEBUGGING_IR
@@ -1038,7 +1128,7 @@ Step_InfluenceGeoRayCen(
     inflray.qOld = phaseq;
 
     V2M2<R3D> dq = point1.q - point0.q;
-    cpx dtau     = point1.tau - point0.tau;
+    cpx dtau     = Cpxacc2Cpx(point1.tau - point0.tau);
 
     [[maybe_unused]] vec3 e1xe2A, e1xe2B;
     if constexpr(R3D) {
@@ -1217,7 +1307,13 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline bool Step_Influenc
             return true;
         }
         // LP: This is silly logic, see comments in influence3D.f90
-        if(is == 0) { inflray.ir = (rB > rA) ? 0 : Pos->NRr - 1; }
+        // Originally the receiver index started at 0 or NRr - 1 and was
+        // bumped one at a time towards rA. All receivers skipped this way are
+        // outside [rA, rB), so jump directly to where that walk would end up.
+        if(is == 0) {
+            inflray.ir = BinarySearchGEQ(Pos->Rr, Pos->NRr, 1, 0, rA);
+            if(rB > rA) inflray.ir = bhc::max(inflray.ir - 1, 0);
+        }
     } else {
         // LP: This is different from point0.x.x due to early return for duplicate points.
         rA = inflray.x.x;
@@ -1251,7 +1347,7 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline bool Step_Influenc
 
     // LP: Quantities to be interpolated between steps
     V2M2<R3D> dq = point1.q - point0.q;     // LP: dqds in 2D
-    cpx dtau     = point1.tau - point0.tau; // LP: dtauds in 2D
+    cpx dtau     = Cpxacc2Cpx(point1.tau - point0.tau); // dtauds in 2D
 
     // phase shifts at caustics
     real phaseq = QScalar(point0.q);
@@ -1260,6 +1356,7 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline bool Step_Influenc
 
     [[maybe_unused]] real L_diag; // LP: 3D
     real zmin, zmax;              // LP: 2D here, 3D later
+    int32_t izMin = 0, izMax = Pos->NRz_per_range - 1;
     // beam window: kills beams outside exp(RL(-0.5) * SQ(ibwin))
     if constexpr(R3D) {
         // beamwidths / LP: Variable values don't carry over to per-receiver beamwidth
@@ -1289,6 +1386,7 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline bool Step_Influenc
             zmin = -REAL_MAX;
             zmax = REAL_MAX;
         }
+        if(!IsIrregularGrid(Beam)) RcvrDepthBand(izMin, izMax, zmin, zmax, Pos);
     }
 
     // compute beam influence for this segment of the ray
@@ -1351,6 +1449,7 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline bool Step_Influenc
                     zmin = bhc::min(point0.x.z, point1.x.z) - L_z;
                     // max depth of ray segment
                     zmax = bhc::max(point0.x.z, point1.x.z) + L_z;
+                    RcvrDepthBand(izMin, izMax, zmin, zmax, Pos);
 
                     // if(inflray.ir == 7 && itheta == 59){
                     //     printf("step ir itheta %d %d %d\n", is, inflray.ir, itheta);
@@ -1359,7 +1458,7 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline bool Step_Influenc
                     x_rcvr.x = Pos->Rr[inflray.ir];
                 }
 
-                for(int32_t iz = 0; iz < Pos->NRz_per_range; ++iz) {
+                for(int32_t iz = izMin; iz <= izMax; ++iz) {
                     int32_t tempiz = iz;
                     if constexpr(!R3D) {
                         if(IsIrregularGrid(Beam)) tempiz = inflray.ir;
@@ -1419,7 +1518,7 @@ template<typename CFG, bool O3D> HOST_DEVICE inline bool Step_InfluenceSGB(
 {
     real w;
     vec2 x, rayt;
-    cpx tau;
+    cpxacc tau;
     real RcvrDeclAngle, RcvrAzimAngle;
     ReceiverAngles<false>(RcvrDeclAngle, RcvrAzimAngle, point1.t, inflray);
 
@@ -1466,10 +1565,10 @@ template<typename CFG, bool O3D> HOST_DEVICE inline bool Step_InfluenceSGB(
                 real ds       = STD::sqrt(SQ(deltaz) - SQ(cpa));
                 real sx1      = sint + ds;
                 real thet     = STD::atan(cpa / sx1);
-                cpx delay     = tau + rayt.y * deltaz;
-                real cnst     = inflray.Ratio1 * cn * point1.Amp / STD::sqrt(sx1);
-                w             = STD::exp(-a * SQ(thet));
-                real phaseInt = point1.Phase + inflray.phase;
+                cpxacc delay     = tau + rayt.y * deltaz;
+                real cnst        = inflray.Ratio1 * cn * point1.Amp / STD::sqrt(sx1);
+                w                = STD::exp(-a * SQ(thet));
+                realacc phaseInt = point1.Phase + inflray.phase;
                 ApplyContribution<CFG, O3D, false>(
                     uAllSources, cnst, w, inflray.omega, delay, phaseInt, RcvrDeclAngle,
                     RcvrAzimAngle, 0, inflray.ir, iz, is, inflray, point1, Pos, Beam,
@@ -19,56 +19,148 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #include "arr.hpp"
 #include "../common_run.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
 namespace bhc { namespace mode {
 
+/**
+ * Multithreaded / GPU runs (AllowMerging == false) append every arrival,
+ * in no particular order between rays. This puts each receiver's arrivals in
+ * the order the single-threaded run would have found them (rays in job order,
+ * i.e. by azimuth and then declination, and each ray's own arrivals in the
+ * order they were added), and then merges them with the same test as AddArr,
+ * on the same stored values. So the result is the same as the single-threaded
+ * one, unless a receiver ran out of space. Then both keep the strongest
+ * arrivals, but parallel runs replace the weakest before pairs are merged, so
+ * the arrivals kept may differ.
+ */
+template<bool O3D, bool R3D> void MergeArrivalPairs(
+    const bhcParams<O3D> &params, ArrInfo *arrinfo)
+{
+    bhcInternal *internal = GetInternal(params);
+    int32_t numThreads    = internal->threadPool.NumThreads();
+    size_t n              = GetFieldSize(params);
+    real omega            = FL(2.0) * REAL_PI * params.freqinfo->freq0;
+    internal->threadPool.Run([&](int32_t worker) {
+        size_t begin = n * (size_t)worker / (size_t)numThreads;
+        size_t end   = n * (size_t)(worker + 1) / (size_t)numThreads;
+        std::vector<Arrival> arrs;
+        for(size_t base = begin; base < end; ++base) {
+            int32_t narr = NumStoredArrivals(arrinfo, base);
+            if(narr <= 1) continue;
+            arrs.resize(narr);
+            for(int32_t iArr = 0; iArr < narr; ++iArr) {
+                arrs[iArr] = LoadArrival(arrinfo, ArrivalIndex(arrinfo, base, iArr));
+            }
+            // Stable, so the arrivals of each ray stay in the order they were
+            // added in.
+            std::stable_sort(
+                arrs.begin(), arrs.end(), [](const Arrival &a, const Arrival &b) {
+                    // The azimuth is NaN in 2D, which would make every
+                    // arrival compare equal.
+                    if constexpr(O3D) {
+                        if(a.SrcAzimAngle != b.SrcAzimAngle) {
+                            return a.SrcAzimAngle < b.SrcAzimAngle;
+                        }
+                    }
+                    return a.SrcDeclAngle < b.SrcDeclAngle;
+                });
+            // Merged in place in arrs (nout <= iArr), then stored back.
+            int32_t nout = 0;
+            for(int32_t iArr = 0; iArr < narr; ++iArr) {
+                const Arrival arr = arrs[iArr];
+                Arrival *prevArr  = nout >= 1 ? &arrs[nout - 1] : nullptr;
+                if(IsSecondStepOfPair<R3D>(
+                       omega, arr.Phase, Cpxf2Cpx(arr.delay), prevArr)) {
+                    MergeArrival(
+                        prevArr, arr.a, arr.delay, arr.SrcDeclAngle, arr.SrcAzimAngle,
+                        arr.RcvrDeclAngle, arr.RcvrAzimAngle);
+                } else {
+                    arrs[nout++] = arr;
+                }
+            }
+            for(int32_t iArr = 0; iArr < nout; ++iArr) {
+                StoreArrival(arrinfo, ArrivalIndex(arrinfo, base, iArr), arrs[iArr]);
+            }
+            arrinfo->NArr[base] = nout;
+        }
+    });
+}
+
+/**
+ * Split between the threads in blocks of rows (receiver depths) of one
+ * source. The maximum number of arrivals of each block is kept, and the
+ * maximum of each source found from them afterwards.
+ */
 template<bool O3D, bool R3D> void PostProcessArrivals(
     const bhcParams<O3D> &params, ArrInfo *arrinfo)
 {
     const Position *Pos = params.Pos;
-    for(int32_t isz = 0; isz < Pos->NSz; ++isz) {
-        for(int32_t isx = 0; isx < Pos->NSx; ++isx) {
-            for(int32_t isy = 0; isy < Pos->NSy; ++isy) {
-                int32_t maxn = 0; // LP: Maximum number of arrivals for this source
-                for(int32_t itheta = 0; itheta < Pos->Ntheta; ++itheta) {
-                    for(int32_t iz = 0; iz < Pos->NRz_per_range; ++iz) {
-                        for(int32_t ir = 0; ir < Pos->NRr; ++ir) {
-                            size_t base
-                                = GetFieldAddr(isx, isy, isz, itheta, iz, ir, Pos);
+    if(!arrinfo->AllowMerging) MergeArrivalPairs<O3D, R3D>(params, arrinfo);
+    size_t nSources     = (size_t)Pos->NSz * (size_t)Pos->NSx * (size_t)Pos->NSy;
+    size_t nRows        = (size_t)Pos->Ntheta * (size_t)Pos->NRz_per_range;
+    size_t rowsPerBlock = bhc::max((size_t)1, (size_t)4096 / (size_t)Pos->NRr);
+    size_t blocksPerSrc = (nRows + rowsPerBlock - 1) / rowsPerBlock;
+    std::vector<int32_t> blockMaxN(nSources * blocksPerSrc);
+    std::atomic<size_t> next(0);
+    GetInternal(params)->threadPool.Run([&](int32_t) {
+        while(true) {
+            size_t b = next.fetch_add(1);
+            if(b >= blockMaxN.size()) break;
+            size_t src  = b / blocksPerSrc;
+            int32_t isy = (int32_t)(src % (size_t)Pos->NSy);
+            int32_t isx = (int32_t)(src / (size_t)Pos->NSy % (size_t)Pos->NSx);
+            int32_t isz = (int32_t)(src / ((size_t)Pos->NSy * (size_t)Pos->NSx));
+            size_t row0 = (b % blocksPerSrc) * rowsPerBlock;
+            size_t row1 = bhc::min(row0 + rowsPerBlock, nRows);
 
-                            int32_t narr = arrinfo->NArr[base];
-                            if(narr > arrinfo->MaxNArr) {
-                                // For multithreading / AllowMerging == false where this
-                                // holds the total number of attempted arrivals,
-                                // including those not written due to limited memory
-                                arrinfo->NArr[base] = narr = arrinfo->MaxNArr;
-                            }
-                            maxn = bhc::max(maxn, narr);
-
-                            float factor;
-                            if constexpr(R3D) {
-                                factor = FL(1.0);
-                            } else {
-                                bool line = false; // Silence MSVC warning
-                                if constexpr(!O3D) line = IsLineSource(params.Beam);
-                                if(line) {
-                                    factor = FL(4.0) * STD::sqrt(REAL_PI);
-                                } else if(Pos->Rr[ir] == FL(0.0)) {
-                                    // avoid /0 at origin
-                                    factor = FL(1e5);
-                                } else {
-                                    // cyl. spreading
-                                    factor = FL(1.0) / STD::sqrt(Pos->Rr[ir]);
-                                }
-                            }
-                            for(int32_t iArr = 0; iArr < narr; ++iArr) {
-                                arrinfo->Arr[base * arrinfo->MaxNArr + iArr].a *= factor;
-                            }
+            int32_t maxn = 0;
+            for(size_t row = row0; row < row1; ++row) {
+                int32_t itheta = (int32_t)(row / (size_t)Pos->NRz_per_range);
+                int32_t iz     = (int32_t)(row % (size_t)Pos->NRz_per_range);
+                for(int32_t ir = 0; ir < Pos->NRr; ++ir) {
+                    size_t base = GetFieldAddr(isx, isy, isz, itheta, iz, ir, Pos);
+
+                    // For multithreading / AllowMerging == false, NArr
+                    // holds the total number of attempted arrivals,
+                    // including those not written due to limited memory
+                    int32_t narr        = NumStoredArrivals(arrinfo, base);
+                    arrinfo->NArr[base] = narr;
+                    maxn                = bhc::max(maxn, narr);
+
+                    float factor;
+                    if constexpr(R3D) {
+                        factor = FL(1.0);
+                    } else {
+                        bool line = false; // Silence MSVC warning
+                        if constexpr(!O3D) line = IsLineSource(params.Beam);
+                        if(line) {
+                            factor = FL(4.0) * STD::sqrt(REAL_PI);
+                        } else if(Pos->Rr[ir] == FL(0.0)) {
+                            // avoid /0 at origin
+                            factor = FL(1e5);
+                        } else {
+                            // cyl. spreading
+                            factor = FL(1.0) / STD::sqrt(Pos->Rr[ir]);
                         }
                     }
+                    for(int32_t iArr = 0; iArr < narr; ++iArr) {
+                        ArrivalAmp(arrinfo, ArrivalIndex(arrinfo, base, iArr)) *= factor;
+                    }
                 }
-                arrinfo->MaxNPerSource[(isz * Pos->NSx + isx) * Pos->NSy + isy] = maxn;
             }
+            blockMaxN[b] = maxn;
         }
+    });
+    // MaxNPerSource is in the same source order.
+    for(size_t src = 0; src < nSources; ++src) {
+        int32_t maxn = 0;
+        for(size_t b = 0; b < blocksPerSrc; ++b) {
+            maxn = bhc::max(maxn, blockMaxN[src * blocksPerSrc + b]);
+        }
+        arrinfo->MaxNPerSource[src] = maxn;
     }
 }
 
@@ -85,13 +177,106 @@ template void PostProcessArrivals<true, true>(
     const bhcParams<true> &params, ArrInfo *arrinfo);
 #endif
 
+/**
+ * Compact binary arrivals format ('2C' / '3C' instead of '2D' / '3D'),
+ * written when the arrivals are stored compact (bhcInit::compactArrivals).
+ * The header has an extra record after the frequency, holding these flags.
+ * All the arrivals of one receiver are in one record after its count, each
+ * as: amplitude (float, or half precision dB if CompactArrAmpdB), phase in
+ * degrees (float), delay (real part, and imaginary part if
+ * CompactArrComplexDelay, floats), angles in degrees (half precision), and
+ * top and bottom bounce counts (int16).
+ */
+constexpr int32_t CompactArrComplexDelay = 1;
+constexpr int32_t CompactArrAmpdB        = 2;
+
+template<bool O3D> inline void WriteCompactArrival(
+    UnformattedOFile &BARRFile, const Arrival &arr, int32_t flags)
+{
+    if(flags & CompactArrAmpdB) {
+        BARRFile.write(FloatToHalf(20.0f * STD::log10(arr.a)));
+    } else {
+        BARRFile.write(arr.a);
+    }
+    BARRFile.write((float)(RadDeg * arr.Phase));
+    BARRFile.write(arr.delay.real());
+    if(flags & CompactArrComplexDelay) BARRFile.write(arr.delay.imag());
+    BARRFile.write(FloatToHalf(arr.SrcDeclAngle));
+    if constexpr(O3D) BARRFile.write(FloatToHalf(arr.SrcAzimAngle));
+    BARRFile.write(FloatToHalf(arr.RcvrDeclAngle));
+    if constexpr(O3D) BARRFile.write(FloatToHalf(arr.RcvrAzimAngle));
+    BARRFile.write((int16_t)bhc::min(arr.NTopBnc, 0x7FFF));
+    BARRFile.write((int16_t)bhc::min(arr.NBotBnc, 0x7FFF));
+}
+
+template<bool O3D> inline void ReadCompactArrival(
+    UnformattedIFile &BARRFile, Arrival &arr, int32_t flags)
+{
+    uint16_t h;
+    if(flags & CompactArrAmpdB) {
+        BARRFile.read(h);
+        arr.a = STD::pow(10.0f, HalfToFloat(h) / 20.0f);
+    } else {
+        BARRFile.read(arr.a);
+    }
+    BARRFile.read(arr.Phase);
+    arr.Phase *= DegRad;
+    float dr, di = 0.0f;
+    BARRFile.read(dr);
+    if(flags & CompactArrComplexDelay) BARRFile.read(di);
+    arr.delay = cpxf(dr, di);
+    BARRFile.read(h);
+    arr.SrcDeclAngle = HalfToFloat(h);
+    arr.SrcAzimAngle = 0.0f;
+    if constexpr(O3D) {
+        BARRFile.read(h);
+        arr.SrcAzimAngle = HalfToFloat(h);
+    }
+    BARRFile.read(h);
+    arr.RcvrDeclAngle = HalfToFloat(h);
+    arr.RcvrAzimAngle = 0.0f;
+    if constexpr(O3D) {
+        BARRFile.read(h);
+        arr.RcvrAzimAngle = HalfToFloat(h);
+    }
+    int16_t b;
+    BARRFile.read(b);
+    arr.NTopBnc = b;
+    BARRFile.read(b);
+    arr.NBotBnc = b;
+}
+
+template<bool O3D> inline void WriteArrivalASCII(LDOBuffer &AARRFile, const Arrival &arr)
+{
+    // Unnecessary inconsistent casting to float; see Fortran version
+    // readme.
+    // You can compress the output file a lot by putting in an explicit format
+    // statement here ... However, you'll need to make sure you keep adequate
+    // precision
+    AARRFile << arr.a;
+    if constexpr(O3D) {
+        AARRFile << RadDeg * arr.Phase;
+    } else {
+        AARRFile << (float)RadDeg * arr.Phase;
+    }
+    AARRFile << arr.delay.real() << arr.delay.imag() << arr.SrcDeclAngle;
+    if constexpr(O3D) AARRFile << arr.SrcAzimAngle;
+    AARRFile << arr.RcvrDeclAngle;
+    if constexpr(O3D) AARRFile << arr.RcvrAzimAngle;
+    AARRFile << arr.NTopBnc << arr.NBotBnc << '\n';
+}
+
+/// Receivers per block of the ASCII arrivals file, see LDOFile::writeblocks.
+constexpr size_t ArrASCIIBlockRcvrs = 256;
+
 template<bool O3D> void WriteOutArrivals(
-    const bhcParams<O3D> &params, const ArrInfo *arrinfo)
+    const bhcParams<O3D> &params, const ArrInfo *arrinfo, const char *FileRoot)
 {
     const Position *Pos = params.Pos;
 
     // LP: originally most of OpenOutputFiles
     bool isAscii;
+    int32_t compactFlags = 0;
     LDOFile AARRFile;
     UnformattedOFile BARRFile(GetInternal(params));
     switch(params.Beam->RunType[0]) {
@@ -99,7 +284,7 @@ template<bool O3D> void WriteOutArrivals(
     case 'A': // arrivals calculation, ascii
         isAscii = true;
 
-        AARRFile.open(GetInternal(params)->FileRoot + ".arr");
+        AARRFile.open(std::string(FileRoot) + ".arr");
         AARRFile << (O3D ? "3D" : "2D") << '\n';
         AARRFile << params.freqinfo->freq0 << '\n';
 
@@ -133,11 +318,32 @@ template<bool O3D> void WriteOutArrivals(
     case 'a': // arrivals calculation, binary
         isAscii = false;
 
-        BARRFile.open(GetInternal(params)->FileRoot + ".arr");
+        BARRFile.open(std::string(FileRoot) + ".arr");
         BARRFile.rec();
-        BARRFile.write((O3D ? "'3D'" : "'2D'"), 4);
+        if(arrinfo->isCompact) {
+            BARRFile.write((O3D ? "'3C'" : "'2C'"), 4);
+        } else {
+            BARRFile.write((O3D ? "'3D'" : "'2D'"), 4);
+        }
         BARRFile.rec();
         BARRFile.write((float)params.freqinfo->freq0);
+        if(arrinfo->isCompact) {
+            if(GetInternal(params)->compactArrivalsdB) compactFlags |= CompactArrAmpdB;
+            size_t n = GetFieldSize(params);
+            for(size_t base = 0; base < n; ++base) {
+                int32_t narr = arrinfo->NArr[base];
+                for(int32_t iArr = 0; iArr < narr; ++iArr) {
+                    size_t idx = ArrivalIndex(arrinfo, base, iArr);
+                    if(arrinfo->ArrC[idx].delayI != 0.0f) {
+                        compactFlags |= CompactArrComplexDelay;
+                        break;
+                    }
+                }
+                if(compactFlags & CompactArrComplexDelay) break;
+            }
+            BARRFile.rec();
+            BARRFile.write(compactFlags);
+        }
 
         // write source locations
         if constexpr(O3D) {
@@ -168,18 +374,41 @@ template<bool O3D> void WriteOutArrivals(
     default: EXTERR("WriteOutArrivals called while not in arrivals mode");
     }
     // LP: originally most of WriteArrivals[ASCII/Binary][3D]
+    if(isAscii) {
+        // The file is in GetFieldAddr order, with the maximum number of
+        // arrivals for each source before its first receiver, so blocks of
+        // receivers can be formatted independently.
+        size_t perSource = (size_t)Pos->Ntheta * (size_t)Pos->NRz_per_range
+            * (size_t)Pos->NRr;
+        size_t nRcvrs = perSource * (size_t)Pos->NSx * (size_t)Pos->NSy
+            * (size_t)Pos->NSz;
+        size_t nBlocks = (nRcvrs + ArrASCIIBlockRcvrs - 1) / ArrASCIIBlockRcvrs;
+        AARRFile.writeblocks(
+            GetInternal(params)->threadPool, nBlocks, 4,
+            [&](size_t iBlock, LDOBuffer &buf) {
+                size_t end = std::min((iBlock + 1) * ArrASCIIBlockRcvrs, nRcvrs);
+                for(size_t base = iBlock * ArrASCIIBlockRcvrs; base < end; ++base) {
+                    if(base % perSource == 0) {
+                        buf << arrinfo->MaxNPerSource[base / perSource] << '\n';
+                    }
+                    int32_t narr = arrinfo->NArr[base];
+                    buf << narr << '\n';
+                    for(int32_t iArr = 0; iArr < narr; ++iArr) {
+                        size_t idx = ArrivalIndex(arrinfo, base, iArr);
+                        WriteArrivalASCII<O3D>(buf, LoadArrival(arrinfo, idx));
+                    }
+                }
+            });
+        return;
+    }
     for(int32_t isz = 0; isz < Pos->NSz; ++isz) {
         for(int32_t isx = 0; isx < Pos->NSx; ++isx) {
             for(int32_t isy = 0; isy < Pos->NSy; ++isy) {
                 // LP: Maximum number of arrivals for this source
                 int32_t maxn
                     = arrinfo->MaxNPerSource[(isz * Pos->NSx + isx) * Pos->NSy + isy];
-                if(isAscii) {
-                    AARRFile << maxn << '\n';
-                } else {
-                    BARRFile.rec();
-                    BARRFile.write(maxn);
-                }
+                BARRFile.rec();
+                BARRFile.write(maxn);
 
                 for(int32_t itheta = 0; itheta < Pos->Ntheta; ++itheta) {
                     for(int32_t iz = 0; iz < Pos->NRz_per_range; ++iz) {
@@ -187,46 +416,26 @@ template<bool O3D> void WriteOutArrivals(
                             size_t base
                                 = GetFieldAddr(isx, isy, isz, itheta, iz, ir, Pos);
                             int32_t narr = arrinfo->NArr[base];
-                            if(isAscii) {
-                                AARRFile << narr << '\n';
-                            } else {
-                                BARRFile.rec();
-                                BARRFile.write(narr);
-                            }
+                            BARRFile.rec();
+                            BARRFile.write(narr);
 
                             for(int32_t iArr = 0; iArr < narr; ++iArr) {
-                                Arrival *arr
-                                    = &arrinfo->Arr[base * arrinfo->MaxNArr + iArr];
-                                // LP: Unnecessary inconsistent casting to float; see
-                                // Fortran version readme.
-                                if(isAscii) {
-                                    // You can compress the output file a lot by putting
-                                    // in an explicit format statement here ... However,
-                                    // you'll need to make sure you keep adequate
-                                    // precision
-                                    AARRFile << arr->a;
-                                    if constexpr(O3D) {
-                                        AARRFile << RadDeg * arr->Phase;
-                                    } else {
-                                        AARRFile << (float)RadDeg * arr->Phase;
-                                    }
-                                    AARRFile << arr->delay.real() << arr->delay.imag()
-                                             << arr->SrcDeclAngle;
-                                    if constexpr(O3D) AARRFile << arr->SrcAzimAngle;
-                                    AARRFile << arr->RcvrDeclAngle;
-                                    if constexpr(O3D) AARRFile << arr->RcvrAzimAngle;
-                                    AARRFile << arr->NTopBnc << arr->NBotBnc << '\n';
+                                size_t idx  = ArrivalIndex(arrinfo, base, iArr);
+                                Arrival arr = LoadArrival(arrinfo, idx);
+                                if(arrinfo->isCompact) {
+                                    if(iArr == 0) BARRFile.rec();
+                                    WriteCompactArrival<O3D>(BARRFile, arr, compactFlags);
                                 } else {
                                     BARRFile.rec();
-                                    BARRFile.write(arr->a);
-                                    BARRFile.write((float)(RadDeg * arr->Phase));
-                                    BARRFile.write(arr->delay);
-                                    BARRFile.write(arr->SrcDeclAngle);
-                                    if constexpr(O3D) BARRFile.write(arr->SrcAzimAngle);
-                                    BARRFile.write(arr->RcvrDeclAngle);
-                                    if constexpr(O3D) BARRFile.write(arr->RcvrAzimAngle);
-                                    BARRFile.write((float)arr->NTopBnc);
-                                    BARRFile.write((float)arr->NBotBnc);
+                                    BARRFile.write(arr.a);
+                                    BARRFile.write((float)(RadDeg * arr.Phase));
+                                    BARRFile.write(arr.delay);
+                                    BARRFile.write(arr.SrcDeclAngle);
+                                    if constexpr(O3D) BARRFile.write(arr.SrcAzimAngle);
+                                    BARRFile.write(arr.RcvrDeclAngle);
+                                    if constexpr(O3D) BARRFile.write(arr.RcvrAzimAngle);
+                                    BARRFile.write((float)arr.NTopBnc);
+                                    BARRFile.write((float)arr.NBotBnc);
                                 }
                             }
                         }
@@ -239,11 +448,11 @@ template<bool O3D> void WriteOutArrivals(
 
 #if BHC_ENABLE_2D
 template void WriteOutArrivals<false>(
-    const bhcParams<false> &params, const ArrInfo *arrinfo);
+    const bhcParams<false> &params, const ArrInfo *arrinfo, const char *FileRoot);
 #endif
 #if BHC_ENABLE_NX2D || BHC_ENABLE_3D
 template void WriteOutArrivals<true>(
-    const bhcParams<true> &params, const ArrInfo *arrinfo);
+    const bhcParams<true> &params, const ArrInfo *arrinfo, const char *FileRoot);
 #endif
 
 template<typename T> void ReadArrivalsValue(
@@ -304,14 +513,16 @@ template<bool O3D, bool R3D> void ReadOutArrivals(
         BARRFile.read(tempc, 4);
         dim = std::string(tempc, 4);
     }
+    // Compact format, see WriteCompactArrival
+    bool compact = !isAscii && dim == (O3D ? "'3C'" : "'2C'");
     if constexpr(O3D) {
-        if(dim != "'3D'") {
+        if(dim != "'3D'" && !compact) {
             EXTERR(
                 "Incorrect dimensionality in arrivals file, must be '3D', got %s",
                 dim.c_str());
         }
     } else {
-        if(dim != "'2D'") {
+        if(dim != "'2D'" && !compact) {
             EXTERR(
                 "Incorrect dimensionality in arrivals file, must be '2D', got %s",
                 dim.c_str());
@@ -321,6 +532,8 @@ template<bool O3D, bool R3D> void ReadOutArrivals(
     float tempf;
     ReadArrivalsValue(AARRFile, BARRFile, isAscii, tempf, true);
     params.freqinfo->freq0 = tempf;
+    int32_t compactFlags   = 0;
+    if(compact) ReadArrivalsValue(AARRFile, BARRFile, isAscii, compactFlags, true);
 
     if constexpr(O3D) {
         ReadArrivalsArray(
@@ -350,7 +563,6 @@ template<bool O3D, bool R3D> void ReadOutArrivals(
     Arr<O3D, R3D> arrmode;
     arrmode.Preprocess(params, outputs);
 
-    Arrival dummy_arr;
     for(int32_t isz = 0; isz < Pos->NSz; ++isz) {
         for(int32_t isx = 0; isx < Pos->NSx; ++isx) {
             for(int32_t isy = 0; isy < Pos->NSy; ++isy) {
@@ -374,50 +586,66 @@ template<bool O3D, bool R3D> void ReadOutArrivals(
                                     "/ rcvr tzr %d,%d,%d), but only memory for %d",
                                     isx, isy, isz, itheta, iz, ir, narr, keep_narr);
                             }
-                            arrinfo->NArr[base] = keep_narr;
                             for(int32_t iArr = 0; iArr < narr; ++iArr) {
-                                Arrival *arr;
-                                if(iArr < keep_narr) {
-                                    arr = &arrinfo->Arr[base * arrinfo->MaxNArr + iArr];
-                                } else {
-                                    arr = &dummy_arr;
+                                size_t idx = 0;
+                                if(iArr < keep_narr
+                                   && !ClaimArrival(arrinfo, base, iArr, idx)) {
+                                    // Arena is full
+                                    EXTWARN(
+                                        "%d arrivals in file (source xyz %d,%d,%d "
+                                        "/ rcvr tzr %d,%d,%d), but only memory "
+                                        "for %d",
+                                        narr, isx, isy, isz, itheta, iz, ir, iArr);
+                                    keep_narr = iArr;
                                 }
-                                ReadArrivalsValue(
-                                    AARRFile, BARRFile, isAscii, arr->a, true);
-                                if(isAscii) {
-                                    // LP: 3D writes double precision to file, don't
-                                    // read that into a float before multiplication
-                                    real phase;
-                                    AARRFile.Read(phase);
-                                    arr->Phase = DegRad * phase;
-                                } else {
-                                    BARRFile.read(arr->Phase);
-                                    arr->Phase *= DegRad;
+                                Arrival arr;
+                                if(compact) {
+                                    if(iArr == 0) BARRFile.rec();
+                                    ReadCompactArrival<O3D>(BARRFile, arr, compactFlags);
+                                    if(iArr < keep_narr) StoreArrival(arrinfo, idx, arr);
+                                    continue;
                                 }
-                                float f1, f2;
-                                ReadArrivalsValue(AARRFile, BARRFile, isAscii, f1);
-                                ReadArrivalsValue(AARRFile, BARRFile, isAscii, f2);
-                                arr->delay = cpxf(f1, f2);
-                                ReadArrivalsValue(
-                                    AARRFile, BARRFile, isAscii, arr->SrcDeclAngle);
-                                if constexpr(O3D)
-                                    ReadArrivalsValue(
-                                        AARRFile, BARRFile, isAscii, arr->SrcAzimAngle);
-                                ReadArrivalsValue(
-                                    AARRFile, BARRFile, isAscii, arr->RcvrDeclAngle);
-                                if constexpr(O3D)
-                                    ReadArrivalsValue(
-                                        AARRFile, BARRFile, isAscii, arr->RcvrAzimAngle);
-                                if(isAscii) {
-                                    AARRFile.Read(arr->NTopBnc);
-                                    AARRFile.Read(arr->NBotBnc);
-                                } else {
-                                    BARRFile.read(f1);
-                                    BARRFile.read(f2);
-                                    arr->NTopBnc = f1;
-                                    arr->NBotBnc = f2;
+                                if(!isAscii) {
+                                    // Each arrival is one record of floats,
+                                    // read in one go.
+                                    float v[10];
+                                    BARRFile.rec();
+                                    BARRFile.read(v, O3D ? 10 : 8);
+                                    arr.a             = v[0];
+                                    arr.Phase         = v[1] * DegRad;
+                                    arr.delay         = cpxf(v[2], v[3]);
+                                    int32_t k         = 4;
+                                    arr.SrcDeclAngle  = v[k++];
+                                    arr.SrcAzimAngle  = O3D ? v[k++] : 0.0f;
+                                    arr.RcvrDeclAngle = v[k++];
+                                    arr.RcvrAzimAngle = O3D ? v[k++] : 0.0f;
+                                    arr.NTopBnc       = (int32_t)v[k++];
+                                    arr.NBotBnc       = (int32_t)v[k++];
+                                    if(iArr < keep_narr) StoreArrival(arrinfo, idx, arr);
+                                    continue;
                                 }
+                                LIST(AARRFile);
+                                AARRFile.Read(arr.a);
+                                // LP: 3D writes double precision to file, don't
+                                // read that into a float before multiplication
+                                real phase = RL(0.0);
+                                AARRFile.Read(phase);
+                                arr.Phase = DegRad * phase;
+                                float f1, f2;
+                                AARRFile.Read(f1);
+                                AARRFile.Read(f2);
+                                arr.delay = cpxf(f1, f2);
+                                AARRFile.Read(arr.SrcDeclAngle);
+                                arr.SrcAzimAngle = 0.0f;
+                                if constexpr(O3D) AARRFile.Read(arr.SrcAzimAngle);
+                                AARRFile.Read(arr.RcvrDeclAngle);
+                                arr.RcvrAzimAngle = 0.0f;
+                                if constexpr(O3D) AARRFile.Read(arr.RcvrAzimAngle);
+                                AARRFile.Read(arr.NTopBnc);
+                                AARRFile.Read(arr.NBotBnc);
+                                if(iArr < keep_narr) StoreArrival(arrinfo, idx, arr);
                             }
+                            arrinfo->NArr[base] = keep_narr;
                         }
                     }
                 }
@@ -33,11 +33,11 @@ extern template void PostProcessArrivals<true, true>(
     const bhcParams<true> &params, ArrInfo *arrinfo);
 
 template<bool O3D> void WriteOutArrivals(
-    const bhcParams<O3D> &params, const ArrInfo *arrinfo);
+    const bhcParams<O3D> &params, const ArrInfo *arrinfo, const char *FileRoot);
 extern template void WriteOutArrivals<false>(
-    const bhcParams<false> &params, const ArrInfo *arrinfo);
+    const bhcParams<false> &params, const ArrInfo *arrinfo, const char *FileRoot);
 extern template void WriteOutArrivals<true>(
-    const bhcParams<true> &params, const ArrInfo *arrinfo);
+    const bhcParams<true> &params, const ArrInfo *arrinfo, const char *FileRoot);
 
 template<bool O3D, bool R3D> void ReadOutArrivals(
     bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const char *FileRoot);
@@ -48,6 +48,73 @@ extern template void ReadOutArrivals<true, false>(
 extern template void ReadOutArrivals<true, true>(
     bhcParams<true> &params, bhcOutputs<true, true> &outputs, const char *FileRoot);
 
+/**
+ * Time series at every receiver from its (post-processed) arrivals, see
+ * bhc::synthesize_waveforms(). out holds nSamples per receiver, with the
+ * receivers in the order of GetFieldAddr.
+ */
+template<bool O3D> void SynthesizeWaveforms(
+    const bhcParams<O3D> &params, const ArrInfo *arrinfo, const bhcWaveformParams &wp,
+    float *out, size_t outCount);
+extern template void SynthesizeWaveforms<false>(
+    const bhcParams<false> &params, const ArrInfo *arrinfo,
+    const bhcWaveformParams &wp, float *out, size_t outCount);
+extern template void SynthesizeWaveforms<true>(
+    const bhcParams<true> &params, const ArrInfo *arrinfo, const bhcWaveformParams &wp,
+    float *out, size_t outCount);
+
+/**
+ * Removes all arrivals, keeping the allocations. In arena mode, this also
+ * returns all the chunks to the arena.
+ */
+template<bool O3D> inline void ClearArrivals(
+    const bhcParams<O3D> &params, ArrInfo *arrinfo)
+{
+    size_t n = GetFieldSize(params);
+    memset(arrinfo->NArr, 0, n * sizeof(int32_t));
+    if(arrinfo->ArrChunks != nullptr) {
+        size_t chunksPerRcvr = (size_t)(arrinfo->MaxNArr / arrinfo->ArrChunkSize);
+        // All bytes 0xFF is -1.
+        memset(arrinfo->ArrChunks, 0xFF, n * chunksPerRcvr * sizeof(int32_t));
+        *arrinfo->ArrChunksUsed = 0;
+    }
+}
+
+/// Frees the arrivals, or forgets them if they are the caller's memory, see
+/// bhc::set_output_buffers.
+template<bool O3D> inline void ReleaseArrivals(
+    const bhcParams<O3D> &params, ArrInfo *arrinfo)
+{
+    bhcInternal *internal = GetInternal(params);
+    if(internal->arrivalsIsUser) {
+        arrinfo->Arr             = nullptr;
+        arrinfo->ArrC            = nullptr;
+        internal->arrivalsIsUser = false;
+    } else {
+        trackdeallocate(params, arrinfo->Arr);
+        trackdeallocate(params, arrinfo->ArrC);
+    }
+}
+
+/// Allocates nArr arrivals, or uses the caller's memory.
+template<bool O3D> inline void AllocateArrivals(
+    const bhcParams<O3D> &params, ArrInfo *arrinfo, size_t nArr)
+{
+    bhcInternal *internal = GetInternal(params);
+    if(internal->userArrivals != nullptr) {
+        if(arrinfo->isCompact) {
+            arrinfo->ArrC = (ArrivalCompact *)internal->userArrivals;
+        } else {
+            arrinfo->Arr = (Arrival *)internal->userArrivals;
+        }
+        internal->arrivalsIsUser = true;
+    } else if(arrinfo->isCompact) {
+        trackallocate(params, "arrivals", arrinfo->ArrC, nArr);
+    } else {
+        trackallocate(params, "arrivals", arrinfo->Arr, nArr);
+    }
+}
+
 template<bool O3D, bool R3D> class Arr : public Field<O3D, R3D> {
 public:
     Arr() {}
@@ -56,9 +123,15 @@ public:
     virtual void Init(bhcOutputs<O3D, R3D> &outputs) const override
     {
         outputs.arrinfo->Arr           = nullptr;
+        outputs.arrinfo->ArrC          = nullptr;
+        outputs.arrinfo->isCompact     = false;
         outputs.arrinfo->NArr          = nullptr;
         outputs.arrinfo->MaxNPerSource = nullptr;
         outputs.arrinfo->MaxNArr       = 1;
+        outputs.arrinfo->ArrChunks     = nullptr;
+        outputs.arrinfo->ArrChunksUsed = nullptr;
+        outputs.arrinfo->ArrChunkSize  = 0;
+        outputs.arrinfo->NArrChunks    = 0;
     }
 
     virtual void Preprocess(
@@ -73,22 +146,50 @@ public:
         Field<O3D, R3D>::Preprocess(params, outputs);
         ArrInfo *arrinfo = outputs.arrinfo;
 
-        trackdeallocate(params, arrinfo->Arr);
+        ReleaseArrivals(params, arrinfo);
         trackdeallocate(params, arrinfo->NArr);
         trackdeallocate(params, arrinfo->MaxNPerSource);
-        arrinfo->AllowMerging = GetInternal(params)->numThreads == 1;
+        trackdeallocate(params, arrinfo->ArrChunks);
+        trackdeallocate(params, arrinfo->ArrChunksUsed);
+        // Interleaved rays in a packet break the pairing of consecutive
+        // arrivals just as threads do, so those runs merge afterwards too.
+        arrinfo->AllowMerging = GetInternal(params)->numThreads == 1
+            && GetInternal(params)->rayPacketSize == 1;
+        arrinfo->isCompact    = GetInternal(params)->compactArrivals;
+        size_t arrSize        = ArrivalBytes(arrinfo);
         size_t nSrcs          = params.Pos->NSx * params.Pos->NSy * params.Pos->NSz;
         size_t nSrcsRcvrs     = nSrcs * params.Pos->Ntheta * params.Pos->NRr
             * params.Pos->NRz_per_range;
-        int64_t remainingMemory = GetInternal(params)->maxMemory
-            - GetInternal(params)->usedMemory;
-        remainingMemory -= nSrcsRcvrs * sizeof(int32_t);
+        // Multi-GPU runs may need the arrivals and counts for each GPU
+        size_t nCopies          = (size_t)NumDeviceOutputCopies<O3D>(params);
+        int64_t remainingMemory = (int64_t)RemainingOutputMemory(params);
+        remainingMemory -= nCopies * nSrcsRcvrs * sizeof(int32_t);
         remainingMemory -= nSrcs * sizeof(int32_t);
         if(IsAlsoEigenraysRun(params.Beam)) { remainingMemory -= remainingMemory / 2; }
         remainingMemory -= 32 * 3; // Possible padding used for the three arrays
+        remainingMemory -= 128 * (nCopies - 1); // Per-GPU copies, including ArrInfo
         remainingMemory  = std::max(remainingMemory, (int64_t)0);
-        arrinfo->MaxNArr = (int32_t)std::min<int32_t>(
-            remainingMemory / (nSrcsRcvrs * sizeof(Arrival)), (size_t)0x7FFFFFFF);
+        if(GetInternal(params)->arrivalsChunkSize > 0) {
+            PreprocessArena(
+                params, arrinfo, nSrcs, nSrcsRcvrs, arrSize, remainingMemory);
+            return;
+        }
+        bhcInternal *internal = GetInternal(params);
+        if(internal->userArrivals != nullptr) {
+            // The caller's memory holds the primary copy; any per-GPU
+            // copies still come out of maxMemory.
+            size_t maxNArr = internal->userArrivalsBytes / (nSrcsRcvrs * arrSize);
+            if(nCopies > 1) {
+                maxNArr = bhc::min(
+                    maxNArr,
+                    (size_t)remainingMemory / ((nCopies - 1) * nSrcsRcvrs * arrSize));
+            }
+            arrinfo->MaxNArr = (int32_t)bhc::min(maxNArr, (size_t)0x7FFFFFFF);
+        } else {
+            arrinfo->MaxNArr = (int32_t)std::min<int32_t>(
+                remainingMemory / (nCopies * nSrcsRcvrs * arrSize),
+                (size_t)0x7FFFFFFF);
+        }
         if(arrinfo->MaxNArr == 0) {
             EXTERR("Insufficient memory to allocate arrivals");
         } else if(arrinfo->MaxNArr < 10) {
@@ -98,15 +199,61 @@ public:
         }
         GetInternal(params)->PRTFile << "\n( Maximum # of arrivals = " << arrinfo->MaxNArr
                                      << " )\n";
-        trackallocate(
-            params, "arrivals", arrinfo->Arr, nSrcsRcvrs * (size_t)arrinfo->MaxNArr);
+        size_t nArr = nSrcsRcvrs * (size_t)arrinfo->MaxNArr;
+        AllocateArrivals(params, arrinfo, nArr);
         trackallocate(params, "arrivals", arrinfo->NArr, nSrcsRcvrs);
         trackallocate(params, "arrivals", arrinfo->MaxNPerSource, nSrcs);
-        memset(arrinfo->Arr, 0, nSrcsRcvrs * (size_t)arrinfo->MaxNArr * sizeof(Arrival));
+        if(arrinfo->isCompact) {
+            zerooutput(params, arrinfo->ArrC, nArr);
+        } else {
+            zerooutput(params, arrinfo->Arr, nArr);
+        }
         memset(arrinfo->NArr, 0, nSrcsRcvrs * sizeof(int32_t));
         // MaxNPerSource does not have to be initialized
     }
 
+    /**
+     * Arena mode, see bhcInit::arrivalsChunkSize. The arena takes all the
+     * remaining memory, but it is neither cleared nor touched until chunks are
+     * handed out, so the pages which are never used do not take physical
+     * memory.
+     */
+    void PreprocessArena(
+        bhcParams<O3D> &params, ArrInfo *arrinfo, size_t nSrcs, size_t nSrcsRcvrs,
+        size_t arrSize, int64_t remainingMemory) const
+    {
+        bhcInternal *internal = GetInternal(params);
+        int32_t chunkSize     = internal->arrivalsChunkSize;
+        int32_t chunksPerRcvr = bhc::max(
+            (internal->arrivalsMaxPerRcvr + chunkSize - 1) / chunkSize, 1);
+        arrinfo->ArrChunkSize = chunkSize;
+        arrinfo->MaxNArr      = chunksPerRcvr * chunkSize;
+        remainingMemory -= (int64_t)(nSrcsRcvrs * chunksPerRcvr * sizeof(int32_t));
+        remainingMemory -= 32 * 2; // Chunk table and counter
+        size_t maxChunks = bhc::min(
+            nSrcsRcvrs * (size_t)chunksPerRcvr, (size_t)0x7FFFFFFF);
+        size_t arenaBytes = internal->userArrivals != nullptr
+            ? internal->userArrivalsBytes
+            : (size_t)std::max(remainingMemory, (int64_t)0);
+        arrinfo->NArrChunks = (int32_t)bhc::min(
+            arenaBytes / ((size_t)chunkSize * arrSize), maxChunks);
+        if(arrinfo->NArrChunks == 0) {
+            EXTERR("Insufficient memory to allocate arrivals");
+        }
+        internal->PRTFile << "\n( Maximum # of arrivals = " << arrinfo->MaxNArr
+                          << ", arena of " << arrinfo->NArrChunks << " chunks of "
+                          << chunkSize << " )\n";
+        size_t nArr = (size_t)arrinfo->NArrChunks * (size_t)chunkSize;
+        AllocateArrivals(params, arrinfo, nArr);
+        trackallocate(params, "arrivals", arrinfo->NArr, nSrcsRcvrs);
+        trackallocate(params, "arrivals", arrinfo->MaxNPerSource, nSrcs);
+        trackallocate(
+            params, "arrivals chunk table", arrinfo->ArrChunks,
+            nSrcsRcvrs * (size_t)chunksPerRcvr);
+        trackallocate(params, "arrivals chunk counter", arrinfo->ArrChunksUsed);
+        ClearArrivals(params, arrinfo);
+    }
+
     virtual void Postprocess(
         bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs) const override
     {
@@ -114,9 +261,10 @@ public:
     }
 
     virtual void Writeout(
-        const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs) const override
+        const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+        const char *FileRoot) const override
     {
-        WriteOutArrivals<O3D>(params, outputs.arrinfo);
+        WriteOutArrivals<O3D>(params, outputs.arrinfo, FileRoot);
     }
 
     virtual void Readout(
@@ -129,9 +277,11 @@ public:
     virtual void Finalize(
         bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs) const override
     {
-        trackdeallocate(params, outputs.arrinfo->Arr);
+        ReleaseArrivals(params, outputs.arrinfo);
         trackdeallocate(params, outputs.arrinfo->NArr);
         trackdeallocate(params, outputs.arrinfo->MaxNPerSource);
+        trackdeallocate(params, outputs.arrinfo->ArrChunks);
+        trackdeallocate(params, outputs.arrinfo->ArrChunksUsed);
     }
 };
 
@@ -19,49 +19,140 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #include "eigen.hpp"
 #include "../common_run.hpp"
 
+#include <algorithm>
+#include <tuple>
+#include <vector>
+
 namespace bhc { namespace mode {
 
 template<bool O3D, bool R3D> void EigenModePostWorker(
-    const bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, int32_t worker,
-    ErrState *errState)
+    const bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs,
+    const std::vector<int32_t> &leaders, int32_t worker, ErrState *errState)
 {
-    SetupThread();
-    while(true) {
-        int32_t job = GetInternal(params)->sharedJobID++;
-        if(job >= bhc::min(outputs.eigen->neigen, outputs.eigen->memsize)) break;
-        EigenHit *hit  = &outputs.eigen->hits[job];
-        int32_t Nsteps = hit->is;
-        RayInitInfo rinit;
-        rinit.isx    = hit->isx;
-        rinit.isy    = hit->isy;
-        rinit.isz    = hit->isz;
-        rinit.ialpha = hit->ialpha;
-        rinit.ibeta  = hit->ibeta;
-        if(!RunRay<O3D, R3D>(
-               outputs.rayinfo, params, job, worker, rinit, Nsteps, errState)) {
-            // Already gave out of memory error; that is the only condition leading
-            // here printf("EigenModePostWorker RunRay failed\n");
-            break;
+    JobScheduler &sched = GetInternal(params)->jobSched;
+    ExecTrace &trace    = GetInternal(params)->execTrace;
+    bool tracing        = trace.Enabled();
+    int32_t begin, end;
+    while(sched.GetNextJobs(worker, begin, end)) {
+        for(int32_t i = begin; i < end; ++i) {
+            double tBegin  = tracing ? trace.Now() : 0.0;
+            int32_t job    = leaders[i];
+            EigenHit *hit  = &outputs.eigen->hits[job];
+            int32_t Nsteps = hit->is;
+            RayInitInfo rinit;
+            rinit.isx    = hit->isx;
+            rinit.isy    = hit->isy;
+            rinit.isz    = hit->isz;
+            rinit.ialpha = hit->ialpha;
+            rinit.ibeta  = hit->ibeta;
+            if(!RunRay<O3D, R3D>(
+                   outputs.rayinfo, params, job, worker, rinit, Nsteps, errState)) {
+                // Already gave out of memory error; that is the only condition leading
+                // here printf("EigenModePostWorker RunRay failed\n");
+                return;
+            }
+            if(tracing) trace.Job(worker, "eigenray", tBegin, job, rinit);
         }
     }
 }
 
 #if BHC_ENABLE_2D
 template void EigenModePostWorker<false, false>(
-    const bhcParams<false> &params, bhcOutputs<false, false> &outputs, int32_t worker,
-    ErrState *errState);
+    const bhcParams<false> &params, bhcOutputs<false, false> &outputs,
+    const std::vector<int32_t> &leaders, int32_t worker, ErrState *errState);
 #endif
 #if BHC_ENABLE_NX2D
 template void EigenModePostWorker<true, false>(
-    const bhcParams<true> &params, bhcOutputs<true, false> &outputs, int32_t worker,
-    ErrState *errState);
+    const bhcParams<true> &params, bhcOutputs<true, false> &outputs,
+    const std::vector<int32_t> &leaders, int32_t worker, ErrState *errState);
 #endif
 #if BHC_ENABLE_3D
 template void EigenModePostWorker<true, true>(
-    const bhcParams<true> &params, bhcOutputs<true, true> &outputs, int32_t worker,
-    ErrState *errState);
+    const bhcParams<true> &params, bhcOutputs<true, true> &outputs,
+    const std::vector<int32_t> &leaders, int32_t worker, ErrState *errState);
 #endif
 
+/**
+ * Several hits often come from the same launch ray (e.g. the same ray
+ * passing several receivers). Each of those re-traces would follow the same
+ * path, only stopping at a different step, so only the hit with the most
+ * steps from each ray (the leader) is traced, and the other hits (followers)
+ * use the first steps of the same ray. Returns the hit indices of the
+ * leaders, and fills in followers[hit] with the leader of each follower hit
+ * or -1 for leaders.
+ */
+inline std::vector<int32_t> GroupEigenHits(
+    const EigenInfo *eigen, int32_t nhits, std::vector<int32_t> &followers)
+{
+    std::vector<int32_t> order(nhits);
+    for(int32_t h = 0; h < nhits; ++h) order[h] = h;
+    auto key = [eigen](int32_t h) {
+        const EigenHit &e = eigen->hits[h];
+        // Most steps first, so the leader of each ray is the first of its hits
+        return std::make_tuple(e.isz, e.isx, e.isy, e.ialpha, e.ibeta, -e.is);
+    };
+    std::sort(order.begin(), order.end(), [&key](int32_t a, int32_t b) {
+        return key(a) < key(b);
+    });
+    std::vector<int32_t> leaders;
+    followers.assign(nhits, -1);
+    for(int32_t i = 0; i < nhits; ++i) {
+        int32_t h = order[i];
+        if(!leaders.empty()) {
+            const EigenHit &l = eigen->hits[leaders.back()];
+            const EigenHit &e = eigen->hits[h];
+            if(l.isz == e.isz && l.isx == e.isx && l.isy == e.isy && l.ialpha == e.ialpha
+               && l.ibeta == e.ibeta) {
+                followers[h] = leaders.back();
+                continue;
+            }
+        }
+        leaders.push_back(h);
+    }
+    // Trace in the original hit order, which is roughly the order of the rays
+    std::sort(leaders.begin(), leaders.end());
+    return leaders;
+}
+
+/// Total bounces at point is of a traced ray, or -1 if not stored exactly.
+template<bool O3D, bool R3D> inline int32_t RayBounces(
+    const RayResult<O3D, R3D> &res, int32_t is)
+{
+    if(res.ray != nullptr) return res.ray[is].NumTopBnc + res.ray[is].NumBotBnc;
+    if(res.compact != nullptr) {
+        const rayPtCompact<R3D> &pt = res.compact[is];
+        if(pt.NumTopBnc == 0x7FFF || pt.NumBotBnc == 0x7FFF) return -1;
+        return pt.NumTopBnc + pt.NumBotBnc;
+    }
+    if(res.soa.NumTopBnc != nullptr)
+        return res.soa.NumTopBnc[is] + res.soa.NumBotBnc[is];
+    return -1;
+}
+
+/**
+ * Number of steps of a follower whose hit is at step is, cut from its leader's
+ * ray, or -1 if it has to be traced again. 0 if the leader's ray did not fit in
+ * memory, as the follower's would not either.
+ *
+ * When asked for is steps, MainRayMode stops at the first step it starts from
+ * which is >= is, and keeps the point after it. A reflection is a two-step,
+ * which is never started from its middle point (the one on the boundary); that
+ * is the only point followed by a bounce. The leader's ray is identical up to
+ * its own stop, so the step is found from its bounce counts.
+ */
+template<bool O3D, bool R3D> inline int32_t FollowerSteps(
+    const RayResult<O3D, R3D> &leader, int32_t is)
+{
+    if(leader.ray == nullptr && leader.compact == nullptr && leader.soa.x == nullptr)
+        return 0;
+    for(int32_t s = is; s + 1 < leader.Nsteps; ++s) {
+        int32_t b0 = RayBounces(leader, s), b1 = RayBounces(leader, s + 1);
+        if(b0 < 0 || b1 < 0) return -1;
+        if(s == 0 || b1 == b0) return s + 2 <= leader.Nsteps ? s + 2 : -1;
+    }
+    return -1;
+}
+
 template<bool O3D, bool R3D> void PostProcessEigenrays(
     bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
 {
@@ -76,16 +167,43 @@ template<bool O3D, bool R3D> void PostProcessEigenrays(
         EXTWARN("%d eigenrays\n", (int)outputs.eigen->neigen);
     }
 
+    int32_t nhits = bhc::min(outputs.eigen->neigen, outputs.eigen->memsize);
+    std::vector<int32_t> followers;
+    std::vector<int32_t> leaders = GroupEigenHits(outputs.eigen, nhits, followers);
+
     ErrState errState;
     ResetErrState(&errState);
-    GetInternal(params)->sharedJobID = 0;
-    int32_t numThreads               = GetInternal(params)->numThreads;
-    std::vector<std::thread> threads;
-    for(int32_t i = 0; i < numThreads; ++i)
-        threads.push_back(std::thread(
-            EigenModePostWorker<O3D, R3D>, std::cref(params), std::ref(outputs), i,
-            &errState));
-    for(int32_t i = 0; i < numThreads; ++i) threads[i].join();
+    int32_t numThreads = GetInternal(params)->numThreads;
+    GetInternal(params)->jobSched.Init(
+        (int32_t)leaders.size(), numThreads, GetInternal(params)->jobChunkSize);
+    GetInternal(params)->threadPool.Run([&](int32_t worker) {
+        EigenModePostWorker<O3D, R3D>(params, outputs, leaders, worker, &errState);
+    });
+    CheckReportErrors(GetInternal(params), &errState);
+
+    // The followers share the leader's memory, which is fine as CompressRay never
+    // does anything with the current MaxN. A follower which cannot be cut from its
+    // leader is traced again on its own, serially, as this is rare.
+    RayResult<O3D, R3D> *results = outputs.rayinfo->results;
+    for(int32_t h = 0; h < nhits; ++h) {
+        int32_t l = followers[h];
+        if(l < 0) continue;
+        int32_t Nsteps = FollowerSteps(results[l], outputs.eigen->hits[h].is);
+        if(Nsteps >= 0) {
+            results[h]        = results[l];
+            results[h].Nsteps = Nsteps;
+            continue;
+        }
+        EigenHit *hit  = &outputs.eigen->hits[h];
+        RayInitInfo rinit;
+        rinit.isx    = hit->isx;
+        rinit.isy    = hit->isy;
+        rinit.isz    = hit->isz;
+        rinit.ialpha = hit->ialpha;
+        rinit.ibeta  = hit->ibeta;
+        Nsteps       = hit->is;
+        RunRay<O3D, R3D>(outputs.rayinfo, params, h, 0, rinit, Nsteps, &errState);
+    }
     CheckReportErrors(GetInternal(params), &errState);
 
     raymode.Postprocess(params, outputs);
@@ -54,7 +54,7 @@ public:
         // Use 1 / hitsMemFraction of the available memory for eigenray hits
         // (the rest for rays).
         constexpr size_t hitsMemFraction = 500;
-        size_t mem     = GetInternal(params)->maxMemory - GetInternal(params)->usedMemory;
+        size_t mem     = RemainingOutputMemory(params);
         eigen->memsize = (int32_t)
             std::min(mem / (hitsMemFraction * sizeof(EigenHit)), (size_t)0x7FFFFFFF);
         if(eigen->memsize == 0) {
@@ -69,6 +69,30 @@ public:
         eigen->neigen = 0;
     }
 
+    virtual void Run(bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs) const override
+    {
+        Field<O3D, R3D>::Run(params, outputs);
+        // If the hits did not fit, trace the rays again in a second pass
+        // with room for all of them, as long as that still leaves at least as
+        // much memory for the eigenrays themselves. Not after the adaptive
+        // fan, which has already refined the fan.
+        EigenInfo *eigen = outputs.eigen;
+        if(eigen->neigen <= eigen->memsize || UseAdaptiveFan(params)) return;
+        size_t avail = RemainingOutputMemory(params)
+            + (size_t)eigen->memsize * sizeof(EigenHit);
+        if((size_t)eigen->neigen * sizeof(EigenHit) > avail / 2) return;
+        bhcInternal *internal = GetInternal(params);
+        internal->PRTFile << "\nOnly " << eigen->memsize << " of " << eigen->neigen
+                          << " eigenray hits fit, tracing again with room for all\n";
+        int32_t memsize = eigen->neigen;
+        trackdeallocate(params, eigen->hits);
+        eigen->memsize = memsize;
+        trackallocate(params, "eigenray hits", eigen->hits, eigen->memsize);
+        eigen->neigen               = 0;
+        internal->completedRayCount = 0;
+        RunFieldModesSelInfl<O3D, R3D>(params, outputs, internal->retainRays);
+    }
+
     virtual void Postprocess(
         bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs) const override
     {
@@ -76,10 +100,11 @@ public:
     }
 
     virtual void Writeout(
-        const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs) const override
+        const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+        const char *FileRoot) const override
     {
         Ray<O3D, R3D> raymode;
-        raymode.Writeout(params, outputs);
+        raymode.Writeout(params, outputs, FileRoot);
     }
 
     virtual void Finalize(
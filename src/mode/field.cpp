@@ -17,29 +17,75 @@ You should have received a copy of the GNU General Public License along with
 this program. If not, see <https://www.gnu.org/licenses/>.
 */
 #include "field.hpp"
+#include "arr.hpp"
+#include "tl.hpp"
 #include "../common_run.hpp"
 
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <vector>
+
 namespace bhc { namespace mode {
 
+/**
+ * 2D: whether all the environments of the batch can use the flat boundary
+ * specialization, see BdryShape. The only segment must extend past the beam
+ * box, so that the ray never reaches its ends.
+ */
+template<bool O3D, bool R3D> inline bool UseFlatBdry(const FieldBatch<O3D, R3D> &batch)
+{
+    if constexpr(O3D) {
+        return false;
+    } else {
+        for(int32_t e = 0; e < batch.n; ++e) {
+            const bhcParams<false> &params = batch.params[e];
+            real box                       = params.Beam->Box.x;
+            for(const BdryInfoTopBot<false> *bdi :
+                {&params.bdinfo->top, &params.bdinfo->bot}) {
+                if(!bdi->flat || bdi->bd[0].x.x >= -box || bdi->bd[1].x.x <= box) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+}
+
+template<char RT, char IT, char ST, bool O3D, bool R3D> inline void RunFieldModesSelBdry(
+    FieldBatch<O3D, R3D> &batch)
+{
+#ifdef BHC_BDRY_ENABLE_FLAT
+    if constexpr(!O3D && !SSPType<ST>::IsQuad()) {
+        if(UseFlatBdry(batch)) {
+            RunFieldModesImpl<CfgSel<RT, IT, ST, 'F'>, O3D, R3D>(batch);
+            return;
+        }
+    }
+#endif
+    RunFieldModesImpl<CfgSel<RT, IT, ST>, O3D, R3D>(batch);
+}
+
 template<char RT, char IT, bool O3D, bool R3D> inline void RunFieldModesSelSSP(
-    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
+    FieldBatch<O3D, R3D> &batch)
 {
-    char st = params.ssp->Type;
+    const bhcParams<O3D> &params = batch.params[0];
+    char st                      = params.ssp->Type;
     if(st == 'N') {
 #ifdef BHC_SSP_ENABLE_N2LINEAR
-        RunFieldModesImpl<CfgSel<RT, IT, 'N'>, O3D, R3D>(params, outputs);
+        RunFieldModesSelBdry<RT, IT, 'N', O3D, R3D>(batch);
 #else
         EXTERR("N2-linear SSP (ssp->Type == 'N') was not enabled at compile time!");
 #endif
     } else if(st == 'C') {
 #ifdef BHC_SSP_ENABLE_CLINEAR
-        RunFieldModesImpl<CfgSel<RT, IT, 'C'>, O3D, R3D>(params, outputs);
+        RunFieldModesSelBdry<RT, IT, 'C', O3D, R3D>(batch);
 #else
         EXTERR("C-linear SSP (ssp->Type == 'C') was not enabled at compile time!");
 #endif
     } else if(st == 'S') {
 #ifdef BHC_SSP_ENABLE_CUBIC
-        RunFieldModesImpl<CfgSel<RT, IT, 'S'>, O3D, R3D>(params, outputs);
+        RunFieldModesSelBdry<RT, IT, 'S', O3D, R3D>(batch);
 #else
         EXTERR("Cubic spline SSP (ssp->Type == 'S') was not enabled at compile time!");
 #endif
@@ -48,7 +94,7 @@ template<char RT, char IT, bool O3D, bool R3D> inline void RunFieldModesSelSSP(
 #ifdef BHC_LIMIT_FEATURES
         if constexpr(!O3D) {
 #endif
-            RunFieldModesImpl<CfgSel<RT, IT, 'P'>, O3D, R3D>(params, outputs);
+            RunFieldModesSelBdry<RT, IT, 'P', O3D, R3D>(batch);
 #ifdef BHC_LIMIT_FEATURES
         } else {
             EXTERR("Nx2D or 3D PCHIP SSP not supported"
@@ -61,7 +107,7 @@ template<char RT, char IT, bool O3D, bool R3D> inline void RunFieldModesSelSSP(
     } else if(st == 'Q') {
 #ifdef BHC_SSP_ENABLE_QUAD
         if constexpr(!O3D) {
-            RunFieldModesImpl<CfgSel<RT, IT, 'Q'>, O3D, R3D>(params, outputs);
+            RunFieldModesSelBdry<RT, IT, 'Q', O3D, R3D>(batch);
         } else {
             EXTERR("Quad SSP not supported in Nx2D or 3D mode!");
         }
@@ -71,7 +117,7 @@ template<char RT, char IT, bool O3D, bool R3D> inline void RunFieldModesSelSSP(
     } else if(st == 'H') {
 #ifdef BHC_SSP_ENABLE_HEXAHEDRAL
         if constexpr(O3D) {
-            RunFieldModesImpl<CfgSel<RT, IT, 'H'>, O3D, R3D>(params, outputs);
+            RunFieldModesSelBdry<RT, IT, 'H', O3D, R3D>(batch);
         } else {
             EXTERR("Hexahedral SSP not supported in 2D mode!");
         }
@@ -80,7 +126,7 @@ template<char RT, char IT, bool O3D, bool R3D> inline void RunFieldModesSelSSP(
 #endif
     } else if(st == 'A') {
 #ifdef BHC_SSP_ENABLE_ANALYTIC
-        RunFieldModesImpl<CfgSel<RT, IT, 'A'>, O3D, R3D>(params, outputs);
+        RunFieldModesSelBdry<RT, IT, 'A', O3D, R3D>(batch);
 #else
         EXTERR("Analytic SSP (ssp->Type == 'A') was not enabled at compile time!");
 #endif
@@ -90,12 +136,13 @@ template<char RT, char IT, bool O3D, bool R3D> inline void RunFieldModesSelSSP(
 }
 
 template<char IT, bool O3D, bool R3D> inline void RunFieldModesSelRun(
-    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
+    FieldBatch<O3D, R3D> &batch)
 {
-    char rt = params.Beam->RunType[0];
+    const bhcParams<O3D> &params = batch.params[0];
+    char rt                      = params.Beam->RunType[0];
     if(rt == 'C' || rt == 'S' || rt == 'I') {
 #ifdef BHC_RUN_ENABLE_TL
-        RunFieldModesSelSSP<'C', IT, O3D, R3D>(params, outputs);
+        RunFieldModesSelSSP<'C', IT, O3D, R3D>(batch);
 #else
         EXTERR("Transmission loss runs (Beam->RunType[0] == 'C', 'S', or 'I') "
                "were not enabled at compile time!");
@@ -105,7 +152,7 @@ template<char IT, bool O3D, bool R3D> inline void RunFieldModesSelRun(
         if constexpr(InflType<IT>::IsCerveny()) {
             EXTERR("Cerveny influence does not support eigenrays!");
         } else {
-            RunFieldModesSelSSP<'E', IT, O3D, R3D>(params, outputs);
+            RunFieldModesSelSSP<'E', IT, O3D, R3D>(batch);
         }
 #else
         EXTERR("Eigenrays runs (Beam->RunType[0] == 'E') "
@@ -116,7 +163,7 @@ template<char IT, bool O3D, bool R3D> inline void RunFieldModesSelRun(
         if constexpr(InflType<IT>::IsCerveny()) {
             EXTERR("Cerveny influence does not support arrivals!");
         } else {
-            RunFieldModesSelSSP<'A', IT, O3D, R3D>(params, outputs);
+            RunFieldModesSelSSP<'A', IT, O3D, R3D>(batch);
         }
 #else
         EXTERR("Arrivals runs (Beam->RunType[0] == 'A', 'a', 'V', or 'v') "
@@ -129,17 +176,18 @@ template<char IT, bool O3D, bool R3D> inline void RunFieldModesSelRun(
     }
 }
 
-template<bool O3D, bool R3D> inline void RunFieldModesSelInfl(
-    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
+template<bool O3D, bool R3D> inline void RunFieldModesSelInflBatch(
+    FieldBatch<O3D, R3D> &batch)
 {
 #ifdef BHC_BUILD_CUDA
-    checkCudaErrors(cudaSetDevice(GetInternal(params)->gpuIndex));
+    checkCudaErrors(cudaSetDevice(batch.Runner()->gpuIndices[0]));
 #endif
-    char it = params.Beam->Type[0];
+    const bhcParams<O3D> &params = batch.params[0];
+    char it                      = params.Beam->Type[0];
     if(it == 'R') {
 #ifdef BHC_INFL_ENABLE_CERVENY_RAYCEN
         if constexpr(!R3D) {
-            RunFieldModesSelRun<'R', O3D, R3D>(params, outputs);
+            RunFieldModesSelRun<'R', O3D, R3D>(batch);
         } else {
             EXTERR("Cerveny ray-centered influence (Beam->Type[0] == 'R') "
                    "is not supported in 3D mode!");
@@ -154,7 +202,7 @@ template<bool O3D, bool R3D> inline void RunFieldModesSelInfl(
 #ifdef BHC_LIMIT_FEATURES
             if constexpr(!O3D) {
 #endif
-                RunFieldModesSelRun<'C', O3D, R3D>(params, outputs);
+                RunFieldModesSelRun<'C', O3D, R3D>(batch);
 #ifdef BHC_LIMIT_FEATURES
             } else {
                 EXTERR("Nx2D Cerveny Cartesian influence (Beam->Type[0] == 'C') "
@@ -171,7 +219,7 @@ template<bool O3D, bool R3D> inline void RunFieldModesSelInfl(
 #endif
     } else if(it == 'G' || it == '^' || it == ' ' || it == 'B') {
 #ifdef BHC_INFL_ENABLE_GEOM_CART
-        RunFieldModesSelRun<'G', O3D, R3D>(params, outputs);
+        RunFieldModesSelRun<'G', O3D, R3D>(batch);
 #else
         EXTERR("Geometric Cartesian influence (Beam->Type[0] == 'G', '^', ' ' "
                "hat / 'B' Gaussian) was not enabled at compile time!");
@@ -186,7 +234,7 @@ template<bool O3D, bool R3D> inline void RunFieldModesSelInfl(
             }
         }
 #endif
-        RunFieldModesSelRun<'g', O3D, R3D>(params, outputs);
+        RunFieldModesSelRun<'g', O3D, R3D>(batch);
 #else
         EXTERR("Geometric ray-centered influence (Beam->Type[0] == 'g' hat / "
                "'b' Gaussian) was not enabled at compile time!");
@@ -194,7 +242,7 @@ template<bool O3D, bool R3D> inline void RunFieldModesSelInfl(
     } else if(it == 'S') {
 #ifdef BHC_INFL_ENABLE_SGB
         if constexpr(!R3D) {
-            RunFieldModesSelRun<'S', O3D, R3D>(params, outputs);
+            RunFieldModesSelRun<'S', O3D, R3D>(batch);
         } else {
             EXTERR("Simple Gaussian beams influence (Beam->Type[0] == 'S') "
                    "is not supported in 3D mode!");
@@ -208,17 +256,1526 @@ template<bool O3D, bool R3D> inline void RunFieldModesSelInfl(
     }
 }
 
+template<bool O3D, bool R3D> void RunFieldModesSelInfl(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, bool retainRays)
+{
+#if BHC_ENABLE_NX2D && BHC_ENABLE_2D
+    if constexpr(O3D && !R3D) {
+        if(!retainRays && RunFieldModesRadialSlices<O3D, R3D>(params, outputs)) return;
+    }
+#endif
+    FieldBatch<O3D, R3D> batch(&params, &outputs, 1);
+    batch.retainRays = retainRays;
+    RunFieldModesSelInflBatch<O3D, R3D>(batch);
+}
+
+template<bool O3D, bool R3D> void RunFieldModesPlayback(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, bhcPlaybackRay *rays,
+    int32_t nRays)
+{
+    FieldBatch<O3D, R3D> batch(&params, &outputs, 1);
+    batch.playback  = rays;
+    batch.nPlayback = nRays;
+    RunFieldModesSelInflBatch<O3D, R3D>(batch);
+}
+
+template<bool O3D, bool R3D> void RunFieldModesBatch(FieldBatch<O3D, R3D> &batch)
+{
+    const bhcParams<O3D> &params0 = batch.params[0];
+    for(int32_t e = 1; e < batch.n; ++e) {
+        const bhcParams<O3D> &params = batch.params[e];
+        if(params.Beam->RunType[0] != params0.Beam->RunType[0]
+           || params.Beam->Type[0] != params0.Beam->Type[0]
+           || params.ssp->Type != params0.ssp->Type) {
+            EXTERR(
+                "All environments in a batch must have the same run type "
+                "(Beam->RunType[0]), beam type (Beam->Type[0]), and SSP type "
+                "(ssp->Type), environment %d differs",
+                e);
+        }
+    }
+    for(int32_t e = 0; e < batch.n; ++e) {
+        SetupRayStats<O3D, R3D>(batch.params[e], batch.outputs[e]);
+    }
+    RunFieldModesSelInflBatch<O3D, R3D>(batch);
+}
+
 #if BHC_ENABLE_2D
 template void RunFieldModesSelInfl<false, false>(
-    bhcParams<false> &params, bhcOutputs<false, false> &outputs);
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs, bool retainRays);
+template void RunFieldModesBatch<false, false>(FieldBatch<false, false> &batch);
+template void RunFieldModesPlayback<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs, bhcPlaybackRay *rays,
+    int32_t nRays);
 #endif
 #if BHC_ENABLE_NX2D
 template void RunFieldModesSelInfl<true, false>(
-    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs, bool retainRays);
+template void RunFieldModesBatch<true, false>(FieldBatch<true, false> &batch);
+template void RunFieldModesPlayback<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs, bhcPlaybackRay *rays,
+    int32_t nRays);
 #endif
 #if BHC_ENABLE_3D
 template void RunFieldModesSelInfl<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs, bool retainRays);
+template void RunFieldModesBatch<true, true>(FieldBatch<true, true> &batch);
+template void RunFieldModesPlayback<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs, bhcPlaybackRay *rays,
+    int32_t nRays);
+#endif
+
+/**
+ * Marks the elevation angles of the rays which reached a receiver in the last
+ * eigenray or arrivals run.
+ */
+template<bool O3D, bool R3D> void FlagAnglesWithHits(
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+    std::vector<bool> &hit)
+{
+    const AngleInfo &alpha = params.Angles->alpha;
+    hit.assign(alpha.n, false);
+    if(IsEigenraysRun(params.Beam) || IsAlsoEigenraysRun(params.Beam)) {
+        const EigenInfo *eigen = outputs.eigen;
+        int32_t n              = bhc::min(eigen->neigen, eigen->memsize);
+        for(int32_t i = 0; i < n; ++i) hit[eigen->hits[i].ialpha] = true;
+    }
+    if(IsArrivalsRun(params.Beam)) {
+        // Arrivals only keep the launch angle itself, in degrees.
+        const ArrInfo *arrinfo = outputs.arrinfo;
+        size_t n               = GetFieldSize(params);
+        for(size_t base = 0; base < n; ++base) {
+            int32_t narr = NumStoredArrivals(arrinfo, base);
+            for(int32_t j = 0; j < narr; ++j) {
+                Arrival arr = LoadArrival(arrinfo, ArrivalIndex(arrinfo, base, j));
+                real a      = DegRad * (real)arr.SrcDeclAngle;
+                int32_t i = BinarySearchLEQ(alpha.angles, alpha.n, 1, 0, a);
+                if(i < alpha.n - 1
+                   && STD::abs(alpha.angles[i + 1] - a) < STD::abs(alpha.angles[i] - a)) {
+                    ++i;
+                }
+                hit[i] = true;
+            }
+        }
+    }
+}
+
+template<bool O3D, bool R3D> void RunFieldModesAdaptiveFan(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
+{
+    bhcInternal *internal = GetInternal(params);
+    AngleInfo &alpha      = params.Angles->alpha;
+    internal->PRTFile << "\nAdaptive launch angle fan, " << internal->adaptiveFanLevels
+                      << " levels of refinement\n";
+    std::vector<bool> hit;
+    std::vector<real> fine;
+    for(int32_t level = 0;; ++level) {
+        internal->PRTFile << "Level " << level << ": " << alpha.n
+                          << " beams, spacing " << (alpha.d * RadDeg) << " degrees\n";
+        SetupRayStats<O3D, R3D>(params, outputs);
+        RunFieldModesSelInfl<O3D, R3D>(params, outputs);
+        if(level == internal->adaptiveFanLevels) break;
+
+        // Bisect every interval of the current fan adjacent to a ray which hit
+        // something. Each refined level's fan is made of runs of angles with
+        // uniform spacing d, separated by gaps which are not refined.
+        FlagAnglesWithHits<O3D, R3D>(params, outputs, hit);
+        fine.clear();
+        for(int32_t i = 0; i < alpha.n - 1; ++i) {
+            if(!hit[i] && !hit[i + 1]) continue;
+            real a0 = alpha.angles[i], a1 = alpha.angles[i + 1];
+            if(level > 0 && a1 - a0 > RL(1.5) * alpha.d) continue; // gap
+            if(fine.empty() || fine.back() != a0) fine.push_back(a0);
+            fine.push_back(RL(0.5) * (a0 + a1));
+            fine.push_back(a1);
+        }
+        if(fine.empty()) break; // Nothing reached any receiver
+
+        if(internal->origAlphaAngles == nullptr) {
+            internal->origAlphaAngles = alpha.angles;
+            internal->origAlphaN      = alpha.n;
+            internal->origAlphaD      = alpha.d;
+            alpha.angles              = nullptr;
+        }
+        alpha.n = (int32_t)fine.size();
+        alpha.d *= RL(0.5);
+        trackallocate(params, "adaptive launch angle fan", alpha.angles, alpha.n);
+        memcpy(alpha.angles, fine.data(), alpha.n * sizeof(real));
+
+        // Discard the previous level's results
+        if(IsEigenraysRun(params.Beam) || IsAlsoEigenraysRun(params.Beam)) {
+            outputs.eigen->neigen = 0;
+        }
+        if(IsArrivalsRun(params.Beam)) ClearArrivals(params, outputs.arrinfo);
+        internal->completedRayCount = 0;
+        internal->totalJobs         = GetNumJobs<O3D>(params.Pos, params.Angles);
+    }
+}
+
+#if BHC_ENABLE_2D
+template void RunFieldModesAdaptiveFan<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs);
+#endif
+#if BHC_ENABLE_NX2D
+template void RunFieldModesAdaptiveFan<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+#endif
+#if BHC_ENABLE_3D
+template void RunFieldModesAdaptiveFan<true, true>(
     bhcParams<true> &params, bhcOutputs<true, true> &outputs);
 #endif
 
+/**
+ * Whether a boundary is the same at all ranges: all points at the same depth,
+ * without per-point halfspace properties.
+ */
+template<bool O3D> inline bool IsRangeIndependent(const BdryInfoTopBot<O3D> &bdry)
+{
+    if constexpr(O3D) {
+        for(int32_t i = 1; i < bdry.NPts.x * bdry.NPts.y; ++i) {
+            if(bdry.bd[i].x.z != bdry.bd[0].x.z) return false;
+        }
+        return true;
+    } else {
+        if(bdry.type[1] == 'L') return false;
+        for(int32_t i = 1; i < bdry.NPts; ++i) {
+            if(bdry.bd[i].x.y != bdry.bd[0].x.y) return false;
+        }
+        return true;
+    }
+}
+
+/**
+ * Whether the launch angles (in radians, after preprocessing) reach within one
+ * step of straight up and straight down, and are symmetric about the
+ * horizontal. A ray traced back from a receiver arrives at the source at an
+ * angle of opposite sign and, by Snell's law, of different size, so anything
+ * less does not trace the same paths as the run it replaces.
+ */
+inline bool IsFullSymmetricFan(const AngleInfo &alpha)
+{
+    if(alpha.n < 2 || alpha.iSingle > 0) return false;
+    const real *a = alpha.angles;
+    real step     = (a[alpha.n - 1] - a[0]) / (real)(alpha.n - 1);
+    real halfPi   = REAL_PI * FL(0.5);
+    if(a[0] > -halfPi + step || a[alpha.n - 1] < halfPi - step) return false;
+    for(int32_t i = 0; i < alpha.n / 2; ++i) {
+        if(STD::abs(a[i] + a[alpha.n - 1 - i]) > RL(1e-3) * step) return false;
+    }
+    return true;
+}
+
+/**
+ * Whether bhcInit::reciprocal applies to this run: a TL or arrivals run with
+ * fewer receiver than source depths.
+ */
+template<bool O3D> inline bool UseReciprocal(const bhcParams<O3D> &params)
+{
+    const Position *Pos = params.Pos;
+    return GetInternal(params)->reciprocal && Pos->NRz < Pos->NSz
+        && (IsTLRun(params.Beam) || IsArrivalsRun(params.Beam));
+}
+
+/// Why a run which UseReciprocal cannot be traced from the receivers, or
+/// nullptr if it can.
+template<bool O3D> inline const char *ReciprocalUnsupported(const bhcParams<O3D> &params)
+{
+    if constexpr(O3D) {
+        return "Nx2D and 3D runs are not supported";
+    } else {
+        const BeamStructure<O3D> *Beam = params.Beam;
+        if(IsTLRun(Beam) && (IsSemiCoherentRun(Beam) || Beam->allTLTypes)) {
+            return "only coherent and incoherent TL is supported (not semi-coherent "
+                   "or allTLTypes)";
+        }
+        if(IsStreamedTLRun(params)) {
+            return "streamed TL (streamTLSources) is not supported";
+        }
+        if(IsArrivalsRun(Beam) && IsAlsoEigenraysRun(Beam)) {
+            return "arrivals runs which also write eigenrays are not supported";
+        }
+        if(UseAdaptiveFan(params)) return "adaptiveFanLevels is not supported";
+        if(IsIrregularGrid(Beam)) return "the receiver grid must be rectilinear";
+        if(params.sbp->SBPFlag == '*') return "source beam patterns are not supported";
+        if(params.ssp->Type == 'Q' || !IsRangeIndependent(params.bdinfo->top)
+           || !IsRangeIndependent(params.bdinfo->bot)) {
+            return "the environment must be range-independent (flat top and bottom "
+                   "without per-point properties, SSP not range-dependent)";
+        }
+        if(!IsFullSymmetricFan(params.Angles->alpha)) {
+            return "the launch angle fan must be from -90 to 90 degrees and symmetric "
+                   "about the horizontal";
+        }
+        return nullptr;
+    }
+}
+
+template<bool O3D, bool R3D> void BeginReciprocal(bhcParams<O3D> &params)
+{
+    bhcInternal *internal      = GetInternal(params);
+    internal->reciprocalActive = false;
+    if(!UseReciprocal(params)) return;
+    const char *unsupported = ReciprocalUnsupported(params);
+    if(unsupported != nullptr) {
+        EXTERR("Reciprocal run (bhcInit::reciprocal): %s", unsupported);
+    }
+    internal->PRTFile << "\nReciprocal run: tracing from the " << params.Pos->NRz
+                      << " receiver depths instead of the " << params.Pos->NSz
+                      << " source depths\n";
+    SwapSourceReceiverDepths(params);
+    internal->reciprocalActive = true;
+}
+
+/**
+ * Moves blocks of blockLen elements from [a][f][b] to [b][f][a] order, in
+ * place, by following the cycles of the permutation.
+ */
+template<typename T> inline void TransposeBlocks(
+    T *data, int32_t nA, int32_t nF, int32_t nB, size_t blockLen)
+{
+    size_t n = (size_t)nA * (size_t)nF * (size_t)nB;
+    std::vector<bool> done(n, false);
+    std::vector<T> tmp(blockLen);
+    size_t bytes = blockLen * sizeof(T);
+    for(size_t start = 0; start < n; ++start) {
+        if(done[start]) continue;
+        memcpy(tmp.data(), &data[start * blockLen], bytes);
+        size_t q = start;
+        while(true) {
+            done[q]  = true;
+            size_t a = q % (size_t)nA;
+            size_t f = (q / (size_t)nA) % (size_t)nF;
+            size_t b = q / ((size_t)nA * (size_t)nF);
+            // Block q gets the block which was at (a, f, b).
+            size_t src = (a * (size_t)nF + f) * (size_t)nB + b;
+            if(src == start) break;
+            memcpy(&data[q * blockLen], &data[src * blockLen], bytes);
+            q = src;
+        }
+        memcpy(&data[q * blockLen], tmp.data(), bytes);
+    }
+}
+
+template<bool O3D, bool R3D> void EndReciprocal(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
+{
+    bhcInternal *internal = GetInternal(params);
+    if(!internal->reciprocalActive) return;
+    // Still swapped here: the "sources" are the original receiver depths.
+    const Position *Pos = params.Pos;
+    int32_t nA          = Pos->NSz;
+    int32_t nB          = Pos->NRz;
+    size_t NRr          = (size_t)Pos->NRr;
+    ArrInfo *arrinfo    = outputs.arrinfo;
+    if(IsTLRun(params.Beam)) {
+        TransposeBlocks(outputs.uAllSources, nA, GetNumFieldFreqs(params), nB, NRr);
+    } else {
+        TransposeBlocks(arrinfo->NArr, nA, 1, nB, NRr);
+        if(arrinfo->ArrChunks != nullptr) {
+            size_t chunksPerRcvr = (size_t)(arrinfo->MaxNArr / arrinfo->ArrChunkSize);
+            TransposeBlocks(arrinfo->ArrChunks, nA, 1, nB, NRr * chunksPerRcvr);
+        } else if(arrinfo->isCompact) {
+            TransposeBlocks(arrinfo->ArrC, nA, 1, nB, NRr * (size_t)arrinfo->MaxNArr);
+        } else {
+            TransposeBlocks(arrinfo->Arr, nA, 1, nB, NRr * (size_t)arrinfo->MaxNArr);
+        }
+    }
+    SwapSourceReceiverDepths(params);
+    internal->reciprocalActive = false;
+    if(IsTLRun(params.Beam)) return;
+
+    // Each arrival was traced from the receiver to the source, so its
+    // angles at the two ends are swapped, and mirrored in range, which flips
+    // their sign.
+    trackdeallocate(params, arrinfo->MaxNPerSource);
+    trackallocate(params, "arrivals", arrinfo->MaxNPerSource, Pos->NSz);
+    for(int32_t isz = 0; isz < Pos->NSz; ++isz) {
+        int32_t maxn = 0;
+        for(int32_t iz = 0; iz < Pos->NRz; ++iz) {
+            for(int32_t ir = 0; ir < Pos->NRr; ++ir) {
+                size_t base  = GetFieldAddr(0, 0, isz, 0, iz, ir, Pos);
+                int32_t narr = arrinfo->NArr[base];
+                maxn         = bhc::max(maxn, narr);
+                for(int32_t iArr = 0; iArr < narr; ++iArr) {
+                    size_t idx        = ArrivalIndex(arrinfo, base, iArr);
+                    Arrival arr       = LoadArrival(arrinfo, idx);
+                    float srcDecl     = arr.SrcDeclAngle;
+                    arr.SrcDeclAngle  = -arr.RcvrDeclAngle;
+                    arr.RcvrDeclAngle = -srcDecl;
+                    StoreArrival(arrinfo, idx, arr);
+                }
+            }
+        }
+        arrinfo->MaxNPerSource[isz] = maxn;
+    }
+}
+
+#if BHC_ENABLE_2D
+template void BeginReciprocal<false, false>(bhcParams<false> &params);
+template void EndReciprocal<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs);
+#endif
+#if BHC_ENABLE_NX2D
+template void BeginReciprocal<true, false>(bhcParams<true> &params);
+template void EndReciprocal<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+#endif
+#if BHC_ENABLE_3D
+template void BeginReciprocal<true, true>(bhcParams<true> &params);
+template void EndReciprocal<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs);
+#endif
+
+/**
+ * Whether the Nx2D bearings of a run using symmetry are traced once and
+ * copied, rather than only the source positions.
+ */
+template<bool O3D, bool R3D> inline bool SymmetricBearings(
+    const bhcParams<O3D> &params, int32_t betaSingle, int32_t Ntheta)
+{
+    return O3D && !R3D && betaSingle == 0 && Ntheta > 1 && params.Angles->beta.n > 1;
+}
+
+/// Whether this run may use symmetry, see bhcInit::exploitSymmetry.
+template<bool O3D, bool R3D> inline bool UseSymmetry(const bhcParams<O3D> &params)
+{
+    if constexpr(!O3D) {
+        return false;
+    } else {
+        bhcInternal *internal          = GetInternal(params);
+        const Position *Pos            = params.Pos;
+        const BeamStructure<O3D> *Beam = params.Beam;
+        const BdryInfo<O3D> *bdinfo    = params.bdinfo;
+        if(!internal->exploitSymmetry || internal->rayStats) return false;
+        if(Pos->NSx * Pos->NSy == 1
+           && !SymmetricBearings<O3D, R3D>(
+               params, params.Angles->beta.iSingle, Pos->Ntheta)) {
+            return false;
+        }
+        bool tl  = IsTLRun(Beam) && !IsStreamedTLRun(params);
+        bool arr = IsArrivalsRun(Beam) && !IsAlsoEigenraysRun(Beam)
+            && !UseAdaptiveFan(params) && internal->arrivalsChunkSize <= 0;
+        if(!(tl || arr) || internal->userField != nullptr
+           || internal->userArrivals != nullptr) {
+            return false;
+        }
+        char st = params.ssp->Type;
+        if(st != 'N' && st != 'C' && st != 'S' && st != 'P') return false;
+        if(!IsRangeIndependent(bdinfo->top) || !IsRangeIndependent(bdinfo->bot)) {
+            return false;
+        }
+        // The beam box is a rectangle around the source, and rays are also
+        // stopped at the edges of the boundaries (see RayTerminate), so rays
+        // in different directions or from different sources end at different
+        // ranges. Those beyond every receiver do not matter.
+        real rMax = RL(0.0);
+        for(int32_t ir = 0; ir < Pos->NRr; ++ir) {
+            rMax = bhc::max(rMax, (real)STD::abs(Pos->Rr[ir]));
+        }
+        if(rMax >= bhc::min(Beam->Box.x, Beam->Box.y)) return false;
+        const BdryInfoTopBot<true> &top = bdinfo->top, &bot = bdinfo->bot;
+        real minx = bhc::max(bot.bd[0].x.x, top.bd[0].x.x);
+        real miny = bhc::max(bot.bd[0].x.y, top.bd[0].x.y);
+        real maxx = bhc::min(
+            bot.bd[(bot.NPts.x - 1) * bot.NPts.y].x.x,
+            top.bd[(top.NPts.x - 1) * top.NPts.y].x.x);
+        real maxy = bhc::min(bot.bd[bot.NPts.y - 1].x.y, top.bd[top.NPts.y - 1].x.y);
+        for(int32_t isx = 0; isx < Pos->NSx; ++isx) {
+            if(Pos->Sx[isx] - rMax <= minx || Pos->Sx[isx] + rMax >= maxx) return false;
+        }
+        for(int32_t isy = 0; isy < Pos->NSy; ++isy) {
+            if(Pos->Sy[isy] - rMax <= miny || Pos->Sy[isy] + rMax >= maxy) return false;
+        }
+        return true;
+    }
+}
+
+template<bool O3D, bool R3D> void BeginSymmetry(bhcParams<O3D> &params)
+{
+    bhcInternal *internal    = GetInternal(params);
+    internal->symmetryActive = false;
+    if(!UseSymmetry<O3D, R3D>(params)) return;
+    Position *Pos            = params.Pos;
+    AngleInfo &beta          = params.Angles->beta;
+    internal->origNSx        = Pos->NSx;
+    internal->origNSy        = Pos->NSy;
+    internal->origNtheta     = Pos->Ntheta;
+    internal->origBetaSingle = beta.iSingle;
+    bool bearings = SymmetricBearings<O3D, R3D>(params, beta.iSingle, Pos->Ntheta);
+    internal->PRTFile << "\nSymmetric run: tracing 1 of the " << Pos->NSx * Pos->NSy
+                      << " source positions per depth";
+    if(bearings) internal->PRTFile << " and 1 of the " << Pos->Ntheta << " bearings";
+    internal->PRTFile << "\n";
+    Pos->NSx = Pos->NSy = 1;
+    if(bearings) {
+        // Nx2D beams are on the receiver radials, so bearing 0 fills
+        // radial 0.
+        Pos->Ntheta  = 1;
+        beta.iSingle = 1;
+    }
+    internal->symmetryActive = true;
+}
+
+template<bool O3D, bool R3D> void EndSymmetry(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
+{
+    bhcInternal *internal = GetInternal(params);
+    if(!internal->symmetryActive) return;
+    // Still reduced here.
+    const Position *Pos = params.Pos;
+    size_t nSmall       = GetTLPlaneSize(params);
+    int32_t nPlanes     = GetNumTLPlanes(params);
+    int32_t NthetaSmall = Pos->Ntheta;
+    bool bearings       = NthetaSmall != internal->origNtheta;
+    AbortSymmetry(params);
+    size_t nFull    = GetTLPlaneSize(params);
+    int32_t Nfreq   = GetNumFieldFreqs(params);
+    size_t blockLen = (size_t)Pos->NRz_per_range * (size_t)Pos->NRr;
+    size_t perDepth = (size_t)Pos->NSx * (size_t)Pos->NSy * (size_t)Nfreq
+        * (size_t)Pos->Ntheta;
+    // Calls f(full, small, itheta) with the start of each receiver block of
+    // the full layout, in order (see GetFieldAddr), and of the block of the
+    // reduced layout it is copied from.
+    auto forEachBlock = [&](auto &&f) {
+        for(size_t b = 0; b < nFull / blockLen; ++b) {
+            size_t isz     = b / perDepth;
+            size_t ifreq   = b / (size_t)Pos->Ntheta % (size_t)Nfreq;
+            int32_t itheta = (int32_t)(b % (size_t)Pos->Ntheta);
+            size_t small   = (isz * (size_t)Nfreq + ifreq) * (size_t)NthetaSmall
+                + (size_t)(bearings ? 0 : itheta);
+            f(b * blockLen, small * blockLen, itheta);
+        }
+    };
+
+    // The reduced outputs are moved out of tracked memory first, as the
+    // arrivals took all the memory which was left.
+    if(IsTLRun(params.Beam)) {
+        std::vector<cpxf> reduced(
+            outputs.uAllSources, outputs.uAllSources + nSmall * (size_t)nPlanes);
+        trackdeallocate(params, outputs.uAllSources);
+        trackallocate(
+            params, "sound field / transmission loss", outputs.uAllSources,
+            nFull * (size_t)nPlanes);
+        for(int32_t p = 0; p < nPlanes; ++p) {
+            forEachBlock([&](size_t full, size_t small, int32_t) {
+                memcpy(
+                    &outputs.uAllSources[(size_t)p * nFull + full],
+                    &reduced[(size_t)p * nSmall + small], blockLen * sizeof(cpxf));
+            });
+        }
+        return;
+    }
+
+    ArrInfo *arrinfo = outputs.arrinfo;
+    size_t arrBytes  = ArrivalBytes(arrinfo);
+    int32_t maxNArr  = 1;
+    for(size_t base = 0; base < nSmall; ++base) {
+        maxNArr = bhc::max(maxNArr, arrinfo->NArr[base]);
+    }
+    // Packed to maxNArr arrivals per receiver, the most any one has.
+    std::vector<char> reduced(nSmall * (size_t)maxNArr * arrBytes);
+    std::vector<int32_t> reducedNArr(arrinfo->NArr, arrinfo->NArr + nSmall);
+    std::vector<int32_t> reducedMaxN(
+        arrinfo->MaxNPerSource, arrinfo->MaxNPerSource + Pos->NSz);
+    for(size_t base = 0; base < nSmall; ++base) {
+        memcpy(
+            &reduced[base * (size_t)maxNArr * arrBytes],
+            ArrivalData(arrinfo, base * (size_t)arrinfo->MaxNArr),
+            (size_t)reducedNArr[base] * arrBytes);
+    }
+    ReleaseArrivals(params, arrinfo);
+    trackdeallocate(params, arrinfo->NArr);
+    trackdeallocate(params, arrinfo->MaxNPerSource);
+    size_t nSrcs     = (size_t)Pos->NSx * (size_t)Pos->NSy * (size_t)Pos->NSz;
+    arrinfo->MaxNArr = maxNArr;
+    AllocateArrivals(params, arrinfo, nFull * (size_t)maxNArr);
+    trackallocate(params, "arrivals", arrinfo->NArr, nFull);
+    trackallocate(params, "arrivals", arrinfo->MaxNPerSource, nSrcs);
+    forEachBlock([&](size_t full, size_t small, int32_t itheta) {
+        // The azimuth each arrival would have had if traced on its own
+        // radial, as in ReceiverAngles.
+        float azim = bearings ? (float)(RadDeg * params.Angles->beta.angles[itheta])
+                              : 0.0f;
+        for(size_t i = 0; i < blockLen; ++i) {
+            int32_t narr            = reducedNArr[small + i];
+            arrinfo->NArr[full + i] = narr;
+            memcpy(
+                ArrivalData(arrinfo, (full + i) * (size_t)maxNArr),
+                &reduced[(small + i) * (size_t)maxNArr * arrBytes],
+                (size_t)narr * arrBytes);
+            if(!bearings) continue;
+            for(int32_t iArr = 0; iArr < narr; ++iArr) {
+                size_t idx        = (full + i) * (size_t)maxNArr + iArr;
+                Arrival arr       = LoadArrival(arrinfo, idx);
+                arr.SrcAzimAngle  = azim;
+                arr.RcvrAzimAngle = azim;
+                StoreArrival(arrinfo, idx, arr);
+            }
+        }
+    });
+    for(size_t isrc = 0; isrc < nSrcs; ++isrc) {
+        // Sources in the order of GetFieldAddr, source depth outermost.
+        arrinfo->MaxNPerSource[isrc]
+            = reducedMaxN[isrc / ((size_t)Pos->NSx * (size_t)Pos->NSy)];
+    }
+}
+
+#if BHC_ENABLE_2D
+template void BeginSymmetry<false, false>(bhcParams<false> &params);
+template void EndSymmetry<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs);
+#endif
+#if BHC_ENABLE_NX2D
+template void BeginSymmetry<true, false>(bhcParams<true> &params);
+template void EndSymmetry<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+#endif
+#if BHC_ENABLE_3D
+template void BeginSymmetry<true, true>(bhcParams<true> &params);
+template void EndSymmetry<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs);
+#endif
+
+template<bool O3D, bool R3D> bool SetupPrivateFields(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, ThreadPool &pool,
+    cpxf *&privFields)
+{
+    privFields            = nullptr;
+    bhcInternal *internal = GetInternal(params);
+    size_t ncopies        = (size_t)(pool.NumThreads() - 1);
+    if(ncopies == 0) return true;
+    size_t n    = GetFieldSize(params);
+    size_t need = ncopies * n * sizeof(cpxf) + 16u;
+    if(internal->usedMemory + need > internal->maxMemory) return false;
+    trackallocate(params, "per-worker copies of sound field", privFields, ncopies * n);
+    // Each worker zeroes its own copy, so the pages end up local to it.
+    pool.Run([&](int32_t worker) {
+        if(worker == 0) return;
+        memset(GetWorkerField(params, outputs, privFields, worker), 0, n * sizeof(cpxf));
+    });
+    return true;
+}
+
+template<bool O3D, bool R3D> void ReducePrivateFields(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, ThreadPool &pool,
+    cpxf *&privFields)
+{
+    if(privFields == nullptr) return;
+    int32_t numThreads = pool.NumThreads();
+    int32_t ncopies    = numThreads - 1;
+    size_t n           = GetFieldSize(params);
+    pool.Run([&](int32_t worker) {
+        size_t begin = n * (size_t)worker / (size_t)numThreads;
+        size_t end   = n * (size_t)(worker + 1) / (size_t)numThreads;
+        // Summed as realacc, so the copies are combined in double in mixed
+        // precision.
+        for(size_t i = begin; i < end; ++i) {
+            cpxf &u    = outputs.uAllSources[i];
+            cpxacc sum = cpxacc((realacc)u.real(), (realacc)u.imag());
+            for(int32_t c = 0; c < ncopies; ++c) {
+                const cpxf &v = privFields[(size_t)c * n + i];
+                sum += cpxacc((realacc)v.real(), (realacc)v.imag());
+            }
+            u = cpxf((float)sum.real(), (float)sum.imag());
+        }
+    });
+    trackdeallocate(params, privFields);
+}
+
+/// FNV-1a, see RetainedRayKey.
+inline void HashBytes(uint64_t &h, const void *data, size_t bytes)
+{
+    const uint8_t *d = (const uint8_t *)data;
+    for(size_t i = 0; i < bytes; ++i) {
+        h ^= d[i];
+        h *= 0x100000001B3ull;
+    }
+}
+template<typename T> inline void HashArray(uint64_t &h, const T *data, size_t n)
+{
+    if(data != nullptr) HashBytes(h, data, n * sizeof(T));
+}
+
+/// Field by field, as HSInfo has padding.
+inline void HashHalfspace(uint64_t &h, const HSInfo &hs)
+{
+    real reals[] = {hs.alphaR,    hs.betaR,     hs.alphaI,    hs.betaI, hs.cP.real(),
+                    hs.cP.imag(), hs.cS.real(), hs.cS.imag(), hs.rho,   hs.Depth};
+    HashArray(h, reals, 10);
+    HashArray(h, &hs.bc, 1);
+    HashArray(h, hs.Opt, 6);
+}
+
+/**
+ * Hash of all the inputs the rays of a field run depend on, see
+ * bhcInit::retainRays. Not the receivers, and of the run type only whether it
+ * is semi-coherent, which changes the source amplitudes. Taken after
+ * preprocessing, so the units are already converted. Hashes the values, never
+ * whole structs (padding) or pointers. Never 0.
+ */
+template<bool O3D> inline uint64_t RetainedRayKey(const bhcParams<O3D> &params)
+{
+    uint64_t h = 0xCBF29CE484222325ull;
+    HashBytes(h, &GetInternal(params)->dim, sizeof(uint8_t));
+
+    const Position *Pos = params.Pos;
+    int32_t nSrcs[]     = {Pos->NSx, Pos->NSy, Pos->NSz};
+    HashArray(h, nSrcs, 3);
+    HashArray(h, Pos->Sx, Pos->NSx);
+    HashArray(h, Pos->Sy, Pos->NSy);
+    HashArray(h, Pos->Sz, Pos->NSz);
+    for(const AngleInfo *a : {&params.Angles->alpha, &params.Angles->beta}) {
+        int32_t ns[] = {a->n, a->iSingle};
+        HashArray(h, ns, 2);
+        HashArray(h, a->angles, a->n);
+    }
+    HashArray(h, &params.freqinfo->freq0, 1);
+
+    const BeamStructure<O3D> *Beam = params.Beam;
+    HashArray(h, Beam->Type, 4);
+    HashArray(h, &Beam->RunType[1], 6);
+    // Whether the rays' amplitudes include the Lloyd mirror factor
+    bool lloydMirror = IsSemiCoherentRun(Beam) && !Beam->allTLTypes;
+    HashArray(h, &lloydMirror, 1);
+    real beamReals[] = {
+        Beam->deltas, Beam->stepTol, Beam->stepMin, Beam->stepMax, Beam->ampCutoff};
+    HashArray(h, beamReals, 5);
+    HashArray(h, &Beam->Box[0], O3D ? 3 : 2);
+    HashArray(h, &Beam->maxBotBnc, 1);
+    const SBPInfo *sbp = params.sbp;
+    HashArray(h, &sbp->SBPFlag, 1);
+    HashArray(h, &sbp->NSBPPts, 1);
+    HashArray(h, sbp->SrcBmPat, 2 * (size_t)sbp->NSBPPts);
+
+    for(const BdryPtSmall *b : {&params.Bdry->Top, &params.Bdry->Bot}) {
+        HashHalfspace(h, b->hs);
+        real extra[] = {b->hsx.zTemp, b->hsx.Mz};
+        HashArray(h, extra, 2);
+    }
+    for(const BdryInfoTopBot<O3D> *b : {&params.bdinfo->top, &params.bdinfo->bot}) {
+        HashArray(h, b->type, 2);
+        size_t n;
+        if constexpr(O3D) {
+            n = (size_t)b->NPts.x * (size_t)b->NPts.y;
+        } else {
+            n = (size_t)b->NPts;
+        }
+        HashArray(h, &n, 1);
+        // The tangents, normals, and curvatures are computed from these.
+        for(size_t i = 0; i < n; ++i) {
+            HashArray(h, &b->bd[i].x[0], O3D ? 3 : 2);
+            if constexpr(!O3D) HashHalfspace(h, b->bd[i].hs);
+        }
+    }
+    for(const ReflectionInfoTopBot *r : {&params.refl->top, &params.refl->bot}) {
+        HashArray(h, &r->NPts, 1);
+        HashArray(h, r->r, r->NPts);
+    }
+
+    const SSPStructure *ssp = params.ssp;
+    HashArray(h, &ssp->Type, 1);
+    int32_t sspDims[] = {ssp->NPts, ssp->Nr, ssp->Nx, ssp->Ny, ssp->Nz};
+    HashArray(h, sspDims, 5);
+    HashArray(h, ssp->c, ssp->NPts);
+    HashArray(h, ssp->cz, ssp->NPts);
+    HashArray(h, ssp->z, ssp->NPts);
+    HashArray(h, ssp->rho, ssp->NPts);
+    if(ssp->Type == 'Q') {
+        HashArray(h, ssp->cMat, (size_t)ssp->NPts * (size_t)ssp->Nr);
+        HashArray(h, ssp->czMat, (size_t)(ssp->NPts - 1) * (size_t)ssp->Nr);
+        HashArray(h, ssp->Seg.r, ssp->Nr);
+    } else if(ssp->Type == 'H') {
+        size_t nxy = (size_t)ssp->Nx * (size_t)ssp->Ny;
+        HashArray(h, ssp->cMat, nxy * (size_t)ssp->Nz);
+        HashArray(h, ssp->czMat, nxy * (size_t)(ssp->Nz - 1));
+        HashArray(h, ssp->Seg.x, ssp->Nx);
+        HashArray(h, ssp->Seg.y, ssp->Ny);
+        HashArray(h, ssp->Seg.z, ssp->Nz);
+    }
+    return h == 0 ? 1 : h;
+}
+
+template<bool O3D, bool R3D> bool BeginRetainedRays(
+    bhcParams<O3D> &params, rayPt<R3D> *&workRays, size_t &capacity, uint64_t &key)
+{
+    bhcInternal *internal = GetInternal(params);
+    key                   = RetainedRayKey(params);
+    if(key == internal->retainedRayKey) return true;
+    FreeRetainedRays(params);
+    size_t nJobs = (size_t)GetNumJobs<O3D>(params.Pos, params.Angles);
+    trackallocate(params, "retained ray starts", internal->retainedRayStart, nJobs);
+    trackallocate(params, "retained ray lengths", internal->retainedRayN, nJobs);
+    trackallocate(
+        params, "rays being traced to retain", workRays,
+        (size_t)internal->numThreads * MaxN);
+    // Only half of what is left, so there is room to move the rays to an
+    // exactly sized block afterwards.
+    int64_t avail = (int64_t)internal->maxMemory - (int64_t)internal->usedMemory - 64;
+    capacity      = (size_t)std::max(avail / 2, (int64_t)0) / sizeof(rayPt<R3D>);
+    trackallocate(
+        params, "retained rays", internal->retainedRayMem,
+        capacity * sizeof(rayPt<R3D>));
+    return false;
+}
+
+template<bool O3D, bool R3D> void EndRetainedRays(
+    bhcParams<O3D> &params, rayPt<R3D> *&workRays, size_t usedPoints, bool overflow,
+    uint64_t key)
+{
+    bhcInternal *internal = GetInternal(params);
+    trackdeallocate(params, workRays);
+    if(overflow) {
+        FreeRetainedRays(params);
+        EXTWARN("Not enough memory to retain the rays (bhcInit::retainRays), the "
+                "next run will trace them again");
+        return;
+    }
+    char *mem    = nullptr;
+    size_t bytes = usedPoints * sizeof(rayPt<R3D>);
+    trackallocate(params, "retained rays", mem, bytes);
+    memcpy(mem, internal->retainedRayMem, bytes);
+    trackdeallocate(params, internal->retainedRayMem);
+    internal->retainedRayMem = mem;
+    internal->retainedRayKey = key;
+}
+
+template<bool O3D> void FreeRetainedRays(bhcParams<O3D> &params)
+{
+    bhcInternal *internal = GetInternal(params);
+    trackdeallocate(params, internal->retainedRayMem);
+    trackdeallocate(params, internal->retainedRayStart);
+    trackdeallocate(params, internal->retainedRayN);
+    internal->retainedRayKey = 0;
+}
+
+/**
+ * Checkpoint file, see bhcInit::checkpointFile: CheckpointHeader, then the
+ * TL field, or NArr of every receiver followed by each receiver's stored
+ * arrivals; then the ray stats, if any.
+ */
+constexpr const char CheckpointMagic[8] = {'B', 'H', 'C', 'C', 'K', 'P', 'T', '1'};
+
+struct CheckpointHeader {
+    char magic[8];
+    uint64_t key;
+    int64_t jobsDone;
+    uint64_t totalSize; // whole file, so a truncated file is ignored
+};
+
+/**
+ * Hash of the inputs and of the layout of the outputs, so a checkpoint of a
+ * different run is never loaded. Not RetainedRayKey, which leaves out the
+ * receivers and the layout of the outputs. The input files cover the
+ * environment; the sources, receivers, angles, frequencies, beam settings, and
+ * SSP, which may also be changed through the API after setup, are hashed from
+ * the params.
+ */
+template<bool O3D, bool R3D> inline uint64_t CheckpointKey(
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs)
+{
+    bhcInternal *internal = GetInternal(params);
+    uint64_t h            = 0xCBF29CE484222325ull;
+    HashBytes(h, &internal->dim, sizeof(uint8_t));
+    if(!internal->noEnvFil) {
+        for(const char *ext : {".env", ".ssp", ".bty", ".ati", ".brc", ".trc", ".sbp"}) {
+            MappedFile file;
+            bool found = file.open(internal->FileRoot + ext);
+            HashBytes(h, &found, 1);
+            if(found) HashBytes(h, file.data(), file.size());
+        }
+    }
+
+    const Position *Pos = params.Pos;
+    int32_t dims[]      = {Pos->NSx, Pos->NSy, Pos->NSz, Pos->NRz, Pos->NRr, Pos->Ntheta,
+                           Pos->NRz_per_range, params.freqinfo->Nfreq};
+    HashArray(h, dims, 8);
+    HashArray(h, Pos->Sx, Pos->NSx);
+    HashArray(h, Pos->Sy, Pos->NSy);
+    HashArray(h, Pos->Sz, Pos->NSz);
+    HashArray(h, Pos->Rz, Pos->NRz);
+    HashArray(h, Pos->Rr, Pos->NRr);
+    HashArray(h, Pos->theta, Pos->Ntheta);
+    for(const AngleInfo *a : {&params.Angles->alpha, &params.Angles->beta}) {
+        int32_t ns[] = {a->n, a->iSingle};
+        HashArray(h, ns, 2);
+        HashArray(h, a->angles, a->n);
+    }
+    HashArray(h, &params.freqinfo->freq0, 1);
+    HashArray(h, params.freqinfo->freqVec, params.freqinfo->Nfreq);
+
+    const BeamStructure<O3D> *Beam = params.Beam;
+    HashArray(h, Beam->Type, 4);
+    HashArray(h, Beam->RunType, 7);
+    real beamReals[] = {Beam->deltas,  Beam->epsMultiplier, Beam->rLoop,
+                        Beam->stepTol, Beam->stepMin,       Beam->stepMax,
+                        Beam->ampCutoff};
+    HashArray(h, beamReals, 7);
+    HashArray(h, &internal->bdryTolerance, 1);
+    HashArray(h, &Beam->Box, 1);
+    HashArray(h, &Beam->maxBotBnc, 1);
+    HashArray(h, &Beam->allTLTypes, 1);
+
+    const SSPStructure *ssp = params.ssp;
+    HashArray(h, &ssp->Type, 1);
+    HashArray(h, &ssp->NPts, 1);
+    HashArray(h, ssp->c, ssp->NPts);
+    HashArray(h, ssp->z, ssp->NPts);
+
+    uint64_t layout[] = {sizeof(real), sizeof(bhcRayStats), outputs.raystats != nullptr,
+                         0, 0};
+    if(IsArrivalsRun(Beam)) {
+        layout[3] = ArrivalBytes(outputs.arrinfo);
+        layout[4] = outputs.arrinfo->MaxNArr;
+    }
+    HashArray(h, layout, 5);
+    return h;
+}
+
+/// Size of the checkpoint file for the current outputs.
+template<bool O3D, bool R3D> inline uint64_t CheckpointSize(
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs)
+{
+    size_t n       = GetFieldSize(params);
+    uint64_t total = sizeof(CheckpointHeader);
+    if(IsTLRun(params.Beam)) {
+        total += n * sizeof(cpxf);
+    } else {
+        const ArrInfo *arrinfo = outputs.arrinfo;
+        total += n * sizeof(int32_t);
+        for(size_t base = 0; base < n; ++base) {
+            total += (uint64_t)NumStoredArrivals(arrinfo, base) * ArrivalBytes(arrinfo);
+        }
+    }
+    if(outputs.raystats != nullptr) {
+        total += (uint64_t)GetNumJobs<O3D>(params.Pos, params.Angles)
+            * sizeof(bhcRayStats);
+    }
+    return total;
+}
+
+/**
+ * Writes the outputs so far to the checkpoint file, under a temporary name
+ * which is then renamed, so a run killed while saving leaves the previous
+ * checkpoint intact.
+ */
+template<bool O3D, bool R3D> void SaveCheckpoint(
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs, uint64_t key,
+    int32_t jobsDone)
+{
+    const std::string &path = GetInternal(params)->checkpointFile;
+    CheckpointHeader header;
+    memcpy(header.magic, CheckpointMagic, sizeof(CheckpointMagic));
+    header.key       = key;
+    header.jobsDone  = jobsDone;
+    header.totalSize = CheckpointSize(params, outputs);
+
+    size_t n            = GetFieldSize(params);
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::binary);
+        out.write((const char *)&header, sizeof(header));
+        if(IsTLRun(params.Beam)) {
+            out.write((const char *)outputs.uAllSources, n * sizeof(cpxf));
+        } else {
+            const ArrInfo *arrinfo = outputs.arrinfo;
+            out.write((const char *)arrinfo->NArr, n * sizeof(int32_t));
+            for(size_t base = 0; base < n; ++base) {
+                out.write(
+                    ArrivalData(arrinfo, base * arrinfo->MaxNArr),
+                    NumStoredArrivals(arrinfo, base) * ArrivalBytes(arrinfo));
+            }
+        }
+        if(outputs.raystats != nullptr) {
+            out.write(
+                (const char *)outputs.raystats,
+                GetNumJobs<O3D>(params.Pos, params.Angles) * sizeof(bhcRayStats));
+        }
+        if(!out.good()) {
+            out.close();
+            std::remove(tmpPath.c_str());
+            EXTWARN("Could not write checkpoint file %s", path.c_str());
+            return;
+        }
+    }
+    if(std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::remove(tmpPath.c_str());
+        EXTWARN("Could not write checkpoint file %s", path.c_str());
+    }
+}
+
+/**
+ * Loads the outputs from the checkpoint file, if it exists and is a checkpoint
+ * of this run. Returns the number of jobs it has done, or 0, without modifying
+ * the outputs, if there is no valid checkpoint.
+ */
+template<bool O3D, bool R3D> int32_t LoadCheckpoint(
+    const bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, uint64_t key)
+{
+    MappedFile file;
+    if(!file.open(GetInternal(params)->checkpointFile)
+       || file.size() < sizeof(CheckpointHeader)) {
+        return 0;
+    }
+    const char *data = file.data();
+    CheckpointHeader header;
+    memcpy(&header, data, sizeof(header));
+    int32_t numJobs = GetNumJobs<O3D>(params.Pos, params.Angles);
+    if(memcmp(header.magic, CheckpointMagic, sizeof(CheckpointMagic)) != 0
+       || header.key != key || header.totalSize != file.size() || header.jobsDone <= 0
+       || header.jobsDone > numJobs) {
+        return 0;
+    }
+    size_t n   = GetFieldSize(params);
+    size_t pos = sizeof(CheckpointHeader);
+    if(IsTLRun(params.Beam)) {
+        if(file.size() < pos + n * sizeof(cpxf)) return 0;
+        memcpy(outputs.uAllSources, data + pos, n * sizeof(cpxf));
+        pos += n * sizeof(cpxf);
+    } else {
+        // Check the sizes of all the receivers' arrivals before touching them
+        ArrInfo *arrinfo   = outputs.arrinfo;
+        size_t arrBytes    = ArrivalBytes(arrinfo);
+        const char *narr   = data + pos;
+        uint64_t totalArrs = 0;
+        if(file.size() < pos + n * sizeof(int32_t)) return 0;
+        for(size_t base = 0; base < n; ++base) {
+            int32_t na;
+            memcpy(&na, narr + base * sizeof(int32_t), sizeof(na));
+            if(na < 0) return 0;
+            totalArrs += (uint64_t)bhc::min(na, arrinfo->MaxNArr);
+        }
+        if(file.size() < pos + n * sizeof(int32_t) + totalArrs * arrBytes) return 0;
+        memcpy(arrinfo->NArr, narr, n * sizeof(int32_t));
+        pos += n * sizeof(int32_t);
+        for(size_t base = 0; base < n; ++base) {
+            size_t bytes = (size_t)NumStoredArrivals(arrinfo, base) * arrBytes;
+            memcpy(ArrivalData(arrinfo, base * arrinfo->MaxNArr), data + pos, bytes);
+            pos += bytes;
+        }
+    }
+    if(outputs.raystats != nullptr) {
+        size_t bytes = (size_t)numJobs * sizeof(bhcRayStats);
+        if(file.size() < pos + bytes) return 0;
+        memcpy(outputs.raystats, data + pos, bytes);
+    }
+    return (int32_t)header.jobsDone;
+}
+
+template<bool O3D, bool R3D> void RunFieldModesCheckpointed(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
+{
+    if(IsAlsoEigenraysRun(params.Beam)) {
+        EXTERR("bhcInit::checkpointFile is not supported for arrivals runs which "
+               "also find eigenrays");
+    }
+    if(IsArrivalsRun(params.Beam) && outputs.arrinfo->ArrChunks != nullptr) {
+        EXTERR("bhcInit::checkpointFile is not supported with the arrivals arena "
+               "(bhcInit::arrivalsChunkSize)");
+    }
+    bhcInternal *internal = GetInternal(params);
+    FieldBatch<O3D, R3D> batch(&params, &outputs, 1);
+    int32_t numJobs = batch.NumJobs();
+    uint64_t key    = CheckpointKey(params, outputs);
+    int32_t done    = LoadCheckpoint(params, outputs, key);
+    if(done > 0) {
+        internal->PRTFile << "\nResuming from checkpoint " << internal->checkpointFile
+                          << ": " << done << " of " << numJobs << " rays done\n";
+        internal->completedRayCount = done;
+    }
+    // Sources are the outermost index of the jobs, so a window is part of
+    // a source or several whole sources. Each window is a separate launch,
+    // with its own private fields (CPU) or prefetches (GPU), so there are at
+    // most 64 of them, unless that would make them very big.
+    int32_t window = bhc::max(bhc::min(numJobs, 65536), (numJobs + 63) / 64);
+    Stopwatch sw;
+    sw.tick();
+    while(done < numJobs) {
+        batch.jobBegin = done;
+        batch.jobEnd   = numJobs - done > window ? done + window : numJobs;
+        RunFieldModesSelInflBatch<O3D, R3D>(batch);
+        done = batch.jobEnd;
+        if(done < numJobs && sw.tock() >= internal->checkpointInterval * 1000.0) {
+            SaveCheckpoint(params, outputs, key, done);
+            sw.tick();
+        }
+    }
+    std::remove(internal->checkpointFile.c_str());
+}
+
+template<bool O3D, bool R3D> void RunFieldModesDistributed(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
+{
+    bhcInternal *internal = GetInternal(params);
+    if(!internal->checkpointFile.empty()) {
+        EXTERR("bhcInit::mpiDistribute is not supported with bhcInit::checkpointFile");
+    }
+    if(IsAlsoEigenraysRun(params.Beam)) {
+        EXTERR("bhcInit::mpiDistribute is not supported for arrivals runs which also "
+               "find eigenrays");
+    }
+    if(IsArrivalsRun(params.Beam) && outputs.arrinfo->ArrChunks != nullptr) {
+        EXTERR("bhcInit::mpiDistribute is not supported with the arrivals arena "
+               "(bhcInit::arrivalsChunkSize)");
+    }
+    int32_t rank, ranks;
+    GetDistributedRank(internal, rank, ranks);
+    FieldBatch<O3D, R3D> batch(&params, &outputs, 1);
+    int32_t numJobs = batch.NumJobs();
+    // Sources are the outermost index of the jobs, see GetJobIndices, so
+    // whole sources are a contiguous range of jobs.
+    const Position *Pos = params.Pos;
+    int32_t nSrcs       = Pos->NSx * Pos->NSy * Pos->NSz;
+    bool bySource       = nSrcs >= ranks;
+    int32_t nUnits      = bySource ? nSrcs : numJobs;
+    int32_t unitJobs    = bySource ? numJobs / nSrcs : 1;
+    std::vector<int32_t> jobBounds(ranks + 1);
+    for(int32_t r = 0; r <= ranks; ++r) {
+        jobBounds[r] = (int32_t)((int64_t)nUnits * r / ranks) * unitJobs;
+    }
+    if(!bySource && IsArrivalsRun(params.Beam)) {
+        // The arrivals of one receiver come from several ranks, so they
+        // cannot be merged as they are found; PostProcessArrivals merges them
+        // once they are all on the root, as for multithreaded runs.
+        outputs.arrinfo->AllowMerging = false;
+    }
+    batch.jobBegin = jobBounds[rank];
+    batch.jobEnd   = jobBounds[rank + 1];
+    if(batch.jobEnd > batch.jobBegin) RunFieldModesSelInflBatch<O3D, R3D>(batch);
+    MergeDistributedOutputs<O3D, R3D>(params, outputs, jobBounds, bySource);
+    internal->completedRayCount = numJobs;
+}
+
+#ifdef BHC_BUILD_CUDA
+template<bool O3D, bool R3D> bool SetupDeviceOutputs(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs,
+    std::vector<bhcOutputs<O3D, R3D>> &devOutputs)
+{
+    bhcInternal *internal = GetInternal(params);
+    int32_t numGPUs       = (int32_t)internal->gpuIndices.size();
+    bool copies           = NumDeviceOutputCopies<O3D>(params) > 1;
+    size_t n              = GetFieldSize(params);
+    if(copies && IsTLRun(params.Beam)) {
+        // Unlike for arrivals, the memory for the copies is not reserved
+        // in advance, so use as many GPUs as there is room for.
+        size_t need  = n * sizeof(cpxf) + 32u;
+        size_t avail = internal->maxMemory - internal->usedMemory;
+        int32_t fit  = (int32_t)bhc::min((size_t)(numGPUs - 1), avail / need) + 1;
+        if(fit < numGPUs) {
+            EXTWARN(
+                "Only enough memory for copies of the sound field for %d of the %d "
+                "GPUs, using %d",
+                fit, numGPUs, fit);
+            numGPUs = fit;
+        }
+    }
+    bool arena = IsArrivalsRun(params.Beam) && outputs.arrinfo->ArrChunks != nullptr;
+    if(arena) {
+        // The GPUs must write to disjoint receivers, see NumDeviceOutputCopies.
+        int32_t nSrcs = params.Pos->NSx * params.Pos->NSy * params.Pos->NSz;
+        if(nSrcs < numGPUs) {
+            EXTWARN(
+                "Arrivals arena runs split GPUs by source, using %d of the %d GPUs",
+                nSrcs, numGPUs);
+            numGPUs = nSrcs;
+        }
+    }
+    devOutputs.assign(numGPUs, outputs);
+    if(numGPUs == 1) return false;
+    bool eigen = IsEigenraysRun(params.Beam) || IsAlsoEigenraysRun(params.Beam);
+    for(int32_t d = 0; d < numGPUs; ++d) {
+        bhcOutputs<O3D, R3D> &dev = devOutputs[d];
+        if(eigen) {
+            int32_t begin = (int32_t)((int64_t)outputs.eigen->memsize * d / numGPUs);
+            int32_t end = (int32_t)((int64_t)outputs.eigen->memsize * (d + 1) / numGPUs);
+            dev.eigen   = nullptr;
+            trackallocate(params, "per-GPU eigenray hits info", dev.eigen);
+            dev.eigen->hits    = &outputs.eigen->hits[begin];
+            dev.eigen->memsize = end - begin;
+            dev.eigen->neigen  = 0;
+        }
+        if(arena) {
+            // Atomics are not coherent between GPUs, so each GPU hands out
+            // the chunks from its own section of the arena.
+            dev.arrinfo = nullptr;
+            trackallocate(params, "per-GPU arrivals arena info", dev.arrinfo);
+            *dev.arrinfo               = *outputs.arrinfo;
+            dev.arrinfo->ArrChunksUsed = nullptr;
+            trackallocate(
+                params, "per-GPU arrivals chunk counter", dev.arrinfo->ArrChunksUsed);
+            int64_t nChunks = outputs.arrinfo->NArrChunks;
+            *dev.arrinfo->ArrChunksUsed = (int32_t)(nChunks * d / numGPUs);
+            dev.arrinfo->NArrChunks     = (int32_t)(nChunks * (d + 1) / numGPUs);
+        }
+        if(!copies || d == 0) continue;
+        if(IsTLRun(params.Beam)) {
+            dev.uAllSources = nullptr;
+            trackallocate(params, "per-GPU copies of sound field", dev.uAllSources, n);
+            memset(dev.uAllSources, 0, n * sizeof(cpxf));
+        } else if(IsArrivalsRun(params.Beam)) {
+            dev.arrinfo = nullptr;
+            trackallocate(params, "per-GPU copies of arrivals", dev.arrinfo);
+            *dev.arrinfo      = *outputs.arrinfo;
+            dev.arrinfo->Arr  = nullptr;
+            dev.arrinfo->ArrC = nullptr;
+            dev.arrinfo->NArr = nullptr;
+            size_t nArr       = n * (size_t)outputs.arrinfo->MaxNArr;
+            if(dev.arrinfo->isCompact) {
+                trackallocate(
+                    params, "per-GPU copies of arrivals", dev.arrinfo->ArrC, nArr);
+            } else {
+                trackallocate(
+                    params, "per-GPU copies of arrivals", dev.arrinfo->Arr, nArr);
+            }
+            trackallocate(params, "per-GPU copies of arrivals", dev.arrinfo->NArr, n);
+            // Only the arrivals below NArr are ever read, so Arr is not cleared
+            memset(dev.arrinfo->NArr, 0, n * sizeof(int32_t));
+        }
+    }
+    return copies;
+}
+
+template<bool O3D, bool R3D> void MergeDeviceOutputs(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs,
+    std::vector<bhcOutputs<O3D, R3D>> &devOutputs)
+{
+    int32_t numGPUs = (int32_t)devOutputs.size();
+    if(numGPUs <= 1) return;
+    bhcInternal *internal = GetInternal(params);
+    size_t n              = GetFieldSize(params);
+    int32_t numThreads    = internal->numThreads;
+    if(devOutputs[1].uAllSources != outputs.uAllSources) {
+        internal->threadPool.Run([&](int32_t worker) {
+            size_t begin = n * (size_t)worker / (size_t)numThreads;
+            size_t end   = n * (size_t)(worker + 1) / (size_t)numThreads;
+            for(int32_t d = 1; d < numGPUs; ++d) {
+                const cpxf *src = devOutputs[d].uAllSources;
+                for(size_t i = begin; i < end; ++i) outputs.uAllSources[i] += src[i];
+            }
+        });
+        for(int32_t d = 1; d < numGPUs; ++d) {
+            trackdeallocate(params, devOutputs[d].uAllSources);
+        }
+    }
+    if(outputs.arrinfo->ArrChunks != nullptr) {
+        // Arena mode, the GPUs shared all the arrays except the counters.
+        for(int32_t d = 0; d < numGPUs; ++d) {
+            trackdeallocate(params, devOutputs[d].arrinfo->ArrChunksUsed);
+            trackdeallocate(params, devOutputs[d].arrinfo);
+        }
+    } else if(devOutputs[1].arrinfo != outputs.arrinfo) {
+        ArrInfo *arrinfo = outputs.arrinfo;
+        int32_t MaxNArr  = arrinfo->MaxNArr;
+        size_t arrBytes  = ArrivalBytes(arrinfo);
+        internal->threadPool.Run([&](int32_t worker) {
+            size_t begin = n * (size_t)worker / (size_t)numThreads;
+            size_t end   = n * (size_t)(worker + 1) / (size_t)numThreads;
+            for(size_t base = begin; base < end; ++base) {
+                // As in PostProcessArrivals, NArr may be larger than
+                // MaxNArr, including the arrivals which did not fit. Keep the
+                // total so the same thing happens here.
+                int32_t total  = arrinfo->NArr[base];
+                int32_t stored = bhc::min(total, MaxNArr);
+                for(int32_t d = 1; d < numGPUs; ++d) {
+                    const ArrInfo *src = devOutputs[d].arrinfo;
+                    int32_t ncopy = bhc::min(src->NArr[base], MaxNArr - stored);
+                    memcpy(
+                        ArrivalData(arrinfo, base * MaxNArr + stored),
+                        ArrivalData(src, base * MaxNArr), ncopy * arrBytes);
+                    stored += ncopy;
+                    total += src->NArr[base];
+                }
+                arrinfo->NArr[base] = total;
+            }
+        });
+        for(int32_t d = 1; d < numGPUs; ++d) {
+            trackdeallocate(params, devOutputs[d].arrinfo->Arr);
+            trackdeallocate(params, devOutputs[d].arrinfo->ArrC);
+            trackdeallocate(params, devOutputs[d].arrinfo->NArr);
+            trackdeallocate(params, devOutputs[d].arrinfo);
+        }
+    }
+    if(devOutputs[0].eigen != outputs.eigen) {
+        // Pack the hits from each GPU's section of the buffer together
+        EigenInfo *eigen = outputs.eigen;
+        int32_t stored = 0, total = 0;
+        bool overflow = false;
+        for(int32_t d = 0; d < numGPUs; ++d) {
+            EigenInfo *src = devOutputs[d].eigen;
+            int32_t ncopy  = bhc::min(src->neigen, src->memsize);
+            memmove(&eigen->hits[stored], src->hits, ncopy * sizeof(EigenHit));
+            stored += ncopy;
+            total += src->neigen;
+            overflow = overflow || src->neigen > src->memsize;
+            trackdeallocate(params, devOutputs[d].eigen);
+        }
+        // If any GPU ran out of space, report the total number of hits,
+        // but only the ones which were stored can be used.
+        if(overflow) eigen->memsize = stored;
+        eigen->neigen = total;
+    }
+}
+
+/// Calls f(ptr, bytes) for each part of the outputs which GPU d writes.
+template<bool O3D, bool R3D, typename F> inline void ForDeviceOutputs(
+    const bhcParams<O3D> &params, const std::vector<bhcOutputs<O3D, R3D>> &devOutputs,
+    int32_t d, bool interleave, F f)
+{
+    const bhcOutputs<O3D, R3D> &dev = devOutputs[d];
+    int32_t numGPUs                 = (int32_t)devOutputs.size();
+    size_t n = GetFieldSize(params), begin = 0, end = n;
+    if(!interleave && numGPUs > 1) {
+        int32_t nSrcs = params.Pos->NSx * params.Pos->NSy * params.Pos->NSz;
+        int32_t srcBegin, srcEnd;
+        SplitAmongDevices(nSrcs, d, numGPUs, srcBegin, srcEnd);
+        begin = n / (size_t)nSrcs * (size_t)srcBegin;
+        end   = n / (size_t)nSrcs * (size_t)srcEnd;
+    }
+    if(IsTLRun(params.Beam)) {
+        f(&dev.uAllSources[begin], (end - begin) * sizeof(cpxf));
+    } else if(IsArrivalsRun(params.Beam)) {
+        const ArrInfo *arrinfo = dev.arrinfo;
+        size_t MaxNArr         = (size_t)arrinfo->MaxNArr;
+        size_t arrBytes        = ArrivalBytes(arrinfo);
+        if(arrinfo->ArrChunks != nullptr) {
+            // This GPU's section of the arena, see SetupDeviceOutputs
+            size_t chunksPerRcvr = MaxNArr / (size_t)arrinfo->ArrChunkSize;
+            size_t chunkSize     = (size_t)arrinfo->ArrChunkSize;
+            size_t chunkBegin
+                = d > 0 ? (size_t)devOutputs[d - 1].arrinfo->NArrChunks : 0;
+            f(ArrivalData(arrinfo, chunkBegin * chunkSize),
+              ((size_t)arrinfo->NArrChunks - chunkBegin) * chunkSize * arrBytes);
+            f(&arrinfo->ArrChunks[begin * chunksPerRcvr],
+              (end - begin) * chunksPerRcvr * sizeof(int32_t));
+            f(arrinfo->ArrChunksUsed, sizeof(int32_t));
+        } else {
+            f(ArrivalData(arrinfo, begin * MaxNArr), (end - begin) * MaxNArr * arrBytes);
+        }
+        f(&arrinfo->NArr[begin], (end - begin) * sizeof(int32_t));
+    }
+    if(IsEigenraysRun(params.Beam) || IsAlsoEigenraysRun(params.Beam)) {
+        f(dev.eigen, sizeof(EigenInfo));
+        f(dev.eigen->hits, (size_t)dev.eigen->memsize * sizeof(EigenHit));
+    }
+}
+
+inline void PrefetchRange(const void *ptr, size_t bytes, int device)
+{
+    if(ptr == nullptr || bytes == 0) return;
+    checkCudaErrors(cudaMemPrefetchAsync(ptr, bytes, device));
+}
+
+template<bool O3D, bool R3D> void PrefetchToDevice(
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+    const std::vector<bhcOutputs<O3D, R3D>> &devOutputs, int32_t d, bool interleave,
+    int device)
+{
+    bhcInternal *internal = GetInternal(params);
+    if(!internal->prefetchMemory) return;
+    // Everything which is not an input: the outputs, including other GPUs'
+    // copies, and the ray data, which field runs do not use.
+    std::set<const void *> notInputs = {
+        outputs.uAllSources,            outputs.eigen,
+        outputs.eigen->hits,            outputs.arrinfo->Arr,
+        outputs.arrinfo->ArrC,          outputs.arrinfo->NArr,
+        outputs.arrinfo->MaxNPerSource, outputs.arrinfo->ArrChunks,
+        outputs.arrinfo->ArrChunksUsed, outputs.rayinfo->results,
+        outputs.rayinfo->RayMem,        outputs.rayinfo->WorkRayMem,
+    };
+    for(const bhcOutputs<O3D, R3D> &dev : devOutputs) {
+        notInputs.insert(dev.uAllSources);
+        notInputs.insert(dev.eigen);
+        notInputs.insert(dev.arrinfo->Arr);
+        notInputs.insert(dev.arrinfo->ArrC);
+        notInputs.insert(dev.arrinfo->NArr);
+        notInputs.insert(dev.arrinfo->ArrChunksUsed);
+    }
+    for(const auto &a : internal->allocations) {
+        if(notInputs.count(a.first) != 0) continue;
+        // The inputs are only read on the GPU(s), so let each GPU keep its
+        // own copy, and keep the host copy valid too. This is still correct
+        // if the host later modifies them, it just invalidates the copies.
+        checkCudaErrors(
+            cudaMemAdvise(a.first, a.second, cudaMemAdviseSetReadMostly, device));
+        PrefetchRange(a.first, a.second, device);
+    }
+    ForDeviceOutputs(
+        params, devOutputs, d, interleave,
+        [&](const void *ptr, size_t bytes) { PrefetchRange(ptr, bytes, device); });
+}
+
+template<bool O3D, bool R3D> void PrefetchOutputsToHost(
+    const bhcParams<O3D> &params, const std::vector<bhcOutputs<O3D, R3D>> &devOutputs,
+    int32_t d, bool interleave)
+{
+    if(!GetInternal(params)->prefetchMemory) return;
+    ForDeviceOutputs(
+        params, devOutputs, d, interleave, [&](const void *ptr, size_t bytes) {
+            PrefetchRange(ptr, bytes, cudaCpuDeviceId);
+        });
+}
+#endif
+
+#if BHC_ENABLE_2D
+template bool BeginRetainedRays<false, false>(
+    bhcParams<false> &params, rayPt<false> *&workRays, size_t &capacity, uint64_t &key);
+template void EndRetainedRays<false, false>(
+    bhcParams<false> &params, rayPt<false> *&workRays, size_t usedPoints, bool overflow,
+    uint64_t key);
+template bool SetupPrivateFields<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs, ThreadPool &pool,
+    cpxf *&privFields);
+template void ReducePrivateFields<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs, ThreadPool &pool,
+    cpxf *&privFields);
+#ifdef BHC_BUILD_CUDA
+template bool SetupDeviceOutputs<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs,
+    std::vector<bhcOutputs<false, false>> &devOutputs);
+template void MergeDeviceOutputs<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs,
+    std::vector<bhcOutputs<false, false>> &devOutputs);
+template void PrefetchToDevice<false, false>(
+    const bhcParams<false> &params, const bhcOutputs<false, false> &outputs,
+    const std::vector<bhcOutputs<false, false>> &devOutputs, int32_t d, bool interleave,
+    int device);
+template void PrefetchOutputsToHost<false, false>(
+    const bhcParams<false> &params,
+    const std::vector<bhcOutputs<false, false>> &devOutputs, int32_t d, bool interleave);
+#endif
+#endif
+#if BHC_ENABLE_NX2D
+template bool BeginRetainedRays<true, false>(
+    bhcParams<true> &params, rayPt<false> *&workRays, size_t &capacity, uint64_t &key);
+template void EndRetainedRays<true, false>(
+    bhcParams<true> &params, rayPt<false> *&workRays, size_t usedPoints, bool overflow,
+    uint64_t key);
+template bool SetupPrivateFields<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs, ThreadPool &pool,
+    cpxf *&privFields);
+template void ReducePrivateFields<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs, ThreadPool &pool,
+    cpxf *&privFields);
+#ifdef BHC_BUILD_CUDA
+template bool SetupDeviceOutputs<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs,
+    std::vector<bhcOutputs<true, false>> &devOutputs);
+template void MergeDeviceOutputs<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs,
+    std::vector<bhcOutputs<true, false>> &devOutputs);
+template void PrefetchToDevice<true, false>(
+    const bhcParams<true> &params, const bhcOutputs<true, false> &outputs,
+    const std::vector<bhcOutputs<true, false>> &devOutputs, int32_t d, bool interleave,
+    int device);
+template void PrefetchOutputsToHost<true, false>(
+    const bhcParams<true> &params,
+    const std::vector<bhcOutputs<true, false>> &devOutputs, int32_t d, bool interleave);
+#endif
+#endif
+#if BHC_ENABLE_3D
+template bool BeginRetainedRays<true, true>(
+    bhcParams<true> &params, rayPt<true> *&workRays, size_t &capacity, uint64_t &key);
+template void EndRetainedRays<true, true>(
+    bhcParams<true> &params, rayPt<true> *&workRays, size_t usedPoints, bool overflow,
+    uint64_t key);
+template bool SetupPrivateFields<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs, ThreadPool &pool,
+    cpxf *&privFields);
+template void ReducePrivateFields<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs, ThreadPool &pool,
+    cpxf *&privFields);
+#ifdef BHC_BUILD_CUDA
+template bool SetupDeviceOutputs<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs,
+    std::vector<bhcOutputs<true, true>> &devOutputs);
+template void MergeDeviceOutputs<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs,
+    std::vector<bhcOutputs<true, true>> &devOutputs);
+template void PrefetchToDevice<true, true>(
+    const bhcParams<true> &params, const bhcOutputs<true, true> &outputs,
+    const std::vector<bhcOutputs<true, true>> &devOutputs, int32_t d, bool interleave,
+    int device);
+template void PrefetchOutputsToHost<true, true>(
+    const bhcParams<true> &params,
+    const std::vector<bhcOutputs<true, true>> &devOutputs, int32_t d, bool interleave);
+#endif
+#endif
+
+#if BHC_ENABLE_2D
+template void FreeRetainedRays<false>(bhcParams<false> &params);
+#endif
+#if BHC_ENABLE_NX2D || BHC_ENABLE_3D
+template void FreeRetainedRays<true>(bhcParams<true> &params);
+#endif
+
+#if BHC_ENABLE_2D
+template void RunFieldModesCheckpointed<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs);
+template void RunFieldModesDistributed<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs);
+#endif
+#if BHC_ENABLE_NX2D
+template void RunFieldModesCheckpointed<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+template void RunFieldModesDistributed<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+#endif
+#if BHC_ENABLE_3D
+template void RunFieldModesCheckpointed<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs);
+template void RunFieldModesDistributed<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs);
+#endif
+
+/**
+ * Ray stats file, see bhcInit::rayStatsFile: RayStatsHeader, then a
+ * bhcRayStats for each of the NRays rays, in job order. The numbers of sources
+ * and azimuthal angles are those of the run; the number of elevation angles is
+ * the rest of NRays, as an adaptive fan (bhcInit::adaptiveFanLevels) has
+ * already been put back to the one from the environment file.
+ */
+constexpr const char RayStatsMagic[8] = {'B', 'H', 'C', 'R', 'S', 'T', 'A', '1'};
+
+struct RayStatsHeader {
+    char magic[8];
+    int32_t NSz, NSx, NSy, Nbeta, Nalpha, unused;
+    uint64_t NRays;
+};
+
+template<bool O3D> void WriteRayStats(
+    const bhcParams<O3D> &params, const bhcRayStats *raystats, int32_t NRays,
+    const std::string &FileRoot)
+{
+    if(raystats == nullptr) return;
+    const Position *Pos   = params.Pos;
+    const AngleInfo &beta = params.Angles->beta;
+    RayStatsHeader header;
+    memcpy(header.magic, RayStatsMagic, sizeof(RayStatsMagic));
+    header.NSz    = Pos->NSz;
+    header.NSx    = O3D ? Pos->NSx : 1;
+    header.NSy    = O3D ? Pos->NSy : 1;
+    header.Nbeta  = (O3D && beta.iSingle == 0) ? beta.n : 1;
+    header.NRays  = (uint64_t)NRays;
+    header.Nalpha = (int32_t)(header.NRays
+                              / ((uint64_t)header.NSz * (uint64_t)header.NSx
+                                 * (uint64_t)header.NSy * (uint64_t)header.Nbeta));
+    header.unused = 0;
+    std::ofstream out(FileRoot + ".raystats", std::ios::binary);
+    out.write((const char *)&header, sizeof(header));
+    out.write((const char *)raystats, header.NRays * sizeof(bhcRayStats));
+    if(!out.good()) {
+        EXTERR("Failed to write ray stats file %s.raystats", FileRoot.c_str());
+    }
+}
+
+#if BHC_ENABLE_2D
+template void WriteRayStats<false>(
+    const bhcParams<false> &params, const bhcRayStats *raystats, int32_t NRays,
+    const std::string &FileRoot);
+#endif
+#if BHC_ENABLE_NX2D || BHC_ENABLE_3D
+template void WriteRayStats<true>(
+    const bhcParams<true> &params, const bhcRayStats *raystats, int32_t NRays,
+    const std::string &FileRoot);
+#endif
+
 }} // namespace bhc::mode
@@ -24,6 +24,163 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 
 namespace bhc { namespace mode {
 
+/**
+ * Whether this run refines the elevation fan, see bhcInit::adaptiveFanLevels.
+ */
+template<bool O3D> inline bool UseAdaptiveFan(const bhcParams<O3D> &params)
+{
+    const AngleInfo &alpha = params.Angles->alpha;
+    return GetInternal(params)->adaptiveFanLevels > 0
+        && (IsEigenraysRun(params.Beam) || IsArrivalsRun(params.Beam))
+        && alpha.iSingle == 0 && alpha.n >= 2;
+}
+
+/// Whether this run is split across MPI ranks, see bhcInit::mpiDistribute.
+template<bool O3D> inline bool UseDistributed(const bhcParams<O3D> &params)
+{
+    bhcInternal *internal = GetInternal(params);
+    return internal->mpiDistribute && !internal->retainRays
+        && (IsTLRun(params.Beam) || IsArrivalsRun(params.Beam));
+}
+
+/// Whether this run saves its progress, see bhcInit::checkpointFile.
+template<bool O3D> inline bool UseCheckpoint(const bhcParams<O3D> &params)
+{
+    bhcInternal *internal = GetInternal(params);
+    return !internal->checkpointFile.empty() && !internal->retainRays
+        && (IsTLRun(params.Beam) || IsArrivalsRun(params.Beam));
+}
+
+/**
+ * Allocates bhcOutputs::raystats for the rays of the current params, or clears
+ * it if it is already the right size. Does nothing unless bhcInit::rayStats.
+ */
+template<bool O3D, bool R3D> inline void SetupRayStats(
+    const bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
+{
+    if(!GetInternal(params)->rayStats) return;
+    int32_t n = GetNumJobs<O3D>(params.Pos, params.Angles);
+    if(outputs.raystats == nullptr || outputs.NRayStats != n) {
+        trackdeallocate(params, outputs.raystats);
+        trackallocate(params, "per-ray statistics", outputs.raystats, n);
+        outputs.NRayStats = n;
+    }
+    memset(outputs.raystats, 0, n * sizeof(bhcRayStats));
+}
+
+/**
+ * Writes the NRays entries of bhcOutputs::raystats to FileRoot.raystats, see
+ * bhcInit::rayStatsFile. Does nothing if there are no stats.
+ */
+template<bool O3D> void WriteRayStats(
+    const bhcParams<O3D> &params, const bhcRayStats *raystats, int32_t NRays,
+    const std::string &FileRoot);
+extern template void WriteRayStats<false>(
+    const bhcParams<false> &params, const bhcRayStats *raystats, int32_t NRays,
+    const std::string &FileRoot);
+extern template void WriteRayStats<true>(
+    const bhcParams<true> &params, const bhcRayStats *raystats, int32_t NRays,
+    const std::string &FileRoot);
+
+/**
+ * Puts back the elevation fan from the environment file after an adaptive fan
+ * run, once the eigenrays (which are retraced by launch angle index) have been
+ * postprocessed. Does nothing if the last run did not use an adaptive fan.
+ */
+template<bool O3D> inline void EndAdaptiveFan(bhcParams<O3D> &params)
+{
+    bhcInternal *internal = GetInternal(params);
+    if(internal->origAlphaAngles == nullptr) return;
+    AngleInfo &alpha = params.Angles->alpha;
+    trackdeallocate(params, alpha.angles);
+    alpha.angles              = internal->origAlphaAngles;
+    alpha.n                   = internal->origAlphaN;
+    alpha.d                   = internal->origAlphaD;
+    internal->origAlphaAngles = nullptr;
+}
+
+/// Swaps the source and receiver depths, see bhcInit::reciprocal.
+template<bool O3D> inline void SwapSourceReceiverDepths(bhcParams<O3D> &params)
+{
+    Position *Pos = params.Pos;
+    std::swap(Pos->Sz, Pos->Rz);
+    std::swap(Pos->NSz, Pos->NRz);
+    Pos->NRz_per_range = Pos->NRz;
+}
+
+/**
+ * If this run should be traced from the receivers (see bhcInit::reciprocal),
+ * swaps the source and receiver depths of the preprocessed params. Call before
+ * the mode's Preprocess, and EndReciprocal after its Postprocess.
+ */
+template<bool O3D, bool R3D> void BeginReciprocal(bhcParams<O3D> &params);
+extern template void BeginReciprocal<false, false>(bhcParams<false> &params);
+extern template void BeginReciprocal<true, false>(bhcParams<true> &params);
+extern template void BeginReciprocal<true, true>(bhcParams<true> &params);
+
+/**
+ * Puts the postprocessed results of a run begun with BeginReciprocal into the
+ * layout of the original sources and receivers, and puts back the depths.
+ * Does nothing if the run was not reciprocal.
+ */
+template<bool O3D, bool R3D> void EndReciprocal(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs);
+extern template void EndReciprocal<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs);
+extern template void EndReciprocal<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+extern template void EndReciprocal<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs);
+
+/// Puts back the depths after a reciprocal run failed, if one was begun.
+template<bool O3D> inline void AbortReciprocal(bhcParams<O3D> &params)
+{
+    bhcInternal *internal = GetInternal(params);
+    if(!internal->reciprocalActive) return;
+    SwapSourceReceiverDepths(params);
+    internal->reciprocalActive = false;
+}
+
+/**
+ * If only one source position per depth (and in Nx2D one bearing) has to be
+ * traced (see bhcInit::exploitSymmetry), reduces the preprocessed params to
+ * those. Call before the mode's Preprocess, and EndSymmetry after its
+ * Postprocess.
+ */
+template<bool O3D, bool R3D> void BeginSymmetry(bhcParams<O3D> &params);
+extern template void BeginSymmetry<false, false>(bhcParams<false> &params);
+extern template void BeginSymmetry<true, false>(bhcParams<true> &params);
+extern template void BeginSymmetry<true, true>(bhcParams<true> &params);
+
+/**
+ * Copies the postprocessed results of a run begun with BeginSymmetry to every
+ * source position (and bearing), and puts back the params. Does nothing if the
+ * run did not use symmetry.
+ */
+template<bool O3D, bool R3D> void EndSymmetry(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs);
+extern template void EndSymmetry<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs);
+extern template void EndSymmetry<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+extern template void EndSymmetry<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs);
+
+/**
+ * Puts back the params of a run begun with BeginSymmetry, without copying any
+ * results, e.g. after the run failed. Does nothing if none was begun.
+ */
+template<bool O3D> inline void AbortSymmetry(bhcParams<O3D> &params)
+{
+    bhcInternal *internal = GetInternal(params);
+    if(!internal->symmetryActive) return;
+    params.Pos->NSx             = internal->origNSx;
+    params.Pos->NSy             = internal->origNSy;
+    params.Pos->Ntheta          = internal->origNtheta;
+    params.Angles->beta.iSingle = internal->origBetaSingle;
+    internal->symmetryActive    = false;
+}
+
 /**
  * Parent class for field modes (TL, eigen, arr).
  */
@@ -39,7 +196,19 @@ public:
 
     virtual void Run(bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs) const override
     {
-        RunFieldModesSelInfl<O3D, R3D>(params, outputs);
+        if(UseAdaptiveFan(params)) {
+            RunFieldModesAdaptiveFan<O3D, R3D>(params, outputs);
+        } else {
+            SetupRayStats<O3D, R3D>(params, outputs);
+            if(UseDistributed(params)) {
+                RunFieldModesDistributed<O3D, R3D>(params, outputs);
+            } else if(UseCheckpoint(params)) {
+                RunFieldModesCheckpointed<O3D, R3D>(params, outputs);
+            } else {
+                RunFieldModesSelInfl<O3D, R3D>(
+                    params, outputs, GetInternal(params)->retainRays);
+            }
+        }
     }
 };
 
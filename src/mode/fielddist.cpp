@@ -0,0 +1,195 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "fieldimpl.hpp"
+#include "../arrivals.hpp"
+
+#include <vector>
+
+#ifdef BHC_USE_MPI
+#include <mpi.h>
+#endif
+
+namespace bhc { namespace mode {
+
+#ifdef BHC_USE_MPI
+
+/// MPI counts are int, so big buffers are sent in pieces of this size.
+constexpr size_t MaxMPIMessage = (size_t)1 << 30;
+
+inline void SendBytes(const void *data, size_t bytes, int dest)
+{
+    const char *d = (const char *)data;
+    for(size_t off = 0; off < bytes; off += MaxMPIMessage) {
+        int n = (int)bhc::min(bytes - off, MaxMPIMessage);
+        MPI_Send(d + off, n, MPI_BYTE, dest, 0, MPI_COMM_WORLD);
+    }
+}
+
+inline void RecvBytes(void *data, size_t bytes, int src)
+{
+    char *d = (char *)data;
+    for(size_t off = 0; off < bytes; off += MaxMPIMessage) {
+        int n = (int)bhc::min(bytes - off, MaxMPIMessage);
+        MPI_Recv(d + off, n, MPI_BYTE, src, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+}
+
+/// Rank 0 receives each other rank's part of an output, and they send it.
+template<typename F> inline void GatherParts(int32_t rank, int32_t ranks, F &&part)
+{
+    for(int32_t r = 1; r < ranks; ++r) {
+        if(rank != 0 && rank != r) continue;
+        void *data;
+        size_t bytes;
+        part(r, data, bytes);
+        if(rank == 0) {
+            RecvBytes(data, bytes, r);
+        } else {
+            SendBytes(data, bytes, 0);
+        }
+    }
+}
+
+void GetDistributedRank(bhcInternal *internal, int32_t &rank, int32_t &ranks)
+{
+    int initialized = 0;
+    MPI_Initialized(&initialized);
+    if(!initialized) {
+        ExternalError(internal, "bhcInit::mpiDistribute: MPI has not been initialized");
+    }
+    int r, n;
+    MPI_Comm_rank(MPI_COMM_WORLD, &r);
+    MPI_Comm_size(MPI_COMM_WORLD, &n);
+    rank  = r;
+    ranks = n;
+}
+
+template<bool O3D, bool R3D> void MergeDistributedOutputs(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs,
+    const std::vector<int32_t> &jobBounds, bool bySource)
+{
+    int32_t rank, ranks;
+    GetDistributedRank(GetInternal(params), rank, ranks);
+    if(ranks <= 1) return;
+    size_t n = GetFieldSize(params);
+    if(IsTLRun(params.Beam) && bySource) {
+        // Sources are also the outermost index of each plane of the
+        // field, see GetFieldAddr, so each rank's sources are one block of it.
+        const Position *Pos   = params.Pos;
+        int32_t nSrcs         = Pos->NSx * Pos->NSy * Pos->NSz;
+        int32_t jobsPerSource = GetNumJobs<O3D>(Pos, params.Angles) / nSrcs;
+        size_t planeSize      = GetTLPlaneSize(params);
+        size_t perSource      = planeSize / (size_t)nSrcs;
+        for(int32_t p = 0; p < GetNumTLPlanes(params); ++p) {
+            GatherParts(rank, ranks, [&](int32_t r, void *&data, size_t &bytes) {
+                size_t srcBegin = (size_t)(jobBounds[r] / jobsPerSource);
+                size_t srcEnd   = (size_t)(jobBounds[r + 1] / jobsPerSource);
+                data  = &outputs.uAllSources[p * planeSize + srcBegin * perSource];
+                bytes = (srcEnd - srcBegin) * perSource * sizeof(cpxf);
+            });
+        }
+    } else if(IsTLRun(params.Beam)) {
+        float *f         = (float *)outputs.uAllSources;
+        size_t nf        = 2 * n;
+        size_t maxFloats = MaxMPIMessage / sizeof(float);
+        for(size_t off = 0; off < nf; off += maxFloats) {
+            int count = (int)bhc::min(nf - off, maxFloats);
+            MPI_Reduce(
+                rank == 0 ? MPI_IN_PLACE : &f[off], &f[off], count, MPI_FLOAT, MPI_SUM,
+                0, MPI_COMM_WORLD);
+        }
+    } else {
+        ArrInfo *arrinfo = outputs.arrinfo;
+        int32_t MaxNArr  = arrinfo->MaxNArr;
+        size_t arrBytes  = ArrivalBytes(arrinfo);
+        std::vector<int32_t> narr;
+        std::vector<char> packed;
+        if(rank != 0) {
+            for(size_t base = 0; base < n; ++base) {
+                const char *src = ArrivalData(arrinfo, base * MaxNArr);
+                packed.insert(
+                    packed.end(), src, src + NumStoredArrivals(arrinfo, base) * arrBytes);
+            }
+            SendBytes(arrinfo->NArr, n * sizeof(int32_t), 0);
+            SendBytes(packed.data(), packed.size(), 0);
+        } else {
+            narr.resize(n);
+            for(int32_t r = 1; r < ranks; ++r) {
+                RecvBytes(narr.data(), n * sizeof(int32_t), r);
+                size_t total = 0;
+                for(size_t base = 0; base < n; ++base) {
+                    total += (size_t)bhc::min(narr[base], MaxNArr) * arrBytes;
+                }
+                packed.resize(total);
+                RecvBytes(packed.data(), total, r);
+                size_t pos = 0;
+                for(size_t base = 0; base < n; ++base) {
+                    // As in MergeDeviceOutputs, NArr keeps the total,
+                    // including the arrivals which did not fit.
+                    int32_t stored = bhc::min(arrinfo->NArr[base], MaxNArr);
+                    int32_t sent   = bhc::min(narr[base], MaxNArr);
+                    int32_t ncopy  = bhc::min(sent, MaxNArr - stored);
+                    memcpy(
+                        ArrivalData(arrinfo, base * MaxNArr + stored), &packed[pos],
+                        ncopy * arrBytes);
+                    pos += sent * arrBytes;
+                    arrinfo->NArr[base] += narr[base];
+                }
+            }
+        }
+    }
+    if(outputs.raystats != nullptr) {
+        GatherParts(rank, ranks, [&](int32_t r, void *&data, size_t &bytes) {
+            data  = &outputs.raystats[jobBounds[r]];
+            bytes = (size_t)(jobBounds[r + 1] - jobBounds[r]) * sizeof(bhcRayStats);
+        });
+    }
+}
+
+#else
+
+void GetDistributedRank(bhcInternal *internal, int32_t &, int32_t &)
+{
+    ExternalError(
+        internal, "bhcInit::mpiDistribute requires a build with BHC_USE_MPI enabled");
+}
+
+template<bool O3D, bool R3D> void MergeDistributedOutputs(
+    bhcParams<O3D> &, bhcOutputs<O3D, R3D> &, const std::vector<int32_t> &, bool)
+{}
+
+#endif
+
+#if BHC_ENABLE_2D
+template void MergeDistributedOutputs<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs,
+    const std::vector<int32_t> &jobBounds, bool bySource);
+#endif
+#if BHC_ENABLE_NX2D
+template void MergeDistributedOutputs<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs,
+    const std::vector<int32_t> &jobBounds, bool bySource);
+#endif
+#if BHC_ENABLE_3D
+template void MergeDistributedOutputs<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs,
+    const std::vector<int32_t> &jobBounds, bool bySource);
+#endif
+
+}} // namespace bhc::mode
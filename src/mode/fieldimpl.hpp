@@ -19,21 +19,369 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #pragma once
 #include "../common.hpp"
 
+#include <algorithm>
+#include <vector>
+
 namespace bhc { namespace mode {
 
+/// Environment which job of a batch belongs to, see FieldBatch::jobOffsets.
+HOST_DEVICE inline int32_t FindBatchEnv(
+    const int32_t *jobOffsets, int32_t nEnvs, int32_t job)
+{
+    int32_t lo = 0, hi = nEnvs - 1;
+    while(lo < hi) {
+        int32_t mid = (lo + hi + 1) / 2;
+        if(jobOffsets[mid] <= job) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/**
+ * One or more environments, all with the same template config, whose rays are
+ * traced together (see bhc::run_batch). The combined job space is
+ * (environment, source, ray). The thread pool, job scheduler, and GPU(s) of
+ * the first environment are used for all of them.
+ */
+template<bool O3D, bool R3D> struct FieldBatch {
+    bhcParams<O3D> *params;
+    bhcOutputs<O3D, R3D> *outputs;
+    int32_t n;
+    /// Environment e has jobs [jobOffsets[e], jobOffsets[e + 1]).
+    std::vector<int32_t> jobOffsets;
+    /// Single environment only: keep or replay the rays, see bhcInit::retainRays.
+    bool retainRays = false;
+    /// Single environment only: re-trace just these rays, see bhc::playback.
+    bhcPlaybackRay *playback = nullptr;
+    int32_t nPlayback        = 0;
+    /// Single environment only: trace just the jobs [jobBegin, jobEnd), see
+    /// bhcInit::checkpointFile. By default all the jobs.
+    int32_t jobBegin = 0, jobEnd;
+
+    FieldBatch(bhcParams<O3D> *params_, bhcOutputs<O3D, R3D> *outputs_, int32_t n_)
+        : params(params_), outputs(outputs_), n(n_), jobOffsets(n_ + 1, 0)
+    {
+        int64_t total = 0;
+        for(int32_t e = 0; e < n; ++e) {
+            total += GetNumJobs<O3D>(params[e].Pos, params[e].Angles);
+            if(total > 0x7FFFFFFF) ExternalError(Runner(), "Too many rays in batch");
+            jobOffsets[e + 1] = (int32_t)total;
+        }
+        jobEnd = NumJobs();
+    }
+
+    int32_t NumJobs() const { return jobOffsets[n]; }
+    int32_t GetEnv(int32_t job) const { return FindBatchEnv(jobOffsets.data(), n, job); }
+    bhcInternal *Runner() const { return GetInternal(params[0]); }
+};
+
+/**
+ * Sets up the job scheduler of the batch's first environment for all the rays
+ * of the batch (or its window of jobs), see InitRayJobs.
+ */
+template<bool O3D, bool R3D> inline void InitBatchJobs(const FieldBatch<O3D, R3D> &batch)
+{
+    bhcInternal *internal = batch.Runner();
+    int32_t numJobs       = batch.jobEnd - batch.jobBegin;
+    if(!internal->orderJobsByCost) {
+        internal->jobSched.Init(
+            numJobs, internal->numThreads, internal->jobChunkSize, nullptr,
+            batch.jobBegin);
+        return;
+    }
+    std::vector<float> cost(numJobs);
+    for(int32_t i = 0; i < numJobs; ++i) {
+        int32_t job = batch.jobBegin + i;
+        int32_t e   = batch.GetEnv(job);
+        cost[i]     = GetRayJobCost<O3D>(batch.params[e], job - batch.jobOffsets[e]);
+    }
+    internal->jobSched.Init(
+        numJobs, internal->numThreads, internal->jobChunkSize, &cost, batch.jobBegin);
+}
+
 template<typename CFG, bool O3D, bool R3D> void FieldModesWorker(
-    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, ErrState *errState);
+    FieldBatch<O3D, R3D> &batch, int32_t worker, const std::vector<cpxf *> &privFields,
+    bool atomicField, ErrState *errState);
+
+/**
+ * CPU TL runs only: if there is enough memory, allocates a private copy of the
+ * field for each worker in pool other than worker 0 (which accumulates
+ * directly into uAllSources), so that the workers can add their contributions
+ * without atomics. Returns false if there is not enough memory, in which case
+ * the workers must use the atomic path.
+ */
+template<bool O3D, bool R3D> bool SetupPrivateFields(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, ThreadPool &pool,
+    cpxf *&privFields);
+/// Adds all the private fields into uAllSources (in parallel) and frees them.
+template<bool O3D, bool R3D> void ReducePrivateFields(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, ThreadPool &pool,
+    cpxf *&privFields);
+/// Field for the given worker to accumulate into, see SetupPrivateFields.
+template<bool O3D, bool R3D> inline cpxf *GetWorkerField(
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+    cpxf *privFields, int32_t worker)
+{
+    if(privFields == nullptr || worker == 0) return outputs.uAllSources;
+    return &privFields[(size_t)(worker - 1) * GetFieldSize(params)];
+}
+
+#ifdef BHC_BUILD_CUDA
+/**
+ * Multi-GPU runs: sets up the outputs each GPU writes to, one per GPU used.
+ * Returns true if each GPU has its own copy of the TL / arrivals outputs, in
+ * which case the rays are interleaved across the GPUs; otherwise, the GPUs are
+ * given disjoint sets of sources (see NumDeviceOutputCopies). Eigenray hits are
+ * always split into one disjoint section of the hits buffer per GPU.
+ */
+template<bool O3D, bool R3D> bool SetupDeviceOutputs(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs,
+    std::vector<bhcOutputs<O3D, R3D>> &devOutputs);
+/// Merges the outputs from each GPU into outputs and frees the copies.
+template<bool O3D, bool R3D> void MergeDeviceOutputs(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs,
+    std::vector<bhcOutputs<O3D, R3D>> &devOutputs);
+/**
+ * Splits n sources (or environments of a batch) between the GPUs, GPU d gets
+ * [begin, end).
+ */
+inline void SplitAmongDevices(
+    int32_t n, int32_t d, int32_t numGPUs, int32_t &begin, int32_t &end)
+{
+    begin = (int32_t)((int64_t)n * d / numGPUs);
+    end   = (int32_t)((int64_t)n * (d + 1) / numGPUs);
+}
+/**
+ * If bhcInit::prefetchMemory, starts migrating all the inputs, and the part of
+ * the outputs which GPU d (CUDA device index `device`) writes, to that GPU,
+ * instead of the kernel page faulting over them. Must be called with that GPU
+ * as the current device, before the kernel is launched, so the kernel is
+ * ordered after the migration.
+ */
+template<bool O3D, bool R3D> void PrefetchToDevice(
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+    const std::vector<bhcOutputs<O3D, R3D>> &devOutputs, int32_t d, bool interleave,
+    int device);
+/// Same, but migrates the outputs GPU d writes back to the host, after the
+/// kernel on GPU d finishes. Call after launching the kernel.
+template<bool O3D, bool R3D> void PrefetchOutputsToHost(
+    const bhcParams<O3D> &params, const std::vector<bhcOutputs<O3D, R3D>> &devOutputs,
+    int32_t d, bool interleave);
+#endif
 
 template<typename CFG, bool O3D, bool R3D> void RunFieldModesImpl(
-    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs);
+    FieldBatch<O3D, R3D> &batch);
+
+extern template bool SetupPrivateFields<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs, ThreadPool &pool,
+    cpxf *&privFields);
+extern template bool SetupPrivateFields<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs, ThreadPool &pool,
+    cpxf *&privFields);
+extern template bool SetupPrivateFields<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs, ThreadPool &pool,
+    cpxf *&privFields);
+extern template void ReducePrivateFields<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs, ThreadPool &pool,
+    cpxf *&privFields);
+extern template void ReducePrivateFields<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs, ThreadPool &pool,
+    cpxf *&privFields);
+extern template void ReducePrivateFields<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs, ThreadPool &pool,
+    cpxf *&privFields);
+
+#ifdef BHC_BUILD_CUDA
+extern template bool SetupDeviceOutputs<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs,
+    std::vector<bhcOutputs<false, false>> &devOutputs);
+extern template bool SetupDeviceOutputs<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs,
+    std::vector<bhcOutputs<true, false>> &devOutputs);
+extern template bool SetupDeviceOutputs<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs,
+    std::vector<bhcOutputs<true, true>> &devOutputs);
+extern template void MergeDeviceOutputs<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs,
+    std::vector<bhcOutputs<false, false>> &devOutputs);
+extern template void MergeDeviceOutputs<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs,
+    std::vector<bhcOutputs<true, false>> &devOutputs);
+extern template void MergeDeviceOutputs<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs,
+    std::vector<bhcOutputs<true, true>> &devOutputs);
+extern template void PrefetchToDevice<false, false>(
+    const bhcParams<false> &params, const bhcOutputs<false, false> &outputs,
+    const std::vector<bhcOutputs<false, false>> &devOutputs, int32_t d, bool interleave,
+    int device);
+extern template void PrefetchToDevice<true, false>(
+    const bhcParams<true> &params, const bhcOutputs<true, false> &outputs,
+    const std::vector<bhcOutputs<true, false>> &devOutputs, int32_t d, bool interleave,
+    int device);
+extern template void PrefetchToDevice<true, true>(
+    const bhcParams<true> &params, const bhcOutputs<true, true> &outputs,
+    const std::vector<bhcOutputs<true, true>> &devOutputs, int32_t d, bool interleave,
+    int device);
+extern template void PrefetchOutputsToHost<false, false>(
+    const bhcParams<false> &params,
+    const std::vector<bhcOutputs<false, false>> &devOutputs, int32_t d, bool interleave);
+extern template void PrefetchOutputsToHost<true, false>(
+    const bhcParams<true> &params,
+    const std::vector<bhcOutputs<true, false>> &devOutputs, int32_t d, bool interleave);
+extern template void PrefetchOutputsToHost<true, true>(
+    const bhcParams<true> &params,
+    const std::vector<bhcOutputs<true, true>> &devOutputs, int32_t d, bool interleave);
+#endif
+
+/**
+ * Start of a field run with bhcInit::retainRays. Returns true if the rays kept
+ * from the last run are still valid for this run, so only their influence
+ * needs to be computed. Otherwise, frees them and allocates the memory for
+ * this run's rays: capacity points in bhcInternal::retainedRayMem, plus a
+ * buffer of MaxN points per worker in workRays to trace into. key identifies
+ * the inputs of this run, pass it to EndRetainedRays.
+ */
+template<bool O3D, bool R3D> bool BeginRetainedRays(
+    bhcParams<O3D> &params, rayPt<R3D> *&workRays, size_t &capacity, uint64_t &key);
+/**
+ * End of a field run which traced rays to keep: frees workRays and moves the
+ * usedPoints points of rays kept to an exactly sized block. If they did not all
+ * fit (overflow), none are kept.
+ */
+template<bool O3D, bool R3D> void EndRetainedRays(
+    bhcParams<O3D> &params, rayPt<R3D> *&workRays, size_t usedPoints, bool overflow,
+    uint64_t key);
+/// Frees the rays kept by bhcInit::retainRays, if any.
+template<bool O3D> void FreeRetainedRays(bhcParams<O3D> &params);
+extern template bool BeginRetainedRays<false, false>(
+    bhcParams<false> &params, rayPt<false> *&workRays, size_t &capacity,
+    uint64_t &key);
+extern template bool BeginRetainedRays<true, false>(
+    bhcParams<true> &params, rayPt<false> *&workRays, size_t &capacity,
+    uint64_t &key);
+extern template bool BeginRetainedRays<true, true>(
+    bhcParams<true> &params, rayPt<true> *&workRays, size_t &capacity,
+    uint64_t &key);
+extern template void EndRetainedRays<false, false>(
+    bhcParams<false> &params, rayPt<false> *&workRays, size_t usedPoints,
+    bool overflow, uint64_t key);
+extern template void EndRetainedRays<true, false>(
+    bhcParams<true> &params, rayPt<false> *&workRays, size_t usedPoints,
+    bool overflow, uint64_t key);
+extern template void EndRetainedRays<true, true>(
+    bhcParams<true> &params, rayPt<true> *&workRays, size_t usedPoints, bool overflow,
+    uint64_t key);
+extern template void FreeRetainedRays<false>(bhcParams<false> &params);
+extern template void FreeRetainedRays<true>(bhcParams<true> &params);
 
 template<bool O3D, bool R3D> void RunFieldModesSelInfl(
-    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs);
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, bool retainRays = false);
 extern template void RunFieldModesSelInfl<false, false>(
-    bhcParams<false> &params, bhcOutputs<false, false> &outputs);
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs, bool retainRays);
 extern template void RunFieldModesSelInfl<true, false>(
-    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs, bool retainRays);
 extern template void RunFieldModesSelInfl<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs, bool retainRays);
+
+/// Re-traces only the nRays rays given, see bhc::playback.
+template<bool O3D, bool R3D> void RunFieldModesPlayback(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, bhcPlaybackRay *rays,
+    int32_t nRays);
+extern template void RunFieldModesPlayback<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs, bhcPlaybackRay *rays,
+    int32_t nRays);
+extern template void RunFieldModesPlayback<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs, bhcPlaybackRay *rays,
+    int32_t nRays);
+extern template void RunFieldModesPlayback<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs, bhcPlaybackRay *rays,
+    int32_t nRays);
+
+/**
+ * Nx2D TL run traced as one 2D run per source and bearing, against the slices
+ * of the boundaries along each bearing, see bhcInit::radialSlices. Returns
+ * false without doing anything if this run cannot be done this way (or the
+ * option is off), in which case it must be run normally.
+ */
+template<bool O3D, bool R3D> bool RunFieldModesRadialSlices(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs);
+extern template bool RunFieldModesRadialSlices<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+
+/**
+ * Eigenray or arrivals run with an adaptively refined elevation fan, see
+ * bhcInit::adaptiveFanLevels. Leaves the final fan in params.Angles->alpha,
+ * undo with EndAdaptiveFan.
+ */
+template<bool O3D, bool R3D> void RunFieldModesAdaptiveFan(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs);
+extern template void RunFieldModesAdaptiveFan<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs);
+extern template void RunFieldModesAdaptiveFan<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+extern template void RunFieldModesAdaptiveFan<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs);
+
+/**
+ * TL or arrivals run traced in windows of consecutive jobs, saving the outputs
+ * so far to bhcInit::checkpointFile periodically, and resuming from it if it
+ * holds a checkpoint of this run.
+ */
+template<bool O3D, bool R3D> void RunFieldModesCheckpointed(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs);
+extern template void RunFieldModesCheckpointed<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs);
+extern template void RunFieldModesCheckpointed<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+extern template void RunFieldModesCheckpointed<true, true>(
     bhcParams<true> &params, bhcOutputs<true, true> &outputs);
 
+/**
+ * TL or arrivals run split across the MPI ranks, see bhcInit::mpiDistribute.
+ * Each rank traces its share of the jobs, then the outputs are gathered on
+ * rank 0 with MergeDistributedOutputs.
+ */
+template<bool O3D, bool R3D> void RunFieldModesDistributed(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs);
+extern template void RunFieldModesDistributed<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs);
+extern template void RunFieldModesDistributed<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+extern template void RunFieldModesDistributed<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs);
+
+/// This process's rank and the number of ranks in MPI_COMM_WORLD. Errors if
+/// not built with BHC_USE_MPI or MPI is not initialized.
+void GetDistributedRank(bhcInternal *internal, int32_t &rank, int32_t &ranks);
+
+/**
+ * Collects the outputs of all the ranks on rank 0. Rank r traced the jobs
+ * [jobBounds[r], jobBounds[r + 1]). If bySource, these are whole sources, so
+ * the ranks wrote disjoint parts of the TL field, which are copied; otherwise
+ * the fields are summed. Arrivals are always appended per receiver, in rank
+ * order, as in MergeDeviceOutputs.
+ */
+template<bool O3D, bool R3D> void MergeDistributedOutputs(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs,
+    const std::vector<int32_t> &jobBounds, bool bySource);
+extern template void MergeDistributedOutputs<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs,
+    const std::vector<int32_t> &jobBounds, bool bySource);
+extern template void MergeDistributedOutputs<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs,
+    const std::vector<int32_t> &jobBounds, bool bySource);
+extern template void MergeDistributedOutputs<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs,
+    const std::vector<int32_t> &jobBounds, bool bySource);
+
+/// Field run of a batch of environments, which must all have the same run
+/// type, beam type, and SSP type.
+template<bool O3D, bool R3D> void RunFieldModesBatch(FieldBatch<O3D, R3D> &batch);
+extern template void RunFieldModesBatch<false, false>(FieldBatch<false, false> &batch);
+extern template void RunFieldModesBatch<true, false>(FieldBatch<true, false> &batch);
+extern template void RunFieldModesBatch<true, true>(FieldBatch<true, true> &batch);
+
 }} // namespace bhc::mode
@@ -0,0 +1,131 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "fieldimpl.hpp"
+#include "../trace.hpp"
+
+namespace bhc { namespace mode {
+
+/**
+ * CPU field run worker which traces several rays together, see
+ * bhcInit::rayPacketSize. Each lane holds one ray of the run of jobs claimed
+ * from the scheduler, and each pass steps every active lane once. When a
+ * lane's ray ends, the lane starts the next job of the run, so the packet
+ * stays full until the run is used up. Neighboring jobs are neighboring launch
+ * angles of the same source, so the lanes mostly read the same SSP and
+ * boundary segments and write nearby parts of the field.
+ */
+template<typename CFG, bool O3D, bool R3D> inline void FieldModesWorkerPacket(
+    FieldBatch<O3D, R3D> &batch, int32_t worker, const std::vector<cpxf *> &privFields,
+    bool atomicField, ErrState *errState)
+{
+    constexpr int32_t MaxLanes = 16;
+    struct Lane {
+        FieldRay<O3D, R3D> ray;
+        RayInitInfo rinit;
+        int32_t job, e;
+        bhcRayStats *stats;
+        double tBegin;
+        bool active;
+    };
+    bhcInternal *internal = batch.Runner();
+    JobScheduler &sched   = internal->jobSched;
+    ExecTrace &trace      = internal->execTrace;
+    bool tracing          = trace.Enabled();
+    int32_t nLanes        = bhc::min(internal->rayPacketSize, MaxLanes);
+    Lane lanes[MaxLanes];
+
+    // Progress is counted per environment, as in FieldModesWorker.
+    int32_t countEnv = -1, count = 0;
+    auto countRay = [&](int32_t e) {
+        if(e != countEnv) {
+            if(count > 0) {
+                GetInternal(batch.params[countEnv])->completedRayCount += count;
+            }
+            countEnv = e;
+            count    = 0;
+        }
+        ++count;
+    };
+    auto finish = [&](Lane &l) {
+        if(l.stats != nullptr) l.stats->time = (float)(trace.Now() - l.tBegin);
+        if(tracing) trace.Job(worker, "field", l.tBegin, l.job, l.rinit);
+        countRay(l.e);
+    };
+
+    int32_t next, end;
+    // Starts the next job of the run in lane l, or marks it inactive if there
+    // are none left.
+    auto start = [&](Lane &l) {
+        l.active = false;
+        while(next < end) {
+            l.job = sched.GetJob(next++);
+            l.e   = batch.GetEnv(l.job);
+
+            bhcParams<O3D> &params        = batch.params[l.e];
+            bhcOutputs<O3D, R3D> &outputs = batch.outputs[l.e];
+            int32_t envJob                = l.job - batch.jobOffsets[l.e];
+            if(!GetJobIndices<O3D>(l.rinit, envJob, params.Pos, params.Angles)) {
+                RunError(errState, BHC_ERR_JOBNUM);
+                next = end;
+                return;
+            }
+            l.stats  = outputs.raystats == nullptr ? nullptr : &outputs.raystats[envJob];
+            l.tBegin = (tracing || l.stats != nullptr) ? trace.Now() : 0.0;
+            if(FieldRayBegin<CFG, O3D, R3D>(
+                   l.ray, l.rinit, params.Bdry, params.bdinfo, params.ssp, params.Pos,
+                   params.Angles, params.freqinfo, params.Beam, params.sbp, errState,
+                   atomicField)) {
+                l.active = true;
+                return;
+            }
+            finish(l);
+        }
+    };
+
+    int32_t begin;
+    while(sched.GetNextJobs(worker, begin, end)) {
+        next = begin;
+        for(int32_t i = 0; i < nLanes; ++i) start(lanes[i]);
+        bool any = true;
+        while(any) {
+            any = false;
+            for(int32_t i = 0; i < nLanes; ++i) {
+                Lane &l = lanes[i];
+                if(!l.active) continue;
+                any                           = true;
+                bhcParams<O3D> &params        = batch.params[l.e];
+                bhcOutputs<O3D, R3D> &outputs = batch.outputs[l.e];
+                if(FieldRayStep<CFG, O3D, R3D>(
+                       l.ray, GetWorkerField(params, outputs, privFields[l.e], worker),
+                       params.Bdry, params.bdinfo, params.refl, params.ssp, params.Pos,
+                       params.freqinfo, params.Beam, outputs.eigen, outputs.arrinfo,
+                       errState)) {
+                    continue;
+                }
+                FieldRayEnd<O3D, R3D>(l.ray, errState, l.stats);
+                finish(l);
+                start(l);
+            }
+        }
+    }
+    if(count > 0) GetInternal(batch.params[countEnv])->completedRayCount += count;
+}
+
+}} // namespace bhc::mode
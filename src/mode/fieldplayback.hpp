@@ -0,0 +1,64 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "fieldimpl.hpp"
+#include "../trace.hpp"
+
+namespace bhc { namespace mode {
+
+/**
+ * Field run of only the rays given to bhc::playback, one after another on the
+ * calling thread so that their times are not disturbed by other rays. Each
+ * ray's stats, time, and (with BHC_PERF_COUNTERS) performance counters are
+ * stored in its bhcPlaybackRay. Always runs on the CPU, also in CUDA builds.
+ */
+template<typename CFG, bool O3D, bool R3D> inline void RunFieldModesPlayback(
+    FieldBatch<O3D, R3D> &batch)
+{
+    bhcParams<O3D> &params        = batch.params[0];
+    bhcOutputs<O3D, R3D> &outputs = batch.outputs[0];
+    bhcInternal *internal         = GetInternal(params);
+    ExecTrace &trace              = internal->execTrace;
+    bool tracing                  = trace.Enabled();
+    ErrState errState;
+    for(int32_t r = 0; r < batch.nPlayback; ++r) {
+        bhcPlaybackRay &ray = batch.playback[r];
+        RayInitInfo rinit   = ray.init;
+        memset(&ray.stats, 0, sizeof(ray.stats));
+        // Fresh per ray, so that the totals are this ray's counts only.
+        ResetErrState(&errState);
+        double tBegin = trace.Now();
+        MainFieldModes<CFG, O3D, R3D>(
+            rinit, outputs.uAllSources, params.Bdry, params.bdinfo, params.refl,
+            params.ssp, params.Pos, params.Angles, params.freqinfo, params.Beam,
+            params.sbp, outputs.eigen, outputs.arrinfo, &errState, &ray.stats, false);
+        ray.stats.time = (float)(trace.Now() - tBegin);
+        for(int32_t c = 0; c < BHC_PERF_MAX; ++c) {
+#ifdef BHC_PERF_COUNTERS
+            ray.perf[c] = errState.perfTotal[c];
+#else
+            ray.perf[c] = 0u;
+#endif
+        }
+        if(tracing) trace.Job(0, "playback", tBegin, r, rinit);
+        CheckReportErrors(internal, &errState);
+    }
+}
+
+}} // namespace bhc::mode
@@ -0,0 +1,118 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "fieldimpl.hpp"
+#include "../trace.hpp"
+
+#include <atomic>
+
+namespace bhc { namespace mode {
+
+/**
+ * Field run with bhcInit::retainRays: if the rays kept from the last run are
+ * still valid, only computes their influence, otherwise traces the rays, keeps
+ * them, and computes their influence. Always runs on the CPU worker threads,
+ * also in CUDA builds, as the influence of a kept ray is much cheaper than
+ * tracing it and the rays stay in host memory.
+ */
+template<typename CFG, bool O3D, bool R3D> inline void RunFieldModesRetained(
+    FieldBatch<O3D, R3D> &batch)
+{
+    bhcParams<O3D> &params        = batch.params[0];
+    bhcOutputs<O3D, R3D> &outputs = batch.outputs[0];
+    bhcInternal *internal         = GetInternal(params);
+    rayPt<R3D> *workRays          = nullptr;
+    size_t capacity               = 0;
+    uint64_t key;
+    bool replay = BeginRetainedRays<O3D, R3D>(params, workRays, capacity, key);
+
+    ErrState errState;
+    ResetErrState(&errState);
+    InitBatchJobs(batch);
+    cpxf *privFields = nullptr;
+    bool atomicField = true;
+    if constexpr(CFG::run::IsTL()) {
+        atomicField = !SetupPrivateFields(
+            params, outputs, internal->threadPool, privFields);
+    }
+    rayPt<R3D> *rays = (rayPt<R3D> *)internal->retainedRayMem;
+    std::atomic<size_t> usedPoints(0);
+    std::atomic<bool> overflow(false);
+    internal->threadPool.Run([&](int32_t worker) {
+        JobScheduler &sched = internal->jobSched;
+        ExecTrace &trace    = internal->execTrace;
+        bool tracing        = trace.Enabled();
+        cpxf *uAllSources   = GetWorkerField(params, outputs, privFields, worker);
+        int32_t begin, end;
+        while(sched.GetNextJobs(worker, begin, end)) {
+            for(int32_t i = begin; i < end; ++i) {
+                int32_t job = sched.GetJob(i);
+                RayInitInfo rinit;
+                if(!GetJobIndices<O3D>(rinit, job, params.Pos, params.Angles)) {
+                    RunError(&errState, BHC_ERR_JOBNUM);
+                    return;
+                }
+                bhcRayStats *stats = outputs.raystats == nullptr ? nullptr
+                                                                : &outputs.raystats[job];
+                double tBegin = (tracing || stats != nullptr) ? trace.Now() : 0.0;
+                const rayPt<R3D> *ray;
+                int32_t Nsteps;
+                if(replay) {
+                    ray    = &rays[internal->retainedRayStart[job]];
+                    Nsteps = internal->retainedRayN[job];
+                } else {
+                    rayPt<R3D> *work = &workRays[(size_t)worker * MaxN];
+                    RecordFieldRay<CFG, O3D, R3D>(
+                        rinit, work, Nsteps, params.Bdry, params.bdinfo, params.refl,
+                        params.ssp, params.Pos, params.Angles, params.freqinfo,
+                        params.Beam, params.sbp, &errState);
+                    // If the kept rays do not fit, the run still completes
+                    // from the worker's buffer, but none of them are kept.
+                    size_t start = usedPoints.fetch_add((size_t)Nsteps);
+                    if(start + (size_t)Nsteps <= capacity) {
+                        memcpy(&rays[start], work, (size_t)Nsteps * sizeof(rayPt<R3D>));
+                        internal->retainedRayStart[job] = start;
+                        internal->retainedRayN[job]     = Nsteps;
+                    } else {
+                        overflow = true;
+                    }
+                    ray = work;
+                }
+                ReplayFieldModes<CFG, O3D, R3D>(
+                    rinit, ray, Nsteps, uAllSources, params.Bdry, params.bdinfo,
+                    params.ssp, params.Pos, params.Angles, params.freqinfo, params.Beam,
+                    params.sbp, outputs.eigen, outputs.arrinfo, &errState, stats,
+                    atomicField);
+                if(stats != nullptr) stats->time = (float)(trace.Now() - tBegin);
+                if(tracing) {
+                    trace.Job(worker, replay ? "replay" : "field", tBegin, job, rinit);
+                }
+            }
+            internal->completedRayCount += end - begin;
+        }
+    });
+    ReducePrivateFields(params, outputs, internal->threadPool, privFields);
+    if(!replay) {
+        EndRetainedRays<O3D, R3D>(
+            params, workRays, usedPoints, overflow || HasErrored(&errState), key);
+    }
+    CheckReportErrors(internal, &errState);
+}
+
+}} // namespace bhc::mode
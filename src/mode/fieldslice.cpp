@@ -0,0 +1,329 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "field.hpp"
+#include "../module/atten.hpp"
+#include "../module/boundary.hpp"
+
+#include <algorithm>
+#include <vector>
+
+namespace bhc { namespace mode {
+
+#if BHC_ENABLE_NX2D && BHC_ENABLE_2D
+
+/**
+ * Whether this Nx2D run may be traced as 2D slices, see bhcInit::radialSlices.
+ * The SSP must depend on depth only, so that it is the same in every slice.
+ */
+inline bool UseRadialSlices(
+    const bhcParams<true> &params, const bhcOutputs<true, false> &outputs)
+{
+    bhcInternal *internal = GetInternal(params);
+    if(!internal->radialSlices || internal->rayStats || outputs.raystats != nullptr) {
+        return false;
+    }
+    char st = params.ssp->Type;
+    if(st != 'N' && st != 'C' && st != 'S' && st != 'P') return false;
+#ifdef BHC_LIMIT_FEATURES
+    // Supported in Nx2D but not in 2D with BHC_LIMIT_FEATURES.
+    if(params.Beam->Type[0] == 'b') return false;
+#endif
+    return IsTLRun(params.Beam) && GetNumFieldFreqs(params) == 1
+        && !params.Beam->allTLTypes;
+}
+
+/**
+ * Depth of the triangulated 3D boundary b3 at x, y, which must be within its
+ * grid. Each cell is split into the same two triangles as in
+ * ComputeBdryTangentNormal, along the diagonal from (ix, iy) to (ix+1, iy+1).
+ */
+inline real SliceBdryDepth(const BdryInfoTopBot<true> &b3, real x, real y)
+{
+    int32_t nx = b3.NPts.x, ny = b3.NPts.y;
+    int32_t ix = BinarySearchLEQ(&b3.bd[0].x.x, nx, ny * BdryStride<true>, 0, x);
+    int32_t iy = BinarySearchLEQ(&b3.bd[0].x.y, ny, BdryStride<true>, 0, y);
+    ix         = bhc::min(ix, nx - 2);
+    iy         = bhc::min(iy, ny - 2);
+    const vec3 &p1 = b3.bd[ix * ny + iy].x;
+    const vec3 &p2 = b3.bd[(ix + 1) * ny + iy].x;
+    const vec3 &p3 = b3.bd[(ix + 1) * ny + iy + 1].x;
+    const vec3 &p4 = b3.bd[ix * ny + iy + 1].x;
+    real s = bhc::max(bhc::min((x - p1.x) / (p2.x - p1.x), RL(1.0)), RL(0.0));
+    real u = bhc::max(bhc::min((y - p1.y) / (p4.y - p1.y), RL(1.0)), RL(0.0));
+    if(s >= u) {
+        return p1.z + s * (p2.z - p1.z) + u * (p3.z - p2.z); // triangle 1
+    } else {
+        return p1.z + u * (p4.z - p1.z) + s * (p3.z - p4.z); // triangle 2
+    }
+}
+
+/**
+ * Cuts the 2D range-depth slice of the 3D boundary b3 along the line through
+ * the source xs in direction dir, and preprocesses it as the 2D boundary of
+ * sparams. The depth along the line is piecewise linear, with breaks where the
+ * line crosses the grid lines and the cell diagonals, so the slice is exact.
+ * Beyond the ends of the 3D boundary, the slice is continued flat, as the 2D
+ * tracer has no notion of escaping the boundary sideways. rEnd is set to the
+ * range at which the line leaves the 3D boundary ahead of the source. Returns
+ * false if the source is not within the 3D boundary's grid.
+ */
+template<bool ISTOP> bool CutBdrySlice(
+    bhcParams<false> &sparams, const BdryInfoTopBot<true> &b3, vec2 xs, vec2 dir,
+    real &rEnd)
+{
+    int32_t nx = b3.NPts.x, ny = b3.NPts.y;
+    real gx0 = b3.bd[0].x.x, gx1 = b3.bd[(nx - 1) * ny].x.x;
+    real gy0 = b3.bd[0].x.y, gy1 = b3.bd[ny - 1].x.y;
+    if(xs.x < gx0 || xs.x > gx1 || xs.y < gy0 || xs.y > gy1) return false;
+
+    // Range interval of the line within the grid
+    real rlo = -REAL_MAX, rhi = REAL_MAX;
+    if(dir.x != RL(0.0)) {
+        real ra = (gx0 - xs.x) / dir.x, rb = (gx1 - xs.x) / dir.x;
+        rlo     = bhc::max(rlo, bhc::min(ra, rb));
+        rhi     = bhc::min(rhi, bhc::max(ra, rb));
+    }
+    if(dir.y != RL(0.0)) {
+        real ra = (gy0 - xs.y) / dir.y, rb = (gy1 - xs.y) / dir.y;
+        rlo     = bhc::max(rlo, bhc::min(ra, rb));
+        rhi     = bhc::min(rhi, bhc::max(ra, rb));
+    }
+    if(!(rlo < rhi)) return false;
+
+    // Crossings of the grid lines
+    std::vector<real> rs;
+    rs.push_back(rlo);
+    rs.push_back(rhi);
+    for(int32_t ix = 0; ix < nx && dir.x != RL(0.0); ++ix) {
+        real r = (b3.bd[ix * ny].x.x - xs.x) / dir.x;
+        if(r > rlo && r < rhi) rs.push_back(r);
+    }
+    for(int32_t iy = 0; iy < ny && dir.y != RL(0.0); ++iy) {
+        real r = (b3.bd[iy].x.y - xs.y) / dir.y;
+        if(r > rlo && r < rhi) rs.push_back(r);
+    }
+    std::sort(rs.begin(), rs.end());
+
+    // Crossings of the cell diagonals, at most one within each run between
+    // grid line crossings (which is within a single cell)
+    size_t ngrid = rs.size();
+    for(size_t i = 0; i + 1 < ngrid; ++i) {
+        real ra = rs[i], rb = rs[i + 1];
+        if(!(rb > ra)) continue;
+        vec2 xm    = xs + (RL(0.5) * (ra + rb)) * dir;
+        int32_t ix = BinarySearchLEQ(&b3.bd[0].x.x, nx, ny * BdryStride<true>, 0, xm.x);
+        int32_t iy = BinarySearchLEQ(&b3.bd[0].x.y, ny, BdryStride<true>, 0, xm.y);
+        ix         = bhc::min(ix, nx - 2);
+        iy         = bhc::min(iy, ny - 2);
+        const vec3 &p1 = b3.bd[ix * ny + iy].x;
+        const vec3 &p3 = b3.bd[(ix + 1) * ny + iy + 1].x;
+        // Signed distance from the diagonal, in cell units.
+        auto diag = [&](real r) {
+            vec2 x = xs + r * dir;
+            return (x.x - p1.x) / (p3.x - p1.x) - (x.y - p1.y) / (p3.y - p1.y);
+        };
+        real fa = diag(ra), fb = diag(rb);
+        if((fa < RL(0.0) && fb > RL(0.0)) || (fa > RL(0.0) && fb < RL(0.0))) {
+            rs.push_back(ra + (rb - ra) * fa / (fa - fb));
+        }
+    }
+    std::sort(rs.begin(), rs.end());
+
+    // Merge breaks which are too close to give a usable segment
+    real tol = RL(1.0e-6) * (rhi - rlo);
+    std::vector<real> rk;
+    for(real r : rs) {
+        if(rk.empty() || r - rk.back() > tol) {
+            rk.push_back(r);
+        } else if(r == rhi) {
+            rk.back() = r;
+        }
+    }
+    if(rk.size() < 2) return false;
+
+    BdryInfoTopBot<false> &b2 = ISTOP ? sparams.bdinfo->top : sparams.bdinfo->bot;
+    int32_t n                 = (int32_t)rk.size();
+    b2.NPts                   = n + 2;
+    b2.type[0]                = b3.type[0] == 'C' ? 'C' : 'L';
+    b2.type[1]                = ' ';
+    b2.rangeInKm              = false;
+    b2.dirty                  = true;
+    trackallocate(sparams, "radial slices of boundaries", b2.bd, b2.NPts);
+    for(int32_t i = 0; i < n; ++i) {
+        vec2 x         = xs + rk[i] * dir;
+        b2.bd[i + 1].x = vec2(rk[i], SliceBdryDepth(b3, x.x, x.y));
+    }
+    real big       = bdry_big<false>::value();
+    b2.bd[0].x     = vec2(bhc::min(RL(2.0) * rlo, rlo - big), b2.bd[1].x.y);
+    b2.bd[n + 1].x = vec2(bhc::max(RL(2.0) * rhi, rhi + big), b2.bd[n].x.y);
+    module::Boundary<false, ISTOP>().Preprocess(sparams);
+    rEnd = rhi;
+    return true;
+}
+
+/**
+ * Memory for the slices: one 2D environment per source and bearing for the
+ * batch. Those with the same source x-y and bearing (all source depths) share
+ * their boundaries and beam box.
+ */
+struct RadialSlices {
+    std::vector<bhcParams<false>> params;
+    std::vector<bhcOutputs<false, false>> outputs;
+    Position *Pos              = nullptr;
+    BdryInfo<false> *bdinfo    = nullptr;
+    BeamStructure<false> *Beam = nullptr;
+    int32_t nBdry              = 0;
+};
+
+inline void FreeRadialSlices(const bhcParams<true> &params, RadialSlices &slices)
+{
+    for(int32_t k = 0; k < slices.nBdry; ++k) {
+        trackdeallocate(params, slices.bdinfo[k].top.bd);
+        trackdeallocate(params, slices.bdinfo[k].bot.bd);
+    }
+    trackdeallocate(params, slices.Pos);
+    trackdeallocate(params, slices.bdinfo);
+    trackdeallocate(params, slices.Beam);
+}
+
+/**
+ * 2D beam parameters of the slice in direction dir: the same as Beam, with the
+ * box being where the line leaves Beam's 3D box, but no further than rEnd.
+ */
+inline void SliceBeam(
+    BeamStructure<false> &b2, const BeamStructure<true> *Beam, vec2 dir, real rEnd)
+{
+    b2.NBeams      = Beam->NBeams;
+    b2.Nimage      = Beam->Nimage;
+    b2.iBeamWindow = Beam->iBeamWindow;
+    b2.Component   = Beam->Component;
+    memcpy(b2.Type, Beam->Type, sizeof(b2.Type));
+    memcpy(b2.RunType, Beam->RunType, sizeof(b2.RunType));
+    b2.rangeInKm     = false;
+    b2.autoDeltas    = Beam->autoDeltas;
+    b2.deltas        = Beam->deltas;
+    b2.epsMultiplier = Beam->epsMultiplier;
+    b2.rLoop         = Beam->rLoop;
+    real rBox        = rEnd;
+    if(dir.x != RL(0.0)) rBox = bhc::min(rBox, Beam->Box.x / STD::abs(dir.x));
+    if(dir.y != RL(0.0)) rBox = bhc::min(rBox, Beam->Box.y / STD::abs(dir.y));
+    b2.Box       = vec2(rBox, Beam->Box.z);
+    b2.stepTol   = Beam->stepTol;
+    b2.stepMin   = Beam->stepMin;
+    b2.stepMax   = Beam->stepMax;
+    b2.ampCutoff = Beam->ampCutoff;
+    b2.maxBotBnc = Beam->maxBotBnc;
+}
+
+template<bool O3D, bool R3D> bool RunFieldModesRadialSlices(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
+{
+    static_assert(O3D && !R3D, "Radial slices are only for Nx2D");
+    if(!UseRadialSlices(params, outputs)) return false;
+    const Position *Pos   = params.Pos;
+    const AngleInfo &beta = params.Angles->beta;
+    int32_t ibeta0        = beta.iSingle >= 1 ? beta.iSingle - 1 : 0;
+    int32_t nbeta         = beta.iSingle >= 1 ? 1 : beta.n;
+    int32_t nBdry         = Pos->NSx * Pos->NSy * nbeta;
+    int32_t nEnv          = Pos->NSz * nBdry;
+
+    RadialSlices slices;
+    try {
+        trackallocate(params, "radial slices of boundaries", slices.bdinfo, nBdry);
+        trackallocate(params, "radial slice beam boxes", slices.Beam, nBdry);
+        trackallocate(params, "radial slice positions", slices.Pos, nEnv);
+        memset(slices.bdinfo, 0, nBdry * sizeof(BdryInfo<false>));
+        slices.nBdry = nBdry;
+        slices.params.resize(nEnv);
+        slices.outputs.resize(nEnv);
+
+        // Environments in the same order as the Nx2D jobs (source depth
+        // outermost, see GetJobIndices), so the first nBdry are those of the
+        // first source depth, which are set up with the slices here.
+        for(int32_t k = 0; k < nBdry; ++k) {
+            int32_t ibeta = ibeta0 + k % nbeta;
+            int32_t isy   = (k / nbeta) % Pos->NSy;
+            int32_t isx   = k / (nbeta * Pos->NSy);
+            vec2 xs(Pos->Sx[isx], Pos->Sy[isy]);
+            vec2 dir(STD::cos(beta.angles[ibeta]), STD::sin(beta.angles[ibeta]));
+            bhcParams<false> &sp = slices.params[k];
+            sp.Bdry              = params.Bdry;
+            sp.bdinfo            = &slices.bdinfo[k];
+            sp.internal          = params.internal;
+            real rTop, rBot;
+            if(!CutBdrySlice<true>(sp, params.bdinfo->top, xs, dir, rTop)
+               || !CutBdrySlice<false>(sp, params.bdinfo->bot, xs, dir, rBot)) {
+                // Source outside the boundaries, leave the error to the
+                // normal run.
+                FreeRadialSlices(params, slices);
+                return false;
+            }
+            SliceBeam(slices.Beam[k], params.Beam, dir, bhc::min(rTop, rBot));
+        }
+
+        for(int32_t e = 0; e < nEnv; ++e) {
+            int32_t k      = e % nBdry;
+            int32_t isz    = e / nBdry;
+            int32_t itheta = ibeta0 + k % nbeta; // Nx2D beams are on the radials
+            int32_t isy    = (k / nbeta) % Pos->NSy;
+            int32_t isx    = k / (nbeta * Pos->NSy);
+
+            Position &sPos = slices.Pos[e];
+            sPos           = *Pos;
+            sPos.NSx       = sPos.NSy = sPos.NSz = sPos.Ntheta = 1;
+            sPos.Sx        = &Pos->Sx[isx];
+            sPos.Sy        = &Pos->Sy[isy];
+            sPos.Sz        = &Pos->Sz[isz];
+            sPos.theta     = &Pos->theta[itheta];
+            if(Pos->t_rcvr != nullptr) sPos.t_rcvr = &Pos->t_rcvr[itheta];
+
+            bhcParams<false> &sp = slices.params[e];
+            sp                   = slices.params[k];
+            memcpy(sp.Title, params.Title, sizeof(sp.Title));
+            sp.fT       = params.fT;
+            sp.refl     = params.refl;
+            sp.ssp      = params.ssp;
+            sp.atten    = params.atten;
+            sp.Pos      = &sPos;
+            sp.Angles   = params.Angles;
+            sp.freqinfo = params.freqinfo;
+            sp.Beam     = &slices.Beam[k];
+            sp.sbp      = params.sbp;
+
+            bhcOutputs<false, false> &so = slices.outputs[e];
+            so.uAllSources               = &outputs.uAllSources[GetFieldAddr(
+                isx, isy, isz, itheta, 0, 0, Pos)];
+        }
+
+        FieldBatch<false, false> batch(slices.params.data(), slices.outputs.data(), nEnv);
+        RunFieldModesBatch<false, false>(batch);
+    } catch(...) {
+        FreeRadialSlices(params, slices);
+        throw;
+    }
+    FreeRadialSlices(params, slices);
+    return true;
+}
+
+template bool RunFieldModesRadialSlices<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+
+#endif
+
+}} // namespace bhc::mode
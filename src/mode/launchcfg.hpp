@@ -0,0 +1,68 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "../common.hpp"
+
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace bhc { namespace mode {
+
+/**
+ * Compile-time launch bounds of the field modes kernel. maxThreads is the
+ * largest block size which can be used at runtime, and minBlocksPerSM makes
+ * the compiler limit the registers per thread so that this many blocks of
+ * maxThreads can be resident on each SM at once. Specialize this for a
+ * particular config to tune it; the block size and number of blocks actually
+ * launched are chosen at runtime (see bhcInit::cudaBlockSize).
+ */
+template<typename CFG, bool O3D, bool R3D> struct FieldLaunchBounds {
+    static constexpr int32_t maxThreads     = 256;
+    static constexpr int32_t minBlocksPerSM = 1;
+};
+
+struct LaunchConfig {
+    int32_t blockSize;
+    int32_t blocksPerSM;
+};
+
+/**
+ * Launch configs chosen by auto-tuning, keyed by GPU model and template
+ * config, shared by all instances of the library in this process.
+ */
+inline std::mutex tunedLaunchConfigsMutex;
+inline std::map<std::string, LaunchConfig> tunedLaunchConfigs;
+
+inline bool FindTunedLaunchConfig(const std::string &key, LaunchConfig &config)
+{
+    std::lock_guard<std::mutex> lock(tunedLaunchConfigsMutex);
+    auto it = tunedLaunchConfigs.find(key);
+    if(it == tunedLaunchConfigs.end()) return false;
+    config = it->second;
+    return true;
+}
+
+inline void SaveTunedLaunchConfig(const std::string &key, const LaunchConfig &config)
+{
+    std::lock_guard<std::mutex> lock(tunedLaunchConfigsMutex);
+    tunedLaunchConfigs[key] = config;
+}
+
+}} // namespace bhc::mode
@@ -0,0 +1,222 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "../common_setup.hpp"
+#include "ray.hpp"
+#include "tl.hpp"
+
+namespace bhc { namespace mode {
+
+/**
+ * Tracked memory held by the results in outputs, which is freed when they
+ * are run again.
+ */
+template<bool O3D, bool R3D> inline size_t OutputsTrackedSize(
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs)
+{
+    bhcInternal *internal            = GetInternal(params);
+    const RayInfo<O3D, R3D> *rayinfo = outputs.rayinfo;
+    const ArrInfo *arrinfo           = outputs.arrinfo;
+    // Caller-owned outputs (bhc::set_output_buffers) are not tracked
+    return (internal->fieldIsUser ? 0 : trackedsize(outputs.uAllSources))
+        + trackedsize(outputs.eigen->hits)
+        + (internal->arrivalsIsUser
+               ? 0
+               : trackedsize(arrinfo->Arr) + trackedsize(arrinfo->ArrC))
+        + trackedsize(arrinfo->NArr) + trackedsize(arrinfo->MaxNPerSource)
+        + trackedsize(arrinfo->ArrChunks) + trackedsize(arrinfo->ArrChunksUsed)
+        + trackedsize(rayinfo->results) + trackedsize(rayinfo->RayMem)
+        + trackedsize(rayinfo->WorkRayMem) + trackedsize(rayinfo->CompactRayMem)
+        + trackedsize(rayinfo->SoARayMem.x) + trackedsize(rayinfo->SoARayMem.t)
+        + trackedsize(rayinfo->SoARayMem.tau) + trackedsize(rayinfo->SoARayMem.Amp)
+        + trackedsize(rayinfo->SoARayMem.NumTopBnc)
+        + trackedsize(rayinfo->SoARayMem.NumBotBnc);
+}
+
+/**
+ * Sizes of the outputs are worked out the same way as in the Preprocess
+ * of each mode, but against the budget rather than bhcInit::maxMemory, and
+ * without allocating anything. Any outputs from a previous run are not
+ * counted, as run() frees them before allocating the new ones.
+ */
+template<bool O3D, bool R3D> inline void PlanMemory(
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+    bhcMemoryPlan &plan, size_t budget)
+{
+    bhcInternal *internal = GetInternal(params);
+    const Position *Pos   = params.Pos;
+    memset(&plan, 0, sizeof(bhcMemoryPlan));
+    plan.budget          = budget > 0 ? budget : internal->maxMemory;
+    plan.maxPointsPerRay = MaxN;
+
+    const SSPStructure *ssp = params.ssp;
+    plan.ssp = trackedsize(ssp) + trackedsize(ssp->cMat) + trackedsize(ssp->czMat)
+        + trackedsize(ssp->cellMat) + trackedsize(ssp->Seg.r) + trackedsize(ssp->Seg.x)
+        + trackedsize(ssp->Seg.y) + trackedsize(ssp->Seg.z);
+    const BdryInfo<O3D> *bdinfo = params.bdinfo;
+    plan.boundaries = trackedsize(bdinfo) + trackedsize(bdinfo->top.bd)
+        + trackedsize(bdinfo->bot.bd) + trackedsize(bdinfo->top.xLookup.iCell)
+        + trackedsize(bdinfo->top.yLookup.iCell) + trackedsize(bdinfo->bot.xLookup.iCell)
+        + trackedsize(bdinfo->bot.yLookup.iCell);
+    size_t prevOutputs = OutputsTrackedSize(params, outputs);
+    size_t inputs      = internal->usedMemory - prevOutputs;
+    plan.otherInputs   = inputs - plan.ssp - plan.boundaries;
+    if(ssp->Type == 'H' && internal->packHexSSP && ssp->cellMat == nullptr) {
+        // Not packed until the first run, see PackHexCells
+        size_t n = (size_t)(ssp->Nx - 1) * (size_t)(ssp->Ny - 1) * (size_t)(ssp->Nz - 1)
+            * 8;
+        plan.ssp += trackallocsize<real>(n);
+        inputs += trackallocsize<real>(n);
+    }
+    int64_t remaining = (int64_t)plan.budget - (int64_t)inputs;
+    remaining         = std::max(remaining, (int64_t)0);
+
+    size_t nSrcs   = (size_t)Pos->NSx * (size_t)Pos->NSy * (size_t)Pos->NSz;
+    size_t nCopies = (size_t)NumDeviceOutputCopies<O3D>(params);
+    bool truncated = false;
+    if(IsEigenraysRun(params.Beam) || IsAlsoEigenraysRun(params.Beam)) {
+        // See Eigen::Preprocess. The rays for the hits are only allocated
+        // once the number of hits is known, from what is left.
+        size_t nHits = std::min(
+            (size_t)remaining / (500 * sizeof(EigenHit)), (size_t)0x7FFFFFFF);
+        plan.eigenHits = trackallocsize<EigenHit>(nHits);
+        remaining -= (int64_t)plan.eigenHits;
+        if(nHits == 0) truncated = true;
+    }
+    if(IsTLRun(params.Beam)) {
+        size_t perSource = GetFieldSize(params) / nSrcs;
+        size_t n         = IsStreamedTLRun(params) ? perSource : perSource * nSrcs;
+        size_t nTracked  = nCopies;
+        if(internal->userField != nullptr) {
+            // The primary copy is the caller's, see TL::Preprocess.
+            --nTracked;
+            if(internal->userFieldCount < n) truncated = true;
+        }
+        plan.field          = nTracked * trackallocsize<cpxf>(n);
+        size_t srcsPerGroup = (size_t)remaining / nCopies
+            / (perSource * sizeof(cpxf) + 32);
+        plan.tlSourceGroups = srcsPerGroup == 0
+            ? 0
+            : (int32_t)((nSrcs + srcsPerGroup - 1) / srcsPerGroup);
+    } else if(IsArrivalsRun(params.Beam)) {
+        // See Arr::Preprocess.
+        size_t nSrcsRcvrs = nSrcs * Pos->Ntheta * Pos->NRr * Pos->NRz_per_range;
+        size_t counts     = nCopies * trackallocsize<int32_t>(nSrcsRcvrs)
+            + trackallocsize<int32_t>(nSrcs);
+        remaining -= (int64_t)(nCopies * nSrcsRcvrs * sizeof(int32_t));
+        remaining -= (int64_t)(nSrcs * sizeof(int32_t));
+        if(IsAlsoEigenraysRun(params.Beam)) { remaining -= remaining / 2; }
+        remaining -= 32 * 3;
+        remaining -= 128 * ((int64_t)nCopies - 1);
+        remaining = std::max(remaining, (int64_t)0);
+        size_t arrSize = internal->compactArrivals ? sizeof(ArrivalCompact)
+                                                   : sizeof(Arrival);
+        if(internal->arrivalsChunkSize > 0) {
+            // Arena takes the rest of the memory, see Arr::PreprocessArena
+            size_t chunkSize     = (size_t)internal->arrivalsChunkSize;
+            size_t chunksPerRcvr = (size_t)bhc::max(
+                (internal->arrivalsMaxPerRcvr + internal->arrivalsChunkSize - 1)
+                    / internal->arrivalsChunkSize,
+                1);
+            size_t table  = trackallocsize<int32_t>(nSrcsRcvrs * chunksPerRcvr);
+            int64_t arena = remaining - (int64_t)(nSrcsRcvrs * chunksPerRcvr * 4) - 64;
+            bool user      = internal->userArrivals != nullptr;
+            size_t nChunks = std::min(
+                (user ? internal->userArrivalsBytes
+                      : (size_t)std::max(arena, (int64_t)0))
+                    / (chunkSize * arrSize),
+                nSrcsRcvrs * chunksPerRcvr);
+            plan.arrivals = counts + table + trackallocsize<int32_t>(1)
+                + (user ? 0 : trackallocsize<char>(nChunks * chunkSize * arrSize));
+            // Per receiver if all receivers had the same number of arrivals
+            plan.maxArrivalsPerRcvr = (int32_t)std::min(
+                nChunks * chunkSize / nSrcsRcvrs, chunksPerRcvr * chunkSize);
+            truncated = nChunks < nSrcsRcvrs * chunksPerRcvr;
+        } else {
+            size_t maxNArr, nTracked = nCopies;
+            if(internal->userArrivals != nullptr) {
+                // The primary copy is the caller's, see Arr::Preprocess.
+                --nTracked;
+                maxNArr = internal->userArrivalsBytes / (nSrcsRcvrs * arrSize);
+                if(nTracked > 0) {
+                    maxNArr = std::min(
+                        maxNArr, (size_t)remaining / (nTracked * nSrcsRcvrs * arrSize));
+                }
+                maxNArr = std::min(maxNArr, (size_t)0x7FFFFFFF);
+            } else {
+                maxNArr = std::min(
+                    (size_t)remaining / (nCopies * nSrcsRcvrs * arrSize),
+                    (size_t)0x7FFFFFFF);
+            }
+            plan.arrivals = counts
+                + nTracked * trackallocsize<char>(nSrcsRcvrs * maxNArr * arrSize);
+            plan.maxArrivalsPerRcvr = (int32_t)maxNArr;
+            truncated               = maxNArr == 0;
+        }
+    } else if(IsRayRun(params.Beam)) {
+        // See Ray::Preprocess.
+        size_t nRays   = (size_t)GetNumJobs<O3D>(Pos, params.Angles);
+        size_t results = trackallocsize<RayResult<O3D, R3D>>(nRays);
+        remaining -= (int64_t)results;
+        size_t fit = (size_t)std::max(remaining, (int64_t)0);
+        if(IsStreamedRayRun(params)) {
+            // See Ray::PreprocessStreamed, no results are kept.
+            size_t depth = internal->streamRaysQueueDepth > 0
+                ? (size_t)internal->streamRaysQueueDepth
+                : (size_t)internal->numThreads * 4;
+            depth = std::min(depth, (fit + results) / trackallocsize<rayPt<R3D>>(MaxN));
+            plan.rays = trackallocsize<rayPt<R3D>>(depth * MaxN);
+            truncated = depth == 0;
+        } else if(internal->compactRays) {
+            size_t work = trackallocsize<rayPt<R3D>>(internal->numThreads * MaxN);
+            fit         = fit > work ? fit - work : 0;
+            size_t n    = std::min(nRays * MaxN, fit / sizeof(rayPtCompact<R3D>));
+            plan.rays   = results + work + trackallocsize<rayPtCompact<R3D>>(n);
+            // Compact points are only used as needed, MaxN is not a limit
+            truncated = n == 0;
+        } else if(internal->soaRays) {
+            size_t work = trackallocsize<rayPt<R3D>>(internal->numThreads * MaxN);
+            fit         = fit > work + 6 * 32 ? fit - work - 6 * 32 : 0;
+            size_t n    = std::min(nRays * MaxN, fit / SoARayPtSize<R3D>);
+            plan.rays   = results + work + n * SoARayPtSize<R3D> + 6 * 32;
+            truncated   = n == 0;
+        } else if(trackallocsize<rayPt<R3D>>(nRays * MaxN) <= fit) {
+            plan.rays = results + trackallocsize<rayPt<R3D>>(nRays * MaxN);
+        } else if(internal->useRayCopyMode) {
+            size_t work = trackallocsize<rayPt<R3D>>(internal->numThreads * MaxN);
+            fit         = fit > work ? fit - work : 0;
+            plan.rays   = results + work
+                + trackallocsize<rayPt<R3D>>(fit / sizeof(rayPt<R3D>));
+            truncated = true;
+        } else {
+            plan.maxPointsPerRay = (int32_t)std::min(
+                fit / (nRays * sizeof(rayPt<R3D>)), (size_t)0x7FFFFFFF);
+            plan.rays = results
+                + trackallocsize<rayPt<R3D>>(nRays * (size_t)plan.maxPointsPerRay);
+            truncated = true;
+        }
+    }
+
+    plan.peak = inputs + plan.field + plan.arrivals + plan.rays + plan.eigenHits;
+    plan.fits = plan.peak <= plan.budget && !truncated
+        && (!IsTLRun(params.Beam) || plan.tlSourceGroups == 1
+            || (IsStreamedTLRun(params) && plan.tlSourceGroups > 0));
+}
+
+}} // namespace bhc::mode
@@ -37,8 +37,10 @@ public:
     virtual void Run(bhcParams<O3D> &, bhcOutputs<O3D, R3D> &) const = 0;
     /// Postprocess after run is complete.
     virtual void Postprocess(bhcParams<O3D> &, bhcOutputs<O3D, R3D> &) const {}
-    /// Write results to disk.
-    virtual void Writeout(const bhcParams<O3D> &, const bhcOutputs<O3D, R3D> &) const {}
+    /// Write results to disk, to files named FileRoot + extension.
+    virtual void Writeout(
+        const bhcParams<O3D> &, const bhcOutputs<O3D, R3D> &, const char *) const
+    {}
     /// Read results from disk.
     virtual void Readout(bhcParams<O3D> &, bhcOutputs<O3D, R3D> &, const char *) const {}
     /// Deallocate memory.
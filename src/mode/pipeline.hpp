@@ -0,0 +1,98 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "../common_setup.hpp"
+
+namespace bhc { namespace mode {
+
+/**
+ * Copy of the parts of the params which Writeout reads, so that the
+ * caller can change the params for the next job while the results of the
+ * previous one are written out (see bhc::run_pipelined). The other structs
+ * (SSP, boundaries, etc.) are still shared with the caller's params, as
+ * Writeout does not read them.
+ */
+template<bool O3D> struct PipelineParams {
+    bhcParams<O3D> params;
+    BdryType Bdry;
+    Position Pos;
+    AnglesStructure Angles;
+    FreqInfo freqinfo;
+    BeamStructure<O3D> Beam;
+};
+
+/// Replaces ptr with a tracked copy of the array it points to.
+template<bool O3D, typename T> inline void CopyPipelineArray(
+    const bhcParams<O3D> &params, T *&ptr)
+{
+    if(ptr == nullptr) return;
+    const T *src = ptr;
+    size_t n     = (trackedsize(src) - 16) / sizeof(T);
+    ptr          = nullptr;
+    trackallocate(params, "params for pipelined writeout", ptr, n);
+    memcpy((void *)ptr, src, n * sizeof(T));
+}
+
+template<bool O3D> inline PipelineParams<O3D> *CopyPipelineParams(
+    const bhcParams<O3D> &params)
+{
+    PipelineParams<O3D> *copy = nullptr;
+    trackallocate(params, "params for pipelined writeout", copy);
+    copy->params          = params;
+    copy->Bdry            = *params.Bdry;
+    copy->Pos             = *params.Pos;
+    copy->Angles          = *params.Angles;
+    copy->freqinfo        = *params.freqinfo;
+    copy->Beam            = *params.Beam;
+    copy->params.Bdry     = &copy->Bdry;
+    copy->params.Pos      = &copy->Pos;
+    copy->params.Angles   = &copy->Angles;
+    copy->params.freqinfo = &copy->freqinfo;
+    copy->params.Beam     = &copy->Beam;
+    CopyPipelineArray(params, copy->Pos.Sx);
+    CopyPipelineArray(params, copy->Pos.Sy);
+    CopyPipelineArray(params, copy->Pos.Sz);
+    CopyPipelineArray(params, copy->Pos.Rr);
+    CopyPipelineArray(params, copy->Pos.Rz);
+    CopyPipelineArray(params, copy->Pos.theta);
+    CopyPipelineArray(params, copy->Pos.t_rcvr);
+    CopyPipelineArray(params, copy->Angles.alpha.angles);
+    CopyPipelineArray(params, copy->Angles.beta.angles);
+    CopyPipelineArray(params, copy->freqinfo.freqVec);
+    return copy;
+}
+
+template<bool O3D> inline void FreePipelineParams(
+    const bhcParams<O3D> &params, PipelineParams<O3D> *&copy)
+{
+    if(copy == nullptr) return;
+    trackdeallocate(params, copy->Pos.Sx);
+    trackdeallocate(params, copy->Pos.Sy);
+    trackdeallocate(params, copy->Pos.Sz);
+    trackdeallocate(params, copy->Pos.Rr);
+    trackdeallocate(params, copy->Pos.Rz);
+    trackdeallocate(params, copy->Pos.theta);
+    trackdeallocate(params, copy->Pos.t_rcvr);
+    trackdeallocate(params, copy->Angles.alpha.angles);
+    trackdeallocate(params, copy->Angles.beta.angles);
+    trackdeallocate(params, copy->freqinfo.freqVec);
+    trackdeallocate(params, copy);
+}
+
+}} // namespace bhc::mode
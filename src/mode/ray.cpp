@@ -20,9 +20,64 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #include "../trace.hpp"
 #include "../module/title.hpp"
 #include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 
 namespace bhc { namespace mode {
 
+/**
+ * Traces one ray into ray, for all the SSP types. Returns false if there was
+ * an error.
+ */
+template<bool O3D, bool R3D> inline bool TraceRay(
+    const bhcParams<O3D> &params, rayPt<R3D> *ray, int32_t maxPoints,
+    RayInitInfo &rinit, int32_t &Nsteps, Origin<O3D, R3D> &org, ErrState *errState)
+{
+    char st = params.ssp->Type;
+    if(st == 'N') {
+        MainRayMode<CfgSel<'R', 'G', 'N'>, O3D, R3D>(
+            rinit, ray, Nsteps, maxPoints, org, params.Bdry, params.bdinfo, params.refl,
+            params.ssp, params.Pos, params.Angles, params.freqinfo, params.Beam,
+            params.sbp, errState);
+    } else if(st == 'C') {
+        MainRayMode<CfgSel<'R', 'G', 'C'>, O3D, R3D>(
+            rinit, ray, Nsteps, maxPoints, org, params.Bdry, params.bdinfo, params.refl,
+            params.ssp, params.Pos, params.Angles, params.freqinfo, params.Beam,
+            params.sbp, errState);
+    } else if(st == 'S') {
+        MainRayMode<CfgSel<'R', 'G', 'S'>, O3D, R3D>(
+            rinit, ray, Nsteps, maxPoints, org, params.Bdry, params.bdinfo, params.refl,
+            params.ssp, params.Pos, params.Angles, params.freqinfo, params.Beam,
+            params.sbp, errState);
+    } else if(st == 'P') {
+        MainRayMode<CfgSel<'R', 'G', 'P'>, O3D, R3D>(
+            rinit, ray, Nsteps, maxPoints, org, params.Bdry, params.bdinfo, params.refl,
+            params.ssp, params.Pos, params.Angles, params.freqinfo, params.Beam,
+            params.sbp, errState);
+    } else if(st == 'Q') {
+        MainRayMode<CfgSel<'R', 'G', 'Q'>, O3D, R3D>(
+            rinit, ray, Nsteps, maxPoints, org, params.Bdry, params.bdinfo, params.refl,
+            params.ssp, params.Pos, params.Angles, params.freqinfo, params.Beam,
+            params.sbp, errState);
+    } else if(st == 'H') {
+        MainRayMode<CfgSel<'R', 'G', 'H'>, O3D, R3D>(
+            rinit, ray, Nsteps, maxPoints, org, params.Bdry, params.bdinfo, params.refl,
+            params.ssp, params.Pos, params.Angles, params.freqinfo, params.Beam,
+            params.sbp, errState);
+    } else if(st == 'A') {
+        MainRayMode<CfgSel<'R', 'G', 'A'>, O3D, R3D>(
+            rinit, ray, Nsteps, maxPoints, org, params.Bdry, params.bdinfo, params.refl,
+            params.ssp, params.Pos, params.Angles, params.freqinfo, params.Beam,
+            params.sbp, errState);
+    } else {
+        RunError(errState, BHC_ERR_INVALID_SSP_TYPE);
+        return false;
+    }
+    return !HasErrored(errState);
+}
+
 template<bool O3D, bool R3D> bool RunRay(
     RayInfo<O3D, R3D> *rayinfo, const bhcParams<O3D> &params, int32_t job, int32_t worker,
     RayInitInfo &rinit, int32_t &Nsteps, ErrState *errState)
@@ -32,7 +87,7 @@ template<bool O3D, bool R3D> bool RunRay(
         return false;
     }
     rayPt<R3D> *ray;
-    if(rayinfo->isCopyMode) {
+    if(rayinfo->isCopyMode || rayinfo->isCompact || rayinfo->isSoA) {
         ray = &rayinfo->WorkRayMem[worker * rayinfo->MaxPointsPerRay];
     } else {
         ray = &rayinfo->RayMem[(size_t)job * rayinfo->MaxPointsPerRay];
@@ -43,50 +98,56 @@ template<bool O3D, bool R3D> bool RunRay(
 #endif
 
     Origin<O3D, R3D> org;
-    char st = params.ssp->Type;
-    if(st == 'N') {
-        MainRayMode<CfgSel<'R', 'G', 'N'>, O3D, R3D>(
-            rinit, ray, Nsteps, rayinfo->MaxPointsPerRay, org, params.Bdry, params.bdinfo,
-            params.refl, params.ssp, params.Pos, params.Angles, params.freqinfo,
-            params.Beam, params.sbp, errState);
-    } else if(st == 'C') {
-        MainRayMode<CfgSel<'R', 'G', 'C'>, O3D, R3D>(
-            rinit, ray, Nsteps, rayinfo->MaxPointsPerRay, org, params.Bdry, params.bdinfo,
-            params.refl, params.ssp, params.Pos, params.Angles, params.freqinfo,
-            params.Beam, params.sbp, errState);
-    } else if(st == 'S') {
-        MainRayMode<CfgSel<'R', 'G', 'S'>, O3D, R3D>(
-            rinit, ray, Nsteps, rayinfo->MaxPointsPerRay, org, params.Bdry, params.bdinfo,
-            params.refl, params.ssp, params.Pos, params.Angles, params.freqinfo,
-            params.Beam, params.sbp, errState);
-    } else if(st == 'P') {
-        MainRayMode<CfgSel<'R', 'G', 'P'>, O3D, R3D>(
-            rinit, ray, Nsteps, rayinfo->MaxPointsPerRay, org, params.Bdry, params.bdinfo,
-            params.refl, params.ssp, params.Pos, params.Angles, params.freqinfo,
-            params.Beam, params.sbp, errState);
-    } else if(st == 'Q') {
-        MainRayMode<CfgSel<'R', 'G', 'Q'>, O3D, R3D>(
-            rinit, ray, Nsteps, rayinfo->MaxPointsPerRay, org, params.Bdry, params.bdinfo,
-            params.refl, params.ssp, params.Pos, params.Angles, params.freqinfo,
-            params.Beam, params.sbp, errState);
-    } else if(st == 'H') {
-        MainRayMode<CfgSel<'R', 'G', 'H'>, O3D, R3D>(
-            rinit, ray, Nsteps, rayinfo->MaxPointsPerRay, org, params.Bdry, params.bdinfo,
-            params.refl, params.ssp, params.Pos, params.Angles, params.freqinfo,
-            params.Beam, params.sbp, errState);
-    } else if(st == 'A') {
-        MainRayMode<CfgSel<'R', 'G', 'A'>, O3D, R3D>(
-            rinit, ray, Nsteps, rayinfo->MaxPointsPerRay, org, params.Bdry, params.bdinfo,
-            params.refl, params.ssp, params.Pos, params.Angles, params.freqinfo,
-            params.Beam, params.sbp, errState);
-    } else {
-        RunError(errState, BHC_ERR_INVALID_SSP_TYPE);
+    if(!TraceRay<O3D, R3D>(
+           params, ray, rayinfo->MaxPointsPerRay, rinit, Nsteps, org, errState)) {
         return false;
     }
-    if(HasErrored(errState)) return false;
 
     bool ret = true;
-    if(rayinfo->isCopyMode) {
+    if(rayinfo->isCompact) {
+        size_t p = AtomicFetchAdd(&rayinfo->RayMemPoints, (size_t)Nsteps);
+        if(p + (size_t)Nsteps > rayinfo->RayMemCapacity) {
+            RunWarning(errState, BHC_WARN_RAYS_OUTOFMEMORY);
+            rayinfo->results[job].compact = nullptr;
+            ret                           = false;
+        } else {
+            rayPtCompact<R3D> *compact    = &rayinfo->CompactRayMem[p];
+            rayinfo->results[job].compact = compact;
+            rayinfo->results[job].x0      = ray[0].x;
+            for(int32_t is = 0; is < Nsteps; ++is) {
+                compact[is].dx        = ray[is].x - ray[0].x;
+                compact[is].NumTopBnc = (int16_t)bhc::min(ray[is].NumTopBnc, 0x7FFF);
+                compact[is].NumBotBnc = (int16_t)bhc::min(ray[is].NumBotBnc, 0x7FFF);
+            }
+        }
+        rayinfo->results[job].ray = nullptr;
+    } else if(rayinfo->isSoA) {
+        size_t p           = AtomicFetchAdd(&rayinfo->RayMemPoints, (size_t)Nsteps);
+        rayPtSoA<R3D> &soa = rayinfo->results[job].soa;
+        rayinfo->results[job].ray = nullptr;
+        if(p + (size_t)Nsteps > rayinfo->RayMemCapacity) {
+            RunWarning(errState, BHC_WARN_RAYS_OUTOFMEMORY);
+            memset(&soa, 0, sizeof(rayPtSoA<R3D>));
+            ret = false;
+        } else {
+            const rayPtSoA<R3D> &mem = rayinfo->SoARayMem;
+            soa.x                    = &mem.x[p];
+            soa.t                    = &mem.t[p];
+            soa.tau                  = &mem.tau[p];
+            soa.Amp                  = &mem.Amp[p];
+            soa.NumTopBnc            = &mem.NumTopBnc[p];
+            soa.NumBotBnc            = &mem.NumBotBnc[p];
+            // One pass per field, so that each is a sequential stream.
+            for(int32_t is = 0; is < Nsteps; ++is) soa.x[is] = ray[is].x;
+            for(int32_t is = 0; is < Nsteps; ++is) soa.t[is] = ray[is].t;
+            for(int32_t is = 0; is < Nsteps; ++is) soa.tau[is] = ray[is].tau;
+            for(int32_t is = 0; is < Nsteps; ++is) soa.Amp[is] = ray[is].Amp;
+            for(int32_t is = 0; is < Nsteps; ++is) {
+                soa.NumTopBnc[is] = ray[is].NumTopBnc;
+                soa.NumBotBnc[is] = ray[is].NumBotBnc;
+            }
+        }
+    } else if(rayinfo->isCopyMode) {
         size_t p = AtomicFetchAdd(&rayinfo->RayMemPoints, (size_t)Nsteps);
         if(p + (size_t)Nsteps > rayinfo->RayMemCapacity) {
             RunWarning(errState, BHC_WARN_RAYS_OUTOFMEMORY);
@@ -126,25 +187,27 @@ template<bool O3D, bool R3D> void RayModeWorker(
     const bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, int32_t worker,
     ErrState *errState)
 {
-    SetupThread();
-    while(true) {
-        int32_t job    = GetInternal(params)->sharedJobID++;
-        int32_t Nsteps = -1;
-        RayInitInfo rinit;
-        if(!GetJobIndices<O3D>(rinit, job, params.Pos, params.Angles)) break;
-        if(!RunRay<O3D, R3D>(
-               outputs.rayinfo, params, job, worker, rinit, Nsteps, errState)) {
-            break;
-        }
-        GetInternal(params)->completedRayCount++;
-    }
-
-    GetInternal(params)->activeThreadCount--;
-    if(GetInternal(params)->activeThreadCount == 0) {
-        if(GetInternal(params)->completedCallback != nullptr) {
-            GetInternal(params)->completedCallback();
+    JobScheduler &sched = GetInternal(params)->jobSched;
+    ExecTrace &trace    = GetInternal(params)->execTrace;
+    bool tracing        = trace.Enabled();
+    int32_t begin, end;
+    bool ok = true;
+    while(ok && sched.GetNextJobs(worker, begin, end)) {
+        int32_t i = begin;
+        for(; i < end; ++i) {
+            int32_t job    = sched.GetJob(i);
+            int32_t Nsteps = -1;
+            double tBegin  = tracing ? trace.Now() : 0.0;
+            RayInitInfo rinit;
+            if(!GetJobIndices<O3D>(rinit, job, params.Pos, params.Angles)
+               || !RunRay<O3D, R3D>(
+                   outputs.rayinfo, params, job, worker, rinit, Nsteps, errState)) {
+                ok = false;
+                break;
+            }
+            if(tracing) trace.Job(worker, "ray", tBegin, job, rinit);
         }
-        CheckReportErrors(GetInternal(params), errState);
+        GetInternal(params)->completedRayCount += i - begin;
     }
 }
 
@@ -167,23 +230,13 @@ template void RayModeWorker<true, true>(
 template<bool O3D, bool R3D> void RunRayMode(
     bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
 {
-    ResetErrState(&GetInternal(params)->errState);
-    GetInternal(params)->sharedJobID       = 0;
-    int32_t numThreads                     = GetInternal(params)->numThreads;
-    GetInternal(params)->totalJobs         = GetNumJobs<O3D>(params.Pos, params.Angles);
-    GetInternal(params)->activeThreadCount = numThreads;
-    std::vector<std::thread> threads;
-    for(int32_t i = 0; i < numThreads; ++i)
-        threads.push_back(std::thread(
-            RayModeWorker<O3D, R3D>, std::ref(params), std::ref(outputs), i,
-            &GetInternal(params)->errState));
-    for(int32_t i = 0; i < numThreads; ++i) {
-        if(outputs.rayinfo->blocking) {
-            threads[i].join();
-        } else {
-            threads[i].detach();
-        }
-    }
+    ErrState errState;
+    ResetErrState(&errState);
+    InitRayJobs<O3D>(params);
+    GetInternal(params)->threadPool.Run([&](int32_t worker) {
+        RayModeWorker<O3D, R3D>(params, outputs, worker, &errState);
+    });
+    CheckReportErrors(GetInternal(params), &errState);
 }
 
 #if BHC_ENABLE_2D
@@ -199,14 +252,347 @@ template void RunRayMode<true, true>(
     bhcParams<true> &params, bhcOutputs<true, true> &outputs);
 #endif
 
+/**
+ * Bounded queue between the workers and the writer of a streamed ray run,
+ * see bhcInit::streamRays. Each ray buffer is either free, being traced into
+ * by a worker, waiting in the queue, or being written.
+ */
+template<bool O3D, bool R3D> class RayStreamQueue {
+public:
+    RayStreamQueue(rayPt<R3D> *mem, size_t nBuffers, int32_t pointsPerBuffer)
+        : finished(false), aborted(false)
+    {
+        for(size_t b = 0; b < nBuffers; ++b) {
+            freeBuffers.push_back(&mem[b * (size_t)pointsPerBuffer]);
+        }
+    }
+
+    /// Waits for a free buffer. Returns nullptr if the writer has failed.
+    rayPt<R3D> *Acquire()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        freeCV.wait(lock, [&] { return aborted || !freeBuffers.empty(); });
+        if(aborted) return nullptr;
+        rayPt<R3D> *ray = freeBuffers.back();
+        freeBuffers.pop_back();
+        return ray;
+    }
+
+    void Release(rayPt<R3D> *ray)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            freeBuffers.push_back(ray);
+        }
+        freeCV.notify_one();
+    }
+
+    void Push(const RayResult<O3D, R3D> &res)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.push_back(res);
+        }
+        readyCV.notify_one();
+    }
+
+    /// Waits for a finished ray. Returns false once all rays have been popped.
+    bool Pop(RayResult<O3D, R3D> &res)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        readyCV.wait(lock, [&] { return finished || !ready.empty(); });
+        if(ready.empty()) return false;
+        res = ready.front();
+        ready.pop_front();
+        return true;
+    }
+
+    /// No more rays will be pushed.
+    void Finish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished = true;
+        }
+        readyCV.notify_all();
+    }
+
+    /// The writer has failed, stop the workers.
+    void Abort()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            aborted = true;
+        }
+        freeCV.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable freeCV, readyCV;
+    std::vector<rayPt<R3D> *> freeBuffers;
+    std::deque<RayResult<O3D, R3D>> ready;
+    bool finished, aborted;
+};
+
+template<bool O3D, bool R3D> void StreamedRayModeWorker(
+    const bhcParams<O3D> &params, RayStreamQueue<O3D, R3D> &queue, int32_t worker,
+    ErrState *errState)
+{
+    JobScheduler &sched = GetInternal(params)->jobSched;
+    int32_t begin, end;
+    bool ok = true;
+    while(ok && sched.GetNextJobs(worker, begin, end)) {
+        int32_t i = begin;
+        for(; i < end; ++i) {
+            int32_t job = sched.GetJob(i);
+            RayInitInfo rinit;
+            if(!GetJobIndices<O3D>(rinit, job, params.Pos, params.Angles)) {
+                ok = false;
+                break;
+            }
+            RayResult<O3D, R3D> res;
+            memset(&res, 0, sizeof(RayResult<O3D, R3D>));
+            res.ray = queue.Acquire();
+            if(res.ray == nullptr) {
+                ok = false;
+                break;
+            }
+            int32_t Nsteps = -1;
+            if(!TraceRay<O3D, R3D>(
+                   params, res.ray, MaxN, rinit, Nsteps, res.org, errState)) {
+                queue.Release(res.ray);
+                ok = false;
+                break;
+            }
+            res.SrcDeclAngle = rinit.SrcDeclAngle;
+            res.Nsteps       = Nsteps;
+            queue.Push(res);
+        }
+        GetInternal(params)->completedRayCount += i - begin;
+    }
+}
+
+/**
+ * See bhcInit::streamRays. The workers trace as in RunRayMode, but into
+ * buffers from the queue, and a writer thread passes each finished ray to
+ * sink and then returns its buffer to the queue.
+ */
+template<bool O3D, bool R3D> void RunStreamedRayMode(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const RaySink<O3D, R3D> &sink)
+{
+    RayInfo<O3D, R3D> *rayinfo = outputs.rayinfo;
+    RayStreamQueue<O3D, R3D> queue(
+        rayinfo->WorkRayMem, rayinfo->RayMemCapacity / (size_t)MaxN, MaxN);
+    std::exception_ptr writerError;
+    std::thread writer([&]() {
+        RayResult<O3D, R3D> res;
+        try {
+            while(queue.Pop(res)) {
+                sink(&res);
+                queue.Release(res.ray);
+            }
+        } catch(...) {
+            writerError = std::current_exception();
+            queue.Abort();
+        }
+    });
+
+    ErrState errState;
+    ResetErrState(&errState);
+    InitRayJobs<O3D>(params);
+    try {
+        GetInternal(params)->threadPool.Run([&](int32_t worker) {
+            StreamedRayModeWorker<O3D, R3D>(params, queue, worker, &errState);
+        });
+    } catch(...) {
+        queue.Finish();
+        writer.join();
+        throw;
+    }
+    queue.Finish();
+    writer.join();
+    if(writerError) std::rethrow_exception(writerError);
+    CheckReportErrors(GetInternal(params), &errState);
+}
+
+#if BHC_ENABLE_2D
+template void RunStreamedRayMode<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs,
+    const RaySink<false, false> &sink);
+#endif
+#if BHC_ENABLE_NX2D
+template void RunStreamedRayMode<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs,
+    const RaySink<true, false> &sink);
+#endif
+#if BHC_ENABLE_3D
+template void RunStreamedRayMode<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs,
+    const RaySink<true, true> &sink);
+#endif
+
+/**
+ * Ray index file, see bhcInit::rayIndexFile: RayIndexHeader, then a
+ * RayIndexEntry for each ray, in the order of the ray file. raySize ties the
+ * index to the ray file it was written with; if the ray file has been
+ * rewritten with a different size since, the index is ignored.
+ */
+constexpr const char RayIndexMagic[8] = {'B', 'H', 'C', 'R', 'I', 'D', 'X', '1'};
+
+struct RayIndexHeader {
+    char magic[8];
+    uint64_t raySize;
+    uint64_t headerSize;
+    uint64_t NRays;
+};
+
+template<bool O3D> void WriteRayIndex(
+    const bhcParams<O3D> &params, const std::string &FileRoot, uint64_t headerSize,
+    uint64_t raySize, const std::vector<RayIndexEntry> &entries)
+{
+    RayIndexHeader header;
+    memcpy(header.magic, RayIndexMagic, sizeof(RayIndexMagic));
+    header.raySize    = raySize;
+    header.headerSize = headerSize;
+    header.NRays      = entries.size();
+    std::ofstream out(FileRoot + ".rayidx", std::ios::binary);
+    out.write((const char *)&header, sizeof(header));
+    out.write((const char *)entries.data(), entries.size() * sizeof(RayIndexEntry));
+    if(!out.good()) EXTERR("Failed to write ray index file %s.rayidx", FileRoot.c_str());
+}
+
+#if BHC_ENABLE_2D
+template void WriteRayIndex<false>(
+    const bhcParams<false> &params, const std::string &FileRoot, uint64_t headerSize,
+    uint64_t raySize, const std::vector<RayIndexEntry> &entries);
+#endif
+#if BHC_ENABLE_NX2D || BHC_ENABLE_3D
+template void WriteRayIndex<true>(
+    const bhcParams<true> &params, const std::string &FileRoot, uint64_t headerSize,
+    uint64_t raySize, const std::vector<RayIndexEntry> &entries);
+#endif
+
+/**
+ * Loads the ray index for a ray file of raySize bytes. Returns false, leaving
+ * entries empty, if there is no index or it does not match the ray file.
+ */
+inline bool ReadRayIndex(
+    const std::string &FileRoot, uint64_t raySize, uint64_t &headerSize,
+    std::vector<RayIndexEntry> &entries)
+{
+    MappedFile file;
+    if(!file.open(FileRoot + ".rayidx") || file.size() < sizeof(RayIndexHeader)) {
+        return false;
+    }
+    RayIndexHeader header;
+    memcpy(&header, file.data(), sizeof(header));
+    if(memcmp(header.magic, RayIndexMagic, sizeof(RayIndexMagic)) != 0
+       || header.raySize != raySize || header.headerSize > raySize
+       || file.size() != sizeof(header) + header.NRays * sizeof(RayIndexEntry)) {
+        return false;
+    }
+    entries.resize(header.NRays);
+    memcpy(
+        (void *)entries.data(), file.data() + sizeof(header),
+        header.NRays * sizeof(RayIndexEntry));
+    uint64_t prev = header.headerSize;
+    for(const RayIndexEntry &e : entries) {
+        if(e.offset < prev || e.offset >= raySize || e.Nsteps <= 0) {
+            entries.clear();
+            return false;
+        }
+        prev = e.offset;
+    }
+    headerSize = header.headerSize;
+    return true;
+}
+
+/**
+ * Parses one ray, which is the text from its take-off angle up to (at most)
+ * the next ray, into res, whose point storage has already been set up.
+ */
+template<bool O3D, bool R3D> void ReadOneRay(
+    bhcInternal *internal, const std::string &path, const char *data, size_t size,
+    int32_t NstepsExpected, RayResult<O3D, R3D> *res, bool compact, bool soa,
+    std::vector<VEC23<O3D>> &points, ErrState *errState)
+{
+    LDIFile RAYFile(internal);
+    RAYFile.open(path, data, size);
+    real alpha0 = NAN;
+    LIST(RAYFile);
+    RAYFile.Read(alpha0);
+    if constexpr(O3D) alpha0 *= RadDeg;
+    res->SrcDeclAngle = alpha0;
+
+    int32_t Nsteps = -1, NumTopBnc = -1, NumBotBnc = -1;
+    LIST(RAYFile);
+    RAYFile.Read(Nsteps);
+    RAYFile.Read(NumTopBnc);
+    RAYFile.Read(NumBotBnc);
+    if(Nsteps != NstepsExpected) {
+        ExternalError(internal, "Ray index file does not match %s", path.c_str());
+    }
+    if(NumTopBnc < 0 || NumBotBnc < 0) {
+        ExternalError(internal, "Invalid number of bounces in ray in RAYFile");
+    }
+    res->Nsteps = Nsteps;
+    if(compact) {
+        res->compact[Nsteps - 1].NumTopBnc = (int16_t)bhc::min(NumTopBnc, 0x7FFF);
+        res->compact[Nsteps - 1].NumBotBnc = (int16_t)bhc::min(NumBotBnc, 0x7FFF);
+    } else if(soa) {
+        res->soa.NumTopBnc[Nsteps - 1] = NumTopBnc;
+        res->soa.NumBotBnc[Nsteps - 1] = NumBotBnc;
+    } else {
+        res->ray[Nsteps - 1].NumTopBnc = NumTopBnc;
+        res->ray[Nsteps - 1].NumBotBnc = NumBotBnc;
+    }
+
+    points.resize(Nsteps);
+    for(int32_t is = 0; is < Nsteps; ++is) {
+        LIST(RAYFile);
+        RAYFile.Read(points[is]);
+    }
+    VEC23<R3D> t(RL(0.0));
+    if constexpr(O3D && !R3D) {
+        res->org.xs = points[0];
+        t           = XYCOMP(points[Nsteps - 1] - points[0]);
+        t *= RL(1.0) / glm::length(t);
+        res->org.tradial = t;
+    }
+    for(int32_t is = 0; is < Nsteps; ++is) {
+        VEC23<R3D> x = OceanToRayX(points[is], res->org, t, -1, errState);
+        if(compact) {
+            if(is == 0) res->x0 = x;
+            res->compact[is].dx = x - res->x0;
+        } else if(soa) {
+            res->soa.x[is] = x;
+        } else {
+            res->ray[is].x = x;
+        }
+    }
+}
+
 template<bool O3D, bool R3D> void ReadOutRay(
-    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const char *FileRoot)
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const char *FileRoot,
+    const int32_t *select, int32_t nSelect)
 {
     RayInfo<O3D, R3D> *rayinfo = outputs.rayinfo;
+    bhcInternal *internal      = GetInternal(params);
     if(!IsRayRun(params.Beam) && !IsEigenraysRun(params.Beam)) {
         EXTERR("ReadOutRay not in ray trace or eigenrays mode");
     }
-    LDIFile RAYFile(GetInternal(params), std::string(FileRoot) + ".ray");
+    std::string path = std::string(FileRoot) + ".ray";
+    MappedFile file;
+    if(!file.open(path)) EXTERR("Failed to open ray file %s", path.c_str());
+    // With an index, only the header has to be parsed here; the rays are
+    // parsed in parallel from their offsets below. Without one, the whole file
+    // is scanned for the offsets first.
+    std::vector<RayIndexEntry> entries;
+    uint64_t headerSize = file.size();
+    bool indexed        = ReadRayIndex(FileRoot, file.size(), headerSize, entries);
+    LDIFile RAYFile(internal);
+    RAYFile.open(path, file.data(), indexed ? headerSize : file.size());
 
     std::string TempTitle;
     LIST(RAYFile);
@@ -276,14 +662,11 @@ template<bool O3D, bool R3D> void ReadOutRay(
 
     trackdeallocate(params, rayinfo->RayMem);
     trackdeallocate(params, rayinfo->WorkRayMem);
+    trackdeallocate(params, rayinfo->CompactRayMem);
+    FreeSoARays(params, rayinfo->SoARayMem);
 
-    [[maybe_unused]] std::vector<VEC23<O3D>> firstpoints;
-    [[maybe_unused]] std::vector<VEC23<O3D>> lastpoints;
-
-    auto pre_rays_pos  = RAYFile.StateSave();
-    int32_t NRays      = 0;
-    size_t TotalPoints = 0;
-    while(!RAYFile.EndOfFile()) {
+    while(!indexed && !RAYFile.EndOfFile()) {
+        auto start  = RAYFile.StateSave();
         real alpha0 = NAN;
         LIST(RAYFile);
         RAYFile.Read(alpha0);
@@ -298,86 +681,124 @@ template<bool O3D, bool R3D> void ReadOutRay(
         if(NumTopBnc < 0 || NumBotBnc < 0) {
             EXTERR("Invalid number of bounces in ray in RAYFile");
         }
-        TotalPoints += (size_t)Nsteps;
-        ++NRays;
+        entries.push_back({(uint64_t)start.s, Nsteps, 0});
 
         VEC23<O3D> v;
         for(int32_t is = 0; is < Nsteps; ++is) {
             LIST(RAYFile);
             RAYFile.Read(v);
-            if constexpr(O3D && !R3D) {
-                if(is == 0) firstpoints.push_back(v);
+        }
+    }
+
+    std::vector<int32_t> rays;
+    if(select != nullptr) {
+        rays.assign(select, select + nSelect);
+        for(int32_t r : rays) {
+            if(r < 0 || r >= (int32_t)entries.size()) {
+                EXTERR(
+                    "Ray %d requested, but RAYFile only has %d rays", r,
+                    (int32_t)entries.size());
             }
         }
-        if constexpr(O3D && !R3D) { lastpoints.push_back(v); }
+    } else {
+        rays.resize(entries.size());
+        for(size_t r = 0; r < entries.size(); ++r) rays[r] = (int32_t)r;
     }
+    size_t TotalPoints = 0;
+    for(int32_t r : rays) TotalPoints += (size_t)entries[r].Nsteps;
 
-    rayinfo->NRays        = NRays;
+    bool compact          = internal->compactRays;
+    bool soa              = !compact && internal->soaRays;
+    rayinfo->NRays        = (int32_t)rays.size();
     rayinfo->RayMemPoints = rayinfo->RayMemCapacity = TotalPoints;
     rayinfo->MaxPointsPerRay                        = MaxN;
+    rayinfo->isCopyMode                             = false;
+    rayinfo->isCompact                              = compact;
+    rayinfo->isSoA                                  = soa;
     trackallocate(params, "ray metadata", rayinfo->results, rayinfo->NRays);
-    trackallocate(params, "rays", rayinfo->RayMem, rayinfo->RayMemCapacity);
-    memset(rayinfo->RayMem, 0, rayinfo->RayMemCapacity * sizeof(rayPt<R3D>));
+    memset(rayinfo->results, 0, rayinfo->NRays * sizeof(RayResult<O3D, R3D>));
+    if(compact) {
+        trackallocate(
+            params, "compact rays", rayinfo->CompactRayMem, rayinfo->RayMemCapacity);
+        memset(
+            rayinfo->CompactRayMem, 0,
+            rayinfo->RayMemCapacity * sizeof(rayPtCompact<R3D>));
+    } else if(soa) {
+        AllocateSoARays(params, rayinfo->SoARayMem, rayinfo->RayMemCapacity);
+        const rayPtSoA<R3D> &mem = rayinfo->SoARayMem;
+        memset(mem.x, 0, rayinfo->RayMemCapacity * sizeof(VEC23<R3D>));
+        memset(mem.t, 0, rayinfo->RayMemCapacity * sizeof(VEC23<R3D>));
+        memset(mem.tau, 0, rayinfo->RayMemCapacity * sizeof(cpxacc));
+        memset(mem.Amp, 0, rayinfo->RayMemCapacity * sizeof(real));
+        memset(mem.NumTopBnc, 0, rayinfo->RayMemCapacity * sizeof(int32_t));
+        memset(mem.NumBotBnc, 0, rayinfo->RayMemCapacity * sizeof(int32_t));
+    } else {
+        trackallocate(params, "rays", rayinfo->RayMem, rayinfo->RayMemCapacity);
+        memset(rayinfo->RayMem, 0, rayinfo->RayMemCapacity * sizeof(rayPt<R3D>));
+    }
 
-    RAYFile.StateLoad(pre_rays_pos);
-    NRays       = 0;
     TotalPoints = 0;
-    while(!RAYFile.EndOfFile()) {
-        real alpha0 = NAN;
-        LIST(RAYFile);
-        RAYFile.Read(alpha0);
-        if(!std::isfinite(alpha0)) break; // Nothing written, out of data
-        if constexpr(O3D) alpha0 *= RadDeg;
-        rayinfo->results[NRays].SrcDeclAngle = alpha0;
-
-        int32_t Nsteps = -1, NumTopBnc = -1, NumBotBnc = -1;
-        LIST(RAYFile);
-        RAYFile.Read(Nsteps);
-        RAYFile.Read(NumTopBnc);
-        RAYFile.Read(NumBotBnc);
-        if(Nsteps <= 0) EXTERR("Internal error in RAYFile read second pass");
-        if(NumTopBnc < 0 || NumBotBnc < 0) {
-            EXTERR("Internal error in RAYFile read second pass");
-        }
-        rayinfo->results[NRays].Nsteps = Nsteps;
-        rayinfo->results[NRays].ray    = &rayinfo->RayMem[TotalPoints];
-        VEC23<R3D> t(RL(0.0));
-        if constexpr(O3D && !R3D) {
-            rayinfo->results[NRays].org.xs = firstpoints[NRays];
-            t = XYCOMP(lastpoints[NRays] - firstpoints[NRays]);
-            t *= RL(1.0) / glm::length(t);
-            rayinfo->results[NRays].org.tradial = t;
+    for(int32_t i = 0; i < rayinfo->NRays; ++i) {
+        RayResult<O3D, R3D> *res = &rayinfo->results[i];
+        if(compact) {
+            res->compact = &rayinfo->CompactRayMem[TotalPoints];
+        } else if(soa) {
+            const rayPtSoA<R3D> &mem = rayinfo->SoARayMem;
+            res->soa.x               = &mem.x[TotalPoints];
+            res->soa.t               = &mem.t[TotalPoints];
+            res->soa.tau             = &mem.tau[TotalPoints];
+            res->soa.Amp             = &mem.Amp[TotalPoints];
+            res->soa.NumTopBnc       = &mem.NumTopBnc[TotalPoints];
+            res->soa.NumBotBnc       = &mem.NumBotBnc[TotalPoints];
+        } else {
+            res->ray = &rayinfo->RayMem[TotalPoints];
         }
-        rayinfo->results[NRays].ray[Nsteps - 1].NumTopBnc = NumTopBnc;
-        rayinfo->results[NRays].ray[Nsteps - 1].NumBotBnc = NumBotBnc;
+        TotalPoints += (size_t)entries[rays[i]].Nsteps;
+    }
 
-        ErrState errState;
-        ResetErrState(&errState);
-        for(int32_t is = 0; is < Nsteps; ++is) {
-            VEC23<O3D> v;
-            LIST(RAYFile);
-            RAYFile.Read(v);
-            rayinfo->results[NRays].ray[is].x
-                = OceanToRayX(v, rayinfo->results[NRays].org, t, -1, &errState);
+    // Each ray is parsed from its own part of the file, so they can be
+    // parsed in parallel.
+    ErrState errState;
+    ResetErrState(&errState);
+    std::atomic<int32_t> next(0);
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    internal->threadPool.Run([&](int32_t) {
+        std::vector<VEC23<O3D>> points;
+        try {
+            for(int32_t i = next++; i < rayinfo->NRays; i = next++) {
+                int32_t r      = rays[i];
+                uint64_t begin = entries[r].offset;
+                uint64_t end   = (size_t)r + 1 < entries.size() ? entries[r + 1].offset
+                                                                : file.size();
+                ReadOneRay<O3D, R3D>(
+                    internal, path, file.data() + begin, end - begin, entries[r].Nsteps,
+                    &rayinfo->results[i], compact, soa, points, &errState);
+            }
+        } catch(...) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if(!error) error = std::current_exception();
+            next = rayinfo->NRays;
         }
-        CheckReportErrors(GetInternal(params), &errState);
-
-        TotalPoints += (size_t)Nsteps;
-        ++NRays;
-    }
+    });
+    if(error) std::rethrow_exception(error);
+    CheckReportErrors(internal, &errState);
 }
 
 #if BHC_ENABLE_2D
 template void ReadOutRay<false, false>(
-    bhcParams<false> &params, bhcOutputs<false, false> &outputs, const char *FileRoot);
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs, const char *FileRoot,
+    const int32_t *select, int32_t nSelect);
 #endif
 #if BHC_ENABLE_NX2D
 template void ReadOutRay<true, false>(
-    bhcParams<true> &params, bhcOutputs<true, false> &outputs, const char *FileRoot);
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs, const char *FileRoot,
+    const int32_t *select, int32_t nSelect);
 #endif
 #if BHC_ENABLE_3D
 template void ReadOutRay<true, true>(
-    bhcParams<true> &params, bhcOutputs<true, true> &outputs, const char *FileRoot);
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs, const char *FileRoot,
+    const int32_t *select, int32_t nSelect);
 #endif
 
 }} // namespace bhc::mode
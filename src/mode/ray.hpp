@@ -19,9 +19,16 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #pragma once
 #include "../common_setup.hpp"
 #include "modemodule.hpp"
+#include <functional>
 
 namespace bhc { namespace mode {
 
+/// Whether the rays are written during run(), see bhcInit::streamRays.
+template<bool O3D> inline bool IsStreamedRayRun(const bhcParams<O3D> &params)
+{
+    return GetInternal(params)->streamRays && IsRayRun(params.Beam);
+}
+
 template<bool O3D, bool R3D> bool RunRay(
     RayInfo<O3D, R3D> *rayinfo, const bhcParams<O3D> &params, int32_t job, int32_t worker,
     RayInitInfo &rinit, int32_t &Nsteps, ErrState *errState);
@@ -44,14 +51,85 @@ extern template void RunRayMode<true, false>(
 extern template void RunRayMode<true, true>(
     bhcParams<true> &params, bhcOutputs<true, true> &outputs);
 
+/// Called from the writer thread for each finished ray, see bhcInit::streamRays.
+template<bool O3D, bool R3D> using RaySink = std::function<void(RayResult<O3D, R3D> *)>;
+
+template<bool O3D, bool R3D> void RunStreamedRayMode(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const RaySink<O3D, R3D> &sink);
+extern template void RunStreamedRayMode<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs,
+    const RaySink<false, false> &sink);
+extern template void RunStreamedRayMode<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs,
+    const RaySink<true, false> &sink);
+extern template void RunStreamedRayMode<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs,
+    const RaySink<true, true> &sink);
+
+/// One ray in the ray index file (FileRoot.rayidx), see bhcInit::rayIndexFile.
+struct RayIndexEntry {
+    uint64_t offset; // Of the ray's take-off angle in the ray file
+    int32_t Nsteps;
+    int32_t unused;
+};
+
+/**
+ * Writes the ray index file for a ray file of raySize bytes, whose header
+ * (before the first ray) is headerSize bytes.
+ */
+template<bool O3D> void WriteRayIndex(
+    const bhcParams<O3D> &params, const std::string &FileRoot, uint64_t headerSize,
+    uint64_t raySize, const std::vector<RayIndexEntry> &entries);
+extern template void WriteRayIndex<false>(
+    const bhcParams<false> &params, const std::string &FileRoot, uint64_t headerSize,
+    uint64_t raySize, const std::vector<RayIndexEntry> &entries);
+extern template void WriteRayIndex<true>(
+    const bhcParams<true> &params, const std::string &FileRoot, uint64_t headerSize,
+    uint64_t raySize, const std::vector<RayIndexEntry> &entries);
+
+/**
+ * Reads the ray file. If select is not nullptr, only the nSelect rays with
+ * those indices (in the order of the ray file) are loaded, in that order.
+ */
 template<bool O3D, bool R3D> void ReadOutRay(
-    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const char *FileRoot);
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const char *FileRoot,
+    const int32_t *select = nullptr, int32_t nSelect = 0);
 extern template void ReadOutRay<false, false>(
-    bhcParams<false> &params, bhcOutputs<false, false> &outputs, const char *FileRoot);
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs, const char *FileRoot,
+    const int32_t *select, int32_t nSelect);
 extern template void ReadOutRay<true, false>(
-    bhcParams<true> &params, bhcOutputs<true, false> &outputs, const char *FileRoot);
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs, const char *FileRoot,
+    const int32_t *select, int32_t nSelect);
 extern template void ReadOutRay<true, true>(
-    bhcParams<true> &params, bhcOutputs<true, true> &outputs, const char *FileRoot);
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs, const char *FileRoot,
+    const int32_t *select, int32_t nSelect);
+
+/// See bhcInit::soaRays.
+template<bool O3D, bool R3D> inline void AllocateSoARays(
+    const bhcParams<O3D> &params, rayPtSoA<R3D> &soa, size_t n)
+{
+    trackallocate(params, "SoA ray positions", soa.x, n);
+    trackallocate(params, "SoA ray tangents", soa.t, n);
+    trackallocate(params, "SoA ray delays", soa.tau, n);
+    trackallocate(params, "SoA ray amplitudes", soa.Amp, n);
+    trackallocate(params, "SoA ray bounces", soa.NumTopBnc, n);
+    trackallocate(params, "SoA ray bounces", soa.NumBotBnc, n);
+}
+
+template<bool O3D, bool R3D> inline void FreeSoARays(
+    const bhcParams<O3D> &params, rayPtSoA<R3D> &soa)
+{
+    trackdeallocate(params, soa.x);
+    trackdeallocate(params, soa.t);
+    trackdeallocate(params, soa.tau);
+    trackdeallocate(params, soa.Amp);
+    trackdeallocate(params, soa.NumTopBnc);
+    trackdeallocate(params, soa.NumBotBnc);
+}
+
+/// Bytes per point of SoA rays.
+template<bool R3D> constexpr size_t SoARayPtSize = 2 * sizeof(VEC23<R3D>)
+    + sizeof(cpxacc) + sizeof(real) + 2 * sizeof(int32_t);
 
 template<bool O3D, bool R3D> class Ray : public ModeModule<O3D, R3D> {
 public:
@@ -60,14 +138,19 @@ public:
 
     virtual void Init(bhcOutputs<O3D, R3D> &outputs) const override
     {
-        outputs.rayinfo->results    = nullptr;
-        outputs.rayinfo->RayMem     = nullptr;
-        outputs.rayinfo->WorkRayMem = nullptr;
+        outputs.rayinfo->results       = nullptr;
+        outputs.rayinfo->RayMem        = nullptr;
+        outputs.rayinfo->WorkRayMem    = nullptr;
+        outputs.rayinfo->CompactRayMem = nullptr;
+        memset(&outputs.rayinfo->SoARayMem, 0, sizeof(rayPtSoA<R3D>));
 
         outputs.rayinfo->RayMemCapacity  = 0;
         outputs.rayinfo->RayMemPoints    = 0;
         outputs.rayinfo->MaxPointsPerRay = 0;
         outputs.rayinfo->NRays           = 0;
+        outputs.rayinfo->isCompact       = false;
+        outputs.rayinfo->isSoA           = false;
+        outputs.rayinfo->blocking        = true;
     }
 
     virtual void Preprocess(
@@ -77,6 +160,12 @@ public:
 
         trackdeallocate(params, rayinfo->RayMem);
         trackdeallocate(params, rayinfo->WorkRayMem);
+        trackdeallocate(params, rayinfo->CompactRayMem);
+        FreeSoARays(params, rayinfo->SoARayMem);
+        if(IsStreamedRayRun(params)) {
+            PreprocessStreamed(params, rayinfo);
+            return;
+        }
         rayinfo->NRays = IsEigenraysRun(params.Beam) || IsAlsoEigenraysRun(params.Beam)
             ? outputs.eigen->neigen
             : GetNumJobs<O3D>(params.Pos, params.Angles);
@@ -86,21 +175,28 @@ public:
 
         rayinfo->MaxPointsPerRay = MaxN;
         rayinfo->isCopyMode      = false;
+        rayinfo->isCompact       = false;
+        rayinfo->isSoA           = false;
+        rayinfo->RayMemPoints    = 0;
+        if(GetInternal(params)->compactRays) {
+            PreprocessCompact(params, rayinfo);
+            return;
+        } else if(GetInternal(params)->soaRays) {
+            PreprocessSoA(params, rayinfo);
+            return;
+        }
         size_t needtotalsize = (size_t)rayinfo->NRays * (size_t)MaxN * sizeof(rayPt<R3D>);
-        if(GetInternal(params)->usedMemory + needtotalsize
-           <= GetInternal(params)->maxMemory) {
+        if(needtotalsize <= RemainingOutputMemory(params)) {
             rayinfo->RayMemCapacity = (size_t)rayinfo->NRays * (size_t)MaxN;
         } else if(GetInternal(params)->useRayCopyMode) {
             trackallocate(
                 params, "work rays for copy mode", rayinfo->WorkRayMem,
                 GetInternal(params)->numThreads * MaxN);
-            rayinfo->RayMemCapacity = (GetInternal(params)->maxMemory
-                                       - GetInternal(params)->usedMemory)
-                / sizeof(rayPt<R3D>);
+            rayinfo->RayMemCapacity = RemainingOutputMemory(params) / sizeof(rayPt<R3D>);
             rayinfo->isCopyMode = true;
         } else {
             rayinfo->MaxPointsPerRay = (int32_t)std::min(
-                (GetInternal(params)->maxMemory - GetInternal(params)->usedMemory)
+                RemainingOutputMemory(params)
                     / ((size_t)rayinfo->NRays * sizeof(rayPt<R3D>)),
                 (size_t)0x7FFFFFFF);
             if(rayinfo->MaxPointsPerRay == 0) {
@@ -114,17 +210,116 @@ public:
                 * (size_t)rayinfo->MaxPointsPerRay;
         }
         trackallocate(params, "rays", rayinfo->RayMem, rayinfo->RayMemCapacity);
-        rayinfo->RayMemPoints = 0;
+    }
+
+    /**
+     * Each worker traces into its own full-size ray, as in copy mode, which is
+     * then stored compactly (see bhcInit::compactRays).
+     */
+    void PreprocessCompact(bhcParams<O3D> &params, RayInfo<O3D, R3D> *rayinfo) const
+    {
+        bhcInternal *internal = GetInternal(params);
+        trackallocate(
+            params, "work rays for compact mode", rayinfo->WorkRayMem,
+            internal->numThreads * MaxN);
+        size_t fit = RemainingOutputMemory(params) / sizeof(rayPtCompact<R3D>);
+        rayinfo->RayMemCapacity = std::min((size_t)rayinfo->NRays * (size_t)MaxN, fit);
+        if(rayinfo->RayMemCapacity == 0) {
+            EXTERR("Insufficient memory to allocate any rays at all");
+        }
+        rayinfo->isCompact = true;
+        trackallocate(
+            params, "compact rays", rayinfo->CompactRayMem, rayinfo->RayMemCapacity);
+    }
+
+    /**
+     * As in compact mode, each worker traces into its own full-size ray, which
+     * is then stored into the SoA arrays (see bhcInit::soaRays).
+     */
+    void PreprocessSoA(bhcParams<O3D> &params, RayInfo<O3D, R3D> *rayinfo) const
+    {
+        bhcInternal *internal = GetInternal(params);
+        trackallocate(
+            params, "work rays for SoA mode", rayinfo->WorkRayMem,
+            internal->numThreads * MaxN);
+        size_t avail = RemainingOutputMemory(params);
+        avail        = avail > 6 * 32 ? avail - 6 * 32 : 0; // Padding of the arrays
+        rayinfo->RayMemCapacity = std::min(
+            (size_t)rayinfo->NRays * (size_t)MaxN, avail / SoARayPtSize<R3D>);
+        if(rayinfo->RayMemCapacity == 0) {
+            EXTERR("Insufficient memory to allocate any rays at all");
+        }
+        rayinfo->isSoA = true;
+        AllocateSoARays(params, rayinfo->SoARayMem, rayinfo->RayMemCapacity);
+    }
+
+    /**
+     * The queue buffers are the work rays, and no results are kept (see
+     * bhcInit::streamRays).
+     */
+    void PreprocessStreamed(bhcParams<O3D> &params, RayInfo<O3D, R3D> *rayinfo) const
+    {
+        bhcInternal *internal = GetInternal(params);
+        trackdeallocate(params, rayinfo->results);
+        rayinfo->NRays           = GetNumJobs<O3D>(params.Pos, params.Angles);
+        rayinfo->MaxPointsPerRay = MaxN;
+        rayinfo->isCopyMode      = false;
+        rayinfo->isCompact       = false;
+        rayinfo->isSoA           = false;
+        rayinfo->RayMemPoints    = 0;
+        size_t depth = internal->streamRaysQueueDepth > 0
+            ? (size_t)internal->streamRaysQueueDepth
+            : (size_t)internal->numThreads * 4;
+        size_t avail = internal->usedMemory < internal->maxMemory
+            ? internal->maxMemory - internal->usedMemory
+            : 0;
+        depth = std::min(depth, avail / trackallocsize<rayPt<R3D>>(MaxN));
+        if(depth == 0) { EXTERR("Insufficient memory to allocate any rays at all"); }
+        rayinfo->RayMemCapacity = depth * (size_t)MaxN;
+        trackallocate(
+            params, "ray buffers for streamed rays", rayinfo->WorkRayMem,
+            rayinfo->RayMemCapacity);
     }
 
     virtual void Run(bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs) const override
     {
-        RunRayMode<O3D, R3D>(params, outputs);
+        if(!IsStreamedRayRun(params)) {
+            RunRayMode<O3D, R3D>(params, outputs);
+            return;
+        }
+        bhcInternal *internal = GetInternal(params);
+        LDOFile RAYFile;
+        uint64_t headerSize = 0;
+        if(internal->rayCallback == nullptr) {
+            if(internal->noEnvFil) {
+                EXTERR("Streamed ray runs without an environment file need rayCallback");
+            }
+            OpenRAYFile(RAYFile, internal->FileRoot, params);
+            headerSize = RAYFile.tell();
+        }
+        bool index = internal->rayIndexFile && internal->rayCallback == nullptr;
+        std::vector<RayIndexEntry> entries;
+        std::vector<real> x;
+        RunStreamedRayMode<O3D, R3D>(params, outputs, [&](RayResult<O3D, R3D> *res) {
+            CompressRay(res, params.Bdry);
+            if(internal->rayCallback == nullptr) {
+                if(index) entries.push_back({RAYFile.tell(), res->Nsteps, 0});
+                WriteRay(RAYFile, res);
+            } else {
+                CallbackRay(internal->rayCallback, res, x);
+            }
+        });
+        if(index) {
+            WriteRayIndex(
+                params, internal->FileRoot, headerSize, RAYFile.tell(), entries);
+        }
     }
 
     virtual void Postprocess(
         bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs) const override
     {
+        // Streamed runs have already written the rays
+        if(IsStreamedRayRun(params)) return;
         RayInfo<O3D, R3D> *rayinfo = outputs.rayinfo;
         for(int r = 0; r < rayinfo->NRays; ++r) {
             RayResult<O3D, R3D> *res = &rayinfo->results[r];
@@ -134,16 +329,37 @@ public:
     }
 
     virtual void Writeout(
-        const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs) const override
+        const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+        const char *FileRoot) const override
     {
+        if(IsStreamedRayRun(params)) return;
         RayInfo<O3D, R3D> *rayinfo = outputs.rayinfo;
+        bhcInternal *internal = GetInternal(params);
         LDOFile RAYFile;
-        OpenRAYFile(RAYFile, GetInternal(params)->FileRoot, params);
-        for(int r = 0; r < rayinfo->NRays; ++r) {
-            const RayResult<O3D, R3D> *res = &rayinfo->results[r];
-            if(res->ray == nullptr) continue;
-            WriteRay(RAYFile, res);
+        OpenRAYFile(RAYFile, FileRoot, params);
+        uint64_t headerSize = RAYFile.tell();
+        // Bytes of each ray, for the index
+        std::vector<uint64_t> sizes(internal->rayIndexFile ? rayinfo->NRays : 0);
+        // One ray per block, as a ray can be up to MaxN points.
+        RAYFile.writeblocks(
+            internal->threadPool, rayinfo->NRays, 1, [&](size_t r, LDOBuffer &buf) {
+                const RayResult<O3D, R3D> *res = &rayinfo->results[r];
+                if(res->ray == nullptr && res->compact == nullptr
+                   && res->soa.x == nullptr) {
+                    return;
+                }
+                WriteRay(buf, res);
+                if(!sizes.empty()) sizes[r] = buf.str().size();
+            });
+        if(!internal->rayIndexFile) return;
+        std::vector<RayIndexEntry> entries;
+        uint64_t offset = headerSize;
+        for(int32_t r = 0; r < rayinfo->NRays; ++r) {
+            if(sizes[r] == 0) continue;
+            entries.push_back({offset, rayinfo->results[r].Nsteps, 0});
+            offset += sizes[r];
         }
+        WriteRayIndex(params, FileRoot, headerSize, offset, entries);
     }
 
     virtual void Readout(
@@ -159,6 +375,8 @@ public:
         trackdeallocate(params, outputs.rayinfo->results);
         trackdeallocate(params, outputs.rayinfo->RayMem);
         trackdeallocate(params, outputs.rayinfo->WorkRayMem);
+        trackdeallocate(params, outputs.rayinfo->CompactRayMem);
+        FreeSoARays(params, outputs.rayinfo->SoARayMem);
     }
 
 private:
@@ -226,9 +444,10 @@ private:
     }
 
     /**
-     * Write to RAYFile.
+     * Write to RAYFile, an LDOFile or an LDOBuffer.
      */
-    inline void WriteRay(LDOFile &RAYFile, const RayResult<O3D, R3D> *res) const
+    template<typename OFILE> inline void WriteRay(
+        OFILE &RAYFile, const RayResult<O3D, R3D> *res) const
     {
         // take-off angle of this ray [LP: 2D: degrees, 3D: radians]
         real alpha0 = res->SrcDeclAngle;
@@ -236,12 +455,53 @@ private:
         RAYFile << alpha0 << '\n';
 
         RAYFile << res->Nsteps;
+        if(res->compact != nullptr) {
+            const rayPtCompact<R3D> *ray = res->compact;
+            RAYFile << (int32_t)ray[res->Nsteps - 1].NumTopBnc;
+            RAYFile << (int32_t)ray[res->Nsteps - 1].NumBotBnc << '\n';
+            for(int32_t is = 0; is < res->Nsteps; ++is) {
+                VEC23<R3D> x = res->x0 + VEC23<R3D>(ray[is].dx);
+                RAYFile << RayToOceanX(x, res->org) << '\n';
+            }
+            return;
+        }
+        if(res->soa.x != nullptr) {
+            RAYFile << res->soa.NumTopBnc[res->Nsteps - 1];
+            RAYFile << res->soa.NumBotBnc[res->Nsteps - 1] << '\n';
+            for(int32_t is = 0; is < res->Nsteps; ++is) {
+                RAYFile << RayToOceanX(res->soa.x[is], res->org) << '\n';
+            }
+            return;
+        }
         RAYFile << res->ray[res->Nsteps - 1].NumTopBnc;
         RAYFile << res->ray[res->Nsteps - 1].NumBotBnc << '\n';
         for(int32_t is = 0; is < res->Nsteps; ++is) {
             RAYFile << RayToOceanX(res->ray[is].x, res->org) << '\n';
         }
     }
+
+    /**
+     * Same data as WriteRay, to bhcInit::rayCallback. Only for full rays, which
+     * is all streamed runs produce.
+     */
+    inline void CallbackRay(
+        void (*rayCallback)(
+            real alpha0, int32_t Nsteps, int32_t NumTopBnc, int32_t NumBotBnc,
+            const real *x),
+        const RayResult<O3D, R3D> *res, std::vector<real> &x) const
+    {
+        real alpha0 = res->SrcDeclAngle;
+        if constexpr(O3D) alpha0 *= DegRad;
+        constexpr int32_t dims = O3D ? 3 : 2;
+        x.resize((size_t)res->Nsteps * dims);
+        for(int32_t is = 0; is < res->Nsteps; ++is) {
+            VEC23<O3D> xo = RayToOceanX(res->ray[is].x, res->org);
+            for(int32_t d = 0; d < dims; ++d) x[(size_t)is * dims + d] = xo[d];
+        }
+        rayCallback(
+            alpha0, res->Nsteps, res->ray[res->Nsteps - 1].NumTopBnc,
+            res->ray[res->Nsteps - 1].NumBotBnc, x.data());
+    }
 };
 
 }} // namespace bhc::mode
@@ -20,6 +20,10 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #include "../trace.hpp"
 #include "../module/title.hpp"
 #include "../module/szrz.hpp"
+#include "tlchunked.hpp"
+
+#include <atomic>
+#include <vector>
 
 namespace bhc { namespace mode {
 
@@ -37,7 +41,7 @@ namespace bhc { namespace mode {
  */
 template<bool O3D> inline void WriteHeader(
     const bhcParams<O3D> &params, DirectOFile &SHDFile, float atten,
-    const std::string &PlotType)
+    const std::string &PlotType, const std::string &FileRoot)
 {
     const Position *Pos      = params.Pos;
     const FreqInfo *freqinfo = params.freqinfo;
@@ -54,7 +58,7 @@ template<bool O3D> inline void WriteHeader(
     LRecl = bhc::max(LRecl, Pos->NRz * (int32_t)sizeof(Pos->Rz[0]));
     LRecl = bhc::max(LRecl, Pos->NRr * (int32_t)sizeof(cpxf));
 
-    std::string FileName = GetInternal(params)->FileRoot + ".shd";
+    std::string FileName = FileRoot + ".shd";
     SHDFile.open(FileName, LRecl);
     if(!SHDFile.good()) { EXTERR("Could not open SHDFile: %s", FileName.c_str()); }
     LRecl /= 4;
@@ -100,17 +104,31 @@ template<bool O3D> inline void WriteHeader(
     DOFWRITE(SHDFile, Pos->Rr, Pos->NRr * sizeof(Pos->Rr[0]));
 }
 
+/// Sound speed and beam epsilons at a source, which ScalePressure needs.
+struct TLSourceScale {
+    real c;
+    cpx epsilon1, epsilon2;
+};
+
 /**
  * LP: Write TL results
+ *
+ * The nominal SSP at each source is found first, which is cheap. The scaling
+ * of the field, which is the bulk of the work, is then split between the
+ * threads, in blocks of rows (receiver depths) of one source, plane, and
+ * frequency, so that runs with few sources are also parallel.
  */
 template<bool O3D, bool R3D> void PostProcessTL(
     const bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
 {
     ErrState errState;
     ResetErrState(&errState);
-    for(int32_t isz = 0; isz < params.Pos->NSz; ++isz) {
-        for(int32_t isx = 0; isx < params.Pos->NSx; ++isx) {
-            for(int32_t isy = 0; isy < params.Pos->NSy; ++isy) {
+    const Position *Pos = params.Pos;
+    size_t nSources     = (size_t)Pos->NSz * (size_t)Pos->NSx * (size_t)Pos->NSy;
+    std::vector<TLSourceScale> scale(nSources);
+    for(int32_t isz = 0; isz < Pos->NSz; ++isz) {
+        for(int32_t isx = 0; isx < Pos->NSx; ++isx) {
+            for(int32_t isy = 0; isy < Pos->NSy; ++isy) {
                 SSPSegState iSeg;
                 iSeg.r = iSeg.x = iSeg.y = iSeg.z = 0;
                 VEC23<O3D> xs, tinit;
@@ -118,64 +136,99 @@ template<bool O3D, bool R3D> void PostProcessTL(
                 char st = params.ssp->Type;
                 if(st == 'N') {
                     o = RayStartNominalSSP<CfgSel<'C', 'G', 'N'>, O3D>(
-                        isx, isy, isz, FL(0.0), iSeg, params.Pos, params.ssp, &errState,
-                        xs, tinit);
+                        isx, isy, isz, FL(0.0), iSeg, Pos, params.ssp, &errState, xs,
+                        tinit);
                 } else if(st == 'C') {
                     o = RayStartNominalSSP<CfgSel<'C', 'G', 'C'>, O3D>(
-                        isx, isy, isz, FL(0.0), iSeg, params.Pos, params.ssp, &errState,
-                        xs, tinit);
+                        isx, isy, isz, FL(0.0), iSeg, Pos, params.ssp, &errState, xs,
+                        tinit);
                 } else if(st == 'S') {
                     o = RayStartNominalSSP<CfgSel<'C', 'G', 'S'>, O3D>(
-                        isx, isy, isz, FL(0.0), iSeg, params.Pos, params.ssp, &errState,
-                        xs, tinit);
+                        isx, isy, isz, FL(0.0), iSeg, Pos, params.ssp, &errState, xs,
+                        tinit);
                 } else if(st == 'P') {
                     o = RayStartNominalSSP<CfgSel<'C', 'G', 'P'>, O3D>(
-                        isx, isy, isz, FL(0.0), iSeg, params.Pos, params.ssp, &errState,
-                        xs, tinit);
+                        isx, isy, isz, FL(0.0), iSeg, Pos, params.ssp, &errState, xs,
+                        tinit);
                 } else if(st == 'Q') {
                     o = RayStartNominalSSP<CfgSel<'C', 'G', 'Q'>, O3D>(
-                        isx, isy, isz, FL(0.0), iSeg, params.Pos, params.ssp, &errState,
-                        xs, tinit);
+                        isx, isy, isz, FL(0.0), iSeg, Pos, params.ssp, &errState, xs,
+                        tinit);
                 } else if(st == 'H') {
                     o = RayStartNominalSSP<CfgSel<'C', 'G', 'H'>, O3D>(
-                        isx, isy, isz, FL(0.0), iSeg, params.Pos, params.ssp, &errState,
-                        xs, tinit);
+                        isx, isy, isz, FL(0.0), iSeg, Pos, params.ssp, &errState, xs,
+                        tinit);
                 } else if(st == 'A') {
                     o = RayStartNominalSSP<CfgSel<'C', 'G', 'A'>, O3D>(
-                        isx, isy, isz, FL(0.0), iSeg, params.Pos, params.ssp, &errState,
-                        xs, tinit);
+                        isx, isy, isz, FL(0.0), iSeg, Pos, params.ssp, &errState, xs,
+                        tinit);
                 } else {
                     EXTERR("Invalid ssp->Type %c!", st);
                 }
-                cpx epsilon1, epsilon2;
+                size_t src        = ((size_t)isz * Pos->NSx + isx) * Pos->NSy + isy;
+                TLSourceScale &sc = scale[src];
+                sc.c              = o.ccpx.real();
                 if constexpr(R3D) {
                     // LP: In BELLHOP3D, this is run for both Nx2D and 3D, but the results
                     // are only used in ScalePressure for 3D
-                    epsilon1 = PickEpsilon<O3D, R3D>(
+                    sc.epsilon1 = PickEpsilon<O3D, R3D>(
                         FL(2.0) * REAL_PI * params.freqinfo->freq0, o.ccpx.real(),
                         o.gradc, FL(0.0), params.Angles->alpha.d, params.Beam, &errState);
-                    epsilon2 = PickEpsilon<O3D, R3D>(
+                    sc.epsilon2 = PickEpsilon<O3D, R3D>(
                         FL(2.0) * REAL_PI * params.freqinfo->freq0, o.ccpx.real(),
                         o.gradc, FL(0.0), params.Angles->beta.d, params.Beam, &errState);
                 } else {
-                    epsilon1 = epsilon2 = RL(0.0);
+                    sc.epsilon1 = sc.epsilon2 = RL(0.0);
                 }
                 if(HasErrored(&errState)) {
-                    // Exit loops
-                    isx = params.Pos->NSx;
-                    isz = params.Pos->NSz;
-                    break;
+                    CheckReportErrors(GetInternal(params), &errState);
+                    return;
                 }
-                ScalePressure<O3D, R3D>(
-                    params.Angles->alpha.d, params.Angles->beta.d, o.ccpx.real(),
-                    epsilon1, epsilon2, params.Pos->Rr,
-                    &outputs
-                         .uAllSources[GetFieldAddr(isx, isy, isz, 0, 0, 0, params.Pos)],
-                    params.Pos->Ntheta, params.Pos->NRz_per_range, params.Pos->NRr,
-                    params.freqinfo->freq0, params.Beam);
             }
         }
     }
+
+    // Each plane of the field is scaled as a run of its TL type, see
+    // bhcInit::allTLTypes.
+    int32_t nPlanes     = GetNumTLPlanes(params);
+    size_t planeSize    = GetTLPlaneSize(params);
+    int32_t Nfreq       = GetNumFieldFreqs(params);
+    size_t nRows        = (size_t)Pos->Ntheta * (size_t)Pos->NRz_per_range;
+    size_t rowsPerBlock = bhc::max((size_t)1, (size_t)16384 / (size_t)Pos->NRr);
+    size_t blocksPerSrc = (nRows + rowsPerBlock - 1) / rowsPerBlock;
+    size_t nBlocks      = nSources * (size_t)nPlanes * (size_t)Nfreq * blocksPerSrc;
+    std::atomic<size_t> next(0);
+    GetInternal(params)->threadPool.Run([&](int32_t) {
+        BeamStructure<O3D> planeBeam = *params.Beam;
+        while(true) {
+            size_t b = next.fetch_add(1);
+            if(b >= nBlocks) break;
+            size_t row0   = (b % blocksPerSrc) * rowsPerBlock;
+            size_t rest   = b / blocksPerSrc;
+            int32_t ifreq = (int32_t)(rest % (size_t)Nfreq);
+            rest /= (size_t)Nfreq;
+            int32_t p  = (int32_t)(rest % (size_t)nPlanes);
+            size_t src = rest / (size_t)nPlanes;
+            // Same order as scale.
+            int32_t isy = (int32_t)(src % (size_t)Pos->NSy);
+            int32_t isx = (int32_t)(src / (size_t)Pos->NSy % (size_t)Pos->NSx);
+            int32_t isz = (int32_t)(src / ((size_t)Pos->NSy * (size_t)Pos->NSx));
+            real freq   = IsBroadbandRun(params.Bdry) ? params.freqinfo->freqVec[ifreq]
+                                                      : params.freqinfo->freq0;
+            planeBeam.RunType[0] = TLPlaneType(params.Beam, p);
+            cpxf *plane          = &outputs.uAllSources[(size_t)p * planeSize];
+            size_t addr = GetFieldAddr(isx, isy, isz, 0, 0, 0, Pos, ifreq, Nfreq)
+                + row0 * (size_t)Pos->NRr;
+            const TLSourceScale &sc = scale[src];
+            // The rows of the block are contiguous, and ScalePressure
+            // treats each row the same, so they are passed as one theta.
+            ScalePressure<O3D, R3D>(
+                params.Angles->alpha.d, params.Angles->beta.d, sc.c, sc.epsilon1,
+                sc.epsilon2, Pos->Rr, &plane[addr], 1,
+                (int32_t)bhc::min(rowsPerBlock, nRows - row0), Pos->NRr, freq,
+                &planeBeam);
+        }
+    });
     CheckReportErrors(GetInternal(params), &errState);
 }
 
@@ -192,12 +245,18 @@ template void PostProcessTL<true, true>(
     const bhcParams<true> &params, bhcOutputs<true, true> &outputs);
 #endif
 
+/**
+ * For broadband runs, the records of each frequency follow those of the
+ * previous one, as a whole single-frequency file, which is the order the
+ * Acoustics Toolbox's read_shd_bin expects.
+ */
 template<bool O3D> inline size_t GetRecNum(
     const bhcParams<O3D> &params, int32_t isx, int32_t isy, int32_t itheta, int32_t isz,
-    int32_t Irz1)
+    int32_t Irz1, int32_t ifreq = 0)
 {
     // clang-format off
-    return        10                     + ((((size_t)isx
+    return        10                     + (((((size_t)ifreq
+        * (size_t)params.Pos->NSx           + (size_t)isx)
         * (size_t)params.Pos->NSy           + (size_t)isy)
         * (size_t)params.Pos->Ntheta        + (size_t)itheta)
         * (size_t)params.Pos->NSz           + (size_t)isz)
@@ -209,16 +268,26 @@ template<bool O3D> inline size_t GetRecNum(
  * LP: Write TL results
  */
 template<bool O3D, bool R3D> void WriteOutTL(
-    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs)
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+    const char *FileRoot)
 {
     real atten = FL(0.0);
     std::string PlotType;
-    DirectOFile SHDFile(GetInternal(params));
 
     // following to set PlotType has already been done in READIN if that was used for
     // input (LP: not anymore)
     PlotType = IsIrregularGrid(params.Beam) ? "irregular " : "rectilin  ";
-    WriteHeader(params, SHDFile, atten, PlotType);
+    if(GetInternal(params)->chunkedTLFile) {
+        TLTileWriter TileFile(GetInternal(params));
+        TileFile.Begin(params, atten, PlotType, FileRoot);
+        size_t nTiles = GetTLPlaneSize(params)
+            / ((size_t)params.Pos->NRz_per_range * (size_t)params.Pos->NRr);
+        TileFile.WriteTiles(0, nTiles, outputs.uAllSources);
+        TileFile.End();
+        return;
+    }
+    DirectOFile SHDFile(GetInternal(params));
+    WriteHeader(params, SHDFile, atten, PlotType, FileRoot);
 
     // clang-format off
     // LP: There are three different orders of the data used here.
@@ -229,40 +298,239 @@ template<bool O3D, bool R3D> void WriteOutTL(
     // clang-format on
     // Since the write order doesn't change the file contents, the write order
     // has been changed to match the file order, to hopefully speed up I/O.
-    for(int32_t isx = 0; isx < params.Pos->NSx; ++isx) {
-        for(int32_t isy = 0; isy < params.Pos->NSy; ++isy) {
-            for(int32_t itheta = 0; itheta < params.Pos->Ntheta; ++itheta) {
-                for(int32_t isz = 0; isz < params.Pos->NSz; ++isz) {
-                    for(int32_t Irz1 = 0; Irz1 < params.Pos->NRz_per_range; ++Irz1) {
-                        SHDFile.rec(GetRecNum(params, isx, isy, itheta, isz, Irz1));
-                        for(int32_t r = 0; r < params.Pos->NRr; ++r) {
-                            cpxf v = outputs.uAllSources[GetFieldAddr(
-                                isx, isy, isz, itheta, Irz1, r, params.Pos)];
-                            DOFWRITEV(SHDFile, v);
+    // The radii of a record are contiguous in the field, and the records are
+    // written in order, so they are gathered and written in bulk.
+    int32_t Nfreq = GetNumFieldFreqs(params);
+    size_t bytes  = (size_t)params.Pos->NRr * sizeof(cpxf);
+    for(int32_t ifreq = 0; ifreq < Nfreq; ++ifreq) {
+        for(int32_t isx = 0; isx < params.Pos->NSx; ++isx) {
+            for(int32_t isy = 0; isy < params.Pos->NSy; ++isy) {
+                for(int32_t itheta = 0; itheta < params.Pos->Ntheta; ++itheta) {
+                    for(int32_t isz = 0; isz < params.Pos->NSz; ++isz) {
+                        for(int32_t Irz1 = 0; Irz1 < params.Pos->NRz_per_range; ++Irz1) {
+                            DOFWRITEREC(
+                                SHDFile,
+                                GetRecNum(params, isx, isy, itheta, isz, Irz1, ifreq),
+                                &outputs.uAllSources[GetFieldAddr(
+                                    isx, isy, isz, itheta, Irz1, 0, params.Pos, ifreq,
+                                    Nfreq)],
+                                bytes);
                         }
                     }
                 }
             }
         }
     }
+    SHDFile.flush();
 }
 
 #if BHC_ENABLE_2D
 template void WriteOutTL<false, false>(
-    const bhcParams<false> &params, const bhcOutputs<false, false> &outputs);
+    const bhcParams<false> &params, const bhcOutputs<false, false> &outputs,
+    const char *FileRoot);
 #endif
 #if BHC_ENABLE_NX2D
 template void WriteOutTL<true, false>(
-    const bhcParams<true> &params, const bhcOutputs<true, false> &outputs);
+    const bhcParams<true> &params, const bhcOutputs<true, false> &outputs,
+    const char *FileRoot);
 #endif
 #if BHC_ENABLE_3D
 template void WriteOutTL<true, true>(
-    const bhcParams<true> &params, const bhcOutputs<true, true> &outputs);
+    const bhcParams<true> &params, const bhcOutputs<true, true> &outputs,
+    const char *FileRoot);
+#endif
+
+/**
+ * See bhcInit::streamTLSources. Each source is run as if it was the only
+ * one, with a copy of Pos listing only that source, so the field for it is
+ * computed and postprocessed exactly as in a single-source run. Its records
+ * are then written to their places in the full shade file.
+ */
+template<bool O3D, bool R3D> void RunStreamedTL(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
+{
+    bhcInternal *internal = GetInternal(params);
+    Position *fullPos     = params.Pos;
+    // Allocated (managed) as the GPU reads it.
+    Position *srcPos = nullptr;
+    trackallocate(params, "single-source positions", srcPos);
+    *srcPos     = *fullPos;
+    srcPos->NSx = srcPos->NSy = srcPos->NSz = 1;
+
+    DirectOFile SHDFile(internal);
+    TLTileWriter TileFile(internal);
+    std::string PlotType = IsIrregularGrid(params.Beam) ? "irregular " : "rectilin  ";
+    if(internal->chunkedTLFile) {
+        TileFile.Begin(params, FL(0.0), PlotType, internal->FileRoot);
+    } else {
+        WriteHeader(params, SHDFile, FL(0.0), PlotType, internal->FileRoot);
+    }
+
+    int32_t Nfreq    = GetNumFieldFreqs(params);
+    size_t n         = GetFieldSize(srcPos, Nfreq);
+    // The tiles of a source are contiguous, see TLTilePrefix.
+    size_t srcTiles = (size_t)Nfreq * (size_t)fullPos->Ntheta;
+    int32_t srcJobs  = GetNumJobs<O3D>(srcPos, params.Angles);
+    int32_t srcsDone = 0;
+    // Each source's rays are a contiguous range of the jobs of the full
+    // run, in the same order as the sources here.
+    SetupRayStats<O3D, R3D>(params, outputs);
+    bhcRayStats *allStats = outputs.raystats;
+    try {
+        for(int32_t isz = 0; isz < fullPos->NSz; ++isz) {
+            for(int32_t isx = 0; isx < fullPos->NSx; ++isx) {
+                for(int32_t isy = 0; isy < fullPos->NSy; ++isy) {
+                    srcPos->Sx = &fullPos->Sx[isx];
+                    srcPos->Sy = &fullPos->Sy[isy];
+                    srcPos->Sz = &fullPos->Sz[isz];
+                    size_t src = ((size_t)isz * (size_t)fullPos->NSx + (size_t)isx)
+                            * (size_t)fullPos->NSy
+                        + (size_t)isy;
+                    zerooutput(params, outputs.uAllSources, n);
+                    params.Pos = srcPos;
+                    if(allStats != nullptr) {
+                        outputs.raystats = &allStats[src * (size_t)srcJobs];
+                    }
+                    RunFieldModesSelInfl<O3D, R3D>(params, outputs);
+                    PostProcessTL<O3D, R3D>(params, outputs);
+                    params.Pos                  = fullPos;
+                    outputs.raystats            = allStats;
+                    internal->completedRayCount = ++srcsDone * srcJobs;
+
+                    if(internal->chunkedTLFile) {
+                        TileFile.WriteTiles(
+                            src * srcTiles, srcTiles, outputs.uAllSources);
+                        continue;
+                    }
+                    // writerec copies the records, so the last of them
+                    // may still be being written while the next source runs.
+                    for(int32_t ifreq = 0; ifreq < Nfreq; ++ifreq) {
+                        for(int32_t itheta = 0; itheta < fullPos->Ntheta; ++itheta) {
+                            for(int32_t Irz1 = 0; Irz1 < fullPos->NRz_per_range; ++Irz1) {
+                                DOFWRITEREC(
+                                    SHDFile,
+                                    GetRecNum(params, isx, isy, itheta, isz, Irz1, ifreq),
+                                    &outputs.uAllSources[GetFieldAddr(
+                                        0, 0, 0, itheta, Irz1, 0, srcPos, ifreq, Nfreq)],
+                                    (size_t)fullPos->NRr * sizeof(cpxf));
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    } catch(...) {
+        params.Pos       = fullPos;
+        outputs.raystats = allStats;
+        trackdeallocate(params, srcPos);
+        throw;
+    }
+    if(internal->chunkedTLFile) {
+        TileFile.End();
+    } else {
+        SHDFile.flush();
+    }
+    trackdeallocate(params, srcPos);
+}
+
+#if BHC_ENABLE_2D
+template void RunStreamedTL<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs);
 #endif
+#if BHC_ENABLE_NX2D
+template void RunStreamedTL<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+#endif
+#if BHC_ENABLE_3D
+template void RunStreamedTL<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs);
+#endif
+
+/**
+ * Same as ReadOutTL, for a chunked TL file, see TLTilePrefix.
+ */
+template<bool O3D, bool R3D> void ReadOutTLChunked(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const char *FileRoot)
+{
+    Position *Pos         = params.Pos;
+    FreqInfo *freqinfo    = params.freqinfo;
+    bhcInternal *internal = GetInternal(params);
+
+    std::ifstream in;
+    TLTilePrefix prefix;
+    OpenTLTileFile(internal, std::string(FileRoot) + ".shdc", in, prefix);
+    std::string TempTitle(80, ' '), PlotType(10, ' ');
+    in.read(&TempTitle[0], 80);
+    in.read(&PlotType[0], 10);
+    bhc::module::Title<O3D> title;
+    title.SetTitle(params, TempTitle);
+    if(IsIrregularGrid(params.Beam) != (PlotType[0] == 'i')) {
+        EXTERR("PlotType (irregular grid) setting in chunked TL file being loaded does "
+               "not match env file");
+    }
+    freqinfo->Nfreq = prefix.Nfreq;
+    Pos->Ntheta     = prefix.Ntheta;
+    Pos->NSx        = prefix.NSx;
+    Pos->NSy        = prefix.NSy;
+    Pos->NSz        = prefix.NSz;
+    Pos->NRz        = prefix.NRz;
+    Pos->NRr        = prefix.NRr;
+    freqinfo->freq0 = prefix.freq0;
+    if(freqinfo->Nfreq != 1 && !IsBroadbandRun(params.Bdry)) {
+        EXTERR("Nfreq in chunked TL file being loaded is not 1, but the env file is not "
+               "broadband (TopOpt[5] == 'B')");
+    }
+    if constexpr(!O3D) {
+        if(Pos->Ntheta != 1 || Pos->NSx != 1 || Pos->NSy != 1) {
+            EXTERR("Ntheta, NSx, or NSy in chunked TL file being loaded are not 1, must "
+                   "be for 2D");
+        }
+    }
+
+    trackallocate(params, "Frequencies", freqinfo->freqVec, freqinfo->Nfreq);
+    trackallocate(params, "receiver bearings", Pos->theta, Pos->Ntheta);
+    trackallocate(params, "source x-coordinates", Pos->Sx, Pos->NSx);
+    trackallocate(params, "source y-coordinates", Pos->Sy, Pos->NSy);
+    trackallocate(params, "source z-coordinates", Pos->Sz, Pos->NSz);
+    trackallocate(params, "receiver z-coordinates", Pos->Rz, Pos->NRz);
+    trackallocate(params, "receiver r-coordinates", Pos->Rr, Pos->NRr);
+    for(int32_t i = 0; i < freqinfo->Nfreq; ++i) {
+        double f;
+        in.read((char *)&f, sizeof(double));
+        freqinfo->freqVec[i] = (real)f;
+    }
+    in.read((char *)Pos->theta, Pos->Ntheta * sizeof(float));
+    in.read((char *)Pos->Sx, Pos->NSx * sizeof(float));
+    in.read((char *)Pos->Sy, Pos->NSy * sizeof(float));
+    in.read((char *)Pos->Sz, Pos->NSz * sizeof(float));
+    in.read((char *)Pos->Rz, Pos->NRz * sizeof(float));
+    in.read((char *)Pos->Rr, Pos->NRr * sizeof(float));
+    if(!in.good()) EXTERR("Chunked TL file %s is truncated", FileRoot);
+
+    module::SzRz<O3D> szrz;
+    szrz.Preprocess(params); // sets NRz_per_range
+    if(Pos->NRz_per_range != prefix.NRz_per_range
+       || GetNumFieldFreqs(params) != prefix.NfreqField) {
+        EXTERR("Receiver grid or frequencies of chunked TL file being loaded do not "
+               "match env file");
+    }
+    TL<O3D, R3D> tl;
+    tl.Preprocess(params, outputs);
+
+    std::vector<uint8_t> buf;
+    size_t nTiles = prefix.NumTiles(), tileSize = prefix.TileSize();
+    for(size_t t = 0; t < nTiles; ++t) {
+        ReadTLTile(internal, in, prefix, t, &outputs.uAllSources[t * tileSize], buf);
+    }
+}
 
 template<bool O3D, bool R3D> void ReadOutTL(
     bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const char *FileRoot)
 {
+    if(GetInternal(params)->chunkedTLFile) {
+        ReadOutTLChunked<O3D, R3D>(params, outputs, FileRoot);
+        return;
+    }
     Position *Pos      = params.Pos;
     FreqInfo *freqinfo = params.freqinfo;
 
@@ -296,7 +564,10 @@ template<bool O3D, bool R3D> void ReadOutTL(
     float atten;
     DIFREADV(SHDFile, atten);
 
-    if(freqinfo->Nfreq != 1) { EXTERR("Nfreq in SHDFile being loaded is not 1"); }
+    if(freqinfo->Nfreq != 1 && !IsBroadbandRun(params.Bdry)) {
+        EXTERR("Nfreq in SHDFile being loaded is not 1, but the env file is not "
+               "broadband (TopOpt[5] == 'B')");
+    }
     if constexpr(!O3D) {
         if(Pos->Ntheta != 1 || Pos->NSx != 1 || Pos->NSy != 1) {
             EXTERR(
@@ -342,18 +613,23 @@ template<bool O3D, bool R3D> void ReadOutTL(
     TL<O3D, R3D> tl;
     tl.Preprocess(params, outputs);
 
-    for(int32_t isx = 0; isx < Pos->NSx; ++isx) {
-        for(int32_t isy = 0; isy < Pos->NSy; ++isy) {
-            for(int32_t itheta = 0; itheta < Pos->Ntheta; ++itheta) {
-                for(int32_t isz = 0; isz < Pos->NSz; ++isz) {
-                    for(int32_t Irz1 = 0; Irz1 < Pos->NRz_per_range; ++Irz1) {
-                        DIFREC(SHDFile, GetRecNum(params, isx, isy, itheta, isz, Irz1));
-                        for(int32_t r = 0; r < Pos->NRr; ++r) {
-                            cpxf v;
-                            DIFREADV(SHDFile, v);
-                            outputs.uAllSources
-                                [GetFieldAddr(isx, isy, isz, itheta, Irz1, r, params.Pos)]
-                                = v;
+    int32_t Nfreq = GetNumFieldFreqs(params);
+    for(int32_t ifreq = 0; ifreq < Nfreq; ++ifreq) {
+        for(int32_t isx = 0; isx < Pos->NSx; ++isx) {
+            for(int32_t isy = 0; isy < Pos->NSy; ++isy) {
+                for(int32_t itheta = 0; itheta < Pos->Ntheta; ++itheta) {
+                    for(int32_t isz = 0; isz < Pos->NSz; ++isz) {
+                        for(int32_t Irz1 = 0; Irz1 < Pos->NRz_per_range; ++Irz1) {
+                            DIFREC(
+                                SHDFile,
+                                GetRecNum(params, isx, isy, itheta, isz, Irz1, ifreq));
+                            // The radii of a record are contiguous in the field.
+                            DIFREAD(
+                                SHDFile,
+                                &outputs.uAllSources[GetFieldAddr(
+                                    isx, isy, isz, itheta, Irz1, 0, params.Pos, ifreq,
+                                    Nfreq)],
+                                Pos->NRr * sizeof(cpxf));
                         }
                     }
                 }
@@ -375,4 +651,38 @@ template void ReadOutTL<true, true>(
     bhcParams<true> &params, bhcOutputs<true, true> &outputs, const char *FileRoot);
 #endif
 
+template<bool O3D> void ReadOutTLTile(
+    const bhcParams<O3D> &params, const char *FileRoot, int32_t isx, int32_t isy,
+    int32_t isz, int32_t ifreq, int32_t itheta, cpxf *field)
+{
+    std::ifstream in;
+    TLTilePrefix prefix;
+    OpenTLTileFile(GetInternal(params), std::string(FileRoot) + ".shdc", in, prefix);
+    if(isx < 0 || isx >= prefix.NSx || isy < 0 || isy >= prefix.NSy || isz < 0
+       || isz >= prefix.NSz || ifreq < 0 || ifreq >= prefix.NfreqField || itheta < 0
+       || itheta >= prefix.Ntheta) {
+        EXTERR("Tile indices out of range for chunked TL file %s", FileRoot);
+    }
+    // Tile number, see TLTilePrefix and GetFieldAddr.
+    size_t t = ((((size_t)isz * (size_t)prefix.NSx + (size_t)isx) * (size_t)prefix.NSy
+                 + (size_t)isy)
+                    * (size_t)prefix.NfreqField
+                + (size_t)ifreq)
+            * (size_t)prefix.Ntheta
+        + (size_t)itheta;
+    std::vector<uint8_t> buf;
+    ReadTLTile(GetInternal(params), in, prefix, t, field, buf);
+}
+
+#if BHC_ENABLE_2D
+template void ReadOutTLTile<false>(
+    const bhcParams<false> &params, const char *FileRoot, int32_t isx, int32_t isy,
+    int32_t isz, int32_t ifreq, int32_t itheta, cpxf *field);
+#endif
+#if BHC_ENABLE_NX2D || BHC_ENABLE_3D
+template void ReadOutTLTile<true>(
+    const bhcParams<true> &params, const char *FileRoot, int32_t isx, int32_t isy,
+    int32_t isz, int32_t ifreq, int32_t itheta, cpxf *field);
+#endif
+
 }} // namespace bhc::mode
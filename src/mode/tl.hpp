@@ -22,6 +22,17 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 
 namespace bhc { namespace mode {
 
+/**
+ * Whether this TL run is computed one source at a time, see
+ * bhcInit::streamTLSources.
+ */
+template<bool O3D> inline bool IsStreamedTLRun(const bhcParams<O3D> &params)
+{
+    const Position *Pos = params.Pos;
+    return GetInternal(params)->streamTLSources && IsTLRun(params.Beam)
+        && Pos->NSx * Pos->NSy * Pos->NSz > 1;
+}
+
 template<bool O3D, bool R3D> void PostProcessTL(
     const bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs);
 extern template void PostProcessTL<false, false>(
@@ -32,13 +43,26 @@ extern template void PostProcessTL<true, true>(
     const bhcParams<true> &params, bhcOutputs<true, true> &outputs);
 
 template<bool O3D, bool R3D> void WriteOutTL(
-    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs);
+    const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+    const char *FileRoot);
 extern template void WriteOutTL<false, false>(
-    const bhcParams<false> &params, const bhcOutputs<false, false> &outputs);
+    const bhcParams<false> &params, const bhcOutputs<false, false> &outputs,
+    const char *FileRoot);
 extern template void WriteOutTL<true, false>(
-    const bhcParams<true> &params, const bhcOutputs<true, false> &outputs);
+    const bhcParams<true> &params, const bhcOutputs<true, false> &outputs,
+    const char *FileRoot);
 extern template void WriteOutTL<true, true>(
-    const bhcParams<true> &params, const bhcOutputs<true, true> &outputs);
+    const bhcParams<true> &params, const bhcOutputs<true, true> &outputs,
+    const char *FileRoot);
+
+template<bool O3D, bool R3D> void RunStreamedTL(
+    bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs);
+extern template void RunStreamedTL<false, false>(
+    bhcParams<false> &params, bhcOutputs<false, false> &outputs);
+extern template void RunStreamedTL<true, false>(
+    bhcParams<true> &params, bhcOutputs<true, false> &outputs);
+extern template void RunStreamedTL<true, true>(
+    bhcParams<true> &params, bhcOutputs<true, true> &outputs);
 
 template<bool O3D, bool R3D> void ReadOutTL(
     bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs, const char *FileRoot);
@@ -49,6 +73,30 @@ extern template void ReadOutTL<true, false>(
 extern template void ReadOutTL<true, true>(
     bhcParams<true> &params, bhcOutputs<true, true> &outputs, const char *FileRoot);
 
+template<bool O3D> void ReadOutTLTile(
+    const bhcParams<O3D> &params, const char *FileRoot, int32_t isx, int32_t isy,
+    int32_t isz, int32_t ifreq, int32_t itheta, cpxf *field);
+extern template void ReadOutTLTile<false>(
+    const bhcParams<false> &params, const char *FileRoot, int32_t isx, int32_t isy,
+    int32_t isz, int32_t ifreq, int32_t itheta, cpxf *field);
+extern template void ReadOutTLTile<true>(
+    const bhcParams<true> &params, const char *FileRoot, int32_t isx, int32_t isy,
+    int32_t isz, int32_t ifreq, int32_t itheta, cpxf *field);
+
+/// Frees the field, or forgets it if it is the caller's memory, see
+/// bhc::set_output_buffers.
+template<bool O3D, bool R3D> inline void ReleaseField(
+    const bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs)
+{
+    bhcInternal *internal = GetInternal(params);
+    if(internal->fieldIsUser) {
+        outputs.uAllSources   = nullptr;
+        internal->fieldIsUser = false;
+    } else {
+        trackdeallocate(params, outputs.uAllSources);
+    }
+}
+
 template<bool O3D, bool R3D> class TL : public Field<O3D, R3D> {
 public:
     TL() {}
@@ -64,25 +112,64 @@ public:
     {
         Field<O3D, R3D>::Preprocess(params, outputs);
 
-        trackdeallocate(params, outputs.uAllSources); // Free if previously run
+        ReleaseField(params, outputs); // Free if previously run
+        if(params.Beam->allTLTypes && IsStreamedTLRun(params)) {
+            EXTERR("allTLTypes cannot be used with streamTLSources");
+        }
         // for a TL calculation, allocate space for the pressure matrix
-        const Position *Pos = params.Pos;
-        size_t n            = (size_t)Pos->NSz * (size_t)Pos->NSx * (size_t)Pos->NSy
-            * (size_t)Pos->Ntheta * (size_t)Pos->NRz_per_range * (size_t)Pos->NRr;
-        trackallocate(params, "sound field / transmission loss", outputs.uAllSources, n);
-        memset(outputs.uAllSources, 0, n * sizeof(cpxf));
+        size_t n = GetFieldSize(params);
+        if(IsStreamedTLRun(params)) {
+            n /= (size_t)params.Pos->NSx * (size_t)params.Pos->NSy
+                * (size_t)params.Pos->NSz;
+        }
+        bhcInternal *internal = GetInternal(params);
+        if(internal->userField != nullptr) {
+            if(internal->userFieldCount < n) {
+                EXTERR(
+                    "Output buffer for the field holds %" PRIu64 " values, but the "
+                    "field needs %" PRIu64,
+                    (uint64_t)internal->userFieldCount, (uint64_t)n);
+            }
+            outputs.uAllSources   = internal->userField;
+            internal->fieldIsUser = true;
+        } else {
+            trackallocate(
+                params, "sound field / transmission loss", outputs.uAllSources, n);
+        }
+        zerooutput(params, outputs.uAllSources, n);
+    }
+
+    virtual void Run(bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs) const override
+    {
+        if(IsStreamedTLRun(params)) {
+            RunStreamedTL<O3D, R3D>(params, outputs);
+        } else {
+            Field<O3D, R3D>::Run(params, outputs);
+        }
     }
 
     virtual void Postprocess(
         bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs) const override
     {
+        // Streamed runs postprocess each source as part of the run
+        if(IsStreamedTLRun(params)) return;
         PostProcessTL<O3D, R3D>(params, outputs);
     }
 
     virtual void Writeout(
-        const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs) const override
+        const bhcParams<O3D> &params, const bhcOutputs<O3D, R3D> &outputs,
+        const char *FileRoot) const override
     {
-        WriteOutTL<O3D, R3D>(params, outputs);
+        // Streamed runs have already written the shade file
+        if(IsStreamedTLRun(params)) return;
+        WriteOutTL<O3D, R3D>(params, outputs, FileRoot);
+        // The other TL types, see bhcInit::allTLTypes
+        for(int32_t p = 1; p < GetNumTLPlanes(params); ++p) {
+            bhcOutputs<O3D, R3D> plane = outputs;
+            plane.uAllSources += (size_t)p * GetTLPlaneSize(params);
+            std::string root = std::string(FileRoot) + "_" + TLPlaneType(params.Beam, p);
+            WriteOutTL<O3D, R3D>(params, plane, root.c_str());
+        }
     }
 
     virtual void Readout(
@@ -95,7 +182,7 @@ public:
     virtual void Finalize(
         bhcParams<O3D> &params, bhcOutputs<O3D, R3D> &outputs) const override
     {
-        trackdeallocate(params, outputs.uAllSources);
+        ReleaseField(params, outputs);
     }
 };
 
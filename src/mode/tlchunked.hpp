@@ -0,0 +1,279 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "../common_setup.hpp"
+
+#include <atomic>
+
+namespace bhc { namespace mode {
+
+/**
+ * Chunked TL file (FileRoot.shdc), see bhcInit::chunkedTLFile. Native
+ * byte order. Starts with TLTilePrefix, followed by the title (80 chars), the
+ * PlotType (10 chars), freqVec (double), theta, Sx, Sy, Sz, Rz, and Rr (float),
+ * then the index at indexOffset: for each tile, the offset of its data in the
+ * file and its size in bytes (uint64). The tile data follows, in any order.
+ *
+ * A tile is the field of one source, frequency, and bearing, i.e. all the
+ * receiver depths and ranges (NRz_per_range * NRr cpxf, depth major). Tiles
+ * are numbered in the order of the field (see GetFieldAddr), so tile t holds
+ * the elements [t * tileSize, (t + 1) * tileSize) of uAllSources.
+ */
+struct TLTilePrefix {
+    char magic[8]; // "BHCSHDC1"
+    int32_t flags; // TLTileCompressed
+    int32_t Nfreq, NfreqField, Ntheta, NSx, NSy, NSz, NRz, NRr, NRz_per_range;
+    float freq0, atten;
+    uint64_t indexOffset;
+
+    size_t NumTiles() const
+    {
+        return (size_t)NSz * (size_t)NSx * (size_t)NSy * (size_t)NfreqField
+            * (size_t)Ntheta;
+    }
+    size_t TileSize() const { return (size_t)NRz_per_range * (size_t)NRr; }
+};
+constexpr int32_t TLTileCompressed = 1;
+
+/**
+ * Lossless compression of a tile. Each 32-bit word (real or imaginary
+ * part) is XORed with the same part of the previous value, which leaves the
+ * high-order bytes zero where the field is smooth. Only the low-order nonzero
+ * bytes are kept: a 2-bit code per word (0, 1, 2, or 4 bytes, packed four to a
+ * byte) followed by the kept bytes. Returns the compressed size, or 0 if it is
+ * not smaller than the tile, in which case the tile is stored as is.
+ */
+inline size_t CompressTLTile(const cpxf *data, size_t n, std::vector<uint8_t> &out)
+{
+    const uint32_t *w = (const uint32_t *)data;
+    size_t nw         = 2 * n;
+    size_t nCodes     = (nw + 3) / 4;
+    size_t raw        = n * sizeof(cpxf);
+    out.assign(nCodes, 0);
+    for(size_t i = 0; i < nw; ++i) {
+        uint32_t x = w[i] ^ (i >= 2 ? w[i - 2] : 0u);
+        uint32_t code, bytes;
+        if(x == 0) {
+            code = bytes = 0;
+        } else if(x <= 0xFFu) {
+            code = bytes = 1;
+        } else if(x <= 0xFFFFu) {
+            code = bytes = 2;
+        } else {
+            code  = 3;
+            bytes = 4;
+        }
+        out[i / 4] |= (uint8_t)(code << (2 * (i % 4)));
+        for(uint32_t b = 0; b < bytes; ++b) out.push_back((uint8_t)(x >> (8 * b)));
+        if(out.size() >= raw) return 0;
+    }
+    return out.size();
+}
+
+/// Inverse of CompressTLTile. Returns false if the data is malformed.
+inline bool DecompressTLTile(const uint8_t *in, size_t size, cpxf *data, size_t n)
+{
+    uint32_t *w   = (uint32_t *)data;
+    size_t nw     = 2 * n;
+    size_t nCodes = (nw + 3) / 4;
+    if(size < nCodes) return false;
+    size_t p = nCodes;
+    for(size_t i = 0; i < nw; ++i) {
+        uint32_t code  = (in[i / 4] >> (2 * (i % 4))) & 3u;
+        uint32_t bytes = code == 3 ? 4 : code;
+        if(p + bytes > size) return false;
+        uint32_t x = 0;
+        for(uint32_t b = 0; b < bytes; ++b) x |= (uint32_t)in[p++] << (8 * b);
+        w[i] = x ^ (i >= 2 ? w[i - 2] : 0u);
+    }
+    return p == size;
+}
+
+/**
+ * Writer of a chunked TL file. The header and a zeroed index are written
+ * by Begin, the tiles (possibly in several groups, e.g. one per source) by
+ * WriteTiles, and the index by End.
+ */
+class TLTileWriter {
+public:
+    TLTileWriter(bhcInternal *internal) : _internal(internal) {}
+
+    template<bool O3D> void Begin(
+        const bhcParams<O3D> &params, float atten, const std::string &PlotType,
+        const std::string &FileRoot)
+    {
+        const Position *Pos      = params.Pos;
+        const FreqInfo *freqinfo = params.freqinfo;
+        path                     = FileRoot + ".shdc";
+        memcpy(prefix.magic, "BHCSHDC1", 8);
+        prefix.flags         = _internal->compressTLFile ? TLTileCompressed : 0;
+        prefix.Nfreq         = freqinfo->Nfreq;
+        prefix.NfreqField    = GetNumFieldFreqs(params);
+        prefix.Ntheta        = Pos->Ntheta;
+        prefix.NSx           = Pos->NSx;
+        prefix.NSy           = Pos->NSy;
+        prefix.NSz           = Pos->NSz;
+        prefix.NRz           = Pos->NRz;
+        prefix.NRr           = Pos->NRr;
+        prefix.NRz_per_range = Pos->NRz_per_range;
+        prefix.freq0         = (float)freqinfo->freq0;
+        prefix.atten         = atten;
+        prefix.indexOffset   = sizeof(TLTilePrefix) + 90
+            + (uint64_t)prefix.Nfreq * sizeof(double)
+            + ((uint64_t)Pos->Ntheta + (uint64_t)Pos->NSx + (uint64_t)Pos->NSy
+               + (uint64_t)Pos->NSz + (uint64_t)Pos->NRz + (uint64_t)Pos->NRr)
+                * sizeof(float);
+        index.assign(2 * prefix.NumTiles(), 0);
+        end = prefix.indexOffset + index.size() * sizeof(uint64_t);
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if(!out.good()) {
+            ExternalError(_internal, "Could not open chunked TL file: %s", path.c_str());
+        }
+        std::string title(params.Title);
+        title.resize(80, ' ');
+        std::string plot(PlotType);
+        plot.resize(10, ' ');
+        out.write((const char *)&prefix, sizeof(TLTilePrefix));
+        out.write(title.data(), 80);
+        out.write(plot.data(), 10);
+        for(int32_t i = 0; i < freqinfo->Nfreq; ++i) {
+            double f = (double)freqinfo->freqVec[i];
+            out.write((const char *)&f, sizeof(double));
+        }
+        out.write((const char *)Pos->theta, Pos->Ntheta * sizeof(float));
+        out.write((const char *)Pos->Sx, Pos->NSx * sizeof(float));
+        out.write((const char *)Pos->Sy, Pos->NSy * sizeof(float));
+        out.write((const char *)Pos->Sz, Pos->NSz * sizeof(float));
+        out.write((const char *)Pos->Rz, Pos->NRz * sizeof(float));
+        out.write((const char *)Pos->Rr, Pos->NRr * sizeof(float));
+        out.write((const char *)index.data(), index.size() * sizeof(uint64_t));
+        if(!out.good()) {
+            ExternalError(_internal, "Failed to write chunked TL file: %s", path.c_str());
+        }
+    }
+
+    /**
+     * Writes nTiles tiles starting at tile firstTile, whose data is field
+     * (which need not be the whole field). Each worker thread compresses whole
+     * tiles and writes them at the end of the file, through its own stream.
+     */
+    void WriteTiles(size_t firstTile, size_t nTiles, const cpxf *field)
+    {
+        size_t tileSize = prefix.TileSize();
+        std::atomic<size_t> nextTile(0);
+        std::atomic<bool> failed(false);
+        _internal->threadPool.Run([&](int32_t) {
+            std::fstream out(path, std::ios::binary | std::ios::in | std::ios::out);
+            if(!out.good()) {
+                failed = true;
+                return;
+            }
+            std::vector<uint8_t> buf;
+            while(true) {
+                size_t t = nextTile++;
+                if(t >= nTiles) break;
+                const cpxf *tile = &field[t * tileSize];
+                const char *data = (const char *)tile;
+                size_t size      = tileSize * sizeof(cpxf);
+                if(prefix.flags & TLTileCompressed) {
+                    size_t c = CompressTLTile(tile, tileSize, buf);
+                    if(c > 0) {
+                        data = (const char *)buf.data();
+                        size = c;
+                    }
+                }
+                uint64_t offset = end.fetch_add(size);
+                out.seekp(offset);
+                out.write(data, size);
+                index[2 * (firstTile + t) + 0] = offset;
+                index[2 * (firstTile + t) + 1] = size;
+            }
+            if(!out.good()) failed = true;
+        });
+        if(failed) {
+            ExternalError(_internal, "Failed to write chunked TL file: %s", path.c_str());
+        }
+    }
+
+    void End()
+    {
+        std::fstream out(path, std::ios::binary | std::ios::in | std::ios::out);
+        out.seekp(prefix.indexOffset);
+        out.write((const char *)index.data(), index.size() * sizeof(uint64_t));
+        if(!out.good()) {
+            ExternalError(_internal, "Failed to write chunked TL file: %s", path.c_str());
+        }
+    }
+
+private:
+    bhcInternal *_internal;
+    std::string path;
+    TLTilePrefix prefix;
+    std::vector<uint64_t> index;
+    std::atomic<uint64_t> end;
+};
+
+/**
+ * Opens a chunked TL file and reads its prefix, checking that it is one.
+ */
+inline void OpenTLTileFile(
+    bhcInternal *internal, const std::string &path, std::ifstream &in,
+    TLTilePrefix &prefix)
+{
+    in.open(path, std::ios::binary);
+    if(!in.good()) {
+        ExternalError(internal, "Could not open chunked TL file: %s", path.c_str());
+    }
+    in.read((char *)&prefix, sizeof(TLTilePrefix));
+    if(!in.good() || memcmp(prefix.magic, "BHCSHDC1", 8) != 0) {
+        ExternalError(internal, "%s is not a chunked TL file", path.c_str());
+    }
+}
+
+/// Reads and decompresses tile t of a chunked TL file into tile.
+inline void ReadTLTile(
+    bhcInternal *internal, std::ifstream &in, const TLTilePrefix &prefix, size_t t,
+    cpxf *tile, std::vector<uint8_t> &buf)
+{
+    uint64_t entry[2];
+    in.seekg(prefix.indexOffset + 2 * t * sizeof(uint64_t));
+    in.read((char *)entry, sizeof(entry));
+    size_t tileSize = prefix.TileSize();
+    size_t raw      = tileSize * sizeof(cpxf);
+    bool ok         = in.good() && entry[1] > 0 && entry[1] <= raw;
+    if(ok) {
+        in.seekg(entry[0]);
+        if(entry[1] == raw) {
+            in.read((char *)tile, raw);
+            ok = in.good();
+        } else {
+            buf.resize(entry[1]);
+            in.read((char *)buf.data(), entry[1]);
+            ok = in.good() && DecompressTLTile(buf.data(), entry[1], tile, tileSize);
+        }
+    }
+    if(!ok) {
+        ExternalError(
+            internal, "Chunked TL file: tile %" PRIuMAX " is missing or corrupt",
+            (uintmax_t)t);
+    }
+}
+
+}} // namespace bhc::mode
@@ -0,0 +1,212 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "arr.hpp"
+#include "../common_run.hpp"
+
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+namespace bhc { namespace mode {
+
+using cpxd = FFTPlan::cpxd;
+
+/**
+ * Each receiver's time series is synthesized in the frequency domain: the
+ * transfer function H(f) = sum a exp(i Phase) exp(-2 pi i f delay), which is
+ * what the TL field would be at f, is multiplied by the source spectrum and
+ * transformed back. Only the bins in the band are summed, with the phasor of
+ * each arrival advanced from bin to bin by one complex multiply.
+ *
+ * The FFT is circular, so it has room for the pulses which overlap the time
+ * series but start before it (up to tail samples earlier) or end after it (up
+ * to lead samples later): lead and tail are the samples of the source pulse
+ * before and after the arrival time. Arrivals whose pulses do not overlap the
+ * time series are skipped, so they cannot wrap around onto it.
+ */
+struct WaveformSetup {
+    double df;
+    int32_t lead, tail;
+    int32_t kMin, kMax; // Bins of the band, inclusive
+    std::vector<cpxd> S; // Source spectrum for kMin..kMax
+};
+
+template<bool O3D> void SetupWaveform(
+    const bhcParams<O3D> &params, const bhcWaveformParams &wp,
+    WaveformSetup &ws, std::unique_ptr<FFTPlan> &plan)
+{
+    double fs   = wp.sampleRate;
+    double fMax = wp.fMax > 0.0 ? wp.fMax : 0.5 * fs;
+    if(!(fs > 0.0) || wp.nSamples <= 0) {
+        EXTERR("synthesize_waveforms: sampleRate and nSamples must be positive");
+    }
+    if(wp.waveform != nullptr && wp.waveformLength <= 0) {
+        EXTERR("synthesize_waveforms: waveformLength must be positive");
+    }
+    if(wp.fMin < 0.0 || wp.fMin >= fMax || fMax > 0.5 * fs) {
+        EXTERR(
+            "synthesize_waveforms: band %g to %g Hz is not within 0 to sampleRate / 2",
+            wp.fMin, fMax);
+    }
+    if(wp.waveform != nullptr) {
+        ws.lead = 0;
+        ws.tail = wp.waveformLength;
+    } else {
+        // The pulse of a Hann window of width B has its main lobe within
+        // +/- 2 / B; beyond 4 / B, its sidelobes are below 1e-3 of the peak.
+        double h = std::ceil(4.0 * fs / (fMax - wp.fMin));
+        ws.lead = ws.tail = (int32_t)bhc::min(h, (double)wp.nSamples);
+    }
+    size_t nFFT = FFTPlan::NextSize((size_t)wp.nSamples + ws.lead + ws.tail);
+    plan.reset(new FFTPlan(nFFT));
+    ws.df   = fs / (double)nFFT;
+    ws.kMin = (int32_t)std::ceil(wp.fMin / ws.df);
+    ws.kMax = (int32_t)bhc::min((double)(nFFT / 2), std::floor(fMax / ws.df));
+    if(ws.kMax < ws.kMin) {
+        EXTERR("synthesize_waveforms: band %g to %g Hz is narrower than the frequency "
+               "resolution %g Hz; use more samples",
+               wp.fMin, fMax, ws.df);
+    }
+    ws.S.resize(ws.kMax - ws.kMin + 1);
+    if(wp.waveform != nullptr) {
+        std::vector<cpxd> buf(nFFT, cpxd(0.0, 0.0));
+        for(int32_t i = 0; i < wp.waveformLength; ++i) buf[i] = wp.waveform[i];
+        plan->Forward(buf.data());
+        for(int32_t k = ws.kMin; k <= ws.kMax; ++k) ws.S[k - ws.kMin] = buf[k];
+    } else {
+        double peak = 0.0;
+        for(int32_t k = ws.kMin; k <= ws.kMax; ++k) {
+            double w = std::sin(M_PI * ((double)k * ws.df - wp.fMin) / (fMax - wp.fMin));
+            w *= w;
+            ws.S[k - ws.kMin] = w;
+            // Value of the pulse at its arrival time, see SynthesizeReceiver
+            peak += (k == 0 || k == (int32_t)nFFT / 2) ? w : 2.0 * w;
+        }
+        if(peak <= 0.0) {
+            EXTERR("synthesize_waveforms: band %g to %g Hz has no frequency bins "
+                   "inside it; use more samples",
+                   wp.fMin, fMax);
+        }
+        for(cpxd &s : ws.S) s *= (double)nFFT / peak;
+    }
+}
+
+/// One receiver's time series, into out[0..nSamples-1]. H and buf are scratch.
+inline void SynthesizeReceiver(
+    const ArrInfo *arrinfo, size_t base, const bhcWaveformParams &wp,
+    const WaveformSetup &ws, const FFTPlan &plan, std::vector<cpxd> &H,
+    std::vector<cpxd> &buf, float *out)
+{
+    int32_t narr = NumStoredArrivals(arrinfo, base);
+    double t0    = wp.t0;
+    if(narr == 0) {
+        if(wp.startTimes != nullptr) wp.startTimes[base] = std::isnan(t0) ? 0.0 : t0;
+        for(int32_t i = 0; i < wp.nSamples; ++i) out[i] = 0.0f;
+        return;
+    }
+    if(std::isnan(t0)) {
+        t0 = INFINITY;
+        for(int32_t iArr = 0; iArr < narr; ++iArr) {
+            Arrival arr = LoadArrival(arrinfo, ArrivalIndex(arrinfo, base, iArr));
+            t0          = bhc::min(t0, (double)arr.delay.real());
+        }
+        t0 -= (double)ws.lead / wp.sampleRate;
+    }
+    if(wp.startTimes != nullptr) wp.startTimes[base] = t0;
+    std::fill(H.begin(), H.end(), cpxd(0.0, 0.0));
+    int32_t nk = ws.kMax - ws.kMin + 1;
+    for(int32_t iArr = 0; iArr < narr; ++iArr) {
+        Arrival arr = LoadArrival(arrinfo, ArrivalIndex(arrinfo, base, iArr));
+        double t    = (double)arr.delay.real() - t0;
+        double s    = t * wp.sampleRate;
+        if(s <= (double)-ws.tail || s >= (double)(wp.nSamples + ws.lead)) continue;
+        // Same sign conventions as the field, see Influence: the
+        // contribution is a exp(-i (omega delay - Phase)), with the
+        // imaginary part of the delay giving the attenuation.
+        cpxd tau(t, (double)arr.delay.imag());
+        cpxd step  = std::exp(cpxd(0.0, -2.0 * M_PI * ws.df) * tau);
+        cpxd phase = (double)arr.a * std::exp(cpxd(0.0, (double)arr.Phase))
+            * std::exp(cpxd(0.0, -2.0 * M_PI * ws.df * (double)ws.kMin) * tau);
+        for(int32_t k = 0; k < nk; ++k) {
+            H[k] += phase;
+            phase *= step;
+        }
+    }
+    // The time series is real, so the negative frequencies are the
+    // conjugates of the positive ones: take twice the real part of the
+    // one-sided spectrum, with DC and Nyquist (which have no mirror) once.
+    int32_t nFFT = (int32_t)plan.Size();
+    std::fill(buf.begin(), buf.end(), cpxd(0.0, 0.0));
+    for(int32_t k = ws.kMin; k <= ws.kMax; ++k) {
+        cpxd x = ws.S[k - ws.kMin] * H[k - ws.kMin];
+        buf[k] = (k == 0 || k == nFFT / 2) ? cpxd(x.real(), 0.0) : 2.0 * x;
+    }
+    plan.Inverse(buf.data());
+    double scale = 1.0 / (double)nFFT;
+    for(int32_t i = 0; i < wp.nSamples; ++i) out[i] = (float)(buf[i].real() * scale);
+}
+
+template<bool O3D> void SynthesizeWaveforms(
+    const bhcParams<O3D> &params, const ArrInfo *arrinfo, const bhcWaveformParams &wp,
+    float *out, size_t outCount)
+{
+    if(!IsArrivalsRun(params.Beam) || arrinfo == nullptr || arrinfo->NArr == nullptr) {
+        EXTERR("synthesize_waveforms: there are no arrivals, run an arrivals run first");
+    }
+    size_t nRcvr = GetFieldSize(params);
+    if(out == nullptr || outCount < nRcvr * (size_t)bhc::max(wp.nSamples, 0)) {
+        EXTERR(
+            "synthesize_waveforms: output has %zu samples, need %zu receivers x %d",
+            outCount, nRcvr, wp.nSamples);
+    }
+    WaveformSetup ws;
+    std::unique_ptr<FFTPlan> plan;
+    SetupWaveform(params, wp, ws, plan);
+
+    // Receivers are claimed a few at a time, as the number of arrivals,
+    // and so the cost, varies a lot between them.
+    constexpr size_t chunk = 16;
+    std::atomic<size_t> next(0);
+    GetInternal(params)->threadPool.Run([&](int32_t) {
+        std::vector<cpxd> H(ws.kMax - ws.kMin + 1), buf(plan->Size());
+        while(true) {
+            size_t begin = next.fetch_add(chunk);
+            if(begin >= nRcvr) break;
+            size_t end = bhc::min(begin + chunk, nRcvr);
+            for(size_t base = begin; base < end; ++base) {
+                SynthesizeReceiver(
+                    arrinfo, base, wp, ws, *plan, H, buf,
+                    &out[base * (size_t)wp.nSamples]);
+            }
+        }
+    });
+}
+
+#if BHC_ENABLE_2D
+template void SynthesizeWaveforms<false>(
+    const bhcParams<false> &params, const ArrInfo *arrinfo,
+    const bhcWaveformParams &wp, float *out, size_t outCount);
+#endif
+#if BHC_ENABLE_NX2D || BHC_ENABLE_3D
+template void SynthesizeWaveforms<true>(
+    const bhcParams<true> &params, const ArrInfo *arrinfo, const bhcWaveformParams &wp,
+    float *out, size_t outCount);
+#endif
+
+}} // namespace bhc::mode
@@ -48,6 +48,11 @@ public:
         Beam->Nimage        = 1;
         Beam->iBeamWindow   = 4;
         Beam->Component     = 'P';
+
+        Beam->stepTol    = Beam->stepMin = Beam->stepMax = RL(0.0);
+        Beam->ampCutoff  = RL(0.0);
+        Beam->maxBotBnc  = -1;
+        Beam->allTLTypes = false;
     }
     virtual void Default(bhcParams<O3D> &params) const override
     {
@@ -130,6 +135,24 @@ public:
         if constexpr(O3D) boxerr = boxerr || Beam->Box.z <= RL(0.0);
         if(boxerr) { EXTERR("ReadEnvironment: Beam box not set up correctly"); }
 
+        const bhcInternal *internal = GetInternal(params);
+        if(internal->stepTolerance < RL(0.0) || internal->stepMinFactor <= RL(0.0)
+           || internal->stepMaxFactor < internal->stepMinFactor) {
+            EXTERR("Adaptive step size: need stepTolerance >= 0 and "
+                   "0 < stepMinFactor <= stepMaxFactor");
+        }
+        if(internal->stepTolerance > RL(0.01)) {
+            EXTWARN("Adaptive step size: stepTolerance = %g m is large; above about "
+                    "0.01 m, TL is much less accurate than with fixed steps",
+                    (double)internal->stepTolerance);
+        }
+        if(internal->rayAmpCutoffdB < RL(0.0) || internal->maxBottomBounces < -1) {
+            EXTERR("Ray pruning: need rayAmpCutoffdB >= 0 and maxBottomBounces >= -1");
+        }
+        if(Beam->allTLTypes && !IsGeometricInfl(Beam)) {
+            EXTERR("allTLTypes is only supported with geometric beams");
+        }
+
         if(IsGeometricInfl(Beam) || IsSGBInfl(Beam)) {
             NULLSTATEMENT;
         } else if(IsCervenyInfl(Beam)) {
@@ -160,6 +183,18 @@ public:
         PRTFile << std::setprecision(4);
         PRTFile << "\n Step length,       deltas = " << std::setw(11) << Beam->deltas
                 << " m\n\n";
+        if(Beam->stepTol > RL(0.0)) {
+            PRTFile << "Adaptive step size, tolerance = " << Beam->stepTol
+                    << " m, step between " << Beam->stepMin << " and " << Beam->stepMax
+                    << " m\n\n";
+        }
+        if(Beam->ampCutoff > RL(0.0)) {
+            PRTFile << "Rays stopped " << GetInternal(params)->rayAmpCutoffdB
+                    << " dB below their initial amplitude\n\n";
+        }
+        if(Beam->maxBotBnc >= 0) {
+            PRTFile << "Rays stopped after " << Beam->maxBotBnc << " bottom bounces\n\n";
+        }
         if constexpr(O3D) {
             PRTFile << "Maximum ray x-range, Box.x  = " << std::setw(11) << Beam->Box.x
                     << " m\n";
@@ -235,6 +270,17 @@ public:
                 / FL(10.0);
             Beam->autoDeltas = true;
         }
+
+        const bhcInternal *internal = GetInternal(params);
+        Beam->stepTol               = internal->stepTolerance;
+        Beam->stepMin               = internal->stepMinFactor * Beam->deltas;
+        Beam->stepMax               = internal->stepMaxFactor * Beam->deltas;
+        Beam->ampCutoff             = RL(0.0);
+        if(internal->rayAmpCutoffdB > RL(0.0)) {
+            Beam->ampCutoff = STD::pow(RL(10.0), -internal->rayAmpCutoffdB / RL(20.0));
+        }
+        Beam->maxBotBnc  = internal->maxBottomBounces;
+        Beam->allTLTypes = internal->allTLTypes && IsTLRun(Beam);
     }
 
 private:
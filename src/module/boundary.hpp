@@ -35,6 +35,8 @@ public:
     {
         BdryInfoTopBot<O3D> *bdinfotb = GetBdryInfoTopBot(params);
         bdinfotb->bd                  = nullptr;
+        bdinfotb->xLookup.iCell       = nullptr;
+        bdinfotb->yLookup.iCell       = nullptr;
     }
 
     virtual void SetupPre(bhcParams<O3D> &params) const override
@@ -49,6 +51,7 @@ public:
         memcpy(bdinfotb->type, "LS", 2);
         bdinfotb->rangeInKm = true;
         bdinfotb->dirty     = true;
+        bdinfotb->flat      = false;
     }
 
     virtual void Default(bhcParams<O3D> &params) const override
@@ -449,9 +452,23 @@ public:
         if(!bdinfotb->dirty) return;
         bdinfotb->dirty = false;
 
+        real tol = GetInternal(params)->bdryTolerance;
+        if(tol > RL(0.0) && IsFile(params)) Simplify(params, bdinfotb, tol);
+
         ComputeBdryTangentNormal(params, bdinfotb);
 
-        if constexpr(!O3D) {
+        if constexpr(O3D) {
+            int32_t ny = bdinfotb->NPts.y;
+            BuildIntervalLookup(
+                params, bdinfotb->xLookup, &bdinfotb->bd[0].x.x, bdinfotb->NPts.x,
+                ny * BdryStride<O3D>);
+            BuildIntervalLookup(
+                params, bdinfotb->yLookup, &bdinfotb->bd[0].x.y, ny, BdryStride<O3D>);
+        } else {
+            const BdryPtFull<false> *bd = bdinfotb->bd;
+            bdinfotb->flat = bdinfotb->NPts == 2 && bd[0].x.y == bd[1].x.y
+                && bd[0].n.x == RL(0.0) && bd[0].kappa == RL(0.0);
+
             // convert range-dependent geoacoustic parameters from user to program units
             if(bdinfotb->type[1] == 'L') {
                 for(int32_t iSeg = 0; iSeg < bdinfotb->NPts; ++iSeg) {
@@ -472,6 +489,8 @@ public:
     {
         BdryInfoTopBot<O3D> *bdinfotb = GetBdryInfoTopBot(params);
         trackdeallocate(params, bdinfotb->bd);
+        trackdeallocate(params, bdinfotb->xLookup.iCell);
+        trackdeallocate(params, bdinfotb->yLookup.iCell);
     }
 
 private:
@@ -514,6 +533,145 @@ private:
     constexpr static const char *s_risesdrops          = ISTOP ? "rises above highest"
                                                                : "drops below lowest";
 
+    /**
+     * Douglas-Peucker over point indices [0, n): between each pair of
+     * consecutive points already marked in keep, finds the point whose removal
+     * error is largest, and if that is more than tol, keeps it and repeats on
+     * both sides. err(a, b, worst) returns the largest error of dropping all
+     * the points strictly between a and b, and sets worst to where it is.
+     */
+    template<typename ERR> static void DouglasPeucker(
+        int32_t n, std::vector<bool> &keep, real tol, const ERR &err)
+    {
+        std::vector<std::pair<int32_t, int32_t>> stack;
+        int32_t prev = 0;
+        for(int32_t i = 1; i < n; ++i) {
+            if(!keep[i]) continue;
+            stack.push_back({prev, i});
+            prev = i;
+        }
+        while(!stack.empty()) {
+            auto [a, b] = stack.back();
+            stack.pop_back();
+            if(b - a < 2) continue;
+            int32_t worst = a + 1;
+            // Written so that a NaN error keeps the point.
+            if(err(a, b, worst) <= tol) continue;
+            keep[worst] = true;
+            stack.push_back({a, worst});
+            stack.push_back({worst, b});
+        }
+    }
+
+    /// Depth error at x of the line from (xa, za) to (xb, zb).
+    static real LerpError(real x, real z, real xa, real za, real xb, real zb)
+    {
+        if(xb == xa) return REAL_MAX;
+        return std::abs(z - (za + (zb - za) * (x - xa) / (xb - xa)));
+    }
+
+    /**
+     * Drops boundary points which are not needed to stay within tol (meters,
+     * in depth) of the original boundary, see bhcInit::bdryTolerance. The
+     * points are compacted in place at the start of bd.
+     */
+    void Simplify(bhcParams<O3D> &params, BdryInfoTopBot<O3D> *bdinfotb, real tol) const
+    {
+        PrintFileEmu &PRTFile = GetInternal(params)->PRTFile;
+        BdryPtFull<O3D> *bd   = bdinfotb->bd;
+        if constexpr(O3D) {
+            int32_t nx = bdinfotb->NPts.x, ny = bdinfotb->NPts.y;
+            std::vector<bool> keepx(nx, false), keepy(ny, false);
+            keepx[0] = keepx[nx - 1] = true;
+            keepy[0] = keepy[ny - 1] = true;
+            // Whole grid lines in x, with the error over every y, then
+            // the same in y along the x lines which are left.
+            DouglasPeucker(nx, keepx, tol, [&](int32_t a, int32_t b, int32_t &worst) {
+                real maxErr = RL(0.0);
+                for(int32_t ix = a + 1; ix < b; ++ix) {
+                    for(int32_t iy = 0; iy < ny; ++iy) {
+                        const vec3 &p  = bd[ix * ny + iy].x;
+                        const vec3 &pa = bd[a * ny + iy].x, &pb = bd[b * ny + iy].x;
+                        real e         = LerpError(p.x, p.z, pa.x, pa.z, pb.x, pb.z);
+                        if(!(e <= maxErr)) {
+                            maxErr = e;
+                            worst  = ix;
+                        }
+                    }
+                }
+                return maxErr;
+            });
+            DouglasPeucker(ny, keepy, tol, [&](int32_t a, int32_t b, int32_t &worst) {
+                real maxErr = RL(0.0);
+                for(int32_t iy = a + 1; iy < b; ++iy) {
+                    for(int32_t ix = 0; ix < nx; ++ix) {
+                        if(!keepx[ix]) continue;
+                        const vec3 &p  = bd[ix * ny + iy].x;
+                        const vec3 &pa = bd[ix * ny + a].x, &pb = bd[ix * ny + b].x;
+                        real e         = LerpError(p.y, p.z, pa.y, pa.z, pb.y, pb.z);
+                        if(!(e <= maxErr)) {
+                            maxErr = e;
+                            worst  = iy;
+                        }
+                    }
+                }
+                return maxErr;
+            });
+            int32_t nxNew = (int32_t)std::count(keepx.begin(), keepx.end(), true);
+            int32_t nyNew = (int32_t)std::count(keepy.begin(), keepy.end(), true);
+            // Each point moves to a lower index, so in place is safe.
+            int32_t i = 0;
+            for(int32_t ix = 0; ix < nx; ++ix) {
+                if(!keepx[ix]) continue;
+                for(int32_t iy = 0; iy < ny; ++iy) {
+                    if(keepy[iy]) bd[i++] = bd[ix * ny + iy];
+                }
+            }
+            bdinfotb->NPts = int2(nxNew, nyNew);
+            PRTFile << "Simplified " << s_altimetrybathymetry << " to within " << tol
+                    << " m: " << nx << " x " << ny << " to " << nxNew << " x " << nyNew
+                    << " points\n";
+        } else {
+            // Points 0 and NPts - 1 are the extensions to +/- infinity.
+            int32_t n = bdinfotb->NPts - 2;
+            if(n <= 2) return;
+            BdryPtFull<false> *pts = &bd[1];
+            std::vector<bool> keep(n, false);
+            keep[0] = keep[n - 1] = true;
+            if(bdinfotb->type[1] == 'L') {
+                // Each segment takes the geoacoustics of its first point.
+                for(int32_t i = 1; i < n; ++i) {
+                    const HSInfo &h0 = pts[i - 1].hs, &h1 = pts[i].hs;
+                    if(h0.alphaR != h1.alphaR || h0.betaR != h1.betaR
+                       || h0.rho != h1.rho || h0.alphaI != h1.alphaI
+                       || h0.betaI != h1.betaI) {
+                        keep[i] = true;
+                    }
+                }
+            }
+            DouglasPeucker(n, keep, tol, [&](int32_t a, int32_t b, int32_t &worst) {
+                real maxErr    = RL(0.0);
+                const vec2 &pa = pts[a].x, &pb = pts[b].x;
+                for(int32_t i = a + 1; i < b; ++i) {
+                    real e = LerpError(pts[i].x.x, pts[i].x.y, pa.x, pa.y, pb.x, pb.y);
+                    if(!(e <= maxErr)) {
+                        maxErr = e;
+                        worst  = i;
+                    }
+                }
+                return maxErr;
+            });
+            int32_t nNew = 0;
+            for(int32_t i = 0; i < n; ++i) {
+                if(keep[i]) pts[nNew++] = pts[i];
+            }
+            pts[nNew]      = bd[bdinfotb->NPts - 1];
+            bdinfotb->NPts = nNew + 2;
+            PRTFile << "Simplified " << s_altimetrybathymetry << " to within " << tol
+                    << " m: " << n << " to " << nNew << " points\n";
+        }
+    }
+
     /**
      * Does some pre-processing on the boundary points to pre-compute segment
      * lengths  (.Len),
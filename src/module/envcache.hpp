@@ -0,0 +1,301 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include "../common_setup.hpp"
+
+namespace bhc { namespace module {
+
+/**
+ * Preprocessed environment cache, see bhcInit::envCacheDir. A cache file
+ * is the header, then the raw bytes of each of the structs in params, then
+ * the used length of the SSP's fixed size arrays and that many entries of
+ * each of them, then each array the structs point to as a byte count (0 for
+ * nullptr) and the bytes. The pointers in the struct bytes are stale and are
+ * replaced as the arrays are loaded. The file name is the key, a hash of the
+ * contents of all the input files and of the build configuration, so any
+ * change to either is a miss.
+ */
+constexpr const char EnvCacheMagic[8] = {'B', 'H', 'C', 'E', 'N', 'V', '0', '2'};
+
+struct EnvCacheHeader {
+    char magic[8];
+    uint64_t totalSize; // whole file, so a truncated file is a miss
+};
+
+/// All the structs in params, in file order. SSPStructure is mostly fixed size
+/// arrays of MaxSSP entries (about 37 MB), so only its other members are
+/// here, and every one of them must be listed.
+template<bool O3D, typename F> inline void ForEachEnvCacheStruct(
+    bhcParams<O3D> &params, F &&f)
+{
+    SSPStructure *ssp = params.ssp;
+    f(params.Title);
+    f(params.fT);
+    f(*params.Bdry);
+    f(*params.bdinfo);
+    f(*params.refl);
+    f(ssp->NPts);
+    f(ssp->Nr);
+    f(ssp->Nx);
+    f(ssp->Ny);
+    f(ssp->Nz);
+    f(ssp->Type);
+    f(ssp->AttenUnit);
+    f(ssp->rangeInKm);
+    f(ssp->dirty);
+    f(ssp->cIsReal);
+    f(*params.atten);
+    f(*params.Pos);
+    f(*params.Angles);
+    f(*params.freqinfo);
+    f(*params.Beam);
+    f(*params.sbp);
+}
+
+/// Each of the fixed size arrays (rows of MaxSSP entries) of SSPStructure, in
+/// file order.
+template<typename F> inline void ForEachEnvCacheSSPRow(SSPStructure *ssp, F &&f)
+{
+    for(cpx *row : {ssp->c, ssp->cz, ssp->n2, ssp->n2z}) f(row);
+    for(int32_t i = 0; i < 4; ++i) {
+        f(ssp->cSpline[i]);
+        f(ssp->cCoef[i]);
+        f(ssp->CSWork[i]);
+        f(ssp->cPoly[i]);
+    }
+    for(int32_t i = 0; i < 3; ++i) f(ssp->czPoly[i]);
+    for(int32_t i = 0; i < 2; ++i) f(ssp->czzPoly[i]);
+    for(real *row : {ssp->z, ssp->rho, ssp->alphaR, ssp->alphaI, ssp->betaR, ssp->betaI})
+        f(row);
+}
+
+/// Number of entries of each SSP row which are used: the depths of the
+/// profile, plus one for the last segment's end.
+inline uint64_t EnvCacheSSPLength(const SSPStructure *ssp)
+{
+    int32_t n = bhc::max(bhc::max(ssp->NPts, ssp->Nz), 0) + 1;
+    return (uint64_t)bhc::min(n, MaxSSP);
+}
+
+/// All the arrays the structs point to, in file order. Every pointer within
+/// the structs must be listed here.
+template<bool O3D, typename F> inline void ForEachEnvCacheArray(
+    bhcParams<O3D> &params, F &&f)
+{
+    SSPStructure *ssp = params.ssp;
+    f(ssp->cMat);
+    f(ssp->czMat);
+    f(ssp->cellMat);
+    f(ssp->Seg.r);
+    f(ssp->Seg.x);
+    f(ssp->Seg.y);
+    f(ssp->Seg.z);
+    BdryInfo<O3D> *bdinfo = params.bdinfo;
+    f(bdinfo->top.bd);
+    f(bdinfo->top.xLookup.iCell);
+    f(bdinfo->top.yLookup.iCell);
+    f(bdinfo->bot.bd);
+    f(bdinfo->bot.xLookup.iCell);
+    f(bdinfo->bot.yLookup.iCell);
+    ReflectionInfo *refl = params.refl;
+    f(refl->bot.r);
+    f(refl->bot.lookup.iCell);
+    f(refl->top.r);
+    f(refl->top.lookup.iCell);
+    Position *Pos = params.Pos;
+    f(Pos->Sx);
+    f(Pos->Sy);
+    f(Pos->Sz);
+    f(Pos->Rr);
+    f(Pos->Rz);
+    f(Pos->theta);
+    f(Pos->t_rcvr);
+    f(params.Angles->alpha.angles);
+    f(params.Angles->beta.angles);
+    f(params.freqinfo->freqVec);
+    f(params.sbp->SrcBmPat);
+}
+
+inline uint64_t EnvCacheHash(uint64_t h, const void *data, size_t bytes)
+{
+    // FNV-1a
+    const uint8_t *d = (const uint8_t *)data;
+    for(size_t i = 0; i < bytes; ++i) {
+        h ^= d[i];
+        h *= 0x100000001B3ull;
+    }
+    return h;
+}
+
+/// The whole usable size of the block (from trackallocate), as the number of
+/// elements is not stored.
+template<typename T> inline uint64_t EnvCacheArrayBytes(const T *ptr)
+{
+    return ptr == nullptr ? 0 : trackedsize(ptr) - 16;
+}
+
+/**
+ * Path of the cache file for the current input files, or empty if caching is
+ * off or there is no environment file.
+ */
+template<bool O3D> inline std::string EnvCachePath(bhcParams<O3D> &params)
+{
+    bhcInternal *internal = GetInternal(params);
+    if(internal->envCacheDir.empty() || internal->noEnvFil) return "";
+    uint64_t h = 0xCBF29CE484222325ull;
+    // Build configuration, layout of everything which is stored, and settings
+    // which change the result of preprocessing
+    uint64_t config[] = {internal->dim,          internal->packHexSSP,
+                         sizeof(real),           sizeof(BdryType),
+                         sizeof(BdryInfo<O3D>),  sizeof(ReflectionInfo),
+                         sizeof(SSPStructure),   sizeof(AttenInfo),
+                         sizeof(Position),       sizeof(AnglesStructure),
+                         sizeof(FreqInfo),       sizeof(BeamStructure<O3D>),
+                         sizeof(SBPInfo)};
+    h = EnvCacheHash(h, BHC_PROGRAMNAME, strlen(BHC_PROGRAMNAME));
+    h = EnvCacheHash(h, EnvCacheMagic, sizeof(EnvCacheMagic));
+    h = EnvCacheHash(h, config, sizeof(config));
+    h = EnvCacheHash(h, &internal->bdryTolerance, sizeof(real));
+    for(const char *ext : {".env", ".ssp", ".bty", ".ati", ".brc", ".trc", ".sbp"}) {
+        MappedFile file;
+        bool found = file.open(internal->FileRoot + ext);
+        if(!found && strcmp(ext, ".env") == 0) return "";
+        h = EnvCacheHash(h, ext, strlen(ext));
+        h = EnvCacheHash(h, &found, 1);
+        if(found) h = EnvCacheHash(h, file.data(), file.size());
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".bhcenv", h);
+    std::string dir = internal->envCacheDir;
+    if(dir.back() != '/' && dir.back() != '\\') dir += '/';
+    return dir + name;
+}
+
+/**
+ * Writes the preprocessed params to the cache. The file is written under a
+ * temporary name and then renamed, so concurrent jobs never see a partial
+ * file. Failure to write the cache is not an error.
+ */
+template<bool O3D> inline void SaveEnvCache(
+    bhcParams<O3D> &params, const std::string &path)
+{
+    EnvCacheHeader header;
+    memcpy(header.magic, EnvCacheMagic, sizeof(EnvCacheMagic));
+    header.totalSize = sizeof(EnvCacheHeader);
+    ForEachEnvCacheStruct(params, [&](auto &s) { header.totalSize += sizeof(s); });
+    uint64_t sspLength = EnvCacheSSPLength(params.ssp);
+    header.totalSize += sizeof(sspLength);
+    ForEachEnvCacheSSPRow(params.ssp, [&](auto *row) {
+        header.totalSize += sspLength * sizeof(*row);
+    });
+    ForEachEnvCacheArray(params, [&](auto *&ptr) {
+        header.totalSize += sizeof(uint64_t) + EnvCacheArrayBytes(ptr);
+    });
+
+    std::string tmpPath = path + ".tmp"
+        + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count())
+        + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    {
+        std::ofstream out(tmpPath, std::ios::binary);
+        if(!out.good()) return;
+        out.write((const char *)&header, sizeof(header));
+        ForEachEnvCacheStruct(
+            params, [&](auto &s) { out.write((const char *)&s, sizeof(s)); });
+        out.write((const char *)&sspLength, sizeof(sspLength));
+        ForEachEnvCacheSSPRow(params.ssp, [&](auto *row) {
+            out.write((const char *)row, sspLength * sizeof(*row));
+        });
+        ForEachEnvCacheArray(params, [&](auto *&ptr) {
+            uint64_t bytes = EnvCacheArrayBytes(ptr);
+            out.write((const char *)&bytes, sizeof(bytes));
+            out.write((const char *)ptr, bytes);
+        });
+        if(!out.good()) {
+            out.close();
+            std::remove(tmpPath.c_str());
+            return;
+        }
+    }
+    if(std::rename(tmpPath.c_str(), path.c_str()) != 0) std::remove(tmpPath.c_str());
+}
+
+/**
+ * Loads the params from the cache file, if it exists and is valid. Returns
+ * false, without modifying the params, if not.
+ */
+template<bool O3D> inline bool LoadEnvCache(
+    bhcParams<O3D> &params, const std::string &path)
+{
+    MappedFile file;
+    if(!file.open(path) || file.size() < sizeof(EnvCacheHeader)) return false;
+    const char *data = file.data();
+    EnvCacheHeader header;
+    memcpy(&header, data, sizeof(header));
+    if(memcmp(header.magic, EnvCacheMagic, sizeof(EnvCacheMagic)) != 0
+       || header.totalSize != file.size()) {
+        return false;
+    }
+    // Check the whole layout before touching the params
+    size_t pos = sizeof(EnvCacheHeader);
+    ForEachEnvCacheStruct(params, [&](auto &s) { pos += sizeof(s); });
+    uint64_t sspLength;
+    if(pos + sizeof(sspLength) > file.size()) return false;
+    memcpy(&sspLength, data + pos, sizeof(sspLength));
+    pos += sizeof(sspLength);
+    if(sspLength > (uint64_t)MaxSSP) return false;
+    ForEachEnvCacheSSPRow(
+        params.ssp, [&](auto *row) { pos += sspLength * sizeof(*row); });
+    bool valid = pos <= file.size();
+    ForEachEnvCacheArray(params, [&](auto *&) {
+        uint64_t bytes;
+        if(!valid || pos + sizeof(bytes) > file.size()) {
+            valid = false;
+            return;
+        }
+        memcpy(&bytes, data + pos, sizeof(bytes));
+        pos += sizeof(bytes);
+        if(bytes > file.size() - pos) valid = false;
+        pos += bytes;
+    });
+    if(!valid || pos != file.size()) return false;
+
+    pos = sizeof(EnvCacheHeader);
+    ForEachEnvCacheStruct(params, [&](auto &s) {
+        memcpy((void *)&s, data + pos, sizeof(s));
+        pos += sizeof(s);
+    });
+    pos += sizeof(sspLength);
+    ForEachEnvCacheSSPRow(params.ssp, [&](auto *row) {
+        memcpy((void *)row, data + pos, sspLength * sizeof(*row));
+        pos += sspLength * sizeof(*row);
+    });
+    ForEachEnvCacheArray(params, [&](auto *&ptr) {
+        uint64_t bytes;
+        memcpy(&bytes, data + pos, sizeof(bytes));
+        pos += sizeof(bytes);
+        ptr = nullptr; // stale pointer from the struct bytes
+        if(bytes == 0) return;
+        trackallocate(params, "cached environment", ptr, bytes / sizeof(*ptr));
+        memcpy((void *)ptr, data + pos, bytes / sizeof(*ptr) * sizeof(*ptr));
+        pos += bytes;
+    });
+    return true;
+}
+
+}} // namespace bhc::module
@@ -31,6 +31,8 @@ namespace bhc { namespace module {
  * and putting 'B' there is considered invalid. Plus, freqVec is never read during
  * the beam trace or influence. However, this can't be removed, as the frequency
  * vector must be written out to the shade file.
+ * In this version, TopOpt[5] == 'B' is accepted, and TL runs then compute the
+ * field at every frequency of freqVec (see IsBroadbandRun).
  */
 template<bool O3D> class FreqVec : public ParamsModule<O3D> {
 public:
@@ -36,6 +36,7 @@ public:
     {
         ReflectionInfoTopBot *refltb = GetReflTopBot(params);
         refltb->r                    = nullptr;
+        refltb->lookup.iCell         = nullptr;
     }
 
     virtual void Default(bhcParams<O3D> &params) const override
@@ -164,12 +165,20 @@ public:
                 refltb->r[itheta].phi *= DegRad; // convert to radians
             }
         }
+        if(refltb->NPts >= 2) {
+            BuildIntervalLookup(
+                params, refltb->lookup, &refltb->r[0].theta, refltb->NPts,
+                sizeof(ReflectionCoef) / sizeof(real));
+        } else {
+            trackdeallocate(params, refltb->lookup.iCell);
+        }
     }
 
     virtual void Finalize(bhcParams<O3D> &params) const override
     {
         ReflectionInfoTopBot *refltb = GetReflTopBot(params);
         trackdeallocate(params, refltb->r);
+        trackdeallocate(params, refltb->lookup.iCell);
     }
 
 private:
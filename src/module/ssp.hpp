@@ -32,9 +32,10 @@ public:
     {
         SSPStructure *ssp = params.ssp;
 
-        ssp->cMat  = nullptr;
-        ssp->czMat = nullptr;
-        ssp->Seg.r = nullptr;
+        ssp->cMat    = nullptr;
+        ssp->czMat   = nullptr;
+        ssp->cellMat = nullptr;
+        ssp->Seg.r   = nullptr;
         ssp->Seg.x = nullptr;
         ssp->Seg.y = nullptr;
         ssp->Seg.z = nullptr;
@@ -53,6 +54,7 @@ public:
 
         ssp->dirty     = true;
         ssp->rangeInKm = false;
+        ssp->cIsReal   = false;
     }
 
     virtual void Default(bhcParams<O3D> &params) const override
@@ -395,7 +397,11 @@ public:
                 << params.Bdry->Bot.hs.Depth << "  m\n";
 
         if(ssp->Type == 'A') {
+#ifdef BHC_SSP_ANALYTIC_HEADER
+            PRTFile << "Analytic SSP option, user-defined model\n";
+#else
             PRTFile << "Analytic SSP option\n";
+#endif
             return;
         }
 
@@ -482,6 +488,7 @@ public:
                 }
             }
             SegZToZ(params);
+            PackHexCells(params);
             // LP: ssp->c and ssp->cz are not well-defined in hexahedral mode, and
             // if the number of depths is changed (ssp->Nz vs. ssp->NPts), computing
             // them may read uninitialized data.
@@ -519,6 +526,22 @@ public:
             cSpline(
                 ssp->z, ssp->cSpline[0], ssp->cSpline[1], ssp->cSpline[2],
                 ssp->cSpline[3], ssp->NPts, iBCBeg, iBCEnd, ssp->NPts);
+
+            // Same operations as SplineALL, so the results are identical.
+            // The last c coefficient is not prescaled, as SplineALL multiplies
+            // it by sixth * h rather than h.
+            for(int32_t i = 0; i < ssp->NPts; ++i) {
+                ssp->cPoly[0][i]   = ssp->cSpline[0][i].real();
+                ssp->cPoly[1][i]   = ssp->cSpline[1][i].real();
+                ssp->cPoly[2][i]   = FL(0.5) * ssp->cSpline[2][i].real();
+                ssp->cPoly[3][i]   = ssp->cSpline[3][i].real();
+                ssp->czPoly[0][i]  = ssp->cSpline[1][i].real();
+                ssp->czPoly[1][i]  = ssp->cSpline[2][i].real();
+                ssp->czPoly[2][i]  = FL(0.5) * ssp->cSpline[3][i].real();
+                ssp->czzPoly[0][i] = ssp->cSpline[2][i].real();
+                ssp->czzPoly[1][i] = ssp->cSpline[3][i].real();
+            }
+            ssp->cIsReal = IsRealProfile(ssp->cSpline, ssp->NPts);
         } break;
         case 'P': // monotone PCHIP ACS profile option
             //                                                               2      3
@@ -528,6 +551,16 @@ public:
                 ssp->z, ssp->c, ssp->NPts, ssp->cCoef[0], ssp->cCoef[1], ssp->cCoef[2],
                 ssp->cCoef[3], ssp->CSWork[0], ssp->CSWork[1], ssp->CSWork[2],
                 ssp->CSWork[3]);
+
+            for(int32_t i = 0; i < ssp->NPts; ++i) {
+                for(int32_t j = 0; j < 4; ++j) ssp->cPoly[j][i] = ssp->cCoef[j][i].real();
+                ssp->czPoly[0][i]  = ssp->cCoef[1][i].real();
+                ssp->czPoly[1][i]  = RL(2.0) * ssp->cCoef[2][i].real();
+                ssp->czPoly[2][i]  = RL(3.0) * ssp->cCoef[3][i].real();
+                ssp->czzPoly[0][i] = RL(2.0) * ssp->cCoef[2][i].real();
+                ssp->czzPoly[1][i] = RL(6.0) * ssp->cCoef[3][i].real();
+            }
+            ssp->cIsReal = IsRealProfile(ssp->cCoef, ssp->NPts);
             break;
         case 'Q':
             // calculate cz
@@ -550,6 +583,7 @@ public:
 
         trackdeallocate(params, ssp->cMat);
         trackdeallocate(params, ssp->czMat);
+        trackdeallocate(params, ssp->cellMat);
         trackdeallocate(params, ssp->Seg.r);
         trackdeallocate(params, ssp->Seg.x);
         trackdeallocate(params, ssp->Seg.y);
@@ -557,6 +591,19 @@ public:
     }
 
 private:
+    /**
+     * Whether the polynomial coefficients, and therefore all interpolated sound
+     * speeds, have no imaginary part.
+     */
+    inline bool IsRealProfile(const cpx (*coef)[MaxSSP], int32_t NPts) const
+    {
+        for(int32_t j = 0; j < 4; ++j) {
+            for(int32_t i = 0; i < NPts; ++i) {
+                if(coef[j][i].imag() != RL(0.0)) return false;
+            }
+        }
+        return true;
+    }
     inline void SegZToZ(bhcParams<O3D> &params) const
     {
         SSPStructure *ssp = params.ssp;
@@ -579,6 +626,33 @@ private:
         }
         ssp->NPts = ssp->Nz;
     }
+    /**
+     * See bhcInit::packHexSSP. Cells are in the same order as czMat, and each
+     * holds c11, c21, c12, c22, cz11, cz12, cz21, cz22 as named in Hexahedral().
+     */
+    inline void PackHexCells(bhcParams<O3D> &params) const
+    {
+        SSPStructure *ssp = params.ssp;
+        trackdeallocate(params, ssp->cellMat);
+        if(!GetInternal(params)->packHexSSP) return;
+        int32_t Nx = ssp->Nx, Ny = ssp->Ny, Nz = ssp->Nz;
+        trackallocate(
+            params, "packed hexahedral SSP cells", ssp->cellMat,
+            (size_t)(Nx - 1) * (size_t)(Ny - 1) * (size_t)(Nz - 1) * 8);
+        for(int32_t ix = 0; ix < Nx - 1; ++ix) {
+            for(int32_t iy = 0; iy < Ny - 1; ++iy) {
+                for(int32_t iz = 0; iz < Nz - 1; ++iz) {
+                    size_t icell = ((size_t)ix * (Ny - 1) + iy) * (Nz - 1) + iz;
+                    real *cell   = &ssp->cellMat[icell * 8];
+                    for(int32_t corner = 0; corner < 4; ++corner) {
+                        int32_t jx = ix + (corner & 1), jy = iy + (corner >> 1);
+                        cell[corner]     = ssp->cMat[(jx * Ny + jy) * Nz + iz];
+                        cell[corner + 4] = ssp->czMat[(jx * Ny + jy) * (Nz - 1) + iz];
+                    }
+                }
+            }
+        }
+    }
     void AllocateArrays(bhcParams<O3D> &params) const
     {
         SSPStructure *ssp = params.ssp;
@@ -169,10 +169,7 @@ public:
         switch(params.Bdry->Top.hs.Opt[5]) {
         case 'I': break;
         case ' ': break;
-        case 'B':
-            EXTERR("ReadEnvironment: BELLHOP/BELLHOP3D does not properly support "
-                   "wideband runs / freqvec / TopOpt[5] == 'B'");
-            [[fallthrough]]; // LP: break here would be unreachable
+        case 'B': break; // Broadband, not supported by BELLHOP/BELLHOP3D
         default: EXTERR("ReadEnvironment: Unknown top option letter in sixth position\n");
         }
     }
@@ -238,6 +235,8 @@ public:
 
         if(params.Bdry->Top.hs.Opt[5] == 'I') {
             PRTFile << "    Development options enabled\n";
+        } else if(params.Bdry->Top.hs.Opt[5] == 'B') {
+            PRTFile << "    Broadband run\n";
         }
     }
 };
@@ -70,6 +70,19 @@ HOST_DEVICE inline void InterpolateReflectionCoefficient(
         //        "set to 0 outside tabulated domain : angle = %f, lower limit = %f",
         //        thetaIntr, rtb.r[iRight].theta);
     } else {
+        // The angles are strictly increasing, so the bracket is unique: the
+        // last iLeft <= NPts - 2 with theta <= thetaIntr. Start from the
+        // preprocessed inverse map, which is O(1) for uniformly spaced angles.
+        int32_t iGuess = rtb.lookup.iCell == nullptr
+            ? -1
+            : IntervalGuess(rtb.lookup, thetaIntr, -1);
+        if(iGuess >= 0) {
+            iLeft = iGuess;
+            while(iLeft < rtb.NPts - 2 && rtb.r[iLeft + 1].theta <= thetaIntr) ++iLeft;
+            while(iLeft > 0 && rtb.r[iLeft].theta > thetaIntr) --iLeft;
+            iRight = iLeft + 1;
+        }
+
         // Search for bracketing abscissas: STD::log2(rtb.NPts) stabs required for a
         // bracket
 
@@ -237,7 +250,9 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void Reflect(
         VEC23<R3D> rayt_tilde = o.ccpx.real() * newPoint.t;         // unit tangent to ray
         VEC23<R3D> rayn_tilde = -vec2(-rayt_tilde.y, rayt_tilde.x); // unit normal  to ray
         // boundary curvature correction
-        real rn = FL(2.0) * rcurv_ray.kappa / SQ(o.ccpx.real()) / Th;
+        real rn = CFG::bdry::IsFlat()
+            ? RL(0.0)
+            : FL(2.0) * rcurv_ray.kappa / SQ(o.ccpx.real()) / Th;
 
         // get the jumps (this could be simplified, e.g. jump in rayt is roughly 2 * Th *
         // nbdry
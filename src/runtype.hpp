@@ -83,10 +83,31 @@ template<char ST> struct SSPType {
         "SSPType templated with invalid character!");
 };
 
-template<char RT, char IT, char ST> struct CfgSel {
+/**
+ * 'G': general top and bottom boundaries. 'F': both are a single flat segment
+ * which extends past the beam box (2D only, see BdryInfoTopBot::flat), so the
+ * ray never changes segment, the boundary crossing tests are in depth only,
+ * and there is no boundary curvature.
+ */
+template<char BT> struct BdryShape {
+    static constexpr bool IsGeneral() { return BT == 'G'; }
+    static constexpr bool IsFlat() { return BT == 'F'; }
+
+    static_assert(
+        IsGeneral() || IsFlat(), "BdryShape templated with invalid character!");
+};
+
+template<char RT, char IT, char ST, char BT = 'G'> struct CfgSel {
     using run  = RunType<RT>;
     using infl = InflType<IT>;
     using ssp  = SSPType<ST>;
+    using bdry = BdryShape<BT>;
+
+    // The flat specialization skips the segment limits, which quad SSPs
+    // also use for their range segments.
+    static_assert(
+        !bdry::IsFlat() || !ssp::IsQuad(),
+        "Flat boundaries with quad SSP not supported!");
 };
 
 template<bool O3D> HOST_DEVICE inline bool IsRayRun(const BeamStructure<O3D> *Beam)
@@ -133,6 +154,22 @@ template<bool O3D> HOST_DEVICE inline bool IsSemiCoherentRun(
     return r == 'S';
 }
 
+/**
+ * TL type ('C', 'S', or 'I') of plane p of the field, see bhcInit::allTLTypes:
+ * plane 0 is the run type's own, followed by the other two in the order C, S,
+ * I.
+ */
+template<bool O3D> HOST_DEVICE inline char TLPlaneType(
+    const BeamStructure<O3D> *Beam, int32_t p)
+{
+    char own = Beam->RunType[0];
+    if(p == 0) return own;
+    for(char t : {'C', 'S', 'I'}) {
+        if(t != own && --p == 0) return t;
+    }
+    return own;
+}
+
 // Beam->Type[0] is
 //   'G', '^', or ' ' Geometric hat beams in Cartesian coordinates
 //   'g' Geometric hat beams in ray-centered coordinates
@@ -20,6 +20,11 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #include "common_run.hpp"
 #include "curves.hpp"
 
+#ifdef BHC_SSP_ANALYTIC_HEADER
+// Defines bhc::AnalyticSSPModel, see DefaultAnalyticSSP
+#include BHC_SSP_ANALYTIC_HEADER
+#endif
+
 namespace bhc {
 
 #define SSP_2D_FN_ARGS \
@@ -102,6 +107,26 @@ HOST_DEVICE inline void cPCHIP(SSP_2D_FN_ARGS)
         RunWarning(errState, BHC_WARN_CPCHIP_INVALIDXT);
         // printf("Invalid xt %g\n", xt);
     }
+    if(ssp->cIsReal) {
+        // Same operations as below on the real parts only; see cPoly.
+        int32_t iz = iSeg.z;
+        for(int32_t i = 0; i < 4; ++i) {
+            if(STD::abs(ssp->cPoly[i][iz]) > RL(1.0e10)) {
+                RunWarning(errState, BHC_WARN_CPCHIP_INVALIDCCOEF);
+            }
+        }
+        o.ccpx = cpx(
+            ssp->cPoly[0][iz]
+                + (ssp->cPoly[1][iz] + (ssp->cPoly[2][iz] + ssp->cPoly[3][iz] * xt) * xt)
+                    * xt,
+            RL(0.0));
+        o.gradc = vec2(
+            RL(0.0),
+            ssp->czPoly[0][iz] + (ssp->czPoly[1][iz] + ssp->czPoly[2][iz] * xt) * xt);
+        o.crr = o.crz = RL(0.0);
+        o.czz         = ssp->czzPoly[0][iz] + ssp->czzPoly[1][iz] * xt;
+        return;
+    }
     for(int32_t i = 0; i < 4; ++i) {
         if(STD::abs(ssp->cCoef[i][iSeg.z]) > RL(1.0e10)) {
             RunWarning(errState, BHC_WARN_CPCHIP_INVALIDCCOEF);
@@ -136,6 +161,23 @@ HOST_DEVICE inline void cCubic(SSP_2D_FN_ARGS)
     LinInterpDensity(x.y, ssp, iSeg, o.rho);
 
     real hSpline = x.y - ssp->z[iSeg.z];
+    if(ssp->cIsReal) {
+        // Same operations as SplineALL on the real parts only; see cPoly.
+        constexpr float sixth = FL(1.0) / FL(6.0);
+        int32_t iz            = iSeg.z;
+        real h                = hSpline;
+        o.ccpx                = cpx(
+            ssp->cPoly[0][iz]
+                + h * (ssp->cPoly[1][iz]
+                       + h * (ssp->cPoly[2][iz] + sixth * h * ssp->cPoly[3][iz])),
+            RL(0.0));
+        o.gradc = vec2(
+            RL(0.0),
+            ssp->czPoly[0][iz] + h * (ssp->czPoly[1][iz] + h * ssp->czPoly[2][iz]));
+        o.crr = o.crz = RL(0.0);
+        o.czz         = ssp->czzPoly[0][iz] + h * ssp->czzPoly[1][iz];
+        return;
+    }
     cpx czcpx, czzcpx;
 
     SplineALL(
@@ -232,22 +274,35 @@ HOST_DEVICE inline void Hexahedral(SSP_3D_FN_ARGS)
     UpdateSSPSegment(x.y, t.y, ssp->Seg.y, ssp->Ny, iSeg.y);
     UpdateSSPSegment(x.z, t.z, ssp->Seg.z, ssp->Nz, iSeg.z);
 
-    // cz at the corners of the current rectangle
-    real cz11 = ssp->czMat[((iSeg.x) * ssp->Ny + iSeg.y) * (ssp->Nz - 1) + iSeg.z];
-    real cz12 = ssp->czMat[((iSeg.x + 1) * ssp->Ny + iSeg.y) * (ssp->Nz - 1) + iSeg.z];
-    real cz21 = ssp->czMat[((iSeg.x) * ssp->Ny + iSeg.y + 1) * (ssp->Nz - 1) + iSeg.z];
-    real cz22
-        = ssp->czMat[((iSeg.x + 1) * ssp->Ny + iSeg.y + 1) * (ssp->Nz - 1) + iSeg.z];
-
-    // for this depth, x.z get the sound speed at the corners of the current rectangle
-    real s3  = x.z - ssp->Seg.z[iSeg.z];
-    real c11 = ssp->cMat[((iSeg.x) * ssp->Ny + iSeg.y) * ssp->Nz + iSeg.z] + s3 * cz11;
-    real c21 = ssp->cMat[((iSeg.x + 1) * ssp->Ny + iSeg.y) * ssp->Nz + iSeg.z]
-        + s3 * cz12;
-    real c12 = ssp->cMat[((iSeg.x) * ssp->Ny + iSeg.y + 1) * ssp->Nz + iSeg.z]
-        + s3 * cz21;
-    real c22 = ssp->cMat[((iSeg.x + 1) * ssp->Ny + iSeg.y + 1) * ssp->Nz + iSeg.z]
-        + s3 * cz22;
+    real s3 = x.z - ssp->Seg.z[iSeg.z];
+    real c11, c12, c21, c22, cz11, cz12, cz21, cz22;
+    if(ssp->cellMat != nullptr) {
+        // See bhcInit::packHexSSP
+        size_t icell = ((size_t)iSeg.x * (ssp->Ny - 1) + iSeg.y) * (ssp->Nz - 1) + iSeg.z;
+        const real *cell = &ssp->cellMat[icell * 8];
+        cz11 = LoadReadOnly(&cell[4]);
+        cz12 = LoadReadOnly(&cell[5]);
+        cz21 = LoadReadOnly(&cell[6]);
+        cz22 = LoadReadOnly(&cell[7]);
+        c11  = LoadReadOnly(&cell[0]) + s3 * cz11;
+        c21  = LoadReadOnly(&cell[1]) + s3 * cz12;
+        c12  = LoadReadOnly(&cell[2]) + s3 * cz21;
+        c22  = LoadReadOnly(&cell[3]) + s3 * cz22;
+    } else {
+        // cz at the corners of the current rectangle
+        cz11 = ssp->czMat[((iSeg.x) * ssp->Ny + iSeg.y) * (ssp->Nz - 1) + iSeg.z];
+        cz12 = ssp->czMat[((iSeg.x + 1) * ssp->Ny + iSeg.y) * (ssp->Nz - 1) + iSeg.z];
+        cz21 = ssp->czMat[((iSeg.x) * ssp->Ny + iSeg.y + 1) * (ssp->Nz - 1) + iSeg.z];
+        cz22 = ssp->czMat[((iSeg.x + 1) * ssp->Ny + iSeg.y + 1) * (ssp->Nz - 1) + iSeg.z];
+
+        // for this depth, x.z get the sound speed at the corners of the current
+        // rectangle
+        c11 = ssp->cMat[((iSeg.x) * ssp->Ny + iSeg.y) * ssp->Nz + iSeg.z] + s3 * cz11;
+        c21 = ssp->cMat[((iSeg.x + 1) * ssp->Ny + iSeg.y) * ssp->Nz + iSeg.z] + s3 * cz12;
+        c12 = ssp->cMat[((iSeg.x) * ssp->Ny + iSeg.y + 1) * ssp->Nz + iSeg.z] + s3 * cz21;
+        c22 = ssp->cMat[((iSeg.x + 1) * ssp->Ny + iSeg.y + 1) * ssp->Nz + iSeg.z]
+            + s3 * cz22;
+    }
 
     // s1 = proportional distance of x.x in x
     real s1 = (x.x - ssp->Seg.x[iSeg.x]) / (ssp->Seg.x[iSeg.x + 1] - ssp->Seg.x[iSeg.x]);
@@ -306,72 +361,97 @@ HOST_DEVICE inline void Hexahedral(SSP_3D_FN_ARGS)
     LinInterpDensity(x.z, ssp, iSeg, o.rho);
 }
 
+/**
+ * Built-in analytic SSP (ssp->Type == 'A'), a Munk-like profile with a linear
+ * trend in y in 3D.
+ *
+ * To evaluate your own ocean model instead, set the CMake variable
+ * BHC_SSP_ANALYTIC_HEADER to a header which defines a struct
+ * bhc::AnalyticSSPModel with the same static Evaluate function (see
+ * examples/analytic_ssp.hpp). It is compiled into the ray tracing code for both
+ * CPU and GPU like the other SSP types, and must set all of o: sound speed,
+ * gradient, second derivatives, and density, in the ocean coordinates of the
+ * run (r, z in 2D; x, y, z in 3D and Nx2D).
+ */
+struct DefaultAnalyticSSP {
+    template<bool O3D> HOST_DEVICE static inline void Evaluate(
+        const VEC23<O3D> &x, SSPOutputs<O3D> &o)
+    {
+        real c0 = FL(1500.0);
+        o.rho   = FL(1.0);
+
+        const float unk1 = FL(1300.0);
+        const float unk2 = FL(0.00737);
+
+        if constexpr(O3D) {
+            real w;
+            // if(x.z < 5000.0){
+            const float unk3 = FL(100000.0);
+            const float unk4 = FL(0.003);
+            real epsilon     = unk2 + x.y / unk3 * unk4;
+            real epsilon_y   = unk4 / unk3;
+
+            w       = FL(2.0) * (x.z - unk1) / unk1;
+            real wz = FL(2.0) / unk1;
+
+            real emw  = STD::exp(-w);
+            o.ccpx    = cpx(c0 * (FL(1.0) + epsilon * (w - FL(1.0) + emw)), FL(0.0));
+            o.gradc.y = c0 * epsilon_y * (w - FL(1.0) + emw);
+            o.gradc.z = c0 * epsilon * (FL(1.0) - emw) * wz;
+            o.czz     = c0 * epsilon * emw * SQ(wz);
+            o.cyz     = c0 * epsilon_y * (FL(1.0) - emw) * wz;
+            // else{ // HOMOGENEOUS HALF-SPACE
+            //     w      = FL(2.0) * (FL(5000.0) - unk1) / unk1;
+            //     o.ccpx = cpx(c0 * (FL(1.0) + unk2 * (w - FL(1.0) + STD::exp(-w))),
+            //         FL(0.0);
+            //     o.gradc.y = FL(0.0);
+            //     o.gradc.z = FL(0.0);
+            //     o.czz     = FL(0.0);
+            //     o.cyz     = FL(0.0);
+            // }
+
+            o.gradc.x = FL(0.0);
+            o.cxx     = FL(0.0);
+            o.cyy     = FL(0.0);
+            o.cxz     = FL(0.0);
+            o.cxy     = FL(0.0);
+        } else {
+            real cr, cz, DxtDz, xt;
+
+            // homogeneous halfspace was removed since BELLHOP needs to get gradc just a
+            // little below the boundaries, on ray reflection
+
+            // if(x.y < 5000.0){
+            xt        = FL(2.0) * (x.y - unk1) / unk1;
+            real emxt = STD::exp(-xt);
+            DxtDz     = FL(2.0) / unk1;
+            o.ccpx    = cpx(c0 * (FL(1.0) + unk2 * (xt - FL(1.0) + emxt)), FL(0.0));
+            cz        = c0 * unk2 * (FL(1.0) - emxt) * DxtDz;
+            o.czz     = c0 * unk2 * emxt * SQ(DxtDz);
+            //}else{
+            // Homogeneous half-space
+            // xt     = FL(2.0) * (FL(5000.0) - unk1) / unk1;
+            // o.ccpx = cpx(c0 * (FL(1.0) + unk2 * (xt - FL(1.0) + emxt)), FL(0.0));
+            // cz     = FL(0.0);
+            // o.czz  = FL(0.0);
+            //}
+
+            cr      = FL(0.0);
+            o.gradc = vec2(cr, cz);
+            o.crz   = FL(0.0);
+            o.crr   = FL(0.0);
+        }
+    }
+};
+
+#ifndef BHC_SSP_ANALYTIC_HEADER
+using AnalyticSSPModel = DefaultAnalyticSSP;
+#endif
+
 template<bool O3D> HOST_DEVICE inline void Analytic(SSP_TEMPL_FN_ARGS)
 {
-    iSeg.z  = 0;
-    real c0 = FL(1500.0);
-    o.rho   = FL(1.0);
-
-    const float unk1 = FL(1300.0);
-    const float unk2 = FL(0.00737);
-
-    if constexpr(O3D) {
-        real w;
-        // if(x.z < 5000.0){
-        const float unk3 = FL(100000.0);
-        const float unk4 = FL(0.003);
-        real epsilon     = unk2 + x.y / unk3 * unk4;
-        real epsilon_y   = unk4 / unk3;
-
-        w       = FL(2.0) * (x.z - unk1) / unk1;
-        real wz = FL(2.0) / unk1;
-
-        real emw  = STD::exp(-w);
-        o.ccpx    = cpx(c0 * (FL(1.0) + epsilon * (w - FL(1.0) + emw)), FL(0.0));
-        o.gradc.y = c0 * epsilon_y * (w - FL(1.0) + emw);
-        o.gradc.z = c0 * epsilon * (FL(1.0) - emw) * wz;
-        o.czz     = c0 * epsilon * emw * SQ(wz);
-        o.cyz     = c0 * epsilon_y * (FL(1.0) - emw) * wz;
-        // else{ // HOMOGENEOUS HALF-SPACE
-        //     w      = FL(2.0) * (FL(5000.0) - unk1) / unk1;
-        //     o.ccpx = cpx(c0 * (FL(1.0) + unk2 * (w - FL(1.0) + STD::exp(-w))), FL(0.0);
-        //     o.gradc.y = FL(0.0);
-        //     o.gradc.z = FL(0.0);
-        //     o.czz     = FL(0.0);
-        //     o.cyz     = FL(0.0);
-        // }
-
-        o.gradc.x = FL(0.0);
-        o.cxx     = FL(0.0);
-        o.cyy     = FL(0.0);
-        o.cxz     = FL(0.0);
-        o.cxy     = FL(0.0);
-    } else {
-        real cr, cz, DxtDz, xt;
-
-        // homogeneous halfspace was removed since BELLHOP needs to get gradc just a
-        // little below the boundaries, on ray reflection
-
-        // if(x.y < 5000.0){
-        xt        = FL(2.0) * (x.y - unk1) / unk1;
-        real emxt = STD::exp(-xt);
-        DxtDz     = FL(2.0) / unk1;
-        o.ccpx    = cpx(c0 * (FL(1.0) + unk2 * (xt - FL(1.0) + emxt)), FL(0.0));
-        cz        = c0 * unk2 * (FL(1.0) - emxt) * DxtDz;
-        o.czz     = c0 * unk2 * emxt * SQ(DxtDz);
-        //}else{
-        // Homogeneous half-space
-        // xt     = FL(2.0) * (FL(5000.0) - unk1) / unk1;
-        // o.ccpx = cpx(c0 * (FL(1.0) + unk2 * (xt - FL(1.0) + emxt)), FL(0.0));
-        // cz     = FL(0.0);
-        // o.czz  = FL(0.0);
-        //}
-
-        cr      = FL(0.0);
-        o.gradc = vec2(cr, cz);
-        o.crz   = FL(0.0);
-        o.crr   = FL(0.0);
-    }
+    iSeg.z = 0;
+    AnalyticSSPModel::template Evaluate<O3D>(x, o);
 }
 
 template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void EvaluateSSP(
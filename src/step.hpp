@@ -109,12 +109,29 @@ template<bool O3D, int DIM> HOST_DEVICE inline void BeamBoxCrossing(
 
 /**
  * LP: h = hTop or hBot
+ * FLAT: the boundary is flat (see BdryShape), so its normal is vertical and
+ * the same tests reduce to depths only.
  */
-template<bool O3D> HOST_DEVICE inline void TopBotCrossing(
+template<bool O3D, bool FLAT = false> HOST_DEVICE inline void TopBotCrossing(
     bool stepTo, real &h, const BdryStateTopBot<O3D> &bd, VEC23<O3D> &x,
     const VEC23<O3D> &x0, const VEC23<O3D> &urayt, bool &refl, int32_t &snapDim)
 {
     if(!stepTo) h = REAL_MAX;
+    if constexpr(FLAT) {
+        real w = DEP(bd.n) * (DEP(x) - DEP(bd.x));
+        if(stepTo ? (w > -INFINITESIMAL_STEP_SIZE) : (w >= RL(0.0))) {
+            h = -(DEP(x0) - DEP(bd.x)) / DEP(urayt);
+            if(stepTo) {
+                x       = x0 + h * urayt;
+                DEP(x)  = DEP(bd.x);
+                snapDim = ZDIM<O3D>();
+            }
+            refl = true;
+        } else {
+            refl = false;
+        }
+        return;
+    }
     VEC23<O3D> d, d0;
     d  = x - bd.x;  // vector from top / bottom to ray
     d0 = x0 - bd.x; // vector from top / bottom node to ray origin
@@ -268,7 +285,7 @@ HOST_DEVICE inline void TriDiagCrossing(
  * Topx, Topn, Botx, Botn: Top, bottom coordinate and normal
  * h: reduced step size
  */
-template<bool O3D> HOST_DEVICE inline void ReduceStep(
+template<typename CFG, bool O3D> HOST_DEVICE inline void ReduceStep(
     const VEC23<O3D> &x0, const VEC23<O3D> &urayt, const SSPSegState &iSeg0,
     BdryState<O3D> &bds, const BeamStructure<O3D> *Beam, const VEC23<O3D> &xs,
     const SSPStructure *ssp, ErrState *errState, real &h, int32_t &iSmallStepCtr)
@@ -297,8 +314,9 @@ template<bool O3D> HOST_DEVICE inline void ReduceStep(
     } else {
         hBoxz_ = REAL_MAX;
     }
-    TopBotCrossing<O3D>(false, hTop, bds.top, x, x0, urayt, dummy, dummy2);
-    TopBotCrossing<O3D>(false, hBot, bds.bot, x, x0, urayt, dummy, dummy2);
+    constexpr bool flat = CFG::bdry::IsFlat();
+    TopBotCrossing<O3D, flat>(false, hTop, bds.top, x, x0, urayt, dummy, dummy2);
+    TopBotCrossing<O3D, flat>(false, hBot, bds.bot, x, x0, urayt, dummy, dummy2);
 
     if constexpr(O3D) {
         TopBotSegCrossing<O3D>(
@@ -312,9 +330,13 @@ template<bool O3D> HOST_DEVICE inline void ReduceStep(
         TriDiagCrossing(
             false, hBotDiag, bds.bot, x, x0, urayt, dummy, dummy, dummy2, errState);
     } else {
-        TopBotSegCrossing<O3D>(
-            false, false, hxSeg, bds.top.lSeg, bds.bot.lSeg, ssp->Seg.r, iSeg0.r, x, x0,
-            urayt, 'Q', ssp, dummy, dummy, dummy2);
+        if constexpr(flat) {
+            hxSeg = REAL_MAX; // The only segment extends past the beam box.
+        } else {
+            TopBotSegCrossing<O3D>(
+                false, false, hxSeg, bds.top.lSeg, bds.bot.lSeg, ssp->Seg.r, iSeg0.r, x,
+                x0, urayt, 'Q', ssp, dummy, dummy, dummy2);
+        }
         hySeg = hTopDiag = hBotDiag = REAL_MAX;
     }
 
@@ -344,17 +366,18 @@ template<bool O3D> HOST_DEVICE inline void ReduceStep(
 /**
  * snapDim: See OceanToRayX.
  */
-template<bool O3D> HOST_DEVICE inline void StepToBdry(
+template<typename CFG, bool O3D> HOST_DEVICE inline void StepToBdry(
     const VEC23<O3D> &x0, VEC23<O3D> &x2, const VEC23<O3D> &urayt, real &h, bool &topRefl,
     bool &botRefl, int32_t &snapDim, const SSPSegState &iSeg0, BdryState<O3D> &bds,
     const BeamStructure<O3D> *Beam, const VEC23<O3D> &xs, const SSPStructure *ssp,
-    ErrState *errState)
+    ErrState *errState, real hNominal)
 {
 #ifdef STEP_DEBUGGING
     printf("StepToBdry\n");
 #endif
     // Original step due to maximum step size
-    h       = Beam->deltas;
+    // hNominal is deltas, unless adaptive step size is enabled.
+    h       = hNominal;
     x2      = x0 + h * urayt;
     snapDim = -1;
 
@@ -364,8 +387,9 @@ template<bool O3D> HOST_DEVICE inline void StepToBdry(
     if constexpr(O3D) {
         BeamBoxCrossing<O3D, 2>(true, h, x2, x0, urayt, Beam, xs, snapDim);
     }
-    TopBotCrossing<O3D>(true, h, bds.top, x2, x0, urayt, topRefl, snapDim);
-    TopBotCrossing<O3D>(true, h, bds.bot, x2, x0, urayt, botRefl, snapDim);
+    constexpr bool flat = CFG::bdry::IsFlat();
+    TopBotCrossing<O3D, flat>(true, h, bds.top, x2, x0, urayt, topRefl, snapDim);
+    TopBotCrossing<O3D, flat>(true, h, bds.bot, x2, x0, urayt, botRefl, snapDim);
     if(botRefl) topRefl = false;
 
     if constexpr(O3D) {
@@ -379,7 +403,7 @@ template<bool O3D> HOST_DEVICE inline void StepToBdry(
             true, h, bds.top, x2, x0, urayt, topRefl, botRefl, snapDim, errState);
         TriDiagCrossing(
             true, h, bds.bot, x2, x0, urayt, topRefl, botRefl, snapDim, errState);
-    } else {
+    } else if constexpr(!flat) {
         TopBotSegCrossing<O3D>(
             true, false, h, bds.top.lSeg, bds.bot.lSeg, ssp->Seg.r, iSeg0.r, x2, x0,
             urayt, 'Q', ssp, topRefl, botRefl, snapDim);
@@ -650,6 +674,31 @@ template<bool R3D> HOST_DEVICE inline void CurvatureCorrection(
     }
 }
 
+/**
+ * Adaptive step size (see bhcInit::stepTolerance). Along the ray, the
+ * tangent turns with curvature kappa = |grad c normal to the ray| / c, and the
+ * dynamic ray equations for p and q oscillate with wavenumber^2 |c_nn| / c. The
+ * midpoint-type integrator below has a local error of about w^2 h^3 / 24 for
+ * either rate w, so h is chosen to make that stepTol, using the sum of both
+ * rates squared evaluated at the start of the step.
+ */
+template<bool O3D, bool R3D> HOST_DEVICE inline real AdaptiveStepSize(
+    const SSPOutputs<R3D> &o0, const StepPartials<R3D> &part0, const VEC23<R3D> &urayt0,
+    real csq0, const BeamStructure<O3D> *Beam)
+{
+    VEC23<R3D> gradcn = o0.gradc - glm::dot(o0.gradc, urayt0) * urayt0;
+    real wsq          = glm::dot(gradcn, gradcn) / csq0;
+    if constexpr(R3D) {
+        wsq += bhc::max(STD::abs(part0.cnn), STD::abs(part0.cmm)) / o0.ccpx.real();
+    } else {
+        wsq += STD::abs(part0.cnn_csq) * o0.ccpx.real();
+    }
+    real hmax3 = Beam->stepMax * Beam->stepMax * Beam->stepMax;
+    if(wsq * hmax3 <= RL(24.0) * Beam->stepTol) return Beam->stepMax;
+    real h = STD::cbrt(RL(24.0) * Beam->stepTol / wsq);
+    return bhc::max(h, Beam->stepMin);
+}
+
 /**
  * Does a single step along the ray
  */
@@ -657,7 +706,7 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void Step(
     rayPt<R3D> ray0, rayPt<R3D> &ray2, BdryState<O3D> &bds,
     const BeamStructure<O3D> *Beam, const VEC23<O3D> &xs, const Origin<O3D, R3D> &org,
     const SSPStructure *ssp, SSPSegState &iSeg, ErrState *errState,
-    int32_t &iSmallStepCtr, bool &topRefl, bool &botRefl)
+    int32_t &iSmallStepCtr, bool &topRefl, bool &botRefl, RayCounters &rc)
 {
     rayPt<R3D> ray1;
     SSPOutputs<R3D> o0, o1, o2;
@@ -711,13 +760,18 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void Step(
     csq0   = SQ(o0.ccpx.real());
     urayt0 = o0.ccpx.real() * ray0.t; // unit tangent
     h      = Beam->deltas; // initially set the step h, to the basic one, deltas
+    if(Beam->stepTol > RL(0.0)) {
+        h = AdaptiveStepSize<O3D, R3D>(o0, part0, urayt0, csq0, Beam);
+    }
+    real hNominal = h;
 
     // printf("urayt0 (%g,%g)\n", urayt0.x, urayt0.y);
 
     // reduce h to land on boundary
     VEC23<O3D> x_o = RayToOceanX(ray0.x, org);
     VEC23<O3D> t_o = RayToOceanT(urayt0, org);
-    ReduceStep<O3D>(x_o, t_o, iSeg0, bds, Beam, xs, ssp, errState, h, iSmallStepCtr);
+    ReduceStep<CFG, O3D>(
+        x_o, t_o, iSeg0, bds, Beam, xs, ssp, errState, h, iSmallStepCtr);
     // printf("out h, urayt0 %20.17f (%20.17f, %20.17f)\n", h, urayt0.x, urayt0.y);
     real halfh = FL(0.5) * h; // first step of the modified polygon method is a half step
 
@@ -748,7 +802,10 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void Step(
 
     // reduce h to land on boundary
     t_o = RayToOceanT(urayt1, org);
-    ReduceStep<O3D>(x_o, t_o, iSeg0, bds, Beam, xs, ssp, errState, h, iSmallStepCtr);
+    ReduceStep<CFG, O3D>(
+        x_o, t_o, iSeg0, bds, Beam, xs, ssp, errState, h, iSmallStepCtr);
+    if(h < hNominal) BHC_PERF_COUNT(rc, BHC_PERF_REDUCED_STEPS);
+    if(iSmallStepCtr > 0) BHC_PERF_COUNT(rc, BHC_PERF_SMALL_STEPS);
 
     // use blend of f' based on proportion of a full step used.
     w1 = h / (RL(2.0) * halfh);
@@ -761,9 +818,14 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void Step(
     VEC23<O3D> x2_o;
     t_o = RayToOceanT(urayt2, org);
     int32_t snapDim;
-    StepToBdry<O3D>(
+    StepToBdry<CFG, O3D>(
         x_o, x2_o, t_o, h, topRefl, botRefl, snapDim, iSeg0, bds, Beam, xs, ssp,
-        errState);
+        errState, hNominal);
+    if(snapDim == -2) {
+        BHC_PERF_COUNT(rc, BHC_PERF_TRIDIAG_CROSSINGS);
+    } else if(snapDim != -1) {
+        BHC_PERF_COUNT(rc, BHC_PERF_BDRY_SNAPS);
+    }
     ray2.x = OceanToRayX(x2_o, org, urayt2, snapDim, errState);
 #ifdef STEP_DEBUGGING
     if constexpr(O3D && !R3D) {
@@ -805,6 +867,7 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void Step(
        || (R3D && (iSeg.x != iSeg0.x || iSeg.y != iSeg0.y))) {
         VEC23<R3D> gradcjump = o2.gradc - o0.gradc;
         CurvatureCorrection<R3D>(ray2, gradcjump, iSeg, iSeg0);
+        BHC_PERF_COUNT(rc, BHC_PERF_SSP_CROSSINGS);
     }
     // if constexpr(R3D){
     //     PrintMatrix(ray2.p, "ray2.p");
@@ -33,11 +33,17 @@ namespace bhc {
  * Topx, Botx: top, bottom coordinate
  * Topn, Botn: top, bottom normal vector (outward)
  * DistTop, DistBot: distance (normal to bdry) from the ray to top, bottom boundary
+ * FLAT: both boundaries are flat (see BdryShape), so the normals are vertical
  */
-template<bool O3D> HOST_DEVICE inline void Distances(
+template<bool O3D, bool FLAT = false> HOST_DEVICE inline void Distances(
     const VEC23<O3D> &rayx, const VEC23<O3D> &Topx, const VEC23<O3D> &Botx,
     const VEC23<O3D> &Topn, const VEC23<O3D> &Botn, real &DistTop, real &DistBot)
 {
+    if constexpr(FLAT) {
+        DistTop = -DEP(Topn) * (DEP(rayx) - DEP(Topx));
+        DistBot = -DEP(Botn) * (DEP(rayx) - DEP(Botx));
+        return;
+    }
     VEC23<O3D> dTop = rayx - Topx; // vector pointing from top    bdry to ray
     VEC23<O3D> dBot = rayx - Botx; // vector pointing from bottom bdry to ray
     DistTop         = -glm::dot(Topn, dTop);
@@ -145,10 +151,9 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline bool RayInit(
         + s * sbp->SrcBmPat[2 * (ibp + 1) + 1]; // initial amplitude
 
     // Lloyd mirror pattern for semi-coherent option
-    if(IsSemiCoherentRun(Beam)) {
-        float omega = FL(2.0) * REAL_PI * freqinfo->freq0;
-        Amp0 *= STD::sqrt(FL(2.0))
-            * STD::abs(STD::sin(omega / o.ccpx.real() * DEP(xs) * STD::sin(rinit.alpha)));
+    // With allTLTypes, it is applied in the influence instead.
+    if(IsSemiCoherentRun(Beam) && !Beam->allTLTypes) {
+        Amp0 *= LloydMirrorFactor(freqinfo->freq0, o.ccpx.real(), DEP(xs), rinit.alpha);
     }
 
     // LP: This part from TraceRay
@@ -170,7 +175,7 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline bool RayInit(
     }
     point0.c         = o.ccpx.real();
     point0.t         = tinit2 / o.ccpx.real();
-    point0.tau       = cpx(FL(0.0), FL(0.0));
+    point0.tau       = cpxacc(FL(0.0), FL(0.0));
     point0.Amp       = Amp0;
     point0.Phase     = FL(0.0);
     point0.NumTopBnc = 0;
@@ -276,12 +281,14 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline bool RayUpdate(
     real &DistEndBot, int32_t &iSmallStepCtr, const Origin<O3D, R3D> &org,
     SSPSegState &iSeg, BdryState<O3D> &bds, BdryType &Bdry, const BdryInfo<O3D> *bdinfo,
     const ReflectionInfo *refl, const SSPStructure *ssp, const FreqInfo *freqinfo,
-    const BeamStructure<O3D> *Beam, const VEC23<O3D> &xs, ErrState *errState)
+    const BeamStructure<O3D> *Beam, const VEC23<O3D> &xs, ErrState *errState,
+    RayCounters &rc)
 {
     bool topRefl, botRefl;
     Step<CFG, O3D, R3D>(
         point0, point1, bds, Beam, xs, org, ssp, iSeg, errState, iSmallStepCtr, topRefl,
-        botRefl);
+        botRefl, rc);
+    BHC_PERF_COUNT(rc, BHC_PERF_STEPS);
     /*
     if(point0.x == point1.x){
         printf("Ray did not move from (%g,%g), bailing\n", point0.x.x, point0.x.y);
@@ -289,17 +296,23 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline bool RayUpdate(
     }
     */
 
-    VEC23<O3D> x_o = RayToOceanX(point1.x, org);
-    VEC23<O3D> t_o = RayToOceanT(point1.t, org);
-    GetBdrySeg<O3D>(x_o, t_o, bds.top, &bdinfo->top, Bdry.Top, true, false, errState);
-    GetBdrySeg<O3D>(x_o, t_o, bds.bot, &bdinfo->bot, Bdry.Bot, false, false, errState);
+    constexpr bool flat = CFG::bdry::IsFlat();
+    VEC23<O3D> x_o      = RayToOceanX(point1.x, org);
+    if constexpr(!flat) {
+        // Flat boundaries have one segment, which extends past the beam box.
+        VEC23<O3D> t_o = RayToOceanT(point1.t, org);
+        GetBdrySeg<O3D>(
+            x_o, t_o, bds.top, &bdinfo->top, Bdry.Top, true, false, errState);
+        GetBdrySeg<O3D>(
+            x_o, t_o, bds.bot, &bdinfo->bot, Bdry.Bot, false, false, errState);
+    }
 
     // Reflections?
     // Tests that ray at step is is inside, and ray at step is+1 is outside
     // to detect only a crossing from inside to outside
     // DistBeg is the distance at point0, which is saved
     // DistEnd is the distance at point1, which needs to be calculated
-    Distances<O3D>(
+    Distances<O3D, flat>(
         x_o, bds.top.x, bds.bot.x, bds.top.n, bds.bot.n, DistEndTop, DistEndBot);
 
     // LP: Merging these cases is important for GPU performance.
@@ -307,6 +320,7 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline bool RayUpdate(
 #ifdef STEP_DEBUGGING
         printf(topRefl ? "Top reflecting\n" : "Bottom reflecting\n");
 #endif
+        BHC_PERF_COUNT(rc, topRefl ? BHC_PERF_TOP_REFL : BHC_PERF_BOT_REFL);
         const BdryInfoTopBot<O3D> &bdi     = topRefl ? bdinfo->top : bdinfo->bot;
         const BdryStateTopBot<O3D> &bdstb  = topRefl ? bds.top : bds.bot;
         const HSInfo &hs                   = topRefl ? Bdry.Top.hs : Bdry.Bot.hs;
@@ -352,7 +366,7 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline bool RayUpdate(
             BdryPtFull<false> *bd1 = &bd0[1]; // LP: next segment
             // LP: FORTRAN actually checks if the whole string is just "C", not just the
             // first char
-            if(bdi.type[0] == 'C') {
+            if(!flat && bdi.type[0] == 'C') {
                 real sss = glm::dot(point1.x - bdstb.x, bd0->t)
                     / bd0->Len; // proportional
                                 // distance
@@ -364,7 +378,7 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline bool RayUpdate(
                 nInt = bd0->n; // normal is constant in a segment
                 tInt = bd0->t;
             }
-            rcurv.kappa = bd0->kappa;
+            rcurv.kappa = flat ? RL(0.0) : bd0->kappa;
         }
 
         Reflect<CFG, O3D, R3D>(
@@ -372,7 +386,7 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline bool RayUpdate(
             org, ssp, iSeg, errState);
         // Incrementing bounce count moved to Reflect
         x_o = RayToOceanX(point2.x, org);
-        Distances<O3D>(
+        Distances<O3D, flat>(
             x_o, bds.top.x, bds.bot.x, bds.top.n, bds.bot.n, DistEndTop, DistEndBot);
         return true;
     }
@@ -393,7 +407,8 @@ template<bool O3D, bool R3D> HOST_DEVICE inline bool RayTerminate(
     const int32_t &iSmallStepCtr, real &DistBegTop, real &DistBegBot,
     const real &DistEndTop, const real &DistEndBot, int32_t MaxPointsPerRay,
     const Origin<O3D, R3D> &org, [[maybe_unused]] const BdryInfo<O3D> *bdinfo,
-    const BeamStructure<O3D> *Beam, ErrState *errState)
+    const BeamStructure<O3D> *Beam, real Amp0, const FreqInfo *freqinfo,
+    ErrState *errState, RayCounters &rc)
 {
     bool leftbox, escapedboundaries, toomanysmallsteps;
     if constexpr(O3D) {
@@ -431,12 +446,32 @@ template<bool O3D, bool R3D> HOST_DEVICE inline bool RayTerminate(
         toomanysmallsteps = false; // LP: The small step counter is never checked in 2D.
     }
     bool lostenergy = point.Amp < FL(0.005);
+    if(Beam->ampCutoff > RL(0.0)) {
+        // The magnitude of exp(-i omega tau) is the volume attenuation.
+        real omega = FL(2.0) * REAL_PI * freqinfo->freq0;
+        lostenergy = lostenergy
+            || point.Amp * STD::exp(omega * (real)point.tau.imag())
+                < Beam->ampCutoff * Amp0;
+    }
+    bool bounced = Beam->maxBotBnc >= 0 && point.NumBotBnc > Beam->maxBotBnc;
     bool backward   = false;
     if constexpr(O3D && !R3D) {
         // backward = point.t.x < FL(0.0); // kills off a backward traveling ray
         // LP: Condition above is now (2022) commented out in Nx2D as well.
     }
-    if(leftbox || lostenergy || escapedboundaries || backward || toomanysmallsteps) {
+    if(leftbox || lostenergy || bounced || escapedboundaries || backward
+       || toomanysmallsteps) {
+        if(leftbox) {
+            BHC_PERF_COUNT(rc, BHC_PERF_TERM_BOX);
+        } else if(escapedboundaries) {
+            BHC_PERF_COUNT(rc, BHC_PERF_TERM_ESCAPED);
+        } else if(lostenergy) {
+            BHC_PERF_COUNT(rc, BHC_PERF_TERM_ENERGY);
+        } else if(bounced) {
+            BHC_PERF_COUNT(rc, BHC_PERF_TERM_BOUNCES);
+        } else if(toomanysmallsteps) {
+            BHC_PERF_COUNT(rc, BHC_PERF_TERM_SMALL_STEPS);
+        }
 #ifdef STEP_DEBUGGING
         if(leftbox) {
             if constexpr(O3D) {
@@ -453,6 +488,8 @@ template<bool O3D, bool R3D> HOST_DEVICE inline bool RayTerminate(
                 DistBegTop, DistEndTop, DistBegBot, DistEndBot);
         } else if(lostenergy) {
             printf("Ray energy dropped to %g\n", point.Amp);
+        } else if(bounced) {
+            printf("Ray reached bottom bounce limit %d\n", Beam->maxBotBnc);
         } else if(backward) {
             printf("Ray is going backwards\n");
         } else if(toomanysmallsteps) {
@@ -466,6 +503,7 @@ template<bool O3D, bool R3D> HOST_DEVICE inline bool RayTerminate(
         return true;
     } else if(is >= MaxPointsPerRay - 3) {
         RunWarning(errState, BHC_WARN_ONERAY_OUTOFMEMORY);
+        BHC_PERF_COUNT(rc, BHC_PERF_TERM_MAX_POINTS);
         // printf("Warning in TraceRay: Insufficient storage for ray trajectory\n");
         Nsteps = is;
         return true;
@@ -501,12 +539,14 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void MainRayMode(
 
     int32_t iSmallStepCtr = 0;
     int32_t is            = 0; // index for a step along the ray
+    RayCounters rc;
+    ResetRayCounters(rc);
 
     while(true) {
         if(HasErrored(errState)) break;
         bool twoSteps = RayUpdate<CFG, O3D, R3D>(
             ray[is], ray[is + 1], ray[is + 2], DistEndTop, DistEndBot, iSmallStepCtr, org,
-            iSeg, bds, Bdry, bdinfo, refl, ssp, freqinfo, Beam, xs, errState);
+            iSeg, bds, Bdry, bdinfo, refl, ssp, freqinfo, Beam, xs, errState, rc);
         if(Nsteps >= 0 && is >= Nsteps) {
             Nsteps = is + 2;
             break;
@@ -514,20 +554,192 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void MainRayMode(
         is += (twoSteps ? 2 : 1);
         if(RayTerminate<O3D, R3D>(
                ray[is], Nsteps, is, xs, iSmallStepCtr, DistBegTop, DistBegBot, DistEndTop,
-               DistEndBot, MaxPointsPerRay, org, bdinfo, Beam, errState))
+               DistEndBot, MaxPointsPerRay, org, bdinfo, Beam, ray[0].Amp, freqinfo,
+               errState, rc))
             break;
     }
+    FlushRayCounters(errState, rc);
+}
+
+/**
+ * Records the counts of a field run ray which has ended at point, see
+ * bhcInit::rayStats. The time is filled in by the caller.
+ */
+template<bool R3D> HOST_DEVICE inline void StoreRayStats(
+    bhcRayStats *stats, int32_t steps, int32_t influence, const rayPt<R3D> &point)
+{
+    if(stats == nullptr) return;
+    stats->steps     = steps;
+    stats->influence = influence;
+    stats->topRefl   = (uint16_t)bhc::min(point.NumTopBnc, (int32_t)65535);
+    stats->botRefl   = (uint16_t)bhc::min(point.NumBotBnc, (int32_t)65535);
 }
 
 /**
- * Main ray tracing function for TL, eigen, and arrivals runs.
+ * State of a ray being traced for a TL, eigen, or arrivals run, between the
+ * steps of FieldRayStep.
+ */
+template<bool O3D, bool R3D> struct FieldRay {
+    real DistBegTop, DistEndTop, DistBegBot, DistEndBot;
+    SSPSegState iSeg;
+    VEC23<O3D> xs, gradc;
+    BdryState<O3D> bds;
+    BdryType Bdry;
+    Origin<O3D, R3D> org;
+    rayPt<R3D> point0, point1, point2;
+    InfluenceRayInfo<R3D> inflray;
+    int32_t iSmallStepCtr;
+    int32_t is;     // index for a step along the ray
+    int32_t Nsteps; // not actually needed in TL mode, debugging only
+    real Amp0;
+    int32_t nInfluence;
+    RayCounters rc;
+};
+
+/**
+ * Starts tracing a ray for a field run. Returns false if the ray could not be
+ * started, in which case FieldRayStep and FieldRayEnd must not be called.
+ */
+template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline bool FieldRayBegin(
+    FieldRay<O3D, R3D> &ray, RayInitInfo &rinit, const BdryType *ConstBdry,
+    const BdryInfo<O3D> *bdinfo, const SSPStructure *ssp, const Position *Pos,
+    const AnglesStructure *Angles, const FreqInfo *freqinfo,
+    const BeamStructure<O3D> *Beam, const SBPInfo *sbp, ErrState *errState,
+    bool atomicField)
+{
+    ray.point2.c = NAN; // Silence incorrect g++ warning about maybe uninitialized;
+    // it is always set when doing two steps, and not used otherwise
+
+    if(!RayInit<CFG, O3D, R3D>(
+           rinit, ray.xs, ray.point0, ray.gradc, ray.DistBegTop, ray.DistBegBot, ray.org,
+           ray.iSeg, ray.bds, ray.Bdry, ConstBdry, bdinfo, ssp, Pos, Angles, freqinfo,
+           Beam, sbp, errState)) {
+        return false;
+    }
+
+    InfluenceRayInfo<R3D> &inflray = ray.inflray;
+    Init_Influence<CFG, O3D, R3D>(
+        inflray, ray.point0, rinit, ray.gradc, Pos, ray.org, ssp, ray.iSeg, Angles,
+        freqinfo, Beam, errState);
+    inflray.atomicField = atomicField;
+    if(CFG::run::IsTL() && IsBroadbandRun(ConstBdry)) {
+        inflray.Nfreq   = freqinfo->Nfreq;
+        inflray.freqVec = freqinfo->freqVec;
+    } else {
+        inflray.Nfreq   = 1;
+        inflray.freqVec = nullptr;
+    }
+    inflray.tlPlaneStride = CFG::run::IsTL() && Beam->allTLTypes
+        ? GetFieldSize(Pos, inflray.Nfreq)
+        : 0;
+
+    ray.iSmallStepCtr = 0;
+    ray.is            = 0;
+    ray.Nsteps        = 0;
+    ray.Amp0          = ray.point0.Amp;
+    ray.nInfluence    = 0;
+    ResetRayCounters(ray.rc);
+    return true;
+}
+
+/**
+ * Takes one (or two, across a boundary) steps along the ray and adds their
+ * influence. Returns false once the ray has terminated.
+ */
+template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline bool FieldRayStep(
+    FieldRay<O3D, R3D> &ray, cpxf *uAllSources, const BdryType *ConstBdry,
+    const BdryInfo<O3D> *bdinfo, const ReflectionInfo *refl, const SSPStructure *ssp,
+    const Position *Pos, const FreqInfo *freqinfo, const BeamStructure<O3D> *Beam,
+    EigenInfo *eigen, const ArrInfo *arrinfo, ErrState *errState)
+{
+    if(HasErrored(errState)) return false;
+    bool twoSteps = RayUpdate<CFG, O3D, R3D>(
+        ray.point0, ray.point1, ray.point2, ray.DistEndTop, ray.DistEndBot,
+        ray.iSmallStepCtr, ray.org, ray.iSeg, ray.bds, ray.Bdry, bdinfo, refl, ssp,
+        freqinfo, Beam, ray.xs, errState, ray.rc);
+    BHC_PERF_COUNT(ray.rc, BHC_PERF_INFLUENCE);
+    ++ray.nInfluence;
+    if(!Step_Influence<CFG, O3D, R3D>(
+           ray.point0, ray.point1, ray.inflray, ray.is, uAllSources, ConstBdry, ray.org,
+           ssp, ray.iSeg, Pos, Beam, eigen, arrinfo, errState)) {
+#ifdef STEP_DEBUGGING
+        printf("Step_Influence terminated ray\n");
+#endif
+        BHC_PERF_COUNT(ray.rc, BHC_PERF_TERM_INFLUENCE);
+        return false;
+    }
+    ++ray.is;
+    if(twoSteps) {
+        BHC_PERF_COUNT(ray.rc, BHC_PERF_INFLUENCE);
+        ++ray.nInfluence;
+        if(!Step_Influence<CFG, O3D, R3D>(
+               ray.point1, ray.point2, ray.inflray, ray.is, uAllSources, ConstBdry,
+               ray.org, ssp, ray.iSeg, Pos, Beam, eigen, arrinfo, errState)) {
+            BHC_PERF_COUNT(ray.rc, BHC_PERF_TERM_INFLUENCE);
+            return false;
+        }
+        ray.point0 = ray.point2;
+        ++ray.is;
+    } else {
+        ray.point0 = ray.point1;
+    }
+    return !RayTerminate<O3D, R3D>(
+        ray.point0, ray.Nsteps, ray.is, ray.xs, ray.iSmallStepCtr, ray.DistBegTop,
+        ray.DistBegBot, ray.DistEndTop, ray.DistEndBot, MaxN, ray.org, bdinfo, Beam,
+        ray.Amp0, freqinfo, errState, ray.rc);
+}
+
+/// Finishes a ray started by FieldRayBegin, see StoreRayStats.
+template<bool O3D, bool R3D> HOST_DEVICE inline void FieldRayEnd(
+    FieldRay<O3D, R3D> &ray, ErrState *errState, bhcRayStats *stats)
+{
+    FlushRayCounters(errState, ray.rc);
+    StoreRayStats<R3D>(stats, ray.is, ray.nInfluence, ray.point0);
+}
+
+/**
+ * Main ray tracing function for TL, eigen, and arrivals runs. If stats is not
+ * null, the ray's counts are stored there (see StoreRayStats). If tile is not
+ * null, TL contributions inside it go there (see FieldTile), and if stage is
+ * not null, eigenray hits go there while it has space (see HitStage).
  */
 template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void MainFieldModes(
     RayInitInfo &rinit, cpxf *uAllSources, const BdryType *ConstBdry,
     const BdryInfo<O3D> *bdinfo, const ReflectionInfo *refl, const SSPStructure *ssp,
     const Position *Pos, const AnglesStructure *Angles, const FreqInfo *freqinfo,
     const BeamStructure<O3D> *Beam, const SBPInfo *sbp, EigenInfo *eigen,
-    const ArrInfo *arrinfo, ErrState *errState)
+    const ArrInfo *arrinfo, ErrState *errState, bhcRayStats *stats = nullptr,
+    bool atomicField = true, const FieldTile *tile = nullptr,
+    const HitStage *stage = nullptr)
+{
+    FieldRay<O3D, R3D> ray;
+    if(!FieldRayBegin<CFG, O3D, R3D>(
+           ray, rinit, ConstBdry, bdinfo, ssp, Pos, Angles, freqinfo, Beam, sbp,
+           errState, atomicField)) {
+        return;
+    }
+    ray.inflray.tile  = tile;
+    ray.inflray.stage = stage;
+    while(FieldRayStep<CFG, O3D, R3D>(
+        ray, uAllSources, ConstBdry, bdinfo, refl, ssp, Pos, freqinfo, Beam, eigen,
+        arrinfo, errState)) {}
+    FieldRayEnd<O3D, R3D>(ray, errState, stats);
+
+    // printf("Nsteps %d\n", ray.Nsteps);
+}
+
+/**
+ * Traces a ray for a field run without computing its influence, storing its
+ * points in ray (at least MaxN long) and their number in Nsteps (0 if the ray
+ * could not be started), see bhcInit::retainRays. These are the same points
+ * MainFieldModes passes to Step_Influence, except that the ray is not cut
+ * short once it has passed all the receivers.
+ */
+template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void RecordFieldRay(
+    RayInitInfo &rinit, rayPt<R3D> *ray, int32_t &Nsteps, const BdryType *ConstBdry,
+    const BdryInfo<O3D> *bdinfo, const ReflectionInfo *refl, const SSPStructure *ssp,
+    const Position *Pos, const AnglesStructure *Angles, const FreqInfo *freqinfo,
+    const BeamStructure<O3D> *Beam, const SBPInfo *sbp, ErrState *errState)
 {
     real DistBegTop, DistEndTop, DistBegBot, DistEndBot;
     SSPSegState iSeg;
@@ -536,56 +748,102 @@ template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void MainFieldMode
     BdryType Bdry;
     Origin<O3D, R3D> org;
 
-    rayPt<R3D> point0, point1, point2;
-    point2.c = NAN; // Silence incorrect g++ warning about maybe uninitialized;
-    // it is always set when doing two steps, and not used otherwise
-    InfluenceRayInfo<R3D> inflray;
-
+    Nsteps = 0;
     if(!RayInit<CFG, O3D, R3D>(
-           rinit, xs, point0, gradc, DistBegTop, DistBegBot, org, iSeg, bds, Bdry,
+           rinit, xs, ray[0], gradc, DistBegTop, DistBegBot, org, iSeg, bds, Bdry,
            ConstBdry, bdinfo, ssp, Pos, Angles, freqinfo, Beam, sbp, errState)) {
         return;
     }
 
-    Init_Influence<CFG, O3D, R3D>(
-        inflray, point0, rinit, gradc, Pos, org, ssp, iSeg, Angles, freqinfo, Beam,
-        errState);
-
     int32_t iSmallStepCtr = 0;
     int32_t is            = 0; // index for a step along the ray
-    int32_t Nsteps        = 0; // not actually needed in TL mode, debugging only
+    int32_t NstepsTerm    = 0; // Not used, see below
+    real Amp0             = ray[0].Amp;
+    RayCounters rc;
+    ResetRayCounters(rc);
 
     while(true) {
         if(HasErrored(errState)) break;
         bool twoSteps = RayUpdate<CFG, O3D, R3D>(
-            point0, point1, point2, DistEndTop, DistEndBot, iSmallStepCtr, org, iSeg, bds,
-            Bdry, bdinfo, refl, ssp, freqinfo, Beam, xs, errState);
-        if(!Step_Influence<CFG, O3D, R3D>(
-               point0, point1, inflray, is, uAllSources, ConstBdry, org, ssp, iSeg, Pos,
-               Beam, eigen, arrinfo, errState)) {
-#ifdef STEP_DEBUGGING
-            printf("Step_Influence terminated ray\n");
-#endif
-            break;
-        }
-        ++is;
-        if(twoSteps) {
-            if(!Step_Influence<CFG, O3D, R3D>(
-                   point1, point2, inflray, is, uAllSources, ConstBdry, org, ssp, iSeg,
-                   Pos, Beam, eigen, arrinfo, errState))
-                break;
-            point0 = point2;
-            ++is;
-        } else {
-            point0 = point1;
-        }
+            ray[is], ray[is + 1], ray[is + 2], DistEndTop, DistEndBot, iSmallStepCtr, org,
+            iSeg, bds, Bdry, bdinfo, refl, ssp, freqinfo, Beam, xs, errState, rc);
+        is += (twoSteps ? 2 : 1);
         if(RayTerminate<O3D, R3D>(
-               point0, Nsteps, is, xs, iSmallStepCtr, DistBegTop, DistBegBot, DistEndTop,
-               DistEndBot, MaxN, org, bdinfo, Beam, errState))
+               ray[is], NstepsTerm, is, xs, iSmallStepCtr, DistBegTop, DistBegBot,
+               DistEndTop, DistEndBot, MaxN, org, bdinfo, Beam, Amp0, freqinfo, errState,
+               rc))
             break;
     }
+    // The influence counters are added by ReplayFieldModes.
+    FlushRayCounters(errState, rc, 0, BHC_PERF_INFLUENCE);
+    // Unlike the Nsteps from RayTerminate, always including the last
+    // point, as MainFieldModes has already computed its influence when it
+    // stops because of MaxN.
+    Nsteps = is + 1;
+}
 
-    // printf("Nsteps %d\n", Nsteps);
+/**
+ * Computes the influence of a ray from RecordFieldRay, the same as
+ * MainFieldModes would while tracing it, including its stats.
+ */
+template<typename CFG, bool O3D, bool R3D> HOST_DEVICE inline void ReplayFieldModes(
+    RayInitInfo &rinit, const rayPt<R3D> *ray, int32_t Nsteps, cpxf *uAllSources,
+    const BdryType *ConstBdry, const BdryInfo<O3D> *bdinfo, const SSPStructure *ssp,
+    const Position *Pos, const AnglesStructure *Angles, const FreqInfo *freqinfo,
+    const BeamStructure<O3D> *Beam, const SBPInfo *sbp, EigenInfo *eigen,
+    const ArrInfo *arrinfo, ErrState *errState, bhcRayStats *stats = nullptr,
+    bool atomicField = true)
+{
+    if(Nsteps < 1) return;
+    real DistBegTop, DistBegBot;
+    SSPSegState iSeg;
+    VEC23<O3D> xs, gradc;
+    BdryState<O3D> bds;
+    BdryType Bdry;
+    Origin<O3D, R3D> org;
+    rayPt<R3D> point0;
+    InfluenceRayInfo<R3D> inflray;
+
+    // Repeated for the origin, SSP segment, and gradient at the source,
+    // which are not stored with the ray. The segment found by later SSP
+    // evaluations only depends on the point, not on where the search started.
+    if(!RayInit<CFG, O3D, R3D>(
+           rinit, xs, point0, gradc, DistBegTop, DistBegBot, org, iSeg, bds, Bdry,
+           ConstBdry, bdinfo, ssp, Pos, Angles, freqinfo, Beam, sbp, errState)) {
+        return;
+    }
+
+    Init_Influence<CFG, O3D, R3D>(
+        inflray, ray[0], rinit, gradc, Pos, org, ssp, iSeg, Angles, freqinfo, Beam,
+        errState);
+    inflray.atomicField = atomicField;
+    if(CFG::run::IsTL() && IsBroadbandRun(ConstBdry)) {
+        inflray.Nfreq   = freqinfo->Nfreq;
+        inflray.freqVec = freqinfo->freqVec;
+    } else {
+        inflray.Nfreq   = 1;
+        inflray.freqVec = nullptr;
+    }
+    inflray.tlPlaneStride = CFG::run::IsTL() && Beam->allTLTypes
+        ? GetFieldSize(Pos, inflray.Nfreq)
+        : 0;
+
+    int32_t nInfluence = 0;
+    RayCounters rc;
+    ResetRayCounters(rc);
+    for(int32_t is = 0; is < Nsteps - 1; ++is) {
+        if(HasErrored(errState)) break;
+        BHC_PERF_COUNT(rc, BHC_PERF_INFLUENCE);
+        ++nInfluence;
+        if(!Step_Influence<CFG, O3D, R3D>(
+               ray[is], ray[is + 1], inflray, is, uAllSources, ConstBdry, org, ssp, iSeg,
+               Pos, Beam, eigen, arrinfo, errState)) {
+            BHC_PERF_COUNT(rc, BHC_PERF_TERM_INFLUENCE);
+            break;
+        }
+    }
+    FlushRayCounters(errState, rc, BHC_PERF_INFLUENCE);
+    StoreRayStats<R3D>(stats, Nsteps - 1, nInfluence, ray[Nsteps - 1]);
 }
 
 } // namespace bhc
@@ -158,4 +158,91 @@ template<typename INT> HOST_DEVICE inline INT AtomicFetchAdd(INT *ptr, INT val)
 #endif
 }
 
+template<typename INT> HOST_DEVICE inline INT AtomicLoad(INT *ptr)
+{
+#ifdef __CUDA_ARCH__
+    return *(volatile INT *)ptr;
+#elif defined(__GNUC__)
+    return __atomic_load_n(ptr, __ATOMIC_RELAXED);
+#elif defined(_MSC_VER)
+    return InterlockedOr((LONG *)ptr, 0); // MSVC does not have a pure atomic load.
+#else
+#error "Unrecognized compiler for atomic intrinsics!"
+#endif
+}
+
+/**
+ * Sets *ptr to desired if it is expected. Returns the previous value of *ptr
+ * either way.
+ */
+template<typename INT> HOST_DEVICE inline INT AtomicCompareExchange(
+    INT *ptr, INT expected, INT desired)
+{
+#ifdef __CUDA_ARCH__
+    return atomicCAS(ptr, expected, desired);
+#elif defined(__GNUC__)
+    __atomic_compare_exchange_n(
+        ptr, &expected, desired, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return expected;
+#elif defined(_MSC_VER)
+    return InterlockedCompareExchange((LONG *)ptr, (LONG)desired, (LONG)expected);
+#else
+#error "Unrecognized compiler for atomic intrinsics!"
+#endif
+}
+
+/// Sets *ptr to desired and returns its previous value.
+template<typename INT> HOST_DEVICE inline INT AtomicExchange(INT *ptr, INT desired)
+{
+#ifdef __CUDA_ARCH__
+    return atomicExch(ptr, desired);
+#elif defined(__GNUC__)
+    return __atomic_exchange_n(ptr, desired, __ATOMIC_RELAXED);
+#elif defined(_MSC_VER)
+    return InterlockedExchange((LONG *)ptr, (LONG)desired);
+#else
+#error "Unrecognized compiler for atomic intrinsics!"
+#endif
+}
+
+/**
+ * Makes this thread's earlier writes visible to other threads before any of
+ * its later ones, e.g. before an atomic which publishes them.
+ */
+HOST_DEVICE inline void ThreadFence()
+{
+#ifdef __CUDA_ARCH__
+    __threadfence();
+#elif defined(__GNUC__)
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#elif defined(_MSC_VER)
+    MemoryBarrier();
+#else
+#error "Unrecognized compiler for atomic intrinsics!"
+#endif
+}
+
+/**
+ * Like AtomicFetchAdd(ptr, 1), for counters which many threads increment at
+ * once. On GPU, the active threads of a warp which increment the same counter
+ * take consecutive values from a single atomic by the first of them, instead
+ * of each doing its own atomic on the same address.
+ */
+template<typename INT> HOST_DEVICE inline INT AtomicIncrementWarp(INT *ptr)
+{
+#if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 700
+    uint32_t active = __activemask();
+    uint32_t peers  = __match_any_sync(active, (unsigned long long)ptr);
+    int32_t lane    = threadIdx.x & 31;
+    int32_t leader  = __ffs(peers) - 1;
+    INT base        = 0;
+    if(lane == leader) base = atomicAdd(ptr, (INT)__popc(peers));
+    base = __shfl_sync(peers, base, leader);
+    return base + (INT)__popc(peers & ((1u << lane) - 1u));
+#else
+    // __match_any_sync needs compute 7.0. On CPU, threads rarely collide.
+    return AtomicFetchAdd(ptr, (INT)1);
+#endif
+}
+
 } // namespace bhc
@@ -34,10 +34,11 @@ public:
     DirectOFile(bhcInternal *internal)
         : _internal(internal), recl(0), record(777777777),
           bytesWrittenThisRecord(777777777), highestRecord(0),
-          bytesWrittenHighestRecord(0)
+          bytesWrittenHighestRecord(0), bulkRec(0), bulkBytes(0)
     {}
     ~DirectOFile()
     {
+        flush();
         if(!ostr.is_open()) return;
         // End of highest record may not have been filled up, causing the file
         // length to be too short, if only part of it was written
@@ -61,6 +62,7 @@ public:
 
     void rec(size_t r)
     {
+        flush();
         if(r >= highestRecord) {
             highestRecord             = r;
             bytesWrittenHighestRecord = 0;
@@ -88,7 +90,54 @@ public:
         write(file, fline, &v, sizeof(T));
     }
 
+    /**
+     * Writes all of record r at once: bytes (at most the record length) from
+     * data, then zeros to the end of the record. Consecutive records are
+     * gathered into a buffer and written with a single call, on a background
+     * thread while the caller gathers the next ones. data may be reused as
+     * soon as this returns. The writes are finished by flush(), rec(), or
+     * closing the file.
+     */
+#define DOFWRITEREC(d, r, data, bytes) d.writerec(__FILE__, __LINE__, r, data, bytes)
+    void writerec(const char *file, int fline, size_t r, const void *data, size_t bytes)
+    {
+        if(bytes > recl) {
+            ExternalError(
+                _internal,
+                "%s:%d: DirectOFile overflow, rec size %" PRIuMAX
+                ", tried to write %" PRIuMAX,
+                file, fline, recl, bytes);
+        }
+        if(bulkBytes > 0
+           && (r != bulkRec + bulkBytes / recl || bulkBytes + recl > bulkFill.size())) {
+            startBulkWrite();
+        }
+        if(bulkBytes == 0) {
+            bulkRec = r;
+            if(bulkFill.empty()) {
+                bulkFill.resize(bhc::max(BulkBufferBytes / recl, (size_t)1) * recl);
+            }
+        }
+        memcpy(&bulkFill[bulkBytes], data, bytes);
+        memset(&bulkFill[bulkBytes + bytes], 0, recl - bytes);
+        bulkBytes += recl;
+        if(r >= highestRecord) {
+            highestRecord             = r;
+            bytesWrittenHighestRecord = recl;
+        }
+    }
+
+    /// Finishes all writes from writerec.
+    void flush()
+    {
+        if(bulkBytes > 0) startBulkWrite();
+        if(bulkThread.joinable()) bulkThread.join();
+    }
+
 private:
+    /// Gathering buffer size for writerec.
+    static constexpr size_t BulkBufferBytes = 8u << 20;
+
     bhcInternal *_internal;
     std::ofstream ostr;
     size_t recl;
@@ -96,6 +145,23 @@ private:
     size_t bytesWrittenThisRecord;
     size_t highestRecord;
     size_t bytesWrittenHighestRecord;
+    // writerec double buffering: records are gathered into bulkFill while
+    // bulkThread writes bulkWrite to the file.
+    std::vector<char> bulkFill, bulkWrite;
+    size_t bulkRec, bulkBytes;
+    std::thread bulkThread;
+
+    void startBulkWrite()
+    {
+        if(bulkThread.joinable()) bulkThread.join();
+        bulkFill.swap(bulkWrite);
+        size_t offset = bulkRec * recl, bytes = bulkBytes;
+        bulkBytes     = 0;
+        bulkThread    = std::thread([this, offset, bytes]() {
+            ostr.seekp(offset);
+            ostr.write(bulkWrite.data(), bytes);
+        });
+    }
 
     void checkAndIncrement(const char *file, int fline, size_t bytes)
     {
@@ -114,27 +180,27 @@ private:
     }
 };
 
+/**
+ * C++ emulation of FORTRAN direct input (binary), reading from a memory mapped
+ * file (see MappedFile).
+ */
 class DirectIFile {
 public:
-    DirectIFile(bhcInternal *internal) : _internal(internal), recl(0) {}
-    ~DirectIFile()
-    {
-        if(!istr.is_open()) return;
-        istr.close();
-    }
+    DirectIFile(bhcInternal *internal) : _internal(internal), recl(0), pos(0) {}
 
     void open(const std::string &path)
     {
-        istr.open(path, std::ios::binary);
-        if(!(istr.good() && istr.is_open())) {
+        if(!mapping.open(path)) {
             ExternalError(_internal, "Failed to open DirectIFile %s", path.c_str());
         }
+        fileLen = mapping.size();
         int32_t temp;
-        istr.read((char *)&temp, 4);
+        if(fileLen < 4) {
+            ExternalError(_internal, "DirectIFile %s is too short", path.c_str());
+        }
+        memcpy(&temp, mapping.data(), 4);
         recl = temp * 4;
-        istr.seekg(0, istr.end);
-        fileLen = istr.tellg();
-        if((fileLen % recl) != 0) {
+        if(recl == 0 || (fileLen % recl) != 0) {
             ExternalError(
                 _internal,
                 "DirectIFile %s file length %" PRIuMAX
@@ -154,8 +220,8 @@ public:
                 " out of bounds, record length is %" PRIuMAX ", file length is %" PRIuMAX,
                 file, fline, r, recl, fileLen);
         }
-        record = r;
-        istr.seekg(a);
+        record              = r;
+        pos                 = a;
         bytesReadThisRecord = 0;
     }
 
@@ -163,16 +229,16 @@ public:
     void read(const char *file, int fline, void *data, size_t bytes)
     {
         checkAndIncrement(file, fline, bytes);
-        istr.read((char *)data, bytes);
+        memcpy(data, mapping.data() + pos, bytes);
+        pos += bytes;
     }
 
 #define DIFREADS(d, bytes) d.readstring(__FILE__, __LINE__, bytes)
     std::string readstring(const char *file, int fline, size_t bytes)
     {
-        char *s = new char[bytes];
-        read(file, fline, s, bytes);
-        std::string ret(s, bytes);
-        delete[] s;
+        checkAndIncrement(file, fline, bytes);
+        std::string ret(mapping.data() + pos, bytes);
+        pos += bytes;
         return ret;
     }
 
@@ -186,16 +252,17 @@ public:
     void skip(const char *file, int fline, size_t bytes)
     {
         checkAndIncrement(file, fline, bytes);
-        istr.seekg((int)bytes, istr.cur);
+        pos += bytes;
     }
 
 private:
     bhcInternal *_internal;
-    std::ifstream istr;
+    MappedFile mapping;
     size_t recl;
     size_t record;
     size_t bytesReadThisRecord;
     size_t fileLen;
+    size_t pos;
 
     void checkAndIncrement(const char *file, int fline, size_t bytes)
     {
@@ -110,8 +110,26 @@ static const char *const warningDescriptions[BHC_WARN_MAX] = {
     "consistent way, edge case issues may result",
 };
 
+void ResetPerfCounters(bhcInternal *internal)
+{
+    memset(&internal->perfCounters, 0, sizeof(bhcPerfCounters));
+#ifdef BHC_PERF_COUNTERS
+    internal->perfCounters.enabled = true;
+#endif
+}
+
 void CheckReportErrors(bhcInternal *internal, const ErrState *errState)
 {
+#ifdef BHC_PERF_COUNTERS
+    bhcPerfCounters &perf = internal->perfCounters;
+    perf.rays += errState->perfRays.load(STD::memory_order_acquire);
+    for(int32_t c = 0; c < BHC_PERF_MAX; ++c) {
+        perf.total[c] += errState->perfTotal[c].load(STD::memory_order_acquire);
+        for(int32_t b = 0; b < BHC_PERF_HIST_BINS; ++b) {
+            perf.hist[c][b] += errState->perfHist[c][b].load(STD::memory_order_acquire);
+        }
+    }
+#endif
     uint32_t error     = errState->error.load(STD::memory_order_acquire);
     uint32_t warning   = errState->warning.load(STD::memory_order_acquire);
     uint32_t errCount  = errState->errCount.load(STD::memory_order_acquire);
@@ -28,8 +28,31 @@ struct bhcInternal;
 
 struct ErrState {
     STD::atomic<uint32_t> error, warning, errCount, warnCount;
+#ifdef BHC_PERF_COUNTERS
+    // See bhc::get_perf_counters. Each ray's counts are collected in a
+    // RayCounters while it is traced, and added here when it ends.
+    STD::atomic<uint64_t> perfRays;
+    STD::atomic<uint64_t> perfTotal[BHC_PERF_MAX];
+    STD::atomic<uint32_t> perfHist[BHC_PERF_MAX][BHC_PERF_HIST_BINS];
+#endif
+};
+
+/**
+ * Event counts for the ray being traced, see bhcPerfCounters. Empty, and
+ * BHC_PERF_COUNT does nothing, unless built with BHC_PERF_COUNTERS.
+ */
+struct RayCounters {
+#ifdef BHC_PERF_COUNTERS
+    uint32_t c[BHC_PERF_MAX];
+#endif
 };
 
+#ifdef BHC_PERF_COUNTERS
+#define BHC_PERF_COUNT(rc, ctr) ++(rc).c[ctr]
+#else
+#define BHC_PERF_COUNT(rc, ctr) (void)(rc)
+#endif
+
 [[noreturn]] extern void ExternalError(bhcInternal *internal, const char *format, ...);
 extern void ExternalWarning(bhcInternal *internal, const char *format, ...);
 #define EXTERR(...) ExternalError(GetInternal(params), __VA_ARGS__)
@@ -55,9 +78,51 @@ inline HOST_DEVICE void ResetErrState(ErrState *errState)
     errState->warning   = 0u;
     errState->errCount  = 0u;
     errState->warnCount = 0u;
+#ifdef BHC_PERF_COUNTERS
+    errState->perfRays = 0u;
+    for(int32_t c = 0; c < BHC_PERF_MAX; ++c) {
+        errState->perfTotal[c] = 0u;
+        for(int32_t b = 0; b < BHC_PERF_HIST_BINS; ++b) errState->perfHist[c][b] = 0u;
+    }
+#endif
 }
 extern void CheckReportErrors(bhcInternal *internal, const ErrState *errState);
 
+inline HOST_DEVICE void ResetRayCounters([[maybe_unused]] RayCounters &rc)
+{
+#ifdef BHC_PERF_COUNTERS
+    for(int32_t c = 0; c < BHC_PERF_MAX; ++c) rc.c[c] = 0u;
+#endif
+}
+/**
+ * Adds the counts of a ray which has ended to the totals and histograms.
+ * Only counters first through end - 1 are added; the ray itself is counted
+ * if first is 0. This is so that retained rays (see bhcInit::retainRays),
+ * which are traced and then have their influence computed separately, are
+ * only counted once.
+ */
+inline HOST_DEVICE void FlushRayCounters(
+    [[maybe_unused]] ErrState *errState, [[maybe_unused]] const RayCounters &rc,
+    [[maybe_unused]] int32_t first = 0, [[maybe_unused]] int32_t end = BHC_PERF_MAX)
+{
+#ifdef BHC_PERF_COUNTERS
+    if(first == 0) errState->perfRays.fetch_add(1u, STD::memory_order_relaxed);
+    for(int32_t c = first; c < end; ++c) {
+        uint32_t n = rc.c[c];
+        int32_t b  = 0;
+        while(n != 0u && b < BHC_PERF_HIST_BINS - 1) {
+            n >>= 1;
+            ++b;
+        }
+        if(rc.c[c] != 0u) {
+            errState->perfTotal[c].fetch_add(rc.c[c], STD::memory_order_relaxed);
+        }
+        errState->perfHist[c][b].fetch_add(1u, STD::memory_order_relaxed);
+    }
+#endif
+}
+extern void ResetPerfCounters(bhcInternal *internal);
+
 #define BHC_ERR_TEMPLATE 0
 #define BHC_ERR_JOBNUM 1
 #define BHC_ERR_RAYINIT 2
@@ -0,0 +1,98 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#ifndef _BHC_INCLUDING_COMPONENTS_
+#error "Must be included from common_setup.hpp!"
+#endif
+
+#include <complex>
+#include <vector>
+
+namespace bhc {
+
+/**
+ * In-place radix-2 complex FFT of a fixed power-of-two size, in double
+ * precision. The twiddle factors and bit reversal permutation are computed
+ * once, so one plan can be shared by any number of threads transforming their
+ * own buffers. Unnormalized in both directions: Inverse(Forward(x)) == n * x.
+ */
+class FFTPlan {
+public:
+    using cpxd = std::complex<double>;
+
+    /// n must be a power of 2.
+    explicit FFTPlan(size_t n) : n(n), rev(n), twiddle(n / 2)
+    {
+        int32_t bits = 0;
+        while(((size_t)1 << bits) < n) ++bits;
+        for(size_t i = 0; i < n; ++i) {
+            size_t r = 0;
+            for(int32_t b = 0; b < bits; ++b) r |= ((i >> b) & 1) << (bits - 1 - b);
+            rev[i] = r;
+        }
+        // Directly rather than by recurrence, so the error does not grow
+        // with n.
+        for(size_t k = 0; k < n / 2; ++k) {
+            double a   = -2.0 * M_PI * (double)k / (double)n;
+            twiddle[k] = cpxd(std::cos(a), std::sin(a));
+        }
+    }
+
+    size_t Size() const { return n; }
+
+    /// X[k] = sum_j x[j] exp(-2 pi i j k / n)
+    void Forward(cpxd *data) const { Transform(data, false); }
+    /// x[j] = sum_k X[k] exp(+2 pi i j k / n)
+    void Inverse(cpxd *data) const { Transform(data, true); }
+
+    /// Smallest power of 2 >= m.
+    static size_t NextSize(size_t m)
+    {
+        size_t s = 1;
+        while(s < m) s <<= 1;
+        return s;
+    }
+
+private:
+    void Transform(cpxd *data, bool inverse) const
+    {
+        for(size_t i = 0; i < n; ++i) {
+            if(i < rev[i]) std::swap(data[i], data[rev[i]]);
+        }
+        for(size_t len = 2; len <= n; len <<= 1) {
+            size_t half = len / 2, step = n / len;
+            for(size_t s = 0; s < n; s += len) {
+                for(size_t j = 0; j < half; ++j) {
+                    cpxd w = twiddle[j * step];
+                    if(inverse) w = std::conj(w);
+                    cpxd u = data[s + j], v = data[s + j + half] * w;
+                    data[s + j]        = u + v;
+                    data[s + j + half] = u - v;
+                }
+            }
+        }
+    }
+
+    size_t n;
+    std::vector<size_t> rev;
+    std::vector<cpxd> twiddle;
+};
+
+} // namespace bhc
@@ -0,0 +1,183 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#ifndef _BHC_INCLUDING_COMPONENTS_
+#error "Must be included from common.hpp!"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+namespace bhc {
+
+/**
+ * Distributes jobs (usually rays) to CPU worker threads.
+ *
+ * Originally each worker claimed one job at a time from a single shared
+ * atomic counter. With many cores and cheap (e.g. 2D) rays, that one cache line
+ * becomes heavily contended, and since some rays (steep ones which bounce many
+ * times) are much more expensive than others, the end of the run was badly
+ * imbalanced. Instead, each worker starts with its own contiguous range of
+ * jobs, which it consumes from the front in chunks. When a worker's range is
+ * empty, it steals the back half of the range of the worker with the most jobs
+ * remaining. The total number of jobs never increases, so once a worker sees
+ * all the ranges empty, it is done.
+ *
+ * Optionally, the jobs may be reordered by estimated cost, so that each worker
+ * traces its most expensive rays first, and what is left to be stolen near the
+ * end of the run is the cheap rays.
+ */
+class JobScheduler {
+public:
+    JobScheduler() : numWorkers(0), chunkSize(1), firstJob(0), useOrder(false) {}
+
+    /**
+     * numJobs: total number of jobs, which are numbered [0, numJobs).
+     * workers: number of worker threads which will call GetNextJobs.
+     * chunk: number of jobs to claim at a time, or <= 0 for automatic.
+     * cost: if not null, estimated relative cost of each job; jobs are
+     * distributed so that each worker does high-cost jobs first.
+     * first: jobs are actually numbered [first, first + numJobs), e.g. for one
+     * window of a checkpointed run; cost is still indexed from 0.
+     */
+    void Init(
+        int32_t numJobs, int32_t workers, int32_t chunk,
+        const std::vector<float> *cost = nullptr, int32_t first = 0)
+    {
+        if(workers < 1) workers = 1;
+        if(workers != numWorkers) {
+            ranges     = std::unique_ptr<Range[]>(new Range[workers]);
+            numWorkers = workers;
+        }
+        if(numJobs < 0) numJobs = 0;
+        if(chunk <= 0) {
+            // Small enough that there are a good number of chunks per worker
+            // for load balancing, big enough to make the atomics rare.
+            chunk = bhc::max(1, bhc::min(64, numJobs / (numWorkers * 32)));
+        }
+        chunkSize = chunk;
+        firstJob  = first;
+        useOrder  = cost != nullptr && (int32_t)cost->size() == numJobs;
+        if(useOrder) {
+            // Sort high cost first, with ties in the natural order, then deal
+            // the sorted jobs out round-robin to the workers' ranges, so each
+            // range is also sorted high cost first.
+            std::vector<int32_t> sorted(numJobs);
+            std::iota(sorted.begin(), sorted.end(), 0);
+            std::stable_sort(sorted.begin(), sorted.end(), [&](int32_t a, int32_t b) {
+                return (*cost)[a] > (*cost)[b];
+            });
+            order.resize(numJobs);
+            for(int32_t w = 0; w < numWorkers; ++w) {
+                int32_t start = RangeStart(numJobs, w);
+                int32_t n     = RangeStart(numJobs, w + 1) - start;
+                for(int32_t k = 0; k < n; ++k) {
+                    order[start + k] = sorted[k * numWorkers + w];
+                }
+            }
+        } else {
+            order.clear();
+        }
+        for(int32_t w = 0; w < numWorkers; ++w) {
+            ranges[w].v.store(Pack(RangeStart(numJobs, w), RangeStart(numJobs, w + 1)));
+        }
+    }
+
+    /**
+     * Claims the next chunk of jobs for this worker. Returns false if there
+     * are no more jobs. Otherwise, the jobs to do are GetJob(i) for i in
+     * [begin, end).
+     */
+    bool GetNextJobs(int32_t worker, int32_t &begin, int32_t &end)
+    {
+        if(worker < 0 || worker >= numWorkers) return false;
+        Range &mine = ranges[worker];
+        while(true) {
+            uint64_t v = mine.v.load(std::memory_order_relaxed);
+            int32_t b = Begin(v), e = End(v);
+            if(b >= e) break;
+            int32_t nb = bhc::min(b + chunkSize, e);
+            if(mine.v.compare_exchange_weak(v, Pack(nb, e))) {
+                begin = b;
+                end   = nb;
+                return true;
+            }
+        }
+        // Own range empty, steal from the worker with the most work left
+        while(true) {
+            int32_t victim = -1, most = 0;
+            for(int32_t w = 0; w < numWorkers; ++w) {
+                uint64_t v = ranges[w].v.load(std::memory_order_relaxed);
+                if(End(v) - Begin(v) > most) {
+                    most   = End(v) - Begin(v);
+                    victim = w;
+                }
+            }
+            if(victim < 0) return false;
+            uint64_t v = ranges[victim].v.load(std::memory_order_relaxed);
+            int32_t b = Begin(v), e = End(v);
+            if(b >= e) continue;
+            int32_t mid = b + (e - b) / 2;
+            if(!ranges[victim].v.compare_exchange_weak(v, Pack(b, mid))) continue;
+            // Keep one chunk to do now, and put the rest in our own range so
+            // other workers can steal from it too. Only stealers modify an
+            // empty range, and they never modify an empty range, so storing
+            // is safe.
+            int32_t nb = bhc::min(mid + chunkSize, e);
+            mine.v.store(Pack(nb, e));
+            begin = mid;
+            end   = nb;
+            return true;
+        }
+    }
+
+    /// Maps a job slot from GetNextJobs to the actual job index.
+    int32_t GetJob(int32_t i) const { return firstJob + (useOrder ? order[i] : i); }
+
+private:
+    struct alignas(64) Range {
+        std::atomic<uint64_t> v;
+    };
+
+    /// The first numJobs % numWorkers workers get one extra job, which the
+    /// round-robin dealing in Init relies on.
+    int32_t RangeStart(int32_t numJobs, int32_t w) const
+    {
+        return w * (numJobs / numWorkers) + bhc::min(w, numJobs % numWorkers);
+    }
+    static uint64_t Pack(int32_t b, int32_t e)
+    {
+        return ((uint64_t)(uint32_t)b << 32) | (uint64_t)(uint32_t)e;
+    }
+    static int32_t Begin(uint64_t v) { return (int32_t)(uint32_t)(v >> 32); }
+    static int32_t End(uint64_t v) { return (int32_t)(uint32_t)(v & 0xFFFFFFFFull); }
+
+    std::unique_ptr<Range[]> ranges;
+    int32_t numWorkers;
+    int32_t chunkSize;
+    int32_t firstJob;
+    bool useOrder;
+    std::vector<int32_t> order;
+};
+
+} // namespace bhc
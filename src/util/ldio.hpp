@@ -38,12 +38,19 @@ namespace bhc {
  * LIST_WARNLINE() is for cases when the input variables should all be on the
  * same line of the input file. If this option is used and reading goes onto
  * a new line of the input, a warning is printed.
+ *
+ * The whole file is read into memory on open, and plain real numbers
+ * (no repetition counts, quotes, or parentheses) are parsed straight out of
+ * that buffer, skipping the general item tokenizer. This matters for large
+ * bathymetry and SSP files, which are almost entirely such numbers. Anything
+ * else goes through GetNextItem with the full list-directed semantics.
  */
 class LDIFile {
 public:
     LDIFile(bhcInternal *internal, bool abort_on_error = true)
-        : _internal(internal), _abort_on_error(abort_on_error), lastitemcount(0), line(0),
-          isafterslash(false), isafternewline(true)
+        : _internal(internal), _abort_on_error(abort_on_error), opened(false), pos(0),
+          ateof(false), lastitemcount(0), line(0), isafterslash(false),
+          isafternewline(true)
     {}
 
     LDIFile(
@@ -56,34 +63,55 @@ public:
     void open(const std::string &filename)
     {
         _filename = filename;
-        f.open(filename);
-        if(!f.good()) Error("Failed to open file");
+        std::ifstream f(filename);
+        if(!f.good()) {
+            Error("Failed to open file");
+            return;
+        }
+        std::ostringstream contents;
+        contents << f.rdbuf();
+        buf    = contents.str();
+        pos    = 0;
+        ateof  = false;
+        opened = true;
         ++line;
-        // automatically closed when ifstream destroyed
     }
 
-    bool Good() { return f.good(); }
+    /// Parses size bytes at data instead of a file. filename is only used in
+    /// messages.
+    void open(const std::string &filename, const char *data, size_t size)
+    {
+        _filename = filename;
+        buf.assign(data, size);
+        pos    = 0;
+        ateof  = false;
+        opened = true;
+        ++line;
+    }
+
+    bool Good() { return opened && !ateof; }
 
     struct State {
-        std::streampos s;
+        size_t s;
         int l;
     };
     State StateSave()
     {
         isafterslash = false;
         if(!isafternewline) { IgnoreRestOfLine(); }
-        return {f.tellg(), line};
+        return {pos, line};
     }
 
     void StateLoad(const State &s)
     {
         isafterslash   = false;
         isafternewline = true;
-        f.seekg(s.s);
-        line = s.l;
+        pos            = s.s;
+        ateof          = false;
+        line           = s.l;
     }
 
-    bool EndOfFile() { return f.eof(); }
+    bool EndOfFile() { return ateof; }
 
 #define LIST(ldif) ldif.List(__FILE__, __LINE__)
 #define LIST_WARNLINE(ldif) ldif.List(__FILE__, __LINE__, true)
@@ -101,7 +129,7 @@ public:
     }
 
 #define LDIFILE_READPREFIX() \
-    if(f.eof() && !isafterslash) Error("End of file"); \
+    if(ateof && !isafterslash) Error("End of file"); \
     std::string s = GetNextItem(); \
     if(s == nullitem) return; \
     REQUIRESEMICOLON
@@ -131,12 +159,14 @@ public:
     }
     void Read(float &v)
     {
+        if(ReadRealFast(v)) return;
         LDIFILE_READPREFIX();
         if(!isReal(s)) Error("String " + s + " is not a real number");
         v = strtof(s.c_str(), nullptr);
     }
     void Read(double &v)
     {
+        if(ReadRealFast(v)) return;
         LDIFILE_READPREFIX();
         if(!isReal(s)) Error("String " + s + " is not a real number");
         v = strtod(s.c_str(), nullptr);
@@ -146,7 +176,7 @@ public:
         LDIFILE_READPREFIX();
         if(!isReal(s)) Error("String " + s + " is not a real number");
         v.x = strtod(s.c_str(), nullptr);
-        if(f.eof() && !isafterslash) Error("End of file");
+        if(ateof && !isafterslash) Error("End of file");
         s = GetNextItem();
         if(s == nullitem) Error("Only specified part of a vec2!");
         if(!isReal(s)) Error("String " + s + " is not a real number");
@@ -157,12 +187,12 @@ public:
         LDIFILE_READPREFIX();
         if(!isReal(s)) Error("String " + s + " is not a real number");
         v.x = strtod(s.c_str(), nullptr);
-        if(f.eof() && !isafterslash) Error("End of file");
+        if(ateof && !isafterslash) Error("End of file");
         s = GetNextItem();
         if(s == nullitem) Error("Only specified part of a vec3!");
         if(!isReal(s)) Error("String " + s + " is not a real number");
         v.y = strtod(s.c_str(), nullptr);
-        if(f.eof() && !isafterslash) Error("End of file");
+        if(ateof && !isafterslash) Error("End of file");
         s = GetNextItem();
         if(s == nullitem) Error("Only specified part of a vec3!");
         if(!isReal(s)) Error("String " + s + " is not a real number");
@@ -201,6 +231,26 @@ public:
     }
 
 private:
+    int Peek()
+    {
+        if(pos >= buf.size()) {
+            ateof = true;
+            return EOF;
+        }
+        return (unsigned char)buf[pos];
+    }
+    void Get()
+    {
+        if(pos >= buf.size()) {
+            ateof = true;
+            return;
+        }
+        ++pos;
+    }
+
+    static void StrToReal(const char *s, char **end, float &v) { v = strtof(s, end); }
+    static void StrToReal(const char *s, char **end, double &v) { v = strtod(s, end); }
+
     void PrintLoc()
     {
         ExternalWarning(
@@ -217,14 +267,14 @@ private:
     void IgnoreRestOfLine()
     {
         if(_debug) ExternalWarning(_internal, "-- ignoring rest of line\n");
-        f.peek();
-        if(f.eof()) Error("End of file");
+        Peek();
+        if(ateof) Error("End of file");
         while(true) {
-            int c = f.peek();
-            if(f.eof() || c == '\n') break;
-            f.get();
+            int c = Peek();
+            if(ateof || c == '\n') break;
+            Get();
         }
-        if(!f.eof()) f.get(); // get the \n
+        if(!ateof) Get(); // get the \n
         ++line;
         isafternewline = true;
     }
@@ -243,10 +293,10 @@ private:
         }
         // Whitespace before start of item
         while(true) {
-            int c = f.peek();
-            if(f.eof()) break;
+            int c = Peek();
+            if(ateof) break;
             if(!isspace(c)) break;
-            f.get();
+            Get();
             if(c == '\n') {
                 ++line;
                 isafternewline = true;
@@ -254,9 +304,9 @@ private:
                 isafternewline = false;
             }
         }
-        if(f.eof()) return nullitem;
-        if(f.peek() == ',') {
-            f.get();
+        if(ateof) return nullitem;
+        if(Peek() == ',') {
+            Get();
             isafternewline = false;
             if(_debug) ExternalWarning(_internal, "-- empty comma, returning null\n");
             return nullitem;
@@ -271,9 +321,9 @@ private:
         lastitem      = "";
         int quotemode = 0;
         while(true) {
-            int c = f.peek();
-            if(f.eof()) break;
-            f.get();
+            int c = Peek();
+            if(ateof) break;
+            Get();
             isafternewline = false;
             if(quotemode == 1) {
                 if(c == '"') {
@@ -335,13 +385,13 @@ private:
             }
         }
         if(quotemode > 0) Error("Quotes or parentheses not closed");
-        if(f.eof()) {
+        if(ateof) {
             if(_debug)
                 ExternalWarning(_internal, "-- eof, returning %s\n", lastitem.c_str());
             return lastitem;
         }
         if(quotemode < 0) {
-            int c = f.peek();
+            int c = Peek();
             if(!isspace(c) && c != ',')
                 Error(
                     std::string("Invalid character '") + (char)c
@@ -359,13 +409,22 @@ private:
                     _internal, "-- new isafterslash, returning %s\n", lastitem.c_str());
             return lastitem;
         }
+        SkipAfterItem();
+        // Finally
+        if(lastitemcount > 0) --lastitemcount;
+        if(_debug)
+            ExternalWarning(_internal, "-- normal returning %s\n", lastitem.c_str());
+        return lastitem;
+    }
+    void SkipAfterItem()
+    {
         // Whitespace and comma after item
         bool hadcomma = false;
         while(true) {
-            int c = f.peek();
-            if(f.eof()) break;
+            int c = Peek();
+            if(ateof) break;
             if(isspace(c)) {
-                f.get();
+                Get();
                 if(c != '\n') {
                     isafternewline = false;
                     continue;
@@ -374,22 +433,63 @@ private:
                 isafternewline = true;
             } else if(c == ',') {
                 if(!hadcomma) {
-                    f.get();
+                    Get();
                     hadcomma       = true;
                     isafternewline = false;
                     continue;
                 }
             } else if(c == '/') {
-                f.get();
+                Get();
                 isafterslash = true;
             }
             break;
         }
-        // Finally
-        if(lastitemcount > 0) --lastitemcount;
-        if(_debug)
-            ExternalWarning(_internal, "-- normal returning %s\n", lastitem.c_str());
-        return lastitem;
+    }
+    /**
+     * Same result as GetNextItem followed by isReal and strtod / strtof, for an
+     * item which is a plain number. Returns false without changing any state
+     * if the next item is anything else (null, repeated, quoted, etc.), in which
+     * case the caller falls back to the general path.
+     */
+    template<typename REAL> bool ReadRealFast(REAL &v)
+    {
+        if(lastitemcount > 0 || isafterslash || _warnline >= 0) return false;
+        size_t p = pos, end = buf.size();
+        int l    = line;
+        for(; p < end && isspace((unsigned char)buf[p]); ++p) {
+            if(buf[p] == '\n') ++l;
+        }
+        size_t start = p;
+        for(; p < end; ++p) {
+            char c = buf[p];
+            if(isspace((unsigned char)c) || c == ',' || c == '/') break;
+            if(c == '*' || c == '"' || c == '\'' || c == '(' || c == ')') return false;
+        }
+        if(p == start) return false;
+        char *numend;
+        REAL r;
+        StrToReal(&buf[start], &numend, r);
+        if(numend != &buf[p]) return false;
+        // Commit, then handle the terminator as the item loop would
+        v    = r;
+        line = l;
+        lastitem.assign(&buf[start], p - start);
+        pos            = p;
+        isafternewline = false;
+        if(pos >= end) {
+            ateof = true;
+            return true;
+        }
+        char c = buf[pos++];
+        if(c == '\n') {
+            ++line;
+            isafternewline = true;
+        } else if(c == '/') {
+            isafterslash = true;
+        } else {
+            SkipAfterItem();
+        }
+        return true;
     }
 
     constexpr static bool _debug = false;
@@ -399,7 +499,10 @@ private:
     int codeline;
     int _warnline;
     bool _abort_on_error;
-    std::ifstream f;
+    bool opened;
+    std::string buf;
+    size_t pos;
+    bool ateof;
     std::string lastitem;
     int32_t lastitemcount;
     int line;
@@ -410,11 +513,164 @@ private:
     static constexpr const char *const nullitem = "\"'";
 };
 
+/**
+ * Formats an integer as LDOFile does in Style::FORTRAN_OUTPUT, right justified
+ * in width characters, into p. Returns the end of the text.
+ */
+inline char *FormatFortranInt(char *p, int32_t i, int32_t width)
+{
+    char tmp[16];
+    int32_t n = (int32_t)(std::to_chars(tmp, tmp + sizeof(tmp), i).ptr - tmp);
+    for(int32_t k = n; k < width; ++k) *p++ = ' ';
+    memcpy(p, tmp, n);
+    return p + n;
+}
+
+/**
+ * Formats a real as LDOFile does in Style::FORTRAN_OUTPUT, into p, which must
+ * have room for width + 8 characters. Returns the end of the text.
+ *
+ * This was done with iostreams, one manipulator at a time, which is slow
+ * and depends on flags left over from previous values. std::to_chars gives the
+ * same digits (both are exact), so only the layout has to be reproduced: the
+ * sci case is %-*.*E and the other case is %#.*g, which for this range of
+ * values and widths over 12 is always in fixed notation and never shorter than
+ * its field.
+ */
+inline char *FormatFortranReal(char *p, double r, int32_t width, bool exp3)
+{
+    *p++ = ' ';
+    *p++ = ' ';
+    if(!std::isfinite(r)) {
+        const char *s = std::isnan(r) ? (std::signbit(r) ? "-nan" : "nan")
+                                      : (r < 0.0 ? "-inf" : "inf");
+        int32_t n = (int32_t)strlen(s);
+        memcpy(p, s, n);
+        p += n;
+        for(int32_t k = n; k < width; ++k) *p++ = ' ';
+        return p;
+    }
+    bool sci  = r != RL(0.0) && (std::abs(r) < RL(0.1) || std::abs(r) >= RL(1.0e6));
+    int32_t w = width;
+    if(r < RL(0.0)) {
+        *p++ = '-';
+        r    = -r;
+    } else if(sci || r >= RL(1.0) || r == RL(0.0)) {
+        *p++ = ' ';
+    }
+    --w;
+    if(sci) --w;
+    int32_t prec = exp3 ? (w - 6) : (w - 5); // 5/4 for exp, 1 for decimal point
+    char *s      = p;
+    if(sci) {
+        p = std::to_chars(p, p + width + 4, r, std::chars_format::scientific, prec).ptr;
+        for(char *c = s; c < p; ++c) {
+            if(*c == 'e') *c = 'E';
+        }
+        for(int32_t k = (int32_t)(p - s); k < (exp3 ? (w + 1) : w); ++k) *p++ = ' ';
+        return p;
+    }
+    if(std::signbit(r)) { // -0.0
+        *p++ = '-';
+        r    = -r;
+    }
+    // prec significant digits, from d.ddde+XX
+    char tmp[48];
+    auto res  = std::to_chars(tmp, tmp + 48, r, std::chars_format::scientific, prec - 1);
+    char *e   = res.ptr;
+    char *ep  = (char *)memchr(tmp, 'e', e - tmp);
+    int32_t x = 0;
+    std::from_chars(ep[1] == '+' ? ep + 2 : ep + 1, e, x);
+    char digits[48];
+    int32_t nd = 0;
+    for(char *c = tmp; c < ep; ++c) {
+        if(*c != '.') digits[nd++] = *c;
+    }
+    if(x >= 0) {
+        memcpy(p, digits, x + 1);
+        p += x + 1;
+        *p++ = '.';
+        memcpy(p, digits + x + 1, nd - x - 1);
+        p += nd - x - 1;
+    } else {
+        *p++ = '0';
+        *p++ = '.';
+        for(int32_t k = 0; k < -x - 1; ++k) *p++ = '0';
+        memcpy(p, digits, nd);
+        p += nd;
+    }
+    for(int32_t k = 0; k < (exp3 ? 5 : 4); ++k) *p++ = ' ';
+    return p;
+}
+
+/**
+ * Output in memory, formatted the same as LDOFile with the default widths and
+ * Style::FORTRAN_OUTPUT. Used to format blocks of an output file in parallel,
+ * see LDOFile::writeblocks.
+ */
+class LDOBuffer {
+public:
+    static constexpr int32_t IntWidth = 12, FloatWidth = 15, DoubleWidth = 24;
+
+    void clear() { buf.clear(); }
+    const std::string &str() const { return buf; }
+
+    LDOBuffer &operator<<(const char &c)
+    {
+        buf += c;
+        return *this;
+    }
+    LDOBuffer &operator<<(const std::string &s)
+    {
+        buf += '\'';
+        buf += s;
+        buf += '\'';
+        return *this;
+    }
+    LDOBuffer &operator<<(const int32_t &i)
+    {
+        char tmp[64];
+        buf.append(tmp, FormatFortranInt(tmp, i, IntWidth) - tmp);
+        return *this;
+    }
+    LDOBuffer &operator<<(float r)
+    {
+        char tmp[64];
+        buf.append(tmp, FormatFortranReal(tmp, r, FloatWidth, false) - tmp);
+        return *this;
+    }
+    LDOBuffer &operator<<(double r)
+    {
+        char tmp[64];
+        buf.append(tmp, FormatFortranReal(tmp, r, DoubleWidth, true) - tmp);
+        return *this;
+    }
+    LDOBuffer &operator<<(const vec2 &v)
+    {
+        this->operator<<(v.x);
+        this->operator<<(v.y);
+        return *this;
+    }
+    LDOBuffer &operator<<(const vec3 &v)
+    {
+        this->operator<<(v.x);
+        this->operator<<(v.y);
+        this->operator<<(v.z);
+        return *this;
+    }
+
+private:
+    std::string buf;
+};
+
 class LDOFile {
 public:
     enum class Style : uint8_t { FORTRAN_OUTPUT, WRITTEN_BY_HAND, MATLAB_OUTPUT };
 
-    LDOFile() : iwidth(12), fwidth(15), dwidth(24), envStyle(Style::FORTRAN_OUTPUT) {}
+    LDOFile()
+        : iwidth(LDOBuffer::IntWidth), fwidth(LDOBuffer::FloatWidth),
+          dwidth(LDOBuffer::DoubleWidth), envStyle(Style::FORTRAN_OUTPUT)
+    {}
     ~LDOFile()
     {
         if(ostr.is_open()) ostr.close();
@@ -445,7 +701,9 @@ public:
     LDOFile &operator<<(const int32_t &i)
     {
         if(iwidth > 0 && envStyle == Style::FORTRAN_OUTPUT) {
-            ostr << std::setiosflags(std::ios_base::right) << std::setw(iwidth);
+            char tmp[64];
+            ostr.write(tmp, FormatFortranInt(tmp, i, iwidth) - tmp);
+            return *this;
         }
         ostr << i;
         if(envStyle != Style::FORTRAN_OUTPUT) ostr << ' ';
@@ -509,6 +767,50 @@ public:
     }
 
     void write(const char *s) { ostr << s; }
+    void write(const LDOBuffer &b) { ostr.write(b.str().data(), b.str().size()); }
+    /// Bytes written so far.
+    size_t tell() { return (size_t)ostr.tellp(); }
+
+    /**
+     * Writes nBlocks blocks in order, each formatted by format(iBlock, buf)
+     * into an LDOBuffer. The blocks are formatted in parallel on pool, in
+     * rounds of blocksPerThread blocks per thread, while the previous round is
+     * written; so only two rounds of blocks are in memory at a time. format
+     * must only read shared state. If the pool is busy with something else
+     * (e.g. a run while this is writing out the previous one, see
+     * bhc::run_pipelined), the round is formatted on this thread instead.
+     */
+    template<typename F> void writeblocks(
+        ThreadPool &pool, size_t nBlocks, size_t blocksPerThread, F &&format)
+    {
+        size_t perRound = (size_t)pool.NumThreads() * blocksPerThread;
+        size_t nRounds  = (nBlocks + perRound - 1) / perRound;
+        std::vector<LDOBuffer> bufs(2 * perRound);
+        std::atomic<size_t> next;
+        auto StartRound = [&](size_t round) -> uint64_t {
+            size_t first = round * perRound;
+            size_t n     = std::min(perRound, nBlocks - first);
+            LDOBuffer *b = &bufs[(round % 2) * perRound];
+            next         = 0;
+            auto task    = [&, first, n, b](int32_t) {
+                for(size_t i = next++; i < n; i = next++) {
+                    b[i].clear();
+                    format(first + i, b[i]);
+                }
+            };
+            uint64_t id = pool.TryStart(task);
+            if(id == 0) task(0);
+            return id;
+        };
+        uint64_t id = nRounds > 0 ? StartRound(0) : 0;
+        for(size_t round = 0; round < nRounds; ++round) {
+            if(id != 0) pool.Wait(id);
+            id           = round + 1 < nRounds ? StartRound(round + 1) : 0;
+            size_t n     = std::min(perRound, nBlocks - round * perRound);
+            LDOBuffer *b = &bufs[(round % 2) * perRound];
+            for(size_t i = 0; i < n; ++i) write(b[i]);
+        }
+    }
 
 private:
     std::ofstream ostr;
@@ -556,31 +858,8 @@ private:
             ostr << r;
             return;
         }
-        ostr << "  ";
-        if(!std::isfinite(r)) {
-            ostr << std::setw(width) << std::left << r;
-            return;
-        }
-        bool sci  = r != RL(0.0) && (std::abs(r) < RL(0.1) || std::abs(r) >= RL(1.0e6));
-        int32_t w = width;
-        if(r < RL(0.0)) {
-            ostr << "-";
-            r = -r;
-        } else if(sci || r >= RL(1.0) || r == RL(0.0)) {
-            ostr << " ";
-        }
-        --w;
-        if(sci) --w;
-        ostr << std::setprecision(exp3 ? (w - 6) : (w - 5)); // 5/4 for exp, 1 for decimal
-                                                             // point
-        if(sci) {
-            ostr << std::setiosflags(std::ios_base::uppercase | std::ios_base::scientific)
-                 << std::setw(exp3 ? (w + 1) : w) << std::left << r;
-        } else {
-            ostr << std::setiosflags(std::ios_base::showpoint) << std::defaultfloat
-                 << std::setw(w - 5) << r;
-            ostr << (exp3 ? "     " : "    ");
-        }
+        char tmp[64];
+        ostr.write(tmp, FormatFortranReal(tmp, r, width, exp3) - tmp);
     }
 };
 
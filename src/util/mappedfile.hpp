@@ -0,0 +1,140 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#ifndef _BHC_INCLUDING_COMPONENTS_
+#error "Must be included from common_setup.hpp!"
+#endif
+
+#ifndef _MSC_VER
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace bhc {
+
+/**
+ * Read-only view of a whole file, memory mapped so that reading it is a copy
+ * (or no copy at all) from the page cache rather than a stream call per
+ * value. If the file cannot be mapped (e.g. it is not a regular file), it is
+ * read into memory instead.
+ */
+class MappedFile {
+public:
+    MappedFile() : base(nullptr), len(0), mapped(false), opened(false)
+    {
+#ifdef _MSC_VER
+        hFile = hMapping = nullptr;
+#endif
+    }
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile &)            = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    /// Returns false if the file could not be opened.
+    bool open(const std::string &path)
+    {
+        close();
+#ifdef _MSC_VER
+        hFile = CreateFileA(
+            path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if(hFile == INVALID_HANDLE_VALUE) {
+            hFile = nullptr;
+            return false;
+        }
+        LARGE_INTEGER size;
+        if(GetFileSizeEx(hFile, &size)) {
+            len = (size_t)size.QuadPart;
+            if(len == 0) return opened = true;
+            hMapping = CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if(hMapping != nullptr) {
+                base = (const char *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+                if(base != nullptr) {
+                    mapped = true;
+                    return opened = true;
+                }
+            }
+        }
+        close();
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0) return false;
+        struct stat st;
+        if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            len = (size_t)st.st_size;
+            if(len == 0) {
+                ::close(fd);
+                return opened = true;
+            }
+            void *p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p != MAP_FAILED) {
+                madvise(p, len, MADV_SEQUENTIAL);
+                ::close(fd);
+                base   = (const char *)p;
+                mapped = true;
+                return opened = true;
+            }
+        }
+        ::close(fd);
+#endif
+        // Fallback, read the whole file.
+        std::ifstream istr(path, std::ios::binary);
+        if(!istr.good()) return false;
+        std::ostringstream contents;
+        contents << istr.rdbuf();
+        buffer = contents.str();
+        base   = buffer.data();
+        len    = buffer.size();
+        return opened = true;
+    }
+
+    void close()
+    {
+#ifdef _MSC_VER
+        if(mapped) UnmapViewOfFile(base);
+        if(hMapping != nullptr) CloseHandle(hMapping);
+        if(hFile != nullptr) CloseHandle(hFile);
+        hFile = hMapping = nullptr;
+#else
+        if(mapped) munmap((void *)base, len);
+#endif
+        buffer.clear();
+        base   = nullptr;
+        len    = 0;
+        mapped = opened = false;
+    }
+
+    bool isOpen() const { return opened; }
+    const char *data() const { return base; }
+    size_t size() const { return len; }
+
+private:
+    const char *base;
+    size_t len;
+    bool mapped, opened;
+    std::string buffer;
+#ifdef _MSC_VER
+    HANDLE hFile, hMapping;
+#endif
+};
+
+} // namespace bhc
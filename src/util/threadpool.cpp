@@ -0,0 +1,112 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "../common_setup.hpp"
+
+namespace bhc {
+
+ThreadPool::ThreadPool(int32_t numThreads, char affinity)
+    : cpus(GetAffinityCPUs(affinity)), generation(0), finished(0), running(0),
+      quit(false)
+{
+    if(numThreads < 1) numThreads = 1;
+    for(int32_t i = 0; i < numThreads; ++i) {
+        threads.push_back(std::thread(&ThreadPool::WorkerMain, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    Wait();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    cvStart.notify_all();
+    for(auto &t : threads) t.join();
+}
+
+uint64_t ThreadPool::Start(std::function<void(int32_t)> task)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cvDone.wait(lock, [this] { return running == 0; });
+    curTask     = std::move(task);
+    running     = NumThreads();
+    uint64_t id = ++generation;
+    lock.unlock();
+    cvStart.notify_all();
+    return id;
+}
+
+uint64_t ThreadPool::TryStart(std::function<void(int32_t)> task)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if(running != 0) return 0;
+    curTask     = std::move(task);
+    running     = NumThreads();
+    uint64_t id = ++generation;
+    lock.unlock();
+    cvStart.notify_all();
+    return id;
+}
+
+void ThreadPool::Wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cvDone.wait(lock, [this] { return running == 0; });
+}
+
+void ThreadPool::Wait(uint64_t id)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cvDone.wait(lock, [this, id] { return finished >= id; });
+}
+
+bool ThreadPool::Busy()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return running != 0;
+}
+
+void ThreadPool::WorkerMain(int32_t worker)
+{
+    SetupThread(cpus.empty() ? -1 : cpus[worker % cpus.size()]);
+    uint64_t lastGeneration = 0;
+    while(true) {
+        std::function<void(int32_t)> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cvStart.wait(lock, [&] { return quit || generation != lastGeneration; });
+            if(quit) return;
+            lastGeneration = generation;
+            task           = curTask;
+        }
+        task(worker);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            --running;
+            if(running == 0) {
+                curTask  = nullptr;
+                finished = generation;
+            }
+        }
+        cvDone.notify_all();
+    }
+}
+
+} // namespace bhc
@@ -0,0 +1,83 @@
+/*
+bellhopcxx / bellhopcuda - C++/CUDA port of BELLHOP(3D) underwater acoustics simulator
+Copyright (C) 2021-2023 The Regents of the University of California
+Marine Physical Lab at Scripps Oceanography, c/o Jules Jaffe, jjaffe@ucsd.edu
+Based on BELLHOP / BELLHOP3D, which is Copyright (C) 1983-2022 Michael B. Porter
+
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#ifndef _BHC_INCLUDING_COMPONENTS_
+#error "Must be included from common.hpp!"
+#endif
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace bhc {
+
+/**
+ * Set of worker threads which lives from setup() to finalize(), so that each
+ * run() does not have to create and join its own threads. All the threads
+ * execute the same task, which receives the index of the worker thread
+ * ([0, NumThreads())) as its argument; the task is expected to get its work
+ * from a JobScheduler or similar.
+ */
+class ThreadPool {
+public:
+    /// affinity: see bhcInit::threadAffinity.
+    ThreadPool(int32_t numThreads, char affinity = 'N');
+    ~ThreadPool();
+
+    int32_t NumThreads() const { return (int32_t)threads.size(); }
+
+    /**
+     * Starts task on all worker threads and returns immediately. If a previous
+     * task is still running, waits for it to complete first. Returns the id of
+     * the task, for Wait(id).
+     */
+    uint64_t Start(std::function<void(int32_t)> task);
+    /**
+     * Like Start(), but if a task is already running, returns 0 immediately
+     * without starting task. For work which can also be done on the calling
+     * thread, so it does not queue up behind e.g. a run on another thread.
+     */
+    uint64_t TryStart(std::function<void(int32_t)> task);
+    /// Waits for the current task (if any) to complete on all worker threads.
+    void Wait();
+    /// Waits for the task with the given id to complete, but not for any task
+    /// started after it by another thread.
+    void Wait(uint64_t id);
+    /// Start() and Wait().
+    void Run(std::function<void(int32_t)> task) { Wait(Start(std::move(task))); }
+    /// Whether a task is currently running.
+    bool Busy();
+
+private:
+    void WorkerMain(int32_t worker);
+
+    std::vector<std::thread> threads;
+    std::vector<int32_t> cpus; // See GetAffinityCPUs
+    std::mutex mutex;
+    std::condition_variable cvStart, cvDone;
+    std::function<void(int32_t)> curTask;
+    uint64_t generation;
+    uint64_t finished; // generation of the last task which completed
+    int32_t running;
+    bool quit;
+};
+
+} // namespace bhc
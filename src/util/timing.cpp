@@ -21,14 +21,149 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #if defined(_WIN32) || defined(_WIN64)
 // #include <windows.h>
 #else
-// sched_setscheduler():
+// sched_setscheduler(), sched_setaffinity():
 #include <sched.h>
 #endif
 
+#include <algorithm>
+#include <fstream>
+#include <tuple>
+
 namespace bhc {
 
-void SetupThread()
+#ifdef __linux__
+/// Reads a topology value of a logical CPU from sysfs, or -1 if unavailable.
+static int32_t ReadCPUTopology(int32_t cpu, const char *name)
+{
+    std::ifstream f(
+        "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/" + name);
+    int32_t v = -1;
+    if(!(f >> v)) return -1;
+    return v;
+}
+#endif
+
+std::vector<int32_t> GetAffinityCPUs(char affinity)
 {
+    std::vector<int32_t> ret;
+#ifdef __linux__
+    if(affinity != 'C' && affinity != 'S') return ret;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return ret;
+    struct CPUInfo {
+        int32_t cpu, package, core, sibling;
+    };
+    std::vector<CPUInfo> info;
+    for(int32_t c = 0; c < CPU_SETSIZE; ++c) {
+        if(!CPU_ISSET(c, &allowed)) continue;
+        CPUInfo i;
+        i.cpu     = c;
+        i.package = bhc::max(ReadCPUTopology(c, "physical_package_id"), 0);
+        i.core    = ReadCPUTopology(c, "core_id");
+        if(i.core < 0) i.core = c;
+        // Index of this logical CPU among the hyperthreads of its core
+        i.sibling = 0;
+        for(const CPUInfo &o : info) {
+            if(o.package == i.package && o.core == i.core) ++i.sibling;
+        }
+        info.push_back(i);
+    }
+    if(affinity == 'C') {
+        std::sort(info.begin(), info.end(), [](const CPUInfo &a, const CPUInfo &b) {
+            return std::tie(a.package, a.core, a.cpu)
+                < std::tie(b.package, b.core, b.cpu);
+        });
+    } else {
+        // Rank of each CPU within its package, all first hyperthreads first
+        std::sort(info.begin(), info.end(), [](const CPUInfo &a, const CPUInfo &b) {
+            return std::tie(a.package, a.sibling, a.core, a.cpu)
+                < std::tie(b.package, b.sibling, b.core, b.cpu);
+        });
+        std::vector<int32_t> rank(info.size());
+        for(size_t i = 0; i < info.size(); ++i) {
+            rank[i] = (i > 0 && info[i].package == info[i - 1].package) ? rank[i - 1] + 1
+                                                                         : 0;
+        }
+        std::vector<size_t> order(info.size());
+        for(size_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return rank[a] < rank[b];
+        });
+        std::vector<CPUInfo> sorted;
+        for(size_t i : order) sorted.push_back(info[i]);
+        info = sorted;
+    }
+    for(const CPUInfo &i : info) ret.push_back(i.cpu);
+#else
+    (void)affinity;
+#endif
+    return ret;
+}
+
+void ExecTrace::Write(bhcInternal *internal, const std::string &path) const
+{
+    if(capacity == 0) return;
+    std::ofstream out(path);
+    if(!out.good()) {
+        ExternalWarning(internal, "Could not open trace file %s", path.c_str());
+        return;
+    }
+    char buf[320];
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    for(int32_t r = 0; r <= numWorkers; ++r) {
+        const Ring &ring  = rings[r];
+        uint64_t n        = bhc::min(ring.count, (uint64_t)capacity);
+        std::string tname = r == numWorkers ? std::string("API")
+                                            : "worker " + std::to_string(r);
+        if(ring.count > n) {
+            tname += " (" + std::to_string(ring.count - n) + " oldest events dropped)";
+        }
+        snprintf(
+            buf, sizeof(buf),
+            "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+            "\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",\n", r, tname.c_str());
+        out << buf;
+        first = false;
+        for(uint64_t k = ring.count - n; k < ring.count; ++k) {
+            const Event &e = ring.events[k % (uint64_t)capacity];
+            int len        = snprintf(
+                buf, sizeof(buf),
+                ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%.3f",
+                e.name, r, e.ts, e.dur);
+            if(e.job >= 0) {
+                snprintf(
+                    buf + len, sizeof(buf) - len,
+                    ",\"args\":{\"job\":%d,\"isx\":%d,\"isy\":%d,\"isz\":%d,"
+                    "\"ialpha\":%d,\"ibeta\":%d}",
+                    e.job, e.isx, e.isy, e.isz, e.ialpha, e.ibeta);
+            }
+            out << buf << "}";
+        }
+    }
+    out << "\n]}\n";
+    if(!out.good()) {
+        ExternalWarning(internal, "Error writing trace file %s", path.c_str());
+    }
+}
+
+void SetupThread(int32_t cpu)
+{
+#ifdef __linux__
+    if(cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if(sched_setaffinity(0, sizeof(set), &set) != 0) {
+            std::cout << "Could not pin worker thread to CPU " << cpu << "\n";
+        }
+    }
+#else
+    (void)cpu;
+#endif
 #ifdef BHC_USE_HIGH_PRIORITY_THREADS
 #if defined(_WIN32) || defined(_WIN64)
     // std::cout << "Warning, not changing thread priority because on Windows\n";
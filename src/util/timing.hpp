@@ -22,11 +22,30 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #error "Must be included from common.hpp!"
 #endif
 
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(BHC_BUILD_CUDA) && defined(BHC_USE_NVTX)
+#include <nvtx3/nvToolsExt.h>
+#endif
+
 namespace bhc {
 
 // #define BHC_USE_HIGH_PRIORITY_THREADS 1
 
-void SetupThread();
+/**
+ * Called at the start of each worker thread. cpu is the logical CPU to pin the
+ * thread to, or -1 not to pin it.
+ */
+void SetupThread(int32_t cpu = -1);
+
+/**
+ * Logical CPUs to pin worker threads to, in the order the workers should be
+ * assigned to them, for bhcInit::threadAffinity. Empty if the threads should
+ * not be pinned (including on platforms where pinning is not supported).
+ */
+std::vector<int32_t> GetAffinityCPUs(char affinity);
 
 inline int32_t ModifyNumThreads(int32_t numThreads)
 {
@@ -39,24 +58,149 @@ inline int32_t ModifyNumThreads(int32_t numThreads)
     return numThreads;
 }
 
+/**
+ * Measures the duration of a phase, for bhcTimings (see bhc::get_timings).
+ */
 class Stopwatch {
 public:
-    Stopwatch(bhcInternal *internal_) : internal(internal_) {}
     inline void tick() { tstart = std::chrono::high_resolution_clock::now(); }
-    inline void tock(const char *label)
+    /// Returns the time in ms since tick().
+    inline double tock() const
     {
         using namespace std::chrono;
         high_resolution_clock::time_point tend = high_resolution_clock::now();
-        double dt = (duration_cast<duration<double>>(tend - tstart)).count();
-        dt *= 1000.0;
-        ExternalWarning(internal, "%s: %f ms", label, dt);
+        return (duration_cast<duration<double>>(tend - tstart)).count() * 1000.0;
     }
 
 private:
-    bhcInternal *internal;
     std::chrono::high_resolution_clock::time_point tstart;
 };
 
+/// Clears the parts of timings which are set by run(), see bhcTimings.
+inline void ResetRunTimings(bhcTimings &timings)
+{
+    timings.preprocess = 0.0;
+    timings.numModules = 0;
+    for(int32_t i = 0; i < BHC_TIMING_MAX_MODULES; ++i) {
+        timings.moduleNames[i]      = nullptr;
+        timings.modulePreprocess[i] = 0.0;
+    }
+    timings.modePreprocess    = 0.0;
+    timings.run               = 0.0;
+    timings.postprocess       = 0.0;
+    timings.cudaKernel        = 0.0;
+    timings.cudaTransfer      = 0.0;
+    timings.cudaKernelName    = nullptr;
+    timings.cudaRegsPerThread = 0;
+    timings.cudaBlockSize     = 0;
+    timings.cudaBlocksPerSM   = 0;
+    timings.cudaOccupancy     = 0.0;
+}
+
+/**
+ * Named range on the timeline of NVIDIA Nsight Systems, from construction to
+ * destruction. Only does anything in bellhopcuda built with the CMake option
+ * BHC_NVTX; name must outlive the range.
+ */
+class NvtxRange {
+public:
+#if defined(BHC_BUILD_CUDA) && defined(BHC_USE_NVTX)
+    NvtxRange(const char *name) { nvtxRangePushA(name); }
+    ~NvtxRange() { nvtxRangePop(); }
+    /// Ends this range and starts the next one at the same level.
+    inline void Next(const char *name)
+    {
+        nvtxRangePop();
+        nvtxRangePushA(name);
+    }
+#else
+    NvtxRange(const char *) {}
+    inline void Next(const char *) {}
+#endif
+    NvtxRange(const NvtxRange &)            = delete;
+    NvtxRange &operator=(const NvtxRange &) = delete;
+};
+
+/**
+ * Timeline of what each CPU worker thread did when, for bhcInit::traceFile.
+ * Each worker records the rays it traces into its own ring buffer, so there
+ * is no synchronization between workers, and the oldest events are dropped
+ * once it is full. The phases of setup, run, and writeout are recorded the
+ * same way in one more buffer, from whichever thread calls the API.
+ */
+class ExecTrace {
+public:
+    ExecTrace(int32_t numWorkers_, int32_t eventsPerBuffer)
+        : epoch(std::chrono::steady_clock::now()), numWorkers(numWorkers_),
+          capacity(eventsPerBuffer > 0 ? eventsPerBuffer : 0)
+    {
+        if(capacity == 0) return;
+        rings = std::unique_ptr<Ring[]>(new Ring[numWorkers + 1]);
+        for(int32_t r = 0; r <= numWorkers; ++r) rings[r].events.resize(capacity);
+    }
+
+    inline bool Enabled() const { return capacity > 0; }
+    /// Microseconds since setup.
+    inline double Now() const
+    {
+        using namespace std::chrono;
+        return duration<double, std::micro>(steady_clock::now() - epoch).count();
+    }
+    /// Records that worker traced the ray of job from tBegin (from Now()) until
+    /// now. name is the kind of run and must be a string literal.
+    inline void Job(
+        int32_t worker, const char *name, double tBegin, int32_t job,
+        const RayInitInfo &rinit)
+    {
+        if(worker < 0 || worker >= numWorkers) return;
+        Add(rings[worker], name, tBegin, job, &rinit);
+    }
+    /// Records a phase of the API call in progress, from tBegin until now.
+    inline void Phase(const char *name, double tBegin)
+    {
+        if(capacity == 0) return;
+        Add(rings[numWorkers], name, tBegin, -1, nullptr);
+    }
+    /// Writes all the events recorded so far as Chrome trace JSON.
+    void Write(bhcInternal *internal, const std::string &path) const;
+
+private:
+    struct Event {
+        const char *name;
+        double ts, dur;
+        int32_t job, isx, isy, isz, ialpha, ibeta;
+    };
+    // Aligned so that workers do not share cache lines.
+    struct alignas(64) Ring {
+        std::vector<Event> events;
+        uint64_t count = 0;
+    };
+
+    inline void Add(
+        Ring &ring, const char *name, double tBegin, int32_t job,
+        const RayInitInfo *rinit)
+    {
+        Event &e = ring.events[ring.count % (uint64_t)capacity];
+        e.name   = name;
+        e.ts     = tBegin;
+        e.dur    = Now() - tBegin;
+        e.job    = job;
+        if(rinit != nullptr) {
+            e.isx    = rinit->isx;
+            e.isy    = rinit->isy;
+            e.isz    = rinit->isz;
+            e.ialpha = rinit->ialpha;
+            e.ibeta  = rinit->ibeta;
+        }
+        ++ring.count;
+    }
+
+    std::chrono::steady_clock::time_point epoch;
+    int32_t numWorkers;
+    int32_t capacity;
+    std::unique_ptr<Ring[]> rings; // numWorkers, then the API phases
+};
+
 template<int N> class MultiStopwatch {
 public:
     MultiStopwatch(bhcInternal *internal_) : internal(internal_)
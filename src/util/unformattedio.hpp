@@ -93,33 +93,48 @@ private:
 };
 
 /**
- * C++ emulation of reading from FORTRAN unformatted file.
+ * C++ emulation of reading from FORTRAN unformatted file. The file is memory
+ * mapped (see MappedFile), so reads are copies from the mapping, and arrays are
+ * copied in one go.
  */
 class UnformattedIFile {
 public:
-    UnformattedIFile(bhcInternal *internal) : _internal(internal), recl(0), recused(0) {}
+    UnformattedIFile(bhcInternal *internal)
+        : _internal(internal), pos(0), recl(0), recused(0), failed(false)
+    {}
     ~UnformattedIFile()
     {
-        if(istr.is_open()) {
-            FinishRecord();
-            istr.close();
-        }
+        if(mapping.isOpen()) FinishRecord();
     }
 
-    void open(const std::string &path) { istr.open(path, std::ios::binary); }
+    void open(const std::string &path)
+    {
+        failed = !mapping.open(path);
+        pos    = 0;
+    }
 
-    bool good() { return istr.good() && istr.is_open(); }
+    bool good() { return mapping.isOpen() && !failed; }
 
     void rec()
     {
         FinishRecord();
         recused = 0;
-        istr.read((char *)&recl, 4);
-        auto g = istr.tellg();
-        istr.seekg(recl, istr.cur);
+        size_t g = pos;
+        if(pos + 4 > mapping.size()) {
+            failed = true;
+            ExternalError(
+                _internal, "Unexpected end of UnformattedIFile at %08X!", (uint32_t)g);
+        }
+        memcpy(&recl, mapping.data() + pos, 4);
+        pos += 4;
         uint32_t recl_copy;
-        istr.read((char *)&recl_copy, 4);
-        istr.seekg(g);
+        if(pos + (size_t)recl + 4 > mapping.size()) {
+            failed = true;
+            ExternalError(
+                _internal, "Record extends past end of UnformattedIFile at %08X!",
+                (uint32_t)g);
+        }
+        memcpy(&recl_copy, mapping.data() + pos + recl, 4);
         if(recl != recl_copy) {
             ExternalError(
                 _internal, "Record length inconsistent in UnformattedIFile at %08X!",
@@ -132,7 +147,8 @@ public:
         if(recused + sizeof(T) > recl) {
             ExternalError(_internal, "Insufficient data in record in UnformattedIFile!");
         }
-        istr.read((char *)&v, sizeof(T));
+        memcpy((void *)&v, mapping.data() + pos, sizeof(T));
+        pos += sizeof(T);
         recused += (int32_t)sizeof(T);
     }
 
@@ -141,7 +157,8 @@ public:
         if(recused + (n * sizeof(T)) > recl) {
             ExternalError(_internal, "Insufficient data in record in UnformattedIFile!");
         }
-        for(size_t i = 0; i < n; ++i) istr.read((char *)&arr[i], sizeof(T));
+        memcpy((void *)arr, mapping.data() + pos, n * sizeof(T));
+        pos += n * sizeof(T);
         recused += (int32_t)(n * sizeof(T));
     }
 
@@ -151,17 +168,20 @@ private:
         if(recused != recl) {
             ExternalWarning(
                 _internal, "Record in UnformattedIFile not fully read at %08X!",
-                (uint32_t)istr.tellg());
+                (uint32_t)pos);
         }
-        if(recl != 0) {              // Not for beginning of file
-            istr.seekg(4, istr.cur); // Skip end length of current record
+        pos += recl - recused;
+        if(recl != 0) { // Not for beginning of file
+            pos += 4;   // Skip end length of current record
         }
     }
 
     bhcInternal *_internal;
-    std::ifstream istr;
+    MappedFile mapping;
+    size_t pos;
     uint32_t recl;
     uint32_t recused;
+    bool failed;
 };
 
 } // namespace bhc